@@ -84,7 +84,7 @@ void firefly_channel_open(struct firefly_connection *conn);
  *
  * The close event will send a firefly_protocol_channel_close packet.
  * The closed event will free the channel's memory and remove it from
- * the connection's chan_list.
+ * the connection's channel table.
  *
  * @param chan The channel to close and free.
  * @return The ID of the event freeing the channel.
@@ -269,8 +269,7 @@ struct labcomm_decoder *firefly_protocol_get_input_stream(
 /**
  * @brief The number of channels in the connection.
  *
- * The complexity of this function is O(n) where n is the number of
- * channels.
+ * The complexity of this function is O(1).
  *
  * @param conn The connection to count channels on.
  * @return The number of channels open on this connection.
@@ -312,6 +311,297 @@ void firefly_connection_set_context(struct firefly_connection * const conn,
 struct firefly_event_queue *firefly_connection_get_event_queue(
 	       struct firefly_connection *conn);
 
+/**
+ * @brief Send the acknowledgements of important samples received on the
+ * connection together instead of one per sample.
+ *
+ * The acks of a channel are then sent as one cumulative ack with the ranges
+ * of the samples received ahead of a lost one. They are sent when
+ * \p max_pending samples are received or \p delay ms after the first of
+ * them, whichever comes first, or earlier with a data sample sent on the
+ * channel. A delay of 0 sends them once the queued events are executed.
+ * Both ends must support cumulative acks. The default sends a plain ack
+ * for each sample at once.
+ *
+ * The delay must be shorter than the resend timeout of the other end, and
+ * requires an event queue with timers.
+ *
+ * @param conn The connection to set the ack delay of.
+ * @param delay The longest time to hold back an ack, in ms.
+ * @param max_pending The number of samples to ack together, 1 disables
+ * cumulative acks.
+ */
+void firefly_connection_set_ack_delay(struct firefly_connection *conn,
+		unsigned int delay, unsigned int max_pending);
+
+/**
+ * @brief The largest encoded sample that can be sent on a channel.
+ */
+#define FIREFLY_SAMPLE_MAX_SIZE (16 * 1024 * 1024)
+
+/**
+ * @brief The default memory limit for reassembling fragmented samples on a
+ * connection, see #firefly_connection_set_reassembly_max().
+ */
+#define FIREFLY_REASSEMBLY_MAX (4 * 1024 * 1024)
+
+/**
+ * @brief Limit the memory used for reassembling samples received on the
+ * connection.
+ *
+ * Samples larger than a packet of the transport are sent in fragments and
+ * reassembled by the receiver. A fragmented sample that would exceed the
+ * limit is dropped if it is not important. An important one is not
+ * acknowledged and is resent until there is room for it, and one larger
+ * than the limit is discarded with an error.
+ *
+ * @param conn The connection to set the limit of.
+ * @param max The largest number of bytes of samples being reassembled.
+ */
+void firefly_connection_set_reassembly_max(struct firefly_connection *conn,
+		size_t max);
+
+/**
+ * @brief Send several protocol packets of the connection together in one
+ * packet of the transport.
+ *
+ * The packets are held back until the next does not fit in the MTU, until
+ * the events queued on the connection are executed or until \p delay us
+ * after the first of them, whichever comes first. Important packets are
+ * sent on their own as they are resent, the held back packets are sent
+ * before them. A delay of 0 holds them back only while the queued events
+ * are executed. The default, and a disabled coalescing, sends each packet
+ * at once.
+ *
+ * A delay requires an event queue with timers, whose clock has a
+ * resolution of ms, so it is rounded up to whole ms.
+ *
+ * @param conn The connection to set the coalescing of.
+ * @param enable If true packets are coalesced, if false the held back ones
+ * are sent and each packet is sent at once from then on.
+ * @param delay The longest time to hold back a packet, in us.
+ */
+void firefly_connection_set_coalescing(struct firefly_connection *conn,
+		bool enable, unsigned int delay);
+
+/**
+ * @brief Send the packets held back to be coalesced at once.
+ *
+ * Must be called from the thread executing the events of the connection.
+ *
+ * @param conn The connection to flush.
+ */
+void firefly_connection_flush(struct firefly_connection *conn);
+
+/**
+ * @brief Detect that the other end of the connection is gone.
+ *
+ * The connection is checked every \p interval ms. A check that finds that
+ * nothing was received since the last one asks the other end for a
+ * heartbeat, one that finds that only heartbeats were received asks for
+ * the next. Any packet received passes the check, so a connection the
+ * other end sends on is never asked. After \p max_missed checks in a row
+ * without hearing from the other end, connection_error is called with
+ * #FIREFLY_ERROR_CONN_TIMEOUT and the checks stop. The other end is thus
+ * declared dead at most (\p max_missed + 1) * \p interval ms after it was
+ * last heard from. Heartbeats are always answered, whether or not they are
+ * enabled on the answering end.
+ *
+ * The interval must be longer than the round trip time of the transport.
+ * Requires an event queue with timers. Must be called from the event
+ * queue, e.g. in the connection_opened callback.
+ *
+ * @param conn The connection to check.
+ * @param interval The time between checks in ms, 0 stops the checks.
+ * @param max_missed The number of checks in a row without hearing from the
+ * other end before it is declared dead, at least 1.
+ */
+void firefly_connection_set_heartbeat(struct firefly_connection *conn,
+		unsigned int interval, unsigned int max_missed);
+
+/**
+ * @brief The largest send window of a channel, see
+ * #firefly_channel_set_window().
+ */
+#define FIREFLY_CHANNEL_WINDOW_MAX (64)
+
+/**
+ * @brief Set the number of important samples that may be sent on the
+ * channel before the first of them is acknowledged.
+ *
+ * Each sample is resent on its own until acknowledged. The receiving end
+ * delivers the samples in order and buffers up to window - 1 samples
+ * received ahead of a lost one, so both ends should use the same window.
+ * With the default window of 1 every important sample waits for the
+ * acknowledgement of the one before it.
+ *
+ * Must be called from the event queue, e.g. in the channel_opened
+ * callback.
+ *
+ * @param chan The channel to set the window of.
+ * @param window The window, 1 to #FIREFLY_CHANNEL_WINDOW_MAX.
+ * @return Integer indicating the result.
+ * @retval 0 on success.
+ * @retval -1 if the window is out of range, smaller than the number of
+ * samples not yet acknowledged or could not be allocated.
+ */
+int firefly_channel_set_window(struct firefly_channel *chan, size_t window);
+
+/**
+ * @brief Counters of the samples of a channel not delivered in latest value
+ * mode, see #firefly_channel_set_latest(), or for lack of credit, see
+ * #firefly_channel_set_credits().
+ */
+struct firefly_channel_stats {
+	uint64_t nbr_superseded; /**< The number of samples replaced by a newer
+							   one of the same type before being sent. */
+	uint64_t nbr_lost; /**< The number of samples from the other end that
+						 were skipped, lost or received too late. */
+	uint64_t nbr_stale; /**< The number of samples from the other end
+						  dropped since a newer one was delivered. */
+	uint64_t nbr_no_credit; /**< The number of samples dropped since the
+							  other end had not granted credit for them. */
+};
+
+/**
+ * @brief Set if the channel sends samples in latest value mode.
+ *
+ * In latest value mode a sample that is not important replaces the
+ * sample of the same type encoded before it if that one is not sent yet,
+ * and samples are sent with a sequence number. The receiving end drops
+ * samples older than the newest one it has delivered, whatever its mode.
+ * Important samples are not affected.
+ *
+ * Must be called from the event queue, e.g. in the channel_opened
+ * callback.
+ *
+ * @param chan The channel to set the mode of.
+ * @param latest True to only send the latest value of each type.
+ */
+void firefly_channel_set_latest(struct firefly_channel *chan, bool latest);
+
+/**
+ * @brief Set if samples encoded on the channel may be sent directly by the
+ * thread encoding them, instead of by the event queue.
+ *
+ * A sample that is not important and fits in one packet is then encoded
+ * and written to the transport before the encode function returns, unless
+ * a sample encoded before it on the channel is still waiting in the event
+ * queue or the other end has limited the credit of the channel. Such
+ * samples, important samples and the control traffic of the connection
+ * still go through the event queue, and the transport writer of the
+ * connection is shared with it under a lock. Direct samples carry no acks
+ * and are not sent in latest value mode.
+ *
+ * The lock is held across the write to the transport, so a direct send may
+ * wait for a whole packet to be written by the event queue or another
+ * thread, and the threads sending directly on the channels of a connection
+ * are serialized by it. The waiters spin briefly and then yield the
+ * processor, which does not hand it to a holder of lower priority under a
+ * real-time scheduler. Only use direct sending with transports that do not
+ * block for long when writing, and from threads that do not preempt the
+ * other senders of the connection on the same processor.
+ *
+ * Must be called from the event queue, e.g. in the channel_opened
+ * callback.
+ *
+ * @param chan The channel to set the mode of.
+ * @param direct True to send samples on the thread encoding them.
+ */
+void firefly_channel_set_direct(struct firefly_channel *chan, bool direct);
+
+/**
+ * @brief Get the counters of samples not delivered on the channel.
+ *
+ * Should be called from the event queue.
+ *
+ * @param chan The channel to get the counters of.
+ * @param stats Filled with the counters.
+ */
+void firefly_channel_get_stats(struct firefly_channel *chan,
+		struct firefly_channel_stats *stats);
+
+/**
+ * @brief What a channel does with a sample encoded when the other end has
+ * not granted credit for it, see #firefly_channel_set_credit_mode().
+ */
+enum firefly_credit_mode {
+	FIREFLY_CREDIT_BLOCK, /**< The sample is held and sent once credit is
+							granted, the default. Fails as
+							#FIREFLY_CREDIT_FAIL when the channel already
+							holds too many samples. */
+	FIREFLY_CREDIT_FAIL, /**< Encoding the sample fails with -EAGAIN. */
+	FIREFLY_CREDIT_DROP /**< The sample is dropped and counted in
+						  nbr_no_credit of #firefly_channel_stats. */
+};
+
+/**
+ * @brief The credit state of a channel, see #firefly_channel_get_credits().
+ */
+struct firefly_channel_credits {
+	bool limited; /**< If the other end limits the samples sent on the
+					channel. */
+	int available; /**< The number of samples that may be encoded before
+					 running out of credit, if limited. Negative if
+					 samples are held waiting for credit. */
+	size_t nbr_held; /**< The number of samples held waiting for credit. */
+	unsigned int granted; /**< The credit granted to the other end, 0 if
+							its samples are not limited. */
+};
+
+/**
+ * @brief Limit the number of samples the other end may send on the channel
+ * before they are consumed.
+ *
+ * The other end may send \p credits samples that are not important ahead
+ * of the last one delivered to the application. More credit is granted as
+ * samples are delivered, which bounds the memory and queued events used
+ * for samples received on the channel. Samples lost on the way are
+ * reclaimed when the other end, out of credit, probes for more. Important
+ * samples and samples sent in latest value mode are not limited, the
+ * former by the send window and the latter since they replace each other.
+ *
+ * Must be called from the event queue, e.g. in the channel_opened
+ * callback, on an open channel.
+ *
+ * @param chan The channel to limit.
+ * @param credits The largest number of samples not yet delivered, 0 lifts
+ * the limit.
+ */
+void firefly_channel_set_credits(struct firefly_channel *chan,
+		unsigned int credits);
+
+/**
+ * @brief Set what is done with samples encoded on the channel when the
+ * other end has not granted credit for them.
+ *
+ * The event queue is never blocked, a blocked sample is held by the channel
+ * until credit is granted. The samples held are bounded, at 1024 per
+ * channel, beyond which encoding fails with -EAGAIN as in
+ * #FIREFLY_CREDIT_FAIL mode until credit is granted. An application that
+ * must not queue samples uses #FIREFLY_CREDIT_FAIL or waits for
+ * #firefly_channel_get_credits() to show available credit.
+ *
+ * Must be called from the event queue, e.g. in the channel_opened
+ * callback.
+ *
+ * @param chan The channel to set the mode of.
+ * @param mode The mode.
+ */
+void firefly_channel_set_credit_mode(struct firefly_channel *chan,
+		enum firefly_credit_mode mode);
+
+/**
+ * @brief Get the credit state of the channel.
+ *
+ * Should be called from the event queue.
+ *
+ * @param chan The channel to get the credit state of.
+ * @param credits Filled with the state.
+ */
+void firefly_channel_get_credits(struct firefly_channel *chan,
+		struct firefly_channel_credits *credits);
+
 /**
  * @brief Request restriction of reliability and type registration on
  * encoders on channel. The agreement is not in effect until the
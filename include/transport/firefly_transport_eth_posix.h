@@ -5,7 +5,8 @@
 #include <sys/time.h>
 
 /**
- * @brief The default interval between resending important packets.
+ * @brief The default interval between resending important packets until a
+ * round trip time is measured.
  */
 #define FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_TIMEOUT (500)
 
@@ -15,6 +16,12 @@
  */
 #define FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_RETRIES (5)
 
+/**
+ * @brief The frame payload size used if the MTU of the interface can not be
+ * read. Interfaces configured for jumbo frames send larger frames.
+ */
+#define FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_MTU (1500)
+
 /**
  * @brief This callback will be called when a new connection is received.
  *
@@ -69,6 +76,10 @@ void firefly_transport_llp_eth_posix_free(struct firefly_transport_llp *llp);
  * #firefly_connection. It shall be supplied as parameter to
  * #firefly_connection_open().
  *
+ * The connection resends important packets until acked, doubling the time
+ * between resends each time. The first time is estimated from the round trip
+ * times of acked packets.
+ *
  * @param llp The \c #firefly_transport_llp to associate the data with.
  * @param mac_address The MAC address of the remote node.
  * @param if_name The name of the interface to send data on.
@@ -82,6 +93,17 @@ struct firefly_transport_connection *firefly_transport_connection_eth_posix_new(
 		char *mac_address,
 		char *if_name);
 
+/**
+ * @brief Set the number of times important packets are resent on a
+ * connection before giving up.
+ *
+ * @param tc The transport specific data as returned by
+ * #firefly_transport_connection_eth_posix_new().
+ * @param retries The number of resends, packets sent later use it.
+ */
+void firefly_transport_connection_eth_posix_set_retries(
+		struct firefly_transport_connection *tc, unsigned char retries);
+
 /**
  * @brief Read data from the #firefly_transport_llp. Any read data will be
  * included in an event pushed to the #firefly_event_queue.
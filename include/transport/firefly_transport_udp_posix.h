@@ -15,7 +15,8 @@
 #include <utils/firefly_event_queue.h>
 
 /**
- * @brief The default interval between resending important packets.
+ * @brief The default interval between resending important packets until a
+ * round trip time is measured.
  */
 #define FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_TIMEOUT (500)
 
@@ -25,6 +26,12 @@
  */
 #define FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_RETRIES (5)
 
+/**
+ * @brief The default size of the datagrams sent, an Ethernet frame less the
+ * IP and UDP headers. Larger samples are sent in fragments.
+ */
+#define FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_MTU (1472)
+
 /**
  * @brief This callback will be called when a new connection is received.
  *
@@ -80,10 +87,16 @@ void firefly_transport_llp_udp_posix_free(struct firefly_transport_llp *llp);
  * #firefly_connection. It shall be supplied as parameter to
  * #firefly_connection_open().
  *
+ * The connection resends important packets until acked, at most
+ * #FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_RETRIES times, doubling the time between
+ * resends each time. The first time is estimated from the round trip times of
+ * acked packets.
+ *
  * @param llp The \c #firefly_transport_llp to associate the data with.
  * @param remote_ipaddr The IP address to connect to.
  * @param remote_port The port to connect to.
- * @param timeout The time in ms between resends.
+ * @param timeout The time in ms between resends until a round trip time is
+ * measured.
  * @return The transport specific data ready to be supplied as argument to
  * #firefly_connection_open().
  * @retval NULL upon failure.
@@ -95,6 +108,29 @@ struct firefly_transport_connection *firefly_transport_connection_udp_posix_new(
 		unsigned short remote_port,
 		unsigned int timeout);
 
+/**
+ * @brief Set the number of times important packets are resent on a
+ * connection before giving up.
+ *
+ * @param tc The transport specific data as returned by
+ * #firefly_transport_connection_udp_posix_new().
+ * @param retries The number of resends, packets sent later use it.
+ */
+void firefly_transport_connection_udp_posix_set_retries(
+		struct firefly_transport_connection *tc, unsigned char retries);
+
+/**
+ * @brief Set the size of the datagrams sent on a connection, e.g. for jumbo
+ * frames or to avoid IP fragmentation on paths with a smaller MTU. Must be
+ * called before the connection is opened.
+ *
+ * @param tc The transport specific data as returned by
+ * #firefly_transport_connection_udp_posix_new().
+ * @param mtu The largest datagram in bytes, at most 65507.
+ */
+void firefly_transport_connection_udp_posix_set_mtu(
+		struct firefly_transport_connection *tc, size_t mtu);
+
 /**
  * @brief Start reader and resend thread. Both will run until stopped with
  * firefly_transport_udp_posix_stop().
@@ -52,6 +52,8 @@ enum firefly_error {
 	/**< Error due to bad state of a connection. */
 	FIREFLY_ERROR_CHAN_REFUSED,
 	/**< Error remote end refused channel request. */
+	FIREFLY_ERROR_CONN_TIMEOUT,
+	/**< Nothing was heard from the remote end of a connection in time. */
 	FIREFLY_ERROR_LAST
 	/**< \b Must be the last enum element. firefly_error_get_str() depends on this.*/
 };
@@ -11,9 +11,8 @@
  * This event queue is a priority queue with optional dependecies between
  * events. To solve any conflicts of priority in a dependecy tree priority
  * inheritance is applied. Any depended on event of lower priority will get the
- * effective priority of the event depending on it. In practice all dependecies
- * of an event will be run as soon the event is first in the queue if not
- * before.
+ * effective priority of the event depending on it. An event is not run until
+ * all events it depends on have been executed and returned to the queue.
  */
 
 #ifndef FIREFLY_EVENT_QUEUE_H
@@ -30,10 +29,40 @@
 
 
 /**
- * @brief Defines the maximum number of events an event may depend on.
+ * @brief Defines the number of events firefly lets a single event depend on,
+ * longer lists of dependencies are split into several events. The queue itself
+ * does not limit the number of dependencies of an event.
  */
 #define FIREFLY_EVENT_QUEUE_MAX_DEPENDS (10)
 
+/**
+ * @brief The largest argument, in bytes, that may be copied into an event
+ * when offered, see #firefly_offer_keyed_event.
+ */
+#define FIREFLY_EVENT_ARG_SIZE (128)
+
+/**
+ * @brief Storage for an argument copied into an event, aligned for any of
+ * the types an event argument is made of.
+ */
+union firefly_event_arg {
+	unsigned char data[FIREFLY_EVENT_ARG_SIZE]; /**< The argument. */
+	int64_t align_int; /**< Unused, aligns data. */
+	double align_double; /**< Unused, aligns data. */
+	void *align_ptr; /**< Unused, aligns data. */
+};
+
+/**
+ * @brief The number of buckets in a #firefly_event_histogram.
+ */
+#define FIREFLY_EVENT_STATS_BUCKETS (24)
+
+/**
+ * @brief The number of distinct execute functions the statistics of a queue
+ * are kept for, events of further functions are counted together.
+ */
+#define FIREFLY_EVENT_STATS_FUNCS (64)
+
 /**
  * @defgroup eq_prio Event Queue Priorities
  * @brief Defines common priorities.
@@ -65,7 +94,7 @@ struct firefly_event;
 /**
  * @brief An event queue
  *
- * This is a priority queue, the events are placed in order upon insertion.
+ * This is a priority queue with one FIFO per priority.
  */
 struct firefly_event_queue;
 
@@ -78,6 +107,80 @@ struct firefly_event_queue;
  */
 typedef int (*firefly_event_execute_f)(void *event_arg);
 
+/**
+ * @brief The function called when an event is dropped without being executed,
+ * to free what its context refers to.
+ *
+ * @warning Called with the event queue locked, it must not use the queue.
+ *
+ * @param event_arg The context the event would have been executed with.
+ */
+typedef void (*firefly_event_destroy_f)(void *event_arg);
+
+/**
+ * @brief A monotonic clock used to time events.
+ *
+ * @return The current time in nanoseconds from an arbitrary epoch.
+ */
+typedef uint64_t (*firefly_event_clock_f)(void);
+
+/**
+ * @brief A histogram of durations.
+ *
+ * Bucket 0 counts durations shorter than a microsecond, bucket i counts
+ * durations of at least 2^(i-1) and less than 2^i microseconds. The last
+ * bucket also counts all longer durations.
+ */
+struct firefly_event_histogram {
+	uint64_t count; /**< The number of durations recorded. */
+	uint64_t total_ns; /**< The sum of the durations recorded. */
+	uint64_t max_ns; /**< The longest duration recorded. */
+	uint64_t buckets[FIREFLY_EVENT_STATS_BUCKETS]; /**< The number of
+						durations recorded per bucket. */
+};
+
+/**
+ * @brief The wait and execution times of the events of a priority or an
+ * execute function.
+ */
+struct firefly_event_stats_entry {
+	firefly_event_execute_f execute; /**< The execute function, NULL for the
+						entries of priorities and of functions not fitting
+						in the table. */
+	const char *name; /**< The name given to the function, may be NULL. */
+	unsigned char prio; /**< The priority, for entries of priorities. */
+	struct firefly_event_histogram wait; /**< The time from an event is
+						offered until it is popped. */
+	struct firefly_event_histogram exec; /**< The time from an event is
+						popped until it is returned. */
+};
+
+/**
+ * @brief A snapshot of the statistics of an event queue.
+ *
+ * Times are only recorded when the queue has a clock, see
+ * firefly_event_queue_set_clock().
+ */
+struct firefly_event_queue_stats {
+	size_t depth; /**< The number of events in the queue. */
+	size_t nbr_timers; /**< The number of timer events not yet due. */
+	size_t depth_high; /**< The largest number of events in the queue. */
+	size_t pool_size; /**< The number of events in the pool. */
+	size_t pool_in_use; /**< The number of events taken from the pool. */
+	size_t pool_in_use_high; /**< The largest number of events taken from
+							   the pool at once. */
+	uint64_t pool_grows; /**< The number of times the pool has grown. */
+	uint64_t nbr_added; /**< The number of events added. */
+	uint64_t nbr_returned; /**< The number of events popped and returned. */
+	uint64_t nbr_dropped; /**< The number of events cancelled or purged. */
+	size_t nbr_prios; /**< The number of entries in prios. */
+	struct firefly_event_stats_entry *prios; /**< One entry per priority
+						events have been popped with, highest first. */
+	size_t nbr_funcs; /**< The number of entries in funcs. */
+	struct firefly_event_stats_entry *funcs; /**< One entry per execute
+						function events have been popped with. */
+};
+
 /**
  * @brief The function implementing any extra logic needed to add an event to
  * the event queue in a thread safe way.
@@ -94,8 +197,9 @@ typedef int (*firefly_event_execute_f)(void *event_arg);
  * @param nbr_depends The number of events this event depends on.
  * @param depends A list of event ids, as returned by this function, specifying
  * the events this event depends on. These events will inherit the priority of
- * this event and be executed before this event. This list will be copied and
- * not be referenced once this function returns.
+ * this event and be executed before this event. IDs of events already returned
+ * to the queue are considered done. This list will not be referenced once
+ * this function returns.
  *
  * @return The positive id of the newly added event.
  * @retval <0 if an error occured.
@@ -105,6 +209,106 @@ typedef int64_t (*firefly_offer_event)(struct firefly_event_queue *eq,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
 		unsigned int nbr_depends, const int64_t *depends);
 
+/**
+ * @brief The function implementing any extra logic needed to add an event
+ * with an affinity key or a copied argument to the event queue in a thread
+ * safe way.
+ *
+ * Events with the same, non-NULL, affinity key are never executed at the same
+ * time when the queue schedules by key. A NULL key gives no such guarantee.
+ *
+ * If \p context_size is non-zero the argument is copied into the event, which
+ * is allocated from the pool of the queue, and \p execute is passed the copy.
+ * The copy lives until the event is returned to the queue, so the event must
+ * neither free it nor keep references to it once executed.
+ *
+ * Queued events may be cancelled, or purged by their key or owner. \p destroy
+ * is then called with the context instead of \p execute.
+ * @note This function is implemented by firefly_event_add_keyed(). Other than
+ * the key, owner, size and destructor the parameters are the same as for
+ * #firefly_offer_event.
+ *
+ * @param eq The firefly_event_queue to add the event to.
+ * @param key The affinity key of the new event, typically the
+ * firefly_connection the event operates on.
+ * @param owner What else the event is purged with, typically the
+ * firefly_channel the event operates on, may be NULL.
+ * @param prio The prioity of the new event.
+ * @param execute A function implementing the event to be executed.
+ * @param context The argument to the function \p execute.
+ * @param context_size The number of bytes of \p context to copy, at most
+ * #FIREFLY_EVENT_ARG_SIZE, or 0 to pass \p context as is.
+ * @param destroy The function called if the event is dropped unexecuted, may
+ * be NULL.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids the event depends on.
+ *
+ * @return The positive id of the newly added event.
+ * @retval <0 if an error occured.
+ * @see #firefly_offer_event
+ */
+typedef int64_t (*firefly_offer_keyed_event)(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_depends,
+		const int64_t *depends);
+
+/**
+ * @brief The function implementing any extra logic needed to add a timer
+ * event to the event queue in a thread safe way.
+ *
+ * A timer event is queued like any other event once its deadline has passed,
+ * and is then held back on its key like an event offered with
+ * #firefly_offer_keyed_event. Until then it may be cancelled, or purged by its
+ * key or owner, and events depending on it wait for it.
+ * @note This function is implemented by firefly_event_add_at().
+ *
+ * @param eq The firefly_event_queue to add the event to.
+ * @param key The affinity key of the event, typically the firefly_connection
+ * the event operates on, may be NULL.
+ * @param owner What else the event is purged with, may be NULL.
+ * @param prio The prioity of the new event.
+ * @param deadline The time the event is due, in milliseconds on the clock of
+ * the queue, see firefly_event_queue_now().
+ * @param execute A function implementing the event to be executed.
+ * @param context The argument to the function \p execute.
+ *
+ * @return The positive id of the newly added event.
+ * @retval <0 if an error occured.
+ */
+typedef int64_t (*firefly_offer_event_at)(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline,
+		firefly_event_execute_f execute, void *context);
+
+/**
+ * @brief The function implementing any extra logic needed to cancel an event
+ * in a thread safe way.
+ * @note This function is implemented by firefly_event_cancel().
+ *
+ * @param eq The firefly_event_queue the event was added to.
+ * @param id The ID of the event to cancel.
+ *
+ * @return Integer indicating the result.
+ * @retval 0 if the event was cancelled, it will not be executed.
+ * @retval <0 if there is no such event or it can not be cancelled.
+ */
+typedef int (*firefly_cancel_event)(struct firefly_event_queue *eq,
+		int64_t id);
+
+/**
+ * @brief The function implementing any extra logic needed to purge the events
+ * of an owner in a thread safe way.
+ * @note This function is implemented by firefly_event_purge().
+ *
+ * @param eq The firefly_event_queue to purge.
+ * @param owner The affinity key or owner of the events to drop.
+ *
+ * @return The number of events dropped.
+ */
+typedef size_t (*firefly_purge_events)(struct firefly_event_queue *eq,
+		const void *owner);
+
 /**
  * @brief Initializes and allocates a new firefly_event_queue.
  *
@@ -126,10 +330,10 @@ struct firefly_event_queue *firefly_event_queue_new(
  *
  * @warning The context of the firefly_event_queue will not be freed.
  *
- * @warning This function calls firefly_event_free() on the remaining events in
- * the queue but that function does not free the context of specific events. If
- * the events has any context that needs to be freed separately this needs to
- * be done manually to avoid memory leaks.
+ * @warning The remaining events in the queue are dropped without being
+ * executed. The destructors of events offered with one are called, whether
+ * the events are ready, blocked, held back or waiting for a timer. Contexts of
+ * other events that are not copied into the events are not freed.
  *
  * @param eq
  *		A pointer to the pointer of the firefly_event_queue to be freed.
@@ -149,7 +353,8 @@ void firefly_event_queue_set_strict_pool_size(struct firefly_event_queue *eq,
 
 /**
  * @brief A default implementation of adding an event to the
- * firefly_event_queue. The event will be sorted into the proper position.
+ * firefly_event_queue. The event is put last among the events of the same
+ * priority, or held back until its dependencies are done.
  *
  * This function may be set as the firefly_offer_event of a firefly_event_queue
  * if no extra functionality is required.
@@ -164,8 +369,9 @@ void firefly_event_queue_set_strict_pool_size(struct firefly_event_queue *eq,
  * @param nbr_depends The number of events this event depends on.
  * @param depends A list of event ids, as returned by this function, specifying
  * the events this event depends on. These events will inherit the priority of
- * this event and be executed before this event. This list will be copied and
- * not be referenced once this function returns.
+ * this event and be executed before this event. IDs of events already returned
+ * to the queue are considered done. This list will not be referenced once
+ * this function returns.
  * @return The positive ID of the newly added event.
  * @retval A negative value upon error.
  * @see #firefly_offer_event
@@ -174,13 +380,295 @@ int64_t firefly_event_add(struct firefly_event_queue *eq, unsigned char prio,
 		firefly_event_execute_f execute, void *context,
 		unsigned int nbr_depends, const int64_t *depends);
 
+/**
+ * @brief The default implementation of #firefly_offer_keyed_event, the same as
+ * firefly_event_add() but sets the affinity key, owner and destructor of the
+ * event and optionally copies its argument into the event.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param key The affinity key of the new event.
+ * @param owner What else the event is purged with, may be NULL.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param context_size The number of bytes of \p context to copy into the
+ * event, or 0 to pass \p context as is.
+ * @param destroy The function called if the event is dropped unexecuted, may
+ * be NULL.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids the event depends on.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ * @see #firefly_event_add
+ */
+int64_t firefly_event_add_keyed(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_depends,
+		const int64_t *depends);
+
+/**
+ * @brief Offer an event with an affinity key and optionally a copied argument
+ * to the queue.
+ *
+ * If the queue has a #firefly_offer_keyed_event set it is used. Otherwise the
+ * key is dropped and the event is offered with the #firefly_offer_event of
+ * the queue, an argument to copy is then copied to the heap and freed once
+ * the event is executed.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param key The affinity key of the new event.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param context_size The number of bytes of \p context to copy, at most
+ * #FIREFLY_EVENT_ARG_SIZE, or 0 to pass \p context as is.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids the event depends on.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_event_offer_keyed(struct firefly_event_queue *eq,
+		const void *key, unsigned char prio, firefly_event_execute_f execute,
+		void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends);
+
+/**
+ * @brief Offer an event with an affinity key, an owner and a destructor to
+ * the queue, see firefly_event_offer_keyed().
+ *
+ * Without a #firefly_offer_keyed_event the argument, key, owner and
+ * destructor are kept in a heap allocated box offered through the
+ * #firefly_offer_event of the queue. The key then gives no scheduling
+ * guarantee but the event is still purged with it, and \p destroy is called
+ * if the event is cancelled, purged or left when the queue is freed.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param key The affinity key of the new event.
+ * @param owner What else the event is purged with, may be NULL.
+ * @param prio The priority of the new event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @param context_size The number of bytes of \p context to copy, at most
+ * #FIREFLY_EVENT_ARG_SIZE, or 0 to pass \p context as is.
+ * @param destroy The function called with the context, or its copy, if the
+ * event is cancelled or purged, may be NULL.
+ * @param nbr_depends The number of events this event depends on.
+ * @param depends A list of event ids the event depends on.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_event_offer_owned(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_depends,
+		const int64_t *depends);
+
+/**
+ * @brief Set the callback used to offer events with an affinity key or a
+ * copied argument, and whether to schedule events by affinity key.
+ *
+ * When scheduling by key, firefly_event_pop() never returns an event whose
+ * key is the same as the key of an event popped but not yet returned. Such
+ * events are held back, in order, until the key is free. This is intended for
+ * queues executed by several threads.
+ *
+ * @param eq The event queue to set the callback of.
+ * @param offer_keyed_cb A function implementing #firefly_offer_keyed_event.
+ * The default is firefly_event_add_keyed() for queues using
+ * firefly_event_add() and NULL otherwise.
+ * @param by_key If true events are scheduled by affinity key, otherwise keys
+ * are ignored which is the default. Requires \p offer_keyed_cb.
+ */
+void firefly_event_queue_set_offer_keyed(struct firefly_event_queue *eq,
+		firefly_offer_keyed_event offer_keyed_cb, bool by_key);
+
+/**
+ * @brief Check whether the queue schedules events by affinity key.
+ *
+ * @param eq The event queue to check.
+ * @retval true if the queue schedules events by affinity key.
+ * @retval false otherwise.
+ */
+bool firefly_event_queue_is_keyed(struct firefly_event_queue *eq);
+
+/**
+ * @brief The default implementation of #firefly_offer_event_at, puts the
+ * event in the timer wheel of the queue. Insertion is constant time.
+ *
+ * An event whose deadline has already passed is queued immediately.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param key The affinity key of the event, typically the firefly_connection
+ * the event operates on, may be NULL.
+ * @param owner What else the event is purged with, may be NULL.
+ * @param prio The priority of the new event.
+ * @param deadline The time the event is due, in milliseconds on the clock of
+ * the queue.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error.
+ */
+int64_t firefly_event_add_at(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline,
+		firefly_event_execute_f execute, void *context);
+
+/**
+ * @brief The default implementation of #firefly_cancel_event. Removes an event
+ * not yet popped, or a timer event not yet due, from the queue in constant
+ * time and calls its destructor. Events depending on it are released as if it
+ * was executed.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The firefly_event_queue the event was added to.
+ * @param id The ID of the event to cancel.
+ * @return Integer indicating the result.
+ * @retval 0 if the event was cancelled.
+ * @retval <0 if the event is unknown, running or finished.
+ */
+int firefly_event_cancel(struct firefly_event_queue *eq, int64_t id);
+
+/**
+ * @brief The default implementation of #firefly_purge_events. Cancels every
+ * event not yet popped whose affinity key or owner is \p owner, see
+ * firefly_event_cancel(). Runs in time proportional to the number of
+ * unfinished events, nothing is added to the path of other events.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The firefly_event_queue to purge.
+ * @param owner The affinity key or owner of the events to drop, not NULL.
+ * @return The number of events dropped.
+ */
+size_t firefly_event_purge(struct firefly_event_queue *eq, const void *owner);
+
+/**
+ * @brief Offer a timer event to the queue using its #firefly_offer_event_at.
+ *
+ * Timers that operate on a connection or channel should be keyed and owned
+ * like the other events of it, so they are serialized with those events and
+ * purged when it is freed.
+ *
+ * @param eq The firefly_event_queue to add the firefly_event to.
+ * @param key The affinity key of the event, typically the firefly_connection
+ * the event operates on, may be NULL.
+ * @param owner What else the event is purged with, may be NULL.
+ * @param prio The priority of the new event.
+ * @param deadline The time the event is due, in milliseconds on the clock of
+ * the queue.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @return The positive ID of the newly added event.
+ * @retval A negative value upon error, or if the queue has no timers.
+ */
+int64_t firefly_event_offer_at(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline,
+		firefly_event_execute_f execute, void *context);
+
+/**
+ * @brief Cancel an event using the #firefly_cancel_event of the queue.
+ *
+ * @param eq The firefly_event_queue the event was added to.
+ * @param id The ID of the event to cancel.
+ * @return Integer indicating the result.
+ * @retval 0 if the event was cancelled.
+ * @retval <0 if the event could not be cancelled.
+ */
+int firefly_event_queue_cancel(struct firefly_event_queue *eq, int64_t id);
+
+/**
+ * @brief Purge the events of an owner using the #firefly_purge_events of the
+ * queue.
+ *
+ * @param eq The firefly_event_queue to purge.
+ * @param owner The affinity key or owner of the events to drop.
+ * @return The number of events dropped, 0 if the queue can not purge.
+ */
+size_t firefly_event_queue_purge(struct firefly_event_queue *eq,
+		const void *owner);
+
+/**
+ * @brief Set the callback used to add timer events.
+ *
+ * The default is firefly_event_add_at() for queues using firefly_event_add()
+ * and NULL otherwise.
+ *
+ * @param eq The event queue to set the callback of.
+ * @param offer_at_cb A function implementing #firefly_offer_event_at.
+ */
+void firefly_event_queue_set_timers(struct firefly_event_queue *eq,
+		firefly_offer_event_at offer_at_cb);
+
+/**
+ * @brief Set the callbacks used to cancel events.
+ *
+ * The defaults are firefly_event_cancel() and firefly_event_purge() for
+ * queues using firefly_event_add() and NULL otherwise.
+ *
+ * @param eq The event queue to set the callbacks of.
+ * @param cancel_cb A function implementing #firefly_cancel_event.
+ * @param purge_cb A function implementing #firefly_purge_events.
+ */
+void firefly_event_queue_set_cancel(struct firefly_event_queue *eq,
+		firefly_cancel_event cancel_cb, firefly_purge_events purge_cb);
+
+/**
+ * @brief Get the current time of the clock of the queue in milliseconds, the
+ * time base of timer events.
+ *
+ * @param eq The event queue.
+ * @return The current time in milliseconds.
+ * @retval 0 if the queue has no clock.
+ */
+uint64_t firefly_event_queue_now(struct firefly_event_queue *eq);
+
+/**
+ * @brief Queue the timer events whose deadline is at or before \p now.
+ *
+ * Runs in time proportional to the number of expired timers plus the time
+ * passed since the last call divided by 64 ms.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The event queue.
+ * @param now The current time in milliseconds.
+ * @return The number of timer events queued.
+ */
+size_t firefly_event_queue_expire(struct firefly_event_queue *eq,
+		uint64_t now);
+
+/**
+ * @brief Get when firefly_event_queue_expire() next needs to be called.
+ *
+ * The time is a lower bound of the earliest deadline, it is exact within the
+ * next 64 ms.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The event queue.
+ * @param deadline Set to the time in milliseconds, if there are timers.
+ * @retval true if the queue has timer events not yet due.
+ * @retval false otherwise.
+ */
+bool firefly_event_queue_next_timer(struct firefly_event_queue *eq,
+		uint64_t *deadline);
+
 /**
  * @brief Get the next event in the firefly_event_queue and remove it from the
  * queue.
  *
- * This function will follow any dependencies and return the next event which
- * must be executed to satify the dependecies of the first event in the queue or
- * itself if all its dependencied are fulfilled.
+ * Only events whose dependencies have all been executed and returned are
+ * considered, the oldest such event of the highest effective priority is
+ * returned. If the queue schedules by key, events whose key is busy are also
+ * skipped.
  *
  * @param eq
  *		The queue to pop an event from.
@@ -192,6 +680,7 @@ struct firefly_event *firefly_event_pop(struct firefly_event_queue *eq);
 /**
  * @brief Returns the event to the pool of available event in the queue. The
  * reference to the event will be set to NULL to prevent it from being used.
+ * Events waiting for this event to finish are released.
  *
  * @param eq The event queue to return the event to
  * @param ev A referece to the reference to the event to return.
@@ -235,4 +724,60 @@ void *firefly_event_queue_get_context(struct firefly_event_queue *eq);
  */
 int64_t firefly_event_queue_event_id(struct firefly_event *ev);
 
+/**
+ * @brief Set the clock used to time the events of the queue. Without a clock
+ * only counters and depths are recorded, which is the default. The clock is
+ * also the time base of timer events, without it firefly_event_queue_expire()
+ * must be given the time.
+ *
+ * @param eq The event queue to set the clock of.
+ * @param clock The clock to use, or NULL to stop timing events.
+ */
+void firefly_event_queue_set_clock(struct firefly_event_queue *eq,
+		firefly_event_clock_f clock);
+
+/**
+ * @brief Name an execute function in the statistics of the queue.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The event queue.
+ * @param execute The execute function to name.
+ * @param name The name, must outlive the queue.
+ * @return Integer indicating the result.
+ * @retval 0 on success.
+ * @retval <0 if the function does not fit in the statistics.
+ */
+int firefly_event_queue_stats_name(struct firefly_event_queue *eq,
+		firefly_event_execute_f execute, const char *name);
+
+/**
+ * @brief Take a snapshot of the statistics of the queue.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The event queue.
+ * @return The snapshot, free it with firefly_event_queue_stats_free().
+ * @retval NULL on allocation failure.
+ */
+struct firefly_event_queue_stats *firefly_event_queue_stats_get(
+		struct firefly_event_queue *eq);
+
+/**
+ * @brief Free a snapshot of statistics.
+ *
+ * @param stats A pointer to the pointer of the snapshot, set to NULL.
+ */
+void firefly_event_queue_stats_free(struct firefly_event_queue_stats **stats);
+
+/**
+ * @brief Reset the histograms, counters and high-watermarks of the queue.
+ * Names of functions are kept.
+ *
+ * @warning This function is not thread safe.
+ *
+ * @param eq The event queue.
+ */
+void firefly_event_queue_stats_reset(struct firefly_event_queue *eq);
+
 #endif
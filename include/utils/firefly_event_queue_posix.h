@@ -2,9 +2,32 @@
 #define FIREFLY_EVENT_QUEUE_POSIX_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include <utils/firefly_event_queue.h>
 
+/**
+ * @brief How an idle worker waits for new events.
+ */
+enum firefly_event_queue_posix_wait_strategy {
+	FIREFLY_EVENT_QUEUE_POSIX_BLOCK, /**< Park on a condition variable at
+					   once, the default. */
+	FIREFLY_EVENT_QUEUE_POSIX_SPIN, /**< Poll for a while, then park. */
+	FIREFLY_EVENT_QUEUE_POSIX_POLL /**< Poll and never park, keeps a core
+					 busy per idle worker. */
+};
+
+/**
+ * @brief Counters of how the workers of a posix queue waited for events.
+ */
+struct firefly_event_queue_posix_wait_stats {
+	uint64_t nbr_spins; /**< The number of times a worker polled. */
+	uint64_t nbr_spin_hits; /**< The number of polls that found work. */
+	uint64_t nbr_parks; /**< The number of times a worker parked. */
+	uint64_t nbr_wakeups; /**< The number of times a parked worker was
+				signalled. */
+};
+
 /**
  * @brief Construct a new struct firefly_event_queue with with a context
  * specific for this utility.
@@ -14,6 +37,29 @@
  */
 struct firefly_event_queue *firefly_event_queue_posix_new(size_t pool_size);
 
+/**
+ * @brief Construct a new struct firefly_event_queue executed by a pool of
+ * worker threads.
+ *
+ * The queue schedules by affinity key, see
+ * firefly_event_queue_set_offer_keyed(). Events with the same key, all events
+ * of a firefly_connection offered by firefly, are executed in order and never
+ * at the same time. Any idle worker picks up the highest priority event which
+ * key is not busy, so the events of a key are not tied to one worker.
+ *
+ * Timer events, see firefly_event_offer_at(), are due in milliseconds on
+ * CLOCK_MONOTONIC, see firefly_event_queue_now(). Idle workers sleep until
+ * the next timer may be due.
+ *
+ * @param pool_size The number of preallocated events.
+ * @param nbr_workers The number of worker threads started by
+ * firefly_event_queue_posix_run(), at least 1.
+ * @return The newly contructed event queue.
+ * @retval NULL on error.
+ */
+struct firefly_event_queue *firefly_event_queue_posix_new_pool(
+		size_t pool_size, size_t nbr_workers);
+
 /**
  * @brief Free the specified event queue and the posix specific context. Stop
  * the event loop if it is running.
@@ -23,10 +69,11 @@ struct firefly_event_queue *firefly_event_queue_posix_new(size_t pool_size);
 void firefly_event_queue_posix_free(struct firefly_event_queue **eq);
 
 /**
- * @brief Start the event loop.
+ * @brief Start the event loop, one thread per worker.
  *
  * @param eq The event queue to loop execute events from. It must have been
- * constructed with firefly_event_queue_posix_new().
+ * constructed with firefly_event_queue_posix_new() or
+ * firefly_event_queue_posix_new_pool().
  * @param attr The attributes to use when starting the event loop posix thread.
  * If NULL the default is used.
  * @return Integer indicating result.
@@ -37,7 +84,7 @@ int firefly_event_queue_posix_run(struct firefly_event_queue *eq,
 		pthread_attr_t *attr);
 
 /**
- * @brief Stop the event loop. Will block untill the event loop is stopped.
+ * @brief Stop the event loop. Will block untill all workers are stopped.
  *
  * @param eq The event queue of the event loop to stop. It must have been
  * constructed with firefly_event_queue_posix_new().
@@ -47,4 +94,65 @@ int firefly_event_queue_posix_run(struct firefly_event_queue *eq,
  */
 int firefly_event_queue_posix_stop(struct firefly_event_queue *eq);
 
+/**
+ * @brief Set how idle workers wait for new events, may be changed while the
+ * event loop runs.
+ *
+ * Parking costs a wake-up through the kernel for the next event. Polling
+ * picks up the next event within microseconds but keeps the worker on its
+ * core while polling. Due timers end the polling as well.
+ *
+ * @param eq The event queue.
+ * @param strategy How to wait.
+ * @param spin_us How long to poll before parking, in microseconds. Only used
+ * by #FIREFLY_EVENT_QUEUE_POSIX_SPIN.
+ */
+void firefly_event_queue_posix_set_wait_strategy(struct firefly_event_queue *eq,
+		enum firefly_event_queue_posix_wait_strategy strategy,
+		unsigned int spin_us);
+
+/**
+ * @brief Read the wait counters of the queue. They are reset by
+ * firefly_event_queue_posix_stats_reset().
+ *
+ * @param eq The event queue.
+ * @param stats Filled with the counters.
+ */
+void firefly_event_queue_posix_wait_stats_get(struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_wait_stats *stats);
+
+/**
+ * @brief Take a snapshot of the statistics of the queue, thread safe version
+ * of firefly_event_queue_stats_get(). Posix queues time their events with
+ * CLOCK_MONOTONIC.
+ *
+ * @param eq The event queue.
+ * @return The snapshot, free it with firefly_event_queue_stats_free().
+ * @retval NULL on allocation failure.
+ */
+struct firefly_event_queue_stats *firefly_event_queue_posix_stats_get(
+		struct firefly_event_queue *eq);
+
+/**
+ * @brief Reset the statistics of the queue, thread safe version of
+ * firefly_event_queue_stats_reset(). Resets the wait counters as well.
+ *
+ * @param eq The event queue.
+ */
+void firefly_event_queue_posix_stats_reset(struct firefly_event_queue *eq);
+
+/**
+ * @brief Name an execute function in the statistics of the queue, thread
+ * safe version of firefly_event_queue_stats_name().
+ *
+ * @param eq The event queue.
+ * @param execute The execute function to name.
+ * @param name The name, must outlive the queue.
+ * @return Integer indicating the result.
+ * @retval 0 on success.
+ * @retval <0 if the function does not fit in the statistics.
+ */
+int firefly_event_queue_posix_stats_name(struct firefly_event_queue *eq,
+		firefly_event_execute_f execute, const char *name);
+
 #endif
@@ -3,6 +3,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 
 #include <labcomm.h>
@@ -12,6 +13,7 @@
 #include <utils/firefly_event_queue.h>
 
 #include "utils/firefly_event_queue_private.h"
+#include "utils/firefly_packet.h"
 #include "utils/cppmacros.h"
 
 /*
@@ -40,6 +42,23 @@ static void firefly_unknown_dest(struct firefly_connection *conn,
 						      &chan_close);
 }
 
+/*
+ * Find the open channel a packet is sent to. A packet from another remote
+ * channel than the one the local channel is connected to was sent to an
+ * earlier channel with the same local id, it is stale and dropped without
+ * closing the remote channel, which may be in use again.
+ */
+static struct firefly_channel *find_channel_by_ids(
+		struct firefly_connection *conn, int src_id, int dest_id,
+		bool *stale)
+{
+	struct firefly_channel *chan;
+
+	chan = find_channel_by_local_id(conn, dest_id);
+	*stale = chan != NULL && chan->remote_id != src_id;
+	return *stale ? NULL : chan;
+}
+
 int firefly_channel_open_event(void *event_arg)
 {
 	struct firefly_connection        *conn;
@@ -82,7 +101,7 @@ void firefly_channel_open(struct firefly_connection *conn)
 {
 	int64_t ret;
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_connection_offer_event(conn,
 						FIREFLY_PRIORITY_HIGH,
 						firefly_channel_open_event,
 						conn, 0, NULL);
@@ -123,8 +142,6 @@ int firefly_channel_open_auto_restrict_event(void *event_arg)
 	labcomm_encode_firefly_protocol_channel_request(conn->transport_encoder,
 							&chan_req);
 
-	FIREFLY_FREE(event_arg);
-
 	return 0;
 }
 
@@ -132,21 +149,16 @@ void firefly_channel_open_auto_restrict( struct firefly_connection *conn,
 					struct firefly_channel_types types)
 {
 	int64_t ret;
-	struct firefly_event_chan_open_auto_restrict *ev;
-
-	ev = FIREFLY_MALLOC(sizeof(*ev));
-	if (ev) {
-		ev->connection = conn;
-		ev->types = types;
-		ret = conn->event_queue->offer_event_cb(conn->event_queue,
-				FIREFLY_PRIORITY_HIGH,
-				firefly_channel_open_auto_restrict_event,
-				ev, 0, NULL);
-		if (ret < 0)
-			firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
-	} else {
+	struct firefly_event_chan_open_auto_restrict ev;
+
+	ev.connection = conn;
+	ev.types = types;
+	ret = firefly_connection_offer_event_copy(conn,
+			FIREFLY_PRIORITY_HIGH,
+			firefly_channel_open_auto_restrict_event,
+			&ev, sizeof(ev), 0, NULL);
+	if (ret < 0)
 		firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
-	}
 }
 
 static int64_t create_channel_closed_event(struct firefly_channel *chan,
@@ -154,9 +166,9 @@ static int64_t create_channel_closed_event(struct firefly_channel *chan,
 {
 	int64_t ret;
 
-	ret = chan->conn->event_queue->offer_event_cb(chan->conn->event_queue,
+	ret = firefly_connection_offer_event_owned(chan->conn, chan,
 			FIREFLY_PRIORITY_HIGH, firefly_channel_closed_event,
-			chan, nbr_deps, deps);
+			chan, 0, NULL, nbr_deps, deps);
 	if (ret < 0)
 		firefly_error(FIREFLY_ERROR_ALLOC, 1, "Could not add event.");
 	return ret;
@@ -188,10 +200,10 @@ int64_t firefly_channel_close(struct firefly_channel *chan)
 
 	conn = chan->conn;
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_connection_offer_event_owned(conn, chan,
 						FIREFLY_PRIORITY_HIGH,
 						firefly_channel_close_event,
-						chan, 0, NULL);
+						chan, 0, NULL, 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "Could not add event to queue.");
@@ -206,6 +218,7 @@ void protocol_data_received(struct firefly_connection *conn,
 		unsigned char *data, size_t size)
 {
 	if (conn->open == FIREFLY_CONNECTION_OPEN) {
+		__atomic_store_n(&conn->heartbeat_received, true, __ATOMIC_RELEASE);
 		labcomm_decoder_ioctl(conn->transport_decoder,
 				FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER,
 				data, size);
@@ -215,33 +228,70 @@ void protocol_data_received(struct firefly_connection *conn,
 	}
 }
 
+void protocol_packet_received(struct firefly_connection *conn,
+		struct firefly_packet *pkt)
+{
+	if (conn->open == FIREFLY_CONNECTION_OPEN) {
+		__atomic_store_n(&conn->heartbeat_received, true, __ATOMIC_RELEASE);
+		labcomm_decoder_ioctl(conn->transport_decoder,
+				FIREFLY_LABCOMM_IOCTL_READER_SET_PACKET, pkt);
+		int res = 0;
+		while (res >= 0)
+			res = labcomm_decoder_decode_one(conn->transport_decoder);
+	} else {
+		firefly_packet_release(pkt);
+	}
+}
+
+void firefly_received_release(struct firefly_connection *conn,
+		unsigned char *data, struct firefly_packet *pkt)
+{
+	if (pkt != NULL)
+		firefly_packet_release(pkt);
+	else
+		FIREFLY_RUNTIME_FREE(conn, data);
+}
+
+/*
+ * Refer to the bytes of a received array in the packet they were received
+ * in, or copy them if they were not received in a packet.
+ */
+static unsigned char *data_received_ref(struct firefly_connection *conn,
+		const unsigned char *data, size_t size, size_t trailer,
+		struct firefly_packet **pkt)
+{
+	unsigned char *res;
+
+	*pkt = NULL;
+	res = transport_labcomm_reader_ref(conn->transport_reader, data, size,
+			trailer, pkt);
+	if (res == NULL) {
+		res = FIREFLY_RUNTIME_MALLOC(conn, size);
+		if (res != NULL)
+			memcpy(res, data, size);
+	}
+	return res;
+}
+
 void handle_channel_request(firefly_protocol_channel_request *chan_req,
 		void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_req_recv *fecrr;
+	struct firefly_event_chan_req_recv fecrr;
 	int ret;
 
 	conn = context;
 
-	fecrr = FIREFLY_MALLOC(sizeof(*fecrr));
-	if (fecrr == NULL) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event.\n");
-		return;
-	}
+	fecrr.conn = conn;
+	memcpy(&fecrr.chan_req, chan_req, sizeof(*chan_req));
 
-	fecrr->conn = conn;
-	memcpy(&fecrr->chan_req, chan_req, sizeof(*chan_req));
-
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_connection_offer_event_copy(conn,
 						FIREFLY_PRIORITY_HIGH,
 						handle_channel_request_event,
-						fecrr, 0, NULL);
+						&fecrr, sizeof(fecrr), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
-		FIREFLY_FREE(fecrr);
 	}
 }
 
@@ -292,8 +342,6 @@ int handle_channel_request_event(void *event_arg)
 		}
 	}
 
-	FIREFLY_FREE(event_arg);
-
 	return ret;
 }
 
@@ -301,27 +349,20 @@ void handle_channel_response(firefly_protocol_channel_response *chan_res,
 		void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_res_recv *fecrr;
+	struct firefly_event_chan_res_recv fecrr;
 	int ret;
 
 	conn = context;
 
-	fecrr = FIREFLY_MALLOC(sizeof(*fecrr));
-	if (fecrr == NULL) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event.\n");
-		return;
-	}
-	fecrr->conn = conn;
-	memcpy(&fecrr->chan_res, chan_res, sizeof(*chan_res));
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	fecrr.conn = conn;
+	memcpy(&fecrr.chan_res, chan_res, sizeof(*chan_res));
+	ret = firefly_connection_offer_event_copy(conn,
 						FIREFLY_PRIORITY_HIGH,
 						handle_channel_response_event,
-						fecrr, 0, NULL);
+						&fecrr, sizeof(fecrr), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
-		FIREFLY_FREE(fecrr);
 	}
 }
 
@@ -359,7 +400,7 @@ int handle_channel_response_event(void *event_arg)
                                      fecrr->chan_res.dest_chan_id, "channel_response");
 	} else if (fecrr->chan_res.ack) {
 		if (chan->remote_id == CHANNEL_ID_NOT_SET) {
-			chan->remote_id = fecrr->chan_res.source_chan_id;
+			set_channel_remote_id(chan, fecrr->chan_res.source_chan_id);
 			firefly_channel_ack(chan);
 			firefly_channel_internal_opened(chan);
 			firefly_channel_set_types(chan, chan->types);
@@ -373,7 +414,6 @@ int handle_channel_response_event(void *event_arg)
 		firefly_channel_free(remove_channel_from_connection(chan,
 								fecrr->conn));
 	}
-	FIREFLY_FREE(event_arg);
 
 	return 0;
 }
@@ -381,26 +421,18 @@ int handle_channel_response_event(void *event_arg)
 void handle_channel_ack(firefly_protocol_channel_ack *chan_ack, void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_ack_recv *fecar;
+	struct firefly_event_chan_ack_recv fecar;
 	int ret;
 
 	conn = context;
-	fecar = FIREFLY_MALLOC(sizeof(*fecar));
-	if (fecar == NULL) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event.\n");
-		return;
-	}
+	fecar.conn = conn;
+	memcpy(&fecar.chan_ack, chan_ack, sizeof(*chan_ack));
 
-	fecar->conn = conn;
-	memcpy(&fecar->chan_ack, chan_ack, sizeof(*chan_ack));
-
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
-			FIREFLY_PRIORITY_HIGH, handle_channel_ack_event, fecar, 0, NULL);
+	ret = firefly_connection_offer_event_copy(conn, FIREFLY_PRIORITY_HIGH,
+			handle_channel_ack_event, &fecar, sizeof(fecar), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
-		FIREFLY_FREE(fecar);
 	}
 }
 
@@ -419,7 +451,6 @@ int handle_channel_ack_event(void *event_arg)
 		firefly_unknown_dest(fecar->conn, fecar->chan_ack.source_chan_id,
 							 fecar->chan_ack.dest_chan_id, "channel_ack");
 	}
-	FIREFLY_FREE(event_arg);
 
 	return 0;
 }
@@ -442,127 +473,493 @@ void handle_channel_close(firefly_protocol_channel_close *chan_close,
 	}
 }
 
+static void handle_data_sample_destroy(void *event_arg)
+{
+	struct firefly_event_recv_sample *fers;
+
+	fers = event_arg;
+	firefly_received_release(fers->conn, fers->data.app_enc_data.a,
+			fers->pkt);
+}
+
 void handle_data_sample(firefly_protocol_data_sample *data, void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_recv_sample *fers;
+	struct firefly_event_recv_sample fers;
 	unsigned char *fers_data;
+	size_t trailer;
 	int ret;
 
 	conn = context;
-	fers = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*fers));
-	fers_data = FIREFLY_RUNTIME_MALLOC(conn, data->app_enc_data.n_0);
-	if (fers == NULL || fers_data == NULL) {
+	if (data->ack_cumulative != 0 || data->ack_ranges.n_0 > 0) {
+		struct firefly_channel *chan;
+		bool stale;
+
+		chan = find_channel_by_ids(conn, data->src_chan_id,
+				data->dest_chan_id, &stale);
+		if (chan != NULL)
+			firefly_channel_ack_ranges(chan, data->ack_cumulative,
+					data->ack_ranges.a, data->ack_ranges.n_0);
+	}
+	/* The application data is followed by the int and array of the acks. */
+	trailer = FIREFLY_LABCOMM_INT_SIZE +
+		firefly_labcomm_packed32_size(data->ack_ranges.n_0) +
+		data->ack_ranges.n_0 * 2 * FIREFLY_LABCOMM_INT_SIZE;
+	fers_data = data_received_ref(conn, data->app_enc_data.a,
+			data->app_enc_data.n_0, trailer, &fers.pkt);
+	if (fers_data == NULL) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "Could not allocate event.\n");
-		FIREFLY_RUNTIME_FREE(conn, fers_data);
-		FIREFLY_RUNTIME_FREE(conn, fers);
 		return;
 	}
 
-	fers->conn = conn;
-	memcpy(&fers->data, data, sizeof(*data));
-	memcpy(fers_data, data->app_enc_data.a, data->app_enc_data.n_0);
-	fers->data.app_enc_data.a = fers_data;
+	fers.conn = conn;
+	memcpy(&fers.data, data, sizeof(*data));
+	fers.data.app_enc_data.a = fers_data;
+	fers.data.ack_ranges.n_0 = 0;
+	fers.data.ack_ranges.a = NULL;
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
-			FIREFLY_PRIORITY_LOW, handle_data_sample_event, fers, 0, NULL);
+	ret = firefly_connection_offer_event_owned(conn, NULL,
+			FIREFLY_PRIORITY_LOW, handle_data_sample_event, &fers,
+			sizeof(fers), handle_data_sample_destroy, 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
-		FIREFLY_RUNTIME_FREE(conn, fers->data.app_enc_data.a);
-		FIREFLY_RUNTIME_FREE(conn, fers);
+		firefly_received_release(conn, fers_data, fers.pkt);
 	}
 }
 
-int handle_data_sample_event(void *event_arg)
+static void data_sample_send_ack(struct firefly_channel *chan, int seqno)
+{
+	firefly_protocol_ack ack_pkt;
+
+	ack_pkt.dest_chan_id = chan->remote_id;
+	ack_pkt.src_chan_id = chan->local_id;
+	ack_pkt.seqno = seqno;
+	labcomm_encode_firefly_protocol_ack(chan->conn->transport_encoder,
+			&ack_pkt);
+}
+
+/*
+ * Send a cumulative ack on each channel with received samples not yet acked.
+ */
+static void data_sample_send_pending_acks(struct firefly_connection *conn)
 {
-	struct firefly_event_recv_sample *fers;
 	struct firefly_channel *chan;
+	firefly_protocol_ack_range ranges[FIREFLY_CHANNEL_WINDOW_MAX];
+	firefly_protocol_ack_ranges ack_pkt;
+
+	conn->nbr_ack_pending = 0;
+	for (size_t i = 0; i < conn->channels.size; i++) {
+		chan = conn->channels.chans[i];
+		if (chan == NULL || !chan->ack_pending)
+			continue;
+		chan->ack_pending = false;
+		ack_pkt.dest_chan_id = chan->remote_id;
+		ack_pkt.src_chan_id = chan->local_id;
+		ack_pkt.cumulative = chan->remote_seqno;
+		ack_pkt.ranges.n_0 = firefly_channel_received_ranges(chan, ranges);
+		ack_pkt.ranges.a = ranges;
+		labcomm_encode_firefly_protocol_ack_ranges(conn->transport_encoder,
+				&ack_pkt);
+	}
+}
 
-	fers = event_arg;
+static int data_sample_send_pending_acks_event(void *event_arg)
+{
+	struct firefly_connection *conn;
 
-	chan = find_channel_by_local_id(fers->conn, fers->data.dest_chan_id);
+	conn = event_arg;
+	conn->ack_flush_id = 0;
+	data_sample_send_pending_acks(conn);
+	return 0;
+}
 
-	if (chan != NULL) {
-                /* FIXME: Undefined wrapping behaviour. */
-		int expected_seqno = chan->remote_seqno + 1;
+/*
+ * Ack an important sample at once, or later together with the other
+ * samples received on the connection if it coalesces acks.
+ */
+static void data_sample_ack(struct firefly_channel *chan, int seqno)
+{
+	struct firefly_connection *conn;
+	struct firefly_event_queue *eq;
+	int64_t id;
 
-		if (expected_seqno <= 0) {
-			expected_seqno = 1;
-		}
-		if (fers->data.important) {
-			firefly_protocol_ack ack_pkt;
-
-			ack_pkt.dest_chan_id = chan->remote_id;
-			ack_pkt.src_chan_id = chan->local_id;
-			ack_pkt.seqno = fers->data.seqno;
-			labcomm_encode_firefly_protocol_ack(
-					chan->conn->transport_encoder,
-					&ack_pkt);
+	conn = chan->conn;
+	if (conn->ack_max_pending <= 1) {
+		data_sample_send_ack(chan, seqno);
+		return;
+	}
+	chan->ack_pending = true;
+	conn->nbr_ack_pending++;
+	if (conn->nbr_ack_pending >= conn->ack_max_pending) {
+		/* An offered event is left to send the acks received until then. */
+		data_sample_send_pending_acks(conn);
+	} else if (conn->ack_flush_id == 0) {
+		eq = conn->event_queue;
+		if (conn->ack_delay > 0) {
+			id = firefly_event_offer_at(eq, conn, NULL,
+					FIREFLY_PRIORITY_LOW,
+					firefly_event_queue_now(eq) + conn->ack_delay,
+					data_sample_send_pending_acks_event, conn);
+		} else {
+			id = firefly_connection_offer_event(conn, FIREFLY_PRIORITY_LOW,
+					data_sample_send_pending_acks_event, conn, 0, NULL);
 		}
-		if (!fers->data.important ||
-		    expected_seqno == fers->data.seqno)
-		{
-			size_t size;
-			int id;
-
-			size = fers->data.app_enc_data.n_0;
-			labcomm_decoder_ioctl(chan->proto_decoder,
-					FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER,
-					fers->data.app_enc_data.a,
-					size);
-
-			id = labcomm_decoder_decode_one(chan->proto_decoder);
-			if (fers->data.important) {
-				chan->remote_seqno = fers->data.seqno;
-			}
-			if (id == -ENOENT) {
+		if (id > 0)
+			conn->ack_flush_id = id;
+		else
+			data_sample_send_pending_acks(conn);
+	}
+}
+
+static void data_sample_decode(struct firefly_channel *chan,
+		unsigned char *data, size_t size)
+{
+	int id;
+
+	labcomm_decoder_ioctl(chan->proto_decoder,
+			FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER,
+			data, size);
+
+	id = labcomm_decoder_decode_one(chan->proto_decoder);
+	if (id == -ENOENT) {
 #if 0
-				if (!chan->auto_restrict) {
-					firefly_error(FIREFLY_ERROR_LABCOMM, 1,
-						      "Unkn. type. Use autorestr.");
-				} else {
-					firefly_error(FIREFLY_ERROR_LABCOMM, 1,
-						      "Wait for restr.");
-				}
+		if (!chan->auto_restrict) {
+			firefly_error(FIREFLY_ERROR_LABCOMM, 1,
+				      "Unkn. type. Use autorestr.");
+		} else {
+			firefly_error(FIREFLY_ERROR_LABCOMM, 1,
+				      "Wait for restr.");
+		}
 #endif
-			} else if (!chan->restricted_local &&
-				   chan->auto_restrict)
+	} else if (!chan->restricted_local &&
+		   chan->auto_restrict)
+	{
+		size_t n = 0;
+
+		for (; n < chan->n_decoder_types; n++) {
+			if (chan->seen_decoder_ids[n] == -1 ||
+			    chan->seen_decoder_ids[n] == id)
 			{
-				size_t n = 0;
-
-				for (; n < chan->n_decoder_types; n++) {
-					if (chan->seen_decoder_ids[n] == -1 ||
-					    chan->seen_decoder_ids[n] == id)
-					{
-						break;
-					}
-				}
-				chan->seen_decoder_ids[n] = id;
-				if (n == chan->n_decoder_types-1) {
-					FIREFLY_FREE(chan->seen_decoder_ids);
-					chan->seen_decoder_ids = NULL;
-					chan->n_decoder_types = 0; /* State-ish */
-					channel_auto_restr_send_ack(chan);
-				}
+				break;
 			}
-		} else if (fers->data.important &&
-			   expected_seqno != fers->data.seqno)
-		{
-#if 0	/* This would probably be a good idea, but it breaks existing tests. */
-			firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
-				      "Received data flagged important with "
-				      "unexpected sequence number.");
-#endif
 		}
+		chan->seen_decoder_ids[n] = id;
+		if (n == chan->n_decoder_types-1) {
+			FIREFLY_FREE(chan->seen_decoder_ids);
+			chan->seen_decoder_ids = NULL;
+			chan->n_decoder_types = 0; /* State-ish */
+			channel_auto_restr_send_ack(chan);
+		}
+	}
+}
+
+/*
+ * Check that a sample sent in latest value mode is newer than the last one
+ * delivered, counting the ones skipped over as lost. Other samples have
+ * sequence number 0 and are always delivered.
+ */
+static bool data_sample_latest(struct firefly_channel *chan, int seqno)
+{
+	int ahead;
+
+	if (seqno == 0)
+		return true;
+	ahead = firefly_seqno_diff(seqno, chan->remote_sample_seqno);
+	if (chan->remote_sample_seqno != 0 && ahead <= 0) {
+		chan->stats.nbr_stale++;
+		return false;
+	}
+	if (ahead > 1)
+		chan->stats.nbr_lost += ahead - 1;
+	chan->remote_sample_seqno = seqno;
+	return true;
+}
+
+static void data_fragment_discard(struct firefly_channel *chan,
+		struct firefly_channel_reassembly *r)
+{
+	chan->conn->reassembly_size -= r->size;
+	FIREFLY_RUNTIME_FREE(chan->conn, r->data);
+	r->data = NULL;
+}
+
+/*
+ * Copy a fragment into the sample it is part of and decode the sample once
+ * all of it is received. Returns false if the sample does not fit within
+ * the reassembly limit of the connection right now.
+ */
+static bool data_fragment_add(struct firefly_channel *chan, bool important,
+		struct firefly_channel_reorder *frag)
+{
+	struct firefly_connection *conn;
+	struct firefly_channel_reassembly *r;
+	size_t total;
+
+	conn = chan->conn;
+	r = &chan->reassembly[important];
+	total = frag->total_size;
+	if (frag->offset < 0 || (size_t) frag->offset > total ||
+			frag->size > total - frag->offset) {
+		firefly_channel_raise(chan, NULL, FIREFLY_ERROR_PROTO_STATE,
+				"Fragment outside of its sample.");
+		return true;
+	}
+	if (r->data != NULL && (r->sample_id != frag->sample_id ||
+				r->size != total)) {
+		/* The rest of the sample was lost. */
+		data_fragment_discard(chan, r);
+		if (!important)
+			chan->stats.nbr_lost++;
+	}
+	if (r->data == NULL) {
+		if (total > conn->reassembly_max) {
+			firefly_channel_raise(chan, NULL, FIREFLY_ERROR_ALLOC,
+					"Sample larger than the reassembly limit.");
+			return true;
+		}
+		if (conn->reassembly_size + total > conn->reassembly_max) {
+			if (!important)
+				chan->stats.nbr_lost++;
+			return false;
+		}
+		r->data = FIREFLY_RUNTIME_MALLOC(conn, total);
+		if (r->data == NULL) {
+			FFL(FIREFLY_ERROR_ALLOC);
+			return false;
+		}
+		conn->reassembly_size += total;
+		r->sample_id = frag->sample_id;
+		r->seqno = frag->seqno;
+		r->size = total;
+		r->received = 0;
+	}
+	memcpy(r->data + frag->offset, frag->data, frag->size);
+	r->received += frag->size;
+	if (r->received >= r->size) {
+		if (important || data_sample_latest(chan, r->seqno))
+			data_sample_decode(chan, r->data, r->size);
+		if (!important && r->seqno == 0)
+			firefly_channel_credit_consumed(chan);
+		data_fragment_discard(chan, r);
+	}
+	return true;
+}
+
+/*
+ * Decode an important sample, or add an important fragment to its sample.
+ * Returns false if it must be received again later.
+ */
+static bool data_sample_deliver(struct firefly_channel *chan,
+		struct firefly_channel_reorder *item)
+{
+	if (item->total_size == 0) {
+		data_sample_decode(chan, item->data, item->size);
+		return true;
+	}
+	return data_fragment_add(chan, true, item);
+}
+
+/*
+ * Buffer an important sample received ahead of its turn, taking over its
+ * data. Returns false if it could not be buffered.
+ */
+static bool data_sample_reorder(struct firefly_channel *chan,
+		struct firefly_channel_reorder *item)
+{
+	struct firefly_channel_reorder **next;
+	struct firefly_channel_reorder *node;
+
+	next = &chan->reorder;
+	while (*next != NULL &&
+			firefly_seqno_diff((*next)->seqno, item->seqno) < 0)
+		next = &(*next)->next;
+	if (*next != NULL && (*next)->seqno == item->seqno)
+		return true; /* Resent, already buffered. */
+	node = FIREFLY_RUNTIME_MALLOC(chan->conn, sizeof(*node));
+	if (node == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		return false;
+	}
+	*node = *item;
+	node->next = *next;
+	*next = node;
+	item->data = NULL;
+
+	return true;
+}
+
+/*
+ * Decode the buffered samples that are next in turn.
+ */
+static void data_sample_reorder_flush(struct firefly_channel *chan)
+{
+	struct firefly_channel_reorder *node;
+
+	while (chan->reorder != NULL &&
+			firefly_seqno_diff(chan->reorder->seqno,
+				chan->remote_seqno) == 1) {
+		node = chan->reorder;
+		chan->reorder = node->next;
+		/* Already acked, it can not be received again. */
+		if (!data_sample_deliver(chan, node))
+			firefly_channel_raise(chan, NULL, FIREFLY_ERROR_ALLOC,
+					"No memory to reassemble sample.");
+		chan->remote_seqno = node->seqno;
+		firefly_received_release(chan->conn, node->data, node->pkt);
+		FIREFLY_RUNTIME_FREE(chan->conn, node);
+	}
+}
+
+/*
+ * Deliver an important sample or fragment in order of sequence numbers,
+ * acking it once it is delivered or buffered.
+ */
+static void data_sample_important(struct firefly_channel *chan,
+		struct firefly_channel_reorder *item)
+{
+	int ahead;
+
+	ahead = firefly_seqno_diff(item->seqno, chan->remote_seqno == INT_MAX ?
+			1 : chan->remote_seqno + 1);
+	if (ahead == 0) {
+		if (!data_sample_deliver(chan, item))
+			return; /* Not acked, resent until there is room for it. */
+		chan->remote_seqno = item->seqno;
+		data_sample_reorder_flush(chan);
+		/* After remote_seqno is updated, a cumulative ack covers it. */
+		data_sample_ack(chan, item->seqno);
+	} else if (ahead < 0) {
+		/* Resent since the ack was lost, ack it again. */
+		data_sample_ack(chan, item->seqno);
+	} else if ((size_t) ahead < chan->window &&
+			data_sample_reorder(chan, item)) {
+		data_sample_ack(chan, item->seqno);
 	} else {
+		/*
+		 * Not acked, the sample is resent until there is room for it in
+		 * the window.
+		 */
+	}
+}
+
+int handle_data_sample_event(void *event_arg)
+{
+	struct firefly_event_recv_sample *fers;
+	struct firefly_channel *chan;
+	bool stale;
+
+	fers = event_arg;
+
+	chan = find_channel_by_ids(fers->conn, fers->data.src_chan_id,
+			fers->data.dest_chan_id, &stale);
+
+	if (chan != NULL) {
+		struct firefly_channel_reorder item;
+
+		if (!fers->data.important) {
+			if (data_sample_latest(chan, fers->data.seqno))
+				data_sample_decode(chan, fers->data.app_enc_data.a,
+						fers->data.app_enc_data.n_0);
+			if (fers->data.seqno == 0)
+				firefly_channel_credit_consumed(chan);
+		} else {
+			item.seqno = fers->data.seqno;
+			item.data = fers->data.app_enc_data.a;
+			item.pkt = fers->pkt;
+			item.size = fers->data.app_enc_data.n_0;
+			item.sample_id = 0;
+			item.offset = 0;
+			item.total_size = 0;
+			data_sample_important(chan, &item);
+			fers->data.app_enc_data.a = item.data;
+		}
+	} else if (!stale) {
 		firefly_unknown_dest(fers->conn, fers->data.src_chan_id,
 							 fers->data.dest_chan_id, "data_sample");
 	}
 
-	FIREFLY_RUNTIME_FREE(fers->conn, fers->data.app_enc_data.a);
-	FIREFLY_RUNTIME_FREE(fers->conn, event_arg);
+	if (fers->data.app_enc_data.a != NULL)
+		firefly_received_release(fers->conn, fers->data.app_enc_data.a,
+				fers->pkt);
+
+	return 0;
+}
+
+static void handle_data_fragment_destroy(void *event_arg)
+{
+	struct firefly_event_recv_fragment *ferf;
+
+	ferf = event_arg;
+	firefly_received_release(ferf->conn, ferf->data.data.a, ferf->pkt);
+}
+
+void handle_data_fragment(firefly_protocol_data_fragment *data, void *context)
+{
+	struct firefly_connection *conn;
+	struct firefly_event_recv_fragment ferf;
+	unsigned char *ferf_data;
+	int ret;
+
+	conn = context;
+	/* The data is the last field of a fragment. */
+	ferf_data = data_received_ref(conn, data->data.a, data->data.n_0, 0,
+			&ferf.pkt);
+	if (ferf_data == NULL) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "Could not allocate event.\n");
+		return;
+	}
+
+	ferf.conn = conn;
+	memcpy(&ferf.data, data, sizeof(*data));
+	ferf.data.data.a = ferf_data;
+
+	ret = firefly_connection_offer_event_owned(conn, NULL,
+			FIREFLY_PRIORITY_LOW, handle_data_fragment_event, &ferf,
+			sizeof(ferf), handle_data_fragment_destroy, 0, NULL);
+	if (ret < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "could not add event to queue");
+		firefly_received_release(conn, ferf_data, ferf.pkt);
+	}
+}
+
+int handle_data_fragment_event(void *event_arg)
+{
+	struct firefly_event_recv_fragment *ferf;
+	struct firefly_channel *chan;
+	struct firefly_channel_reorder item;
+	bool stale;
+
+	ferf = event_arg;
+	item.seqno = ferf->data.seqno;
+	item.data = ferf->data.data.a;
+	item.pkt = ferf->pkt;
+	item.size = ferf->data.data.n_0;
+	item.sample_id = ferf->data.sample_id;
+	item.offset = ferf->data.offset;
+	item.total_size = ferf->data.total_size;
+	chan = find_channel_by_ids(ferf->conn, ferf->data.src_chan_id,
+			ferf->data.dest_chan_id, &stale);
+	if (chan != NULL) {
+		if (item.total_size <= 0) {
+			firefly_channel_raise(chan, NULL, FIREFLY_ERROR_PROTO_STATE,
+					"Fragment of an empty sample.");
+		} else if (ferf->data.important) {
+			data_sample_important(chan, &item);
+		} else {
+			/* Dropped if there is no room, like a lost fragment. */
+			data_fragment_add(chan, false, &item);
+		}
+	} else if (!stale) {
+		firefly_unknown_dest(ferf->conn, ferf->data.src_chan_id,
+							 ferf->data.dest_chan_id, "data_fragment");
+	}
+
+	if (item.data != NULL)
+		firefly_received_release(ferf->conn, item.data, item.pkt);
 
 	return 0;
 }
@@ -571,62 +968,107 @@ void handle_ack(firefly_protocol_ack *ack, void *context)
 {
 	struct firefly_connection *conn;
 	struct firefly_channel *chan;
+	bool stale;
 
 	conn = context;
-	chan = find_channel_by_local_id(conn, ack->dest_chan_id);
+	chan = find_channel_by_ids(conn, ack->src_chan_id, ack->dest_chan_id,
+			&stale);
 	if (chan == NULL) {
-		firefly_unknown_dest(conn, ack->src_chan_id, ack->dest_chan_id, "ack");
-	} else if ((chan->current_seqno == ack->seqno && ack->seqno > 0) ||
-		   (chan->auto_restrict && chan->restricted_local &&
-		    ack->seqno == FIREFLY_PROTO_ACK_RESTRICT_ACK))
+		if (!stale)
+			firefly_unknown_dest(conn, ack->src_chan_id, ack->dest_chan_id,
+					"ack");
+	} else if (chan->auto_restrict && chan->restricted_local &&
+		    ack->seqno == FIREFLY_PROTO_ACK_RESTRICT_ACK)
 	{
 		firefly_channel_ack(chan);
+	} else if (ack->seqno > 0) {
+		firefly_channel_ack_seqno(chan, ack->seqno);
 	}
 }
 
-struct firefly_channel *find_channel_by_remote_id(
-		struct firefly_connection *conn, int id)
+void handle_ack_ranges(firefly_protocol_ack_ranges *ack, void *context)
 {
-	struct channel_list_node *head;
+	struct firefly_connection *conn;
+	struct firefly_channel *chan;
+	bool stale;
 
-	head = conn->chan_list;
-	while (head) {
-		if (head->chan->remote_id == id)
-			break;
-		head = head->next;
+	conn = context;
+	chan = find_channel_by_ids(conn, ack->src_chan_id, ack->dest_chan_id,
+			&stale);
+	if (chan == NULL) {
+		if (!stale)
+			firefly_unknown_dest(conn, ack->src_chan_id, ack->dest_chan_id,
+					"ack_ranges");
+	} else {
+		firefly_channel_ack_ranges(chan, ack->cumulative, ack->ranges.a,
+				ack->ranges.n_0);
 	}
-	return (head) ? head->chan : NULL;
 }
 
-struct firefly_channel *find_channel_by_local_id(
-		struct firefly_connection *conn, int id)
+void handle_heartbeat(firefly_protocol_heartbeat *hb, void *context)
 {
-	struct channel_list_node *head;
+	struct firefly_connection *conn;
+	int64_t ret;
 
-	head = conn->chan_list;
-	while (head) {
-		if (head->chan->local_id == id)
-			break;
-		head = head->next;
+	conn = context;
+	if (hb->reply) {
+		__atomic_store_n(&conn->heartbeat_replied, true, __ATOMIC_RELEASE);
+		return;
+	}
+	ret = firefly_connection_offer_event(conn, FIREFLY_PRIORITY_HIGH,
+			handle_heartbeat_event, conn, 0, NULL);
+	if (ret < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "could not add event to queue");
 	}
-	return (head) ? head->chan : NULL;
 }
 
-void add_channel_to_connection(struct firefly_channel *chan,
-		struct firefly_connection *conn)
+int handle_heartbeat_event(void *event_arg)
 {
-	struct channel_list_node *new_node;
+	firefly_connection_send_heartbeat(event_arg, true);
+	return 0;
+}
 
-	new_node = FIREFLY_MALLOC(sizeof(*new_node));
+void handle_channel_credit(firefly_protocol_channel_credit *credit,
+		void *context)
+{
+	struct firefly_connection *conn;
+	struct firefly_event_recv_credit ferc;
+	int64_t ret;
 
-	if (new_node != NULL) {
-		new_node->chan = chan;
-		new_node->next = conn->chan_list;
-		conn->chan_list = new_node;
-	} else {
+	conn = context;
+	ferc.conn = conn;
+	memcpy(&ferc.credit, credit, sizeof(*credit));
+	/*
+	 * A probe is answered after the samples received before it are
+	 * delivered, the rest are lost.
+	 */
+	ret = firefly_connection_offer_event_copy(conn,
+			credit->probe ? FIREFLY_PRIORITY_LOW : FIREFLY_PRIORITY_HIGH,
+			handle_channel_credit_event, &ferc, sizeof(ferc), 0, NULL);
+	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Failed to allocate new channel list note\n");
+			      "could not add event to queue");
+	}
+}
+
+int handle_channel_credit_event(void *event_arg)
+{
+	struct firefly_event_recv_credit *ferc;
+	struct firefly_channel *chan;
+	bool stale;
+
+	ferc = event_arg;
+	chan = find_channel_by_ids(ferc->conn, ferc->credit.src_chan_id,
+			ferc->credit.dest_chan_id, &stale);
+	if (chan == NULL) {
+		if (!stale)
+			firefly_unknown_dest(ferc->conn, ferc->credit.src_chan_id,
+					ferc->credit.dest_chan_id, "channel_credit");
+	} else {
+		firefly_channel_credit_received(chan, &ferc->credit);
 	}
+	return 0;
 }
 
 struct labcomm_encoder *firefly_protocol_get_output_stream(
@@ -643,16 +1085,7 @@ struct labcomm_decoder *firefly_protocol_get_input_stream(
 
 size_t firefly_number_channels_in_connection(struct firefly_connection *conn)
 {
-	struct channel_list_node *node;
-	size_t cnt = 0;
-
-	node = conn->chan_list;
-	while (node != NULL) {
-		node = node->next;
-		cnt++;
-	}
-
-	return cnt;
+	return conn->channels.nbr_chans;
 }
 
 void handle_channel_restrict_request(
@@ -660,26 +1093,19 @@ void handle_channel_restrict_request(
 		void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_channel_restrict_request *earg;
+	struct firefly_event_channel_restrict_request earg;
 	int ret;
 
 	conn = context;
-	earg = FIREFLY_MALLOC(sizeof(*earg));
-	if (!earg) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event arg.\n");
-		return;
-	}
-	memcpy(&earg->rreq, data, sizeof(*data));
-	earg->conn = conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	memcpy(&earg.rreq, data, sizeof(*data));
+	earg.conn = conn;
+	ret = firefly_connection_offer_event_copy(conn,
 						FIREFLY_PRIORITY_MEDIUM,
 						&channel_restrict_request_event,
-						earg, 0, NULL);
+						&earg, sizeof(earg), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "Could not add event to queue");
-		FIREFLY_FREE(earg);
 	}
 }
 
@@ -696,7 +1122,6 @@ int channel_restrict_request_event(void *context)
 	if (!chan) {
 		firefly_unknown_dest(conn, earg->rreq.source_chan_id,
 							 earg->rreq.dest_chan_id, "channel_restrict_request");
-		FIREFLY_FREE(earg);
 		return -1;
 	}
 	resp.dest_chan_id   = chan->remote_id;
@@ -729,7 +1154,6 @@ int channel_restrict_request_event(void *context)
 	labcomm_encode_firefly_protocol_channel_restrict_ack(
 			conn->transport_encoder,
 			&resp);
-	FIREFLY_FREE(earg);
 
 	return 0;
 }
@@ -738,27 +1162,20 @@ void handle_channel_restrict_ack(firefly_protocol_channel_restrict_ack *data,
 				 void *context)
 {
 	struct firefly_connection *conn;
-	struct firefly_event_chan_restrict_ack *earg;
+	struct firefly_event_chan_restrict_ack earg;
 	int ret;
 
 	conn = context;
 
-	earg = FIREFLY_MALLOC(sizeof(*earg));
-	if (!earg) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-			      "Could not allocate event arg.\n");
-		return;
-	}
-	memcpy(&earg->rack, data, sizeof(*data));
-	earg->conn = conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	memcpy(&earg.rack, data, sizeof(*data));
+	earg.conn = conn;
+	ret = firefly_connection_offer_event_copy(conn,
 						FIREFLY_PRIORITY_MEDIUM,
 						channel_restrict_ack_event,
-						earg, 0, NULL);
+						&earg, sizeof(earg), 0, NULL);
 	if (ret < 0) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "Could not add event to queue");
-		FIREFLY_FREE(earg);
 	}
 }
 
@@ -774,7 +1191,6 @@ int channel_restrict_ack_event(void *context)
 	if (!chan) {
 		firefly_unknown_dest(conn, earg->rack.source_chan_id,
 							 earg->rack.dest_chan_id, "restrict_ack");
-		FIREFLY_FREE(context);
 		return -1;
 	}
 	if (chan->auto_restrict) {
@@ -815,7 +1231,6 @@ int channel_restrict_ack_event(void *context)
 	}
 	chan->restricted_remote = earg->rack.restricted;
 	firefly_channel_ack(chan);
-	FIREFLY_FREE(earg);
 
 	return 0;
 }
@@ -1,6 +1,8 @@
 #include "protocol/firefly_protocol_private.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <string.h>
 
 #include <utils/firefly_errors.h>
 #include "utils/firefly_event_queue_private.h"
@@ -20,8 +22,39 @@ struct firefly_channel *firefly_channel_new(struct firefly_connection *conn)
 	chan->state		= FIREFLY_CHANNEL_READY;
 	chan->important_queue	= NULL;
 	chan->important_id	= 0;
+	chan->important_sample	= false;
 	chan->current_seqno	= 0;
+	chan->window		= 1;
+	chan->unacked		= NULL;
+	chan->nbr_unacked	= 0;
 	chan->remote_seqno	= 0;
+	chan->reorder		= NULL;
+	chan->ack_pending	= false;
+	chan->latest		= false;
+	chan->direct		= false;
+	chan->nbr_queued	= 0;
+	chan->latest_types	= NULL;
+	chan->sample_seqno	= 0;
+	chan->remote_sample_seqno = 0;
+	chan->stats.nbr_superseded = 0;
+	chan->stats.nbr_lost	= 0;
+	chan->stats.nbr_stale	= 0;
+	chan->stats.nbr_no_credit = 0;
+	chan->fragment_id	= 0;
+	memset(chan->reassembly, 0, sizeof(chan->reassembly));
+	chan->credit_mode	= FIREFLY_CREDIT_BLOCK;
+	chan->credit_limited	= false;
+	chan->credit_limit	= 0;
+	chan->credit_sent	= 0;
+	chan->credit_released	= 0;
+	chan->credit_held	= NULL;
+	chan->credit_held_last	= NULL;
+	chan->nbr_credit_held	= 0;
+	chan->credit_probe_pending = false;
+	chan->credit_probe_id	= 0;
+	chan->credits		= 0;
+	chan->credit_consumed	= 0;
+	chan->credit_granted	= 0;
 	chan->restricted_local	= false;
 	chan->restricted_remote	= false;
 	chan->auto_restrict	= false;
@@ -54,9 +87,46 @@ void firefly_channel_free(struct firefly_channel *chan)
 	while (node != NULL) {
 		tmp = node;
 		node = node->next;
-		FIREFLY_FREE(tmp->event_arg);
+		if (tmp->event_arg_size > 0 && tmp->destroy != NULL)
+			tmp->destroy(&tmp->event_arg_copy);
 		FIREFLY_FREE(tmp);
 	}
+	while (chan->reorder) {
+		struct firefly_channel_reorder *tmp;
+
+		tmp = chan->reorder;
+		chan->reorder = tmp->next;
+		firefly_received_release(chan->conn, tmp->data, tmp->pkt);
+		FIREFLY_RUNTIME_FREE(chan->conn, tmp);
+	}
+	FIREFLY_FREE(chan->unacked);
+	for (size_t i = 0; i < 2; i++) {
+		if (chan->reassembly[i].data != NULL) {
+			chan->conn->reassembly_size -= chan->reassembly[i].size;
+			FIREFLY_RUNTIME_FREE(chan->conn, chan->reassembly[i].data);
+		}
+	}
+	while (chan->credit_held) {
+		struct firefly_channel_held *tmp;
+
+		tmp = chan->credit_held;
+		chan->credit_held = tmp->next;
+		if (tmp->destroy != NULL)
+			tmp->destroy(&tmp->event_arg);
+		FIREFLY_RUNTIME_FREE(chan->conn, tmp);
+	}
+	if (chan->credit_probe_id > 0)
+		firefly_event_queue_cancel(chan->conn->event_queue,
+				chan->credit_probe_id);
+	while (chan->latest_types) {
+		struct firefly_channel_latest *tmp;
+
+		tmp = chan->latest_types;
+		chan->latest_types = tmp->next;
+		if (tmp->pending != NULL)
+			firefly_sample_buffer_release(chan->conn, tmp->pending);
+		FIREFLY_RUNTIME_FREE(chan->conn, tmp);
+	}
 	while (chan->enc_types) {
 		struct firefly_channel_encoder_type *tmp;
 
@@ -73,20 +143,313 @@ struct firefly_connection *firefly_channel_get_connection(
 	return chan->conn;
 }
 
+int firefly_channel_set_window(struct firefly_channel *chan, size_t window)
+{
+	struct firefly_channel_unacked *unacked;
+
+	if (window < 1 || window > FIREFLY_CHANNEL_WINDOW_MAX ||
+			chan->nbr_unacked >= window) {
+		firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
+			      "Invalid window or too many unacked samples.");
+		return -1;
+	}
+	unacked = NULL;
+	if (window > 1) {
+		unacked = FIREFLY_MALLOC((window - 1) * sizeof(*unacked));
+		if (!unacked) {
+			FFL(FIREFLY_ERROR_ALLOC);
+			return -1;
+		}
+		if (chan->nbr_unacked > 0)
+			memcpy(unacked, chan->unacked,
+					chan->nbr_unacked * sizeof(*unacked));
+	}
+	FIREFLY_FREE(chan->unacked);
+	chan->unacked = unacked;
+	chan->window = window;
+
+	return 0;
+}
+
 int firefly_channel_next_seqno(struct firefly_channel *chan)
 {
+	if (chan->important_id != 0 && chan->nbr_unacked + 1 < chan->window) {
+		chan->unacked[chan->nbr_unacked].seqno = chan->current_seqno;
+		chan->unacked[chan->nbr_unacked].important_id =
+			chan->important_id;
+		chan->nbr_unacked++;
+		chan->important_id = 0;
+	}
+	chan->important_sample = true;
 	if (chan->current_seqno == INT_MAX) {
 		chan->current_seqno = 0;
 	}
 	return ++chan->current_seqno;
 }
 
+int firefly_channel_next_sample_seqno(struct firefly_channel *chan)
+{
+	if (chan->sample_seqno == INT_MAX)
+		chan->sample_seqno = 0;
+	return ++chan->sample_seqno;
+}
+
+void firefly_channel_set_latest(struct firefly_channel *chan, bool latest)
+{
+	chan->latest = latest;
+}
+
+void firefly_channel_set_direct(struct firefly_channel *chan, bool direct)
+{
+	chan->direct = direct;
+}
+
+void firefly_channel_get_stats(struct firefly_channel *chan,
+		struct firefly_channel_stats *stats)
+{
+	*stats = chan->stats;
+	/* Counted by the thread encoding on the channel. */
+	stats->nbr_superseded = __atomic_load_n(&chan->stats.nbr_superseded,
+			__ATOMIC_RELAXED);
+	stats->nbr_no_credit = __atomic_load_n(&chan->stats.nbr_no_credit,
+			__ATOMIC_RELAXED);
+}
+
+int firefly_credit_diff(uint32_t a, uint32_t b)
+{
+	return (int32_t) (a - b);
+}
+
+static void firefly_channel_send_credit(struct firefly_channel *chan,
+		uint32_t limit, unsigned int credits, bool probe)
+{
+	firefly_protocol_channel_credit pkt;
+
+	pkt.dest_chan_id = chan->remote_id;
+	pkt.src_chan_id  = chan->local_id;
+	pkt.limit        = (int) limit;
+	pkt.credits      = credits;
+	pkt.probe        = probe;
+	labcomm_encode_firefly_protocol_channel_credit(
+			chan->conn->transport_encoder, &pkt);
+}
+
+static void firefly_channel_grant(struct firefly_channel *chan)
+{
+	chan->credit_granted = chan->credit_consumed + chan->credits;
+	firefly_channel_send_credit(chan, chan->credit_granted, chan->credits,
+			false);
+}
+
+void firefly_channel_set_credits(struct firefly_channel *chan,
+		unsigned int credits)
+{
+	if (credits > INT_MAX)
+		credits = INT_MAX;
+	chan->credits = credits;
+	firefly_channel_grant(chan);
+}
+
+void firefly_channel_set_credit_mode(struct firefly_channel *chan,
+		enum firefly_credit_mode mode)
+{
+	chan->credit_mode = mode;
+}
+
+void firefly_channel_get_credits(struct firefly_channel *chan,
+		struct firefly_channel_credits *credits)
+{
+	credits->limited = __atomic_load_n(&chan->credit_limited,
+			__ATOMIC_ACQUIRE);
+	credits->available = credits->limited ?
+		firefly_credit_diff(__atomic_load_n(&chan->credit_limit,
+					__ATOMIC_ACQUIRE),
+				__atomic_load_n(&chan->credit_sent, __ATOMIC_RELAXED)) : 0;
+	credits->nbr_held = chan->nbr_credit_held;
+	credits->granted = chan->credits;
+}
+
+static bool firefly_channel_credit_blocked(struct firefly_channel *chan)
+{
+	return chan->credit_limited && firefly_credit_diff(chan->credit_limit,
+			__atomic_load_n(&chan->credit_sent, __ATOMIC_RELAXED)) <= 0;
+}
+
+/*
+ * Probe for credit while out of it, in case the credit granted was lost or
+ * the samples counted against it were.
+ */
+static int firefly_channel_credit_probe_event(void *event_arg)
+{
+	struct firefly_channel *chan;
+	struct firefly_event_queue *eq;
+	int64_t id;
+
+	chan = event_arg;
+	chan->credit_probe_id = 0;
+	if (!firefly_channel_credit_blocked(chan)) {
+		__atomic_store_n(&chan->credit_probe_pending, false,
+				__ATOMIC_RELEASE);
+		return 0;
+	}
+	firefly_channel_send_credit(chan, __atomic_load_n(&chan->credit_released,
+				__ATOMIC_ACQUIRE), 0, true);
+	eq = chan->conn->event_queue;
+	id = firefly_event_offer_at(eq, chan->conn, chan, FIREFLY_PRIORITY_LOW,
+			firefly_event_queue_now(eq) + FIREFLY_CHANNEL_CREDIT_PROBE_DELAY,
+			firefly_channel_credit_probe_event, chan);
+	if (id > 0)
+		chan->credit_probe_id = id;
+	else
+		__atomic_store_n(&chan->credit_probe_pending, false,
+				__ATOMIC_RELEASE);
+	return 0;
+}
+
+static int firefly_channel_credit_blocked_event(void *event_arg)
+{
+	struct firefly_channel *chan;
+	struct firefly_event_queue *eq;
+	int64_t id;
+
+	chan = event_arg;
+	if (chan->credit_probe_id != 0)
+		return 0;
+	eq = chan->conn->event_queue;
+	id = firefly_event_offer_at(eq, chan->conn, chan, FIREFLY_PRIORITY_LOW,
+			firefly_event_queue_now(eq) + FIREFLY_CHANNEL_CREDIT_PROBE_DELAY,
+			firefly_channel_credit_probe_event, chan);
+	if (id > 0)
+		chan->credit_probe_id = id;
+	else
+		firefly_channel_credit_probe_event(chan);
+	return 0;
+}
+
+/*
+ * Start probing for credit unless already probing, from any thread.
+ */
+static void firefly_channel_credit_probe(struct firefly_channel *chan)
+{
+	if (__atomic_exchange_n(&chan->credit_probe_pending, true,
+				__ATOMIC_ACQ_REL))
+		return;
+	if (firefly_connection_offer_event_owned(chan->conn, chan,
+				FIREFLY_PRIORITY_HIGH, firefly_channel_credit_blocked_event,
+				chan, 0, NULL, 0, NULL) < 0)
+		__atomic_store_n(&chan->credit_probe_pending, false,
+				__ATOMIC_RELEASE);
+}
+
+int firefly_channel_credit_take(struct firefly_channel *chan,
+		uint32_t *credit_seqno)
+{
+	if (__atomic_load_n(&chan->credit_limited, __ATOMIC_ACQUIRE) &&
+			firefly_credit_diff(__atomic_load_n(&chan->credit_limit,
+					__ATOMIC_ACQUIRE), chan->credit_sent) <= 0 &&
+			(chan->credit_mode != FIREFLY_CREDIT_BLOCK ||
+			 __atomic_load_n(&chan->nbr_credit_held, __ATOMIC_RELAXED) >=
+			 FIREFLY_CHANNEL_CREDIT_HELD_MAX)) {
+		firefly_channel_credit_probe(chan);
+		/* A blocking channel holding too many samples refuses more. */
+		if (chan->credit_mode != FIREFLY_CREDIT_DROP)
+			return -EAGAIN;
+		__atomic_add_fetch(&chan->stats.nbr_no_credit, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	/* Only the thread encoding on the channel counts. */
+	*credit_seqno = __atomic_add_fetch(&chan->credit_sent, 1,
+			__ATOMIC_RELAXED);
+	if (*credit_seqno == 0)
+		*credit_seqno = __atomic_add_fetch(&chan->credit_sent, 1,
+				__ATOMIC_RELAXED);
+	return 0;
+}
+
+bool firefly_channel_credit_hold(struct firefly_channel *chan,
+		uint32_t credit_seqno, firefly_event_execute_f event,
+		void *event_arg, size_t event_arg_size,
+		firefly_event_destroy_f destroy)
+{
+	struct firefly_channel_held *held;
+
+	/* Samples accepted in the other modes are sent whatever the credit. */
+	if (!chan->credit_limited || chan->credit_mode != FIREFLY_CREDIT_BLOCK ||
+			firefly_credit_diff(chan->credit_limit, credit_seqno) >= 0) {
+		chan->credit_released = credit_seqno;
+		return false;
+	}
+	held = FIREFLY_RUNTIME_MALLOC(chan->conn, sizeof(*held));
+	if (held == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		chan->credit_released = credit_seqno;
+		return false;
+	}
+	held->next = NULL;
+	held->credit_seqno = credit_seqno;
+	held->event = event;
+	held->destroy = destroy;
+	memcpy(&held->event_arg, event_arg, event_arg_size);
+	if (chan->credit_held_last != NULL)
+		chan->credit_held_last->next = held;
+	else
+		chan->credit_held = held;
+	chan->credit_held_last = held;
+	__atomic_add_fetch(&chan->nbr_credit_held, 1, __ATOMIC_RELAXED);
+	firefly_channel_credit_probe(chan);
+	return true;
+}
+
+void firefly_channel_credit_consumed(struct firefly_channel *chan)
+{
+	chan->credit_consumed++;
+	if (chan->credits > 0 && firefly_credit_diff(chan->credit_granted,
+				chan->credit_consumed) <= (int) chan->credits / 2)
+		firefly_channel_grant(chan);
+}
+
+void firefly_channel_credit_received(struct firefly_channel *chan,
+		firefly_protocol_channel_credit *credit)
+{
+	struct firefly_channel_held *held;
+	uint32_t limit;
+
+	limit = (uint32_t) credit->limit;
+	if (credit->probe) {
+		/* Samples sent before the probe and not received are lost. */
+		if (firefly_credit_diff(limit, chan->credit_consumed) > 0)
+			chan->credit_consumed = limit;
+		firefly_channel_grant(chan);
+		return;
+	}
+	if (credit->credits <= 0) {
+		__atomic_store_n(&chan->credit_limited, false, __ATOMIC_RELEASE);
+	} else if (!chan->credit_limited ||
+			firefly_credit_diff(limit, chan->credit_limit) > 0) {
+		__atomic_store_n(&chan->credit_limit, limit, __ATOMIC_RELEASE);
+		__atomic_store_n(&chan->credit_limited, true, __ATOMIC_RELEASE);
+	}
+	while (chan->credit_held != NULL && (!chan->credit_limited ||
+				firefly_credit_diff(chan->credit_limit,
+					chan->credit_held->credit_seqno) >= 0)) {
+		held = chan->credit_held;
+		chan->credit_held = held->next;
+		if (chan->credit_held == NULL)
+			chan->credit_held_last = NULL;
+		__atomic_sub_fetch(&chan->nbr_credit_held, 1, __ATOMIC_RELAXED);
+		held->event(&held->event_arg);
+		FIREFLY_RUNTIME_FREE(chan->conn, held);
+	}
+}
+
 int firefly_channel_closed_event(void *event_arg)
 {
 	struct firefly_channel *chan;
 
 	chan = event_arg;
 
+	/* Pending events of the channel would outlive it. */
+	firefly_event_queue_purge(chan->conn->event_queue, chan);
 	firefly_channel_ack(chan);
 
 	remove_channel_from_connection(chan, chan->conn);
@@ -103,10 +466,10 @@ void firefly_channel_restrict(struct firefly_channel *chan)
 	int ret;
 
 	conn = chan->conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_connection_offer_event_owned(conn, chan,
 						FIREFLY_PRIORITY_MEDIUM,
 						firefly_channel_restrict_event,
-						chan, 0, NULL);
+						chan, 0, NULL, 0, NULL);
 	if (ret < 0)
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
@@ -123,8 +486,8 @@ int firefly_channel_restrict_event(void *earg)
 		return -1; /* Already [in the process of beeing] restricted */
 	if (chan->restricted_remote)
 		return 0;  /* In process of answering remote request. */
-	if (!firefly_channel_enqueue_important(chan,
-				firefly_channel_restrict_event, earg)) {
+	if (!firefly_channel_enqueue_important(chan, false,
+				firefly_channel_restrict_event, earg, 0, NULL)) {
 		chan->restricted_local = true;
 
 		req.dest_chan_id   = chan->remote_id;
@@ -147,10 +510,10 @@ void firefly_channel_unrestrict(struct firefly_channel *chan)
 	int ret;
 
 	conn = chan->conn;
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_connection_offer_event_owned(conn, chan,
 						FIREFLY_PRIORITY_MEDIUM,
 						firefly_channel_unrestrict_event,
-						chan, 0, NULL);
+						chan, 0, NULL, 0, NULL);
 	if (ret < 0)
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 			      "could not add event to queue");
@@ -168,8 +531,8 @@ int firefly_channel_unrestrict_event(void *earg)
 	if (!chan->restricted_remote)
 		return 0;  /* Previous request not completed.  */
 
-	if (!firefly_channel_enqueue_important(chan,
-				firefly_channel_restrict_event, earg)) {
+	if (!firefly_channel_enqueue_important(chan, false,
+				firefly_channel_restrict_event, earg, 0, NULL)) {
 		chan->restricted_local = false;
 
 		req.dest_chan_id   = chan->remote_id;
@@ -262,36 +625,169 @@ void firefly_channel_internal_opened(struct firefly_channel *chan)
 	}
 }
 
-void firefly_channel_ack(struct firefly_channel *chan)
+/*
+ * Offer the events of the queued important packets that may be sent now.
+ */
+static void firefly_channel_send_queued(struct firefly_channel *chan)
 {
 	struct firefly_connection *conn;
 	struct firefly_channel_important_queue *tmp;
+	size_t outstanding;
 
 	conn = chan->conn;
-	if (chan->important_id != 0 &&
-			chan->conn->transport != NULL &&
-			chan->conn->transport->ack != NULL)
-		chan->conn->transport->ack(chan->important_id, chan->conn);
-	chan->important_id = 0;
+	outstanding = chan->nbr_unacked + (chan->important_id != 0);
 	/*
 	 * If there are queued important packets and the channel is open,
-	 * send the next one.
+	 * send as many as fit in the window.
 	 */
-	if (chan->state == FIREFLY_CHANNEL_OPEN &&
-			chan->important_queue != NULL) {
+	while (chan->state == FIREFLY_CHANNEL_OPEN &&
+			chan->important_queue != NULL &&
+			outstanding < chan->window &&
+			(chan->important_queue->sample || outstanding == 0)) {
 		tmp = chan->important_queue;
 		chan->important_queue = tmp->next;
-		conn->event_queue->offer_event_cb(conn->event_queue,
-				FIREFLY_PRIORITY_HIGH,
-				tmp->event, tmp->event_arg, 0, NULL);
+		if (tmp->event_arg_size > 0)
+			firefly_connection_offer_event_owned(conn, chan,
+					FIREFLY_PRIORITY_HIGH, tmp->event, &tmp->event_arg_copy,
+					tmp->event_arg_size, tmp->destroy, 0, NULL);
+		else
+			firefly_connection_offer_event(conn,
+					FIREFLY_PRIORITY_HIGH,
+					tmp->event, tmp->event_arg, 0, NULL);
+		outstanding++;
+		if (!tmp->sample)
+			outstanding = chan->window;
 		FIREFLY_FREE(tmp);
 	}
 }
 
+static void firefly_channel_transport_ack(struct firefly_channel *chan,
+		uint32_t important_id)
+{
+	if (important_id != 0 &&
+			chan->conn->transport != NULL &&
+			chan->conn->transport->ack != NULL)
+		chan->conn->transport->ack(important_id, chan->conn);
+}
+
+void firefly_channel_ack(struct firefly_channel *chan)
+{
+	firefly_channel_transport_ack(chan, chan->important_id);
+	for (size_t i = 0; i < chan->nbr_unacked; i++)
+		firefly_channel_transport_ack(chan, chan->unacked[i].important_id);
+	chan->important_id = 0;
+	chan->important_sample = false;
+	chan->nbr_unacked = 0;
+	firefly_channel_send_queued(chan);
+}
+
+void firefly_channel_ack_seqno(struct firefly_channel *chan, int seqno)
+{
+	uint32_t important_id;
+
+	important_id = 0;
+	if (chan->current_seqno == seqno && chan->important_id != 0) {
+		important_id = chan->important_id;
+		chan->important_id = 0;
+		chan->important_sample = false;
+	} else {
+		for (size_t i = 0; i < chan->nbr_unacked; i++) {
+			if (chan->unacked[i].seqno == seqno) {
+				important_id = chan->unacked[i].important_id;
+				chan->unacked[i] = chan->unacked[--chan->nbr_unacked];
+				break;
+			}
+		}
+	}
+	if (important_id != 0) {
+		firefly_channel_transport_ack(chan, important_id);
+		firefly_channel_send_queued(chan);
+	}
+}
+
+int firefly_seqno_diff(int a, int b)
+{
+	long long d;
+
+	d = (long long) a - b;
+	if (d > INT_MAX / 2)
+		d -= INT_MAX;
+	else if (d < -(INT_MAX / 2))
+		d += INT_MAX;
+	return d;
+}
+
+static bool firefly_channel_seqno_acked(int seqno, int cumulative,
+		const firefly_protocol_ack_range *ranges, size_t nbr_ranges)
+{
+	if (cumulative != 0 && firefly_seqno_diff(seqno, cumulative) <= 0)
+		return true;
+	for (size_t i = 0; i < nbr_ranges; i++) {
+		if (firefly_seqno_diff(seqno, ranges[i].first) >= 0 &&
+				firefly_seqno_diff(seqno, ranges[i].last) <= 0)
+			return true;
+	}
+	return false;
+}
+
+void firefly_channel_ack_ranges(struct firefly_channel *chan, int cumulative,
+		const firefly_protocol_ack_range *ranges, size_t nbr_ranges)
+{
+	bool acked;
+
+	acked = false;
+	if (chan->important_id != 0 && chan->important_sample &&
+			firefly_channel_seqno_acked(chan->current_seqno, cumulative,
+				ranges, nbr_ranges)) {
+		firefly_channel_transport_ack(chan, chan->important_id);
+		chan->important_id = 0;
+		chan->important_sample = false;
+		acked = true;
+	}
+	/* Backwards, since the last entry is moved into the removed one. */
+	for (size_t i = chan->nbr_unacked; i-- > 0;) {
+		if (firefly_channel_seqno_acked(chan->unacked[i].seqno, cumulative,
+					ranges, nbr_ranges)) {
+			firefly_channel_transport_ack(chan,
+					chan->unacked[i].important_id);
+			chan->unacked[i] = chan->unacked[--chan->nbr_unacked];
+			acked = true;
+		}
+	}
+	if (acked)
+		firefly_channel_send_queued(chan);
+}
+
+size_t firefly_channel_received_ranges(struct firefly_channel *chan,
+		firefly_protocol_ack_range *ranges)
+{
+	struct firefly_channel_reorder *node;
+	size_t n;
+
+	n = 0;
+	for (node = chan->reorder; node != NULL; node = node->next) {
+		if (n > 0 && firefly_seqno_diff(node->seqno, ranges[n - 1].last) == 1) {
+			ranges[n - 1].last = node->seqno;
+		} else {
+			ranges[n].first = node->seqno;
+			ranges[n].last = node->seqno;
+			n++;
+		}
+	}
+	return n;
+}
+
 bool firefly_channel_enqueue_important(struct firefly_channel *chan,
-		firefly_event_execute_f event, void *event_arg)
+		bool sample, firefly_event_execute_f event, void *event_arg,
+		size_t event_arg_size, firefly_event_destroy_f destroy)
 {
-	if (chan->important_id != 0) {
+	size_t outstanding;
+
+	outstanding = chan->nbr_unacked + (chan->important_id != 0);
+	if (outstanding == 0 || (sample && outstanding < chan->window &&
+				(chan->important_id == 0 || chan->important_sample))) {
+		return false;
+	} else {
 		struct firefly_channel_important_queue **last;
 
 		last = &chan->important_queue;
@@ -301,10 +797,13 @@ bool firefly_channel_enqueue_important(struct firefly_channel *chan,
 		*last = FIREFLY_MALLOC(sizeof(**last));
 		(*last)->next = NULL;
 		(*last)->event_arg = event_arg;
+		(*last)->sample = sample;
+		(*last)->event_arg_size = event_arg_size;
+		(*last)->destroy = destroy;
+		if (event_arg_size > 0)
+			memcpy(&(*last)->event_arg_copy, event_arg, event_arg_size);
 		(*last)->event = event;
 		return true;
-	} else {
-		return false;
 	}
 }
 
@@ -30,7 +30,7 @@ static int firefly_connection_open_event(void *arg)
  */
 static void signature_trans_write(unsigned char *data, size_t size,
 				  struct firefly_connection *conn,
-				  bool important, unsigned char *id)
+				  bool important, uint32_t *id)
 {
 	UNUSED_VAR(important);
 	UNUSED_VAR(id);
@@ -69,12 +69,26 @@ struct firefly_connection *firefly_connection_new(
 	}
 	conn->actions            = actions;
 	conn->event_queue        = event_queue;
-	conn->chan_list          = NULL;
-	conn->channel_id_counter = 0;
+	memset(&conn->channels, 0, sizeof(conn->channels));
 	conn->lc_memory          = lc_mem;
 	conn->context            = NULL;
 	conn->transport          = tc;
 	conn->open               = FIREFLY_CONNECTION_OPEN;
+	conn->ack_delay          = 0;
+	conn->ack_max_pending    = 1;
+	conn->nbr_ack_pending    = 0;
+	conn->ack_flush_id       = 0;
+	conn->reassembly_max     = FIREFLY_REASSEMBLY_MAX;
+	conn->reassembly_size    = 0;
+	conn->coalesce           = false;
+	conn->coalesce_delay     = 0;
+	conn->coalesce_flush_id  = 0;
+	conn->heartbeat_interval = 0;
+	conn->heartbeat_max_missed = 1;
+	conn->heartbeat_missed   = 0;
+	conn->heartbeat_received = false;
+	conn->heartbeat_replied  = false;
+	conn->heartbeat_id       = 0;
 	if (memory_replacements) {
 		conn->memory_replacements.alloc_replacement =
 			memory_replacements->alloc_replacement;
@@ -105,6 +119,7 @@ struct firefly_connection *firefly_connection_new(
 	init_firefly_protocol__signatures();
 
 	conn->transport_decoder = labcomm_decoder_new(reader, NULL, lc_mem, NULL);
+	conn->transport_reader = reader;
 	conn->transport_encoder = labcomm_encoder_new(writer, NULL, lc_mem, NULL);
 
         /* TODO: Error handling. */
@@ -151,6 +166,18 @@ struct firefly_connection *firefly_connection_new(
 	labcomm_decoder_register_firefly_protocol_channel_restrict_ack(
 			conn->transport_decoder, handle_channel_restrict_ack, conn);
 
+	labcomm_decoder_register_firefly_protocol_ack_ranges(conn->transport_decoder,
+						handle_ack_ranges, conn);
+
+	labcomm_decoder_register_firefly_protocol_data_fragment(conn->transport_decoder,
+						handle_data_fragment, conn);
+
+	labcomm_decoder_register_firefly_protocol_channel_credit(conn->transport_decoder,
+						handle_channel_credit, conn);
+
+	labcomm_decoder_register_firefly_protocol_heartbeat(conn->transport_decoder,
+						handle_heartbeat, conn);
+
 	labcomm_encoder_register_firefly_protocol_data_sample(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_request(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_response(conn->transport_encoder);
@@ -159,6 +186,10 @@ struct firefly_connection *firefly_connection_new(
 	labcomm_encoder_register_firefly_protocol_ack(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_restrict_request(conn->transport_encoder);
 	labcomm_encoder_register_firefly_protocol_channel_restrict_ack(conn->transport_encoder);
+	labcomm_encoder_register_firefly_protocol_ack_ranges(conn->transport_encoder);
+	labcomm_encoder_register_firefly_protocol_data_fragment(conn->transport_encoder);
+	labcomm_encoder_register_firefly_protocol_channel_credit(conn->transport_encoder);
+	labcomm_encoder_register_firefly_protocol_heartbeat(conn->transport_encoder);
 
 	conn->transport = orig_transport;
 	// TODO: Fix this once Labcomm re-gets error handling
@@ -184,7 +215,7 @@ int firefly_connection_open(
 	if (conn) {
 		firefly_connection_set_context(conn, context);
 	}
-	return conn != NULL ? conn->event_queue->offer_event_cb(conn->event_queue,
+	return conn != NULL ? firefly_connection_offer_event(conn,
 			FIREFLY_PRIORITY_HIGH, firefly_connection_open_event,
 			conn, 0, NULL) : -1;
 }
@@ -193,7 +224,7 @@ int64_t firefly_connection_close(struct firefly_connection *conn)
 {
 	int ret;
 
-	ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	ret = firefly_connection_offer_event(conn,
 			FIREFLY_CONNECTION_CLOSE_PRIORITY, firefly_connection_close_event,
 			conn, 0, NULL);
 	if (ret < 0) {
@@ -206,26 +237,31 @@ int64_t firefly_connection_close(struct firefly_connection *conn)
 int firefly_connection_close_event(void *event_arg)
 {
 	struct firefly_connection *conn;
-	struct channel_list_node *head;
+	struct firefly_channel_table *table;
 	int64_t deps[FIREFLY_EVENT_QUEUE_MAX_DEPENDS] = {0};
 	int count = 0;
+	size_t i = 0;
 	int64_t ret;
 
 	conn = event_arg;
 	conn->open = FIREFLY_CONNECTION_CLOSED;
 
-	head = conn->chan_list;
-	while (head != NULL && count < FIREFLY_EVENT_QUEUE_MAX_DEPENDS) {
-		deps[count] = firefly_channel_close(head->chan);
-		head = head->next;
-		++count;
+	table = &conn->channels;
+	while (i < table->size && count < FIREFLY_EVENT_QUEUE_MAX_DEPENDS) {
+		if (table->chans[i] != NULL) {
+			deps[count] = firefly_channel_close(table->chans[i]);
+			++count;
+		}
+		++i;
 	}
-	if (head == NULL) {
-		ret = conn->event_queue->offer_event_cb(conn->event_queue,
+	while (i < table->size && table->chans[i] == NULL)
+		++i;
+	if (i == table->size) {
+		ret = firefly_connection_offer_event(conn,
 				FIREFLY_CONNECTION_CLOSE_PRIORITY,
 				firefly_connection_free_event, conn, count, deps);
 	} else {
-		ret = conn->event_queue->offer_event_cb(conn->event_queue,
+		ret = firefly_connection_offer_event(conn,
 				FIREFLY_CONNECTION_CLOSE_PRIORITY,
 				firefly_connection_close_event,
 				conn, count, deps);
@@ -245,6 +281,8 @@ int firefly_connection_free_event(void *event_arg)
 	struct firefly_connection *conn;
 
 	conn = event_arg;
+	firefly_event_queue_purge(conn->event_queue, conn);
+	firefly_connection_flush(conn);
 	if (conn->transport != NULL && conn->transport->close != NULL) {
 		conn->transport->close(conn);
 	}
@@ -255,10 +293,20 @@ int firefly_connection_free_event(void *event_arg)
 
 void firefly_connection_free(struct firefly_connection **conn)
 {
-	while ((*conn)->chan_list != NULL) {
-		firefly_channel_closed_event((*conn)->chan_list->chan);
+	for (size_t i = 0; i < (*conn)->channels.size; i++) {
+		if ((*conn)->channels.chans[i] != NULL)
+			firefly_channel_closed_event((*conn)->channels.chans[i]);
 	}
-	FIREFLY_FREE((*conn)->chan_list);
+	firefly_channel_table_free(*conn);
+	if ((*conn)->ack_flush_id > 0)
+		firefly_event_queue_cancel((*conn)->event_queue,
+				(*conn)->ack_flush_id);
+	if ((*conn)->coalesce_flush_id > 0)
+		firefly_event_queue_cancel((*conn)->event_queue,
+				(*conn)->coalesce_flush_id);
+	if ((*conn)->heartbeat_id > 0)
+		firefly_event_queue_cancel((*conn)->event_queue,
+				(*conn)->heartbeat_id);
 	if ((*conn)->transport_encoder != NULL) {
 		labcomm_encoder_free((*conn)->transport_encoder);
 	}
@@ -270,33 +318,252 @@ void firefly_connection_free(struct firefly_connection **conn)
 	*conn = NULL;
 }
 
+static size_t channel_table_remote_hash(int id, size_t remote_size)
+{
+	return ((uint32_t) id * 2654435761u) & (remote_size - 1);
+}
+
+static void channel_table_remote_put(struct firefly_channel **remote,
+		size_t remote_size, struct firefly_channel *chan)
+{
+	size_t i;
+
+	i = channel_table_remote_hash(chan->remote_id, remote_size);
+	while (remote[i] != NULL)
+		i = (i + 1) & (remote_size - 1);
+	remote[i] = chan;
+}
+
+static int channel_table_remote_add(struct firefly_channel_table *table,
+		struct firefly_channel *chan)
+{
+	/* Keep at most half of the entries used to keep the probes short. */
+	if (2 * (table->nbr_remote + 1) > table->remote_size) {
+		struct firefly_channel **remote;
+		size_t remote_size;
+
+		remote_size = table->remote_size > 0 ?
+			2 * table->remote_size : FIREFLY_CHANNEL_TABLE_MIN_SIZE;
+		remote = FIREFLY_MALLOC(remote_size * sizeof(*remote));
+		if (remote == NULL)
+			return -1;
+		memset(remote, 0, remote_size * sizeof(*remote));
+		for (size_t i = 0; i < table->remote_size; i++) {
+			if (table->remote[i] != NULL)
+				channel_table_remote_put(remote, remote_size,
+						table->remote[i]);
+		}
+		FIREFLY_FREE(table->remote);
+		table->remote = remote;
+		table->remote_size = remote_size;
+	}
+	channel_table_remote_put(table->remote, table->remote_size, chan);
+	table->nbr_remote++;
+	return 0;
+}
+
+static void channel_table_remote_remove(struct firefly_channel_table *table,
+		struct firefly_channel *chan)
+{
+	size_t mask;
+	size_t i;
+	size_t j;
+
+	if (table->remote_size == 0)
+		return;
+	mask = table->remote_size - 1;
+	i = channel_table_remote_hash(chan->remote_id, table->remote_size);
+	while (table->remote[i] != chan) {
+		if (table->remote[i] == NULL)
+			return;
+		i = (i + 1) & mask;
+	}
+	/*
+	 * Move back the entries after the hole that can not be found past it,
+	 * instead of leaving a marker for the removed entry.
+	 */
+	j = i;
+	for (;;) {
+		size_t home;
+
+		table->remote[i] = NULL;
+		do {
+			j = (j + 1) & mask;
+			if (table->remote[j] == NULL) {
+				table->nbr_remote--;
+				return;
+			}
+			home = channel_table_remote_hash(table->remote[j]->remote_id,
+					table->remote_size);
+		} while (((j - home) & mask) < ((j - i) & mask));
+		table->remote[i] = table->remote[j];
+		i = j;
+	}
+}
+
+static bool channel_table_contains(struct firefly_channel_table *table,
+		struct firefly_channel *chan)
+{
+	return chan->local_id >= 0 && (size_t) chan->local_id < table->size &&
+		table->chans[chan->local_id] == chan;
+}
+
+static void channel_table_release_id(struct firefly_channel_table *table,
+		int id)
+{
+	if (table->nbr_free_ids == table->free_size) {
+		int *free_ids;
+		size_t free_size;
+
+		free_size = table->free_size > 0 ?
+			2 * table->free_size : FIREFLY_CHANNEL_TABLE_MIN_SIZE;
+		free_ids = FIREFLY_MALLOC(free_size * sizeof(*free_ids));
+		if (free_ids == NULL) {
+			/* The id is not handed out again. */
+			return;
+		}
+		for (size_t i = 0; i < table->nbr_free_ids; i++)
+			free_ids[i] = table->free_ids[(table->free_head + i) %
+				table->free_size];
+		FIREFLY_FREE(table->free_ids);
+		table->free_ids = free_ids;
+		table->free_size = free_size;
+		table->free_head = 0;
+	}
+	table->free_ids[(table->free_head + table->nbr_free_ids) %
+		table->free_size] = id;
+	table->nbr_free_ids++;
+}
+
+struct firefly_channel *find_channel_by_local_id(
+		struct firefly_connection *conn, int id)
+{
+	if (id < 0 || (size_t) id >= conn->channels.size)
+		return NULL;
+	return conn->channels.chans[id];
+}
+
+struct firefly_channel *find_channel_by_remote_id(
+		struct firefly_connection *conn, int id)
+{
+	struct firefly_channel_table *table;
+	size_t i;
+
+	table = &conn->channels;
+	if (table->nbr_remote == 0)
+		return NULL;
+	i = channel_table_remote_hash(id, table->remote_size);
+	while (table->remote[i] != NULL) {
+		if (table->remote[i]->remote_id == id)
+			return table->remote[i];
+		i = (i + 1) & (table->remote_size - 1);
+	}
+	return NULL;
+}
+
+void add_channel_to_connection(struct firefly_channel *chan,
+		struct firefly_connection *conn)
+{
+	struct firefly_channel_table *table;
+
+	table = &conn->channels;
+	if (chan->local_id < 0) {
+		firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
+			      "Channel without local id added to connection\n");
+		return;
+	}
+	if ((size_t) chan->local_id >= table->size) {
+		struct firefly_channel **chans;
+		size_t size;
+
+		size = table->size > 0 ?
+			table->size : FIREFLY_CHANNEL_TABLE_MIN_SIZE;
+		while (size <= (size_t) chan->local_id)
+			size *= 2;
+		chans = FIREFLY_MALLOC(size * sizeof(*chans));
+		if (chans == NULL) {
+			firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				      "Failed to allocate channel table\n");
+			return;
+		}
+		memset(chans, 0, size * sizeof(*chans));
+		if (table->size > 0)
+			memcpy(chans, table->chans, table->size * sizeof(*chans));
+		FIREFLY_FREE(table->chans);
+		table->chans = chans;
+		table->size = size;
+	}
+	if (table->chans[chan->local_id] != NULL) {
+		firefly_error(FIREFLY_ERROR_PROTO_STATE, 1,
+			      "Channel id already used on connection\n");
+		return;
+	}
+	if (chan->remote_id != CHANNEL_ID_NOT_SET &&
+			channel_table_remote_add(table, chan) < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "Failed to allocate channel table\n");
+		return;
+	}
+	table->chans[chan->local_id] = chan;
+	table->nbr_chans++;
+}
+
 struct firefly_channel *remove_channel_from_connection(
 		struct firefly_channel *chan, struct firefly_connection *conn)
 {
-	struct firefly_channel *ret;
-	struct channel_list_node **head;
-
-	ret = NULL;
-	head = &conn->chan_list;
-	while (head != NULL && (*head) != NULL) {
-		if ((*head)->chan->local_id == chan->local_id) {
-			struct channel_list_node *tmp;
-
-			tmp = (*head)->next;
-			ret = chan;
-			FIREFLY_FREE(*head);
-			*head = tmp;
-			head = NULL;
-		} else {
-			*head = (*head)->next;
-		}
+	struct firefly_channel_table *table;
+
+	table = &conn->channels;
+	if (!channel_table_contains(table, chan))
+		return NULL;
+	if (chan->remote_id != CHANNEL_ID_NOT_SET)
+		channel_table_remote_remove(table, chan);
+	table->chans[chan->local_id] = NULL;
+	table->nbr_chans--;
+	channel_table_release_id(table, chan->local_id);
+	return chan;
+}
+
+void set_channel_remote_id(struct firefly_channel *chan, int id)
+{
+	struct firefly_channel_table *table;
+	bool added;
+
+	table = &chan->conn->channels;
+	added = channel_table_contains(table, chan);
+	if (added && chan->remote_id != CHANNEL_ID_NOT_SET)
+		channel_table_remote_remove(table, chan);
+	chan->remote_id = id;
+	if (added && id != CHANNEL_ID_NOT_SET &&
+			channel_table_remote_add(table, chan) < 0) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+			      "Failed to allocate channel table\n");
 	}
-	return ret;
 }
 
 int next_channel_id(struct firefly_connection *conn)
 {
-	return conn->channel_id_counter++;
+	struct firefly_channel_table *table;
+
+	table = &conn->channels;
+	while (table->nbr_free_ids > FIREFLY_CHANNEL_ID_QUARANTINE) {
+		int id;
+
+		id = table->free_ids[table->free_head];
+		table->free_head = (table->free_head + 1) % table->free_size;
+		table->nbr_free_ids--;
+		if (find_channel_by_local_id(conn, id) == NULL)
+			return id;
+	}
+	return table->next_id++;
+}
+
+void firefly_channel_table_free(struct firefly_connection *conn)
+{
+	FIREFLY_FREE(conn->channels.chans);
+	FIREFLY_FREE(conn->channels.remote);
+	FIREFLY_FREE(conn->channels.free_ids);
+	memset(&conn->channels, 0, sizeof(conn->channels));
 }
 
 void *firefly_connection_get_context(struct firefly_connection *conn)
@@ -316,6 +583,141 @@ struct firefly_event_queue *firefly_connection_get_event_queue(
 	return conn->event_queue;
 }
 
+void firefly_connection_set_ack_delay(struct firefly_connection *conn,
+		unsigned int delay, unsigned int max_pending)
+{
+	conn->ack_delay = delay;
+	conn->ack_max_pending = max_pending > 0 ? max_pending : 1;
+}
+
+void firefly_connection_set_reassembly_max(struct firefly_connection *conn,
+		size_t max)
+{
+	conn->reassembly_max = max;
+}
+
+size_t firefly_connection_packet_size(struct firefly_connection *conn)
+{
+	if (conn->transport != NULL && conn->transport->mtu != 0)
+		return conn->transport->mtu;
+	return BUFFER_SIZE;
+}
+
+void firefly_connection_set_coalescing(struct firefly_connection *conn,
+		bool enable, unsigned int delay)
+{
+	if (!enable)
+		firefly_connection_flush(conn);
+	conn->coalesce = enable;
+	conn->coalesce_delay = delay;
+}
+
+void firefly_connection_flush(struct firefly_connection *conn)
+{
+	/* An offered flush event finds nothing left to send. */
+	labcomm_encoder_ioctl(conn->transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_FLUSH);
+}
+
+static int firefly_connection_flush_event(void *event_arg)
+{
+	struct firefly_connection *conn;
+
+	conn = event_arg;
+	conn->coalesce_flush_id = 0;
+	labcomm_encoder_ioctl(conn->transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_FLUSH);
+	return 0;
+}
+
+int firefly_connection_coalesce(struct firefly_connection *conn)
+{
+	struct firefly_event_queue *eq;
+	int64_t id;
+
+	if (conn->coalesce_flush_id != 0)
+		return 0;
+	eq = conn->event_queue;
+	if (conn->coalesce_delay > 0) {
+		id = firefly_event_offer_at(eq, conn, NULL, FIREFLY_PRIORITY_LOW,
+				firefly_event_queue_now(eq) +
+				(conn->coalesce_delay + 999) / 1000,
+				firefly_connection_flush_event, conn);
+	} else {
+		id = firefly_connection_offer_event(conn, FIREFLY_PRIORITY_LOW,
+				firefly_connection_flush_event, conn, 0, NULL);
+	}
+	if (id <= 0)
+		return -1;
+	conn->coalesce_flush_id = id;
+	return 0;
+}
+
+void firefly_connection_send_heartbeat(struct firefly_connection *conn,
+		bool reply)
+{
+	firefly_protocol_heartbeat hb;
+
+	hb.reply = reply;
+	labcomm_encode_firefly_protocol_heartbeat(conn->transport_encoder, &hb);
+}
+
+static int firefly_connection_heartbeat_event(void *event_arg);
+
+static void firefly_connection_heartbeat_arm(struct firefly_connection *conn)
+{
+	struct firefly_event_queue *eq;
+	int64_t id;
+
+	eq = conn->event_queue;
+	id = firefly_event_offer_at(eq, conn, NULL, FIREFLY_PRIORITY_HIGH,
+			firefly_event_queue_now(eq) + conn->heartbeat_interval,
+			firefly_connection_heartbeat_event, conn);
+	conn->heartbeat_id = id > 0 ? id : 0;
+}
+
+static int firefly_connection_heartbeat_event(void *event_arg)
+{
+	struct firefly_connection *conn;
+	bool received;
+	bool replied;
+
+	conn = event_arg;
+	conn->heartbeat_id = 0;
+	if (conn->open != FIREFLY_CONNECTION_OPEN)
+		return 0;
+	received = __atomic_exchange_n(&conn->heartbeat_received, false,
+			__ATOMIC_ACQ_REL);
+	replied = __atomic_exchange_n(&conn->heartbeat_replied, false,
+			__ATOMIC_ACQ_REL);
+	if (received) {
+		conn->heartbeat_missed = 0;
+	} else if (++conn->heartbeat_missed >= conn->heartbeat_max_missed) {
+		FIREFLY_CONNECTION_RAISE(conn, FIREFLY_ERROR_CONN_TIMEOUT,
+				"Nothing heard from the other end");
+		return 0;
+	}
+	/* Other traffic shows that the other end is alive. */
+	if (!received || replied)
+		firefly_connection_send_heartbeat(conn, false);
+	firefly_connection_heartbeat_arm(conn);
+	return 0;
+}
+
+void firefly_connection_set_heartbeat(struct firefly_connection *conn,
+		unsigned int interval, unsigned int max_missed)
+{
+	if (conn->heartbeat_id > 0) {
+		firefly_event_queue_cancel(conn->event_queue, conn->heartbeat_id);
+		conn->heartbeat_id = 0;
+	}
+	conn->heartbeat_interval = interval;
+	conn->heartbeat_max_missed = max_missed > 0 ? max_missed : 1;
+	conn->heartbeat_missed = 0;
+	if (interval > 0)
+		firefly_connection_heartbeat_arm(conn);
+}
+
 struct firefly_connection_raise_arg {
 	struct firefly_connection *conn;
 	enum firefly_error reason;
@@ -331,6 +733,32 @@ static int firefly_connection_raise_event(void *args)
 	return 0;
 }
 
+int64_t firefly_connection_offer_event(struct firefly_connection *conn,
+		unsigned char prio, firefly_event_execute_f execute, void *arg,
+		unsigned int nbr_deps, const int64_t *deps)
+{
+	return firefly_event_offer_keyed(conn->event_queue, conn, prio, execute,
+			arg, 0, nbr_deps, deps);
+}
+
+int64_t firefly_connection_offer_event_copy(struct firefly_connection *conn,
+		unsigned char prio, firefly_event_execute_f execute, const void *arg,
+		size_t arg_size, unsigned int nbr_deps, const int64_t *deps)
+{
+	return firefly_event_offer_keyed(conn->event_queue, conn, prio, execute,
+			(void *) arg, arg_size, nbr_deps, deps);
+}
+
+int64_t firefly_connection_offer_event_owned(struct firefly_connection *conn,
+		const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, const void *arg, size_t arg_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_deps,
+		const int64_t *deps)
+{
+	return firefly_event_offer_owned(conn->event_queue, conn, owner, prio,
+			execute, (void *) arg, arg_size, destroy, nbr_deps, deps);
+}
+
 void firefly_connection_raise_later(struct firefly_connection *conn,
 		enum firefly_error reason, const char *msg)
 {
@@ -349,7 +777,7 @@ void firefly_connection_raise_later(struct firefly_connection *conn,
 		memset(args->msg, 0, FF_ERRMSG_MAXLEN + 1);
 	}
 
-	conn->event_queue->offer_event_cb(conn->event_queue,
+	firefly_connection_offer_event(conn,
 				FIREFLY_PRIORITY_HIGH, firefly_connection_raise_event,
 				args, 0, NULL);
 }
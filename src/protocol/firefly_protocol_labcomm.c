@@ -2,7 +2,10 @@
 #include "protocol/firefly_protocol_private.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <labcomm.h>
 #include <labcomm_ioctl.h>
@@ -13,20 +16,33 @@
 #include <utils/cppmacros.h>
 
 #include "utils/firefly_event_queue_private.h"
+#include "utils/firefly_packet.h"
 
 struct protocol_writer_context {
 	struct firefly_channel *chan;
 	bool important;
+	int index; /**< The LabComm index of the sample being encoded. */
+	struct firefly_packet_pool *pool;
+	struct firefly_packet *pkt; /**< The packet being encoded into, after
+								  #FIREFLY_DATA_SAMPLE_HEADROOM bytes. */
 };
 
 struct transport_writer_context {
 	struct firefly_connection *conn;
-	unsigned char *important_id;
+	uint32_t *important_id;
+	struct firefly_packet_pool *pool;
+	struct firefly_packet *pkt; /**< The packet being encoded into. */
+	size_t held; /**< The size of the packets held back to be coalesced at
+				   the start of the buffer. */
+	bool locked; /**< Held while a packet is encoded or sent, samples sent
+				   directly by the thread encoding them take it as well. */
 };
 
 struct transport_reader_list {
 	unsigned char *data;
 	size_t len;
+	struct firefly_packet *pkt; /**< The packet holding data, NULL if data is
+								  allocated with FIREFLY_RUNTIME_MALLOC. */
 	struct transport_reader_list *next;
 };
 
@@ -35,8 +51,14 @@ struct transport_reader_context {
 	struct transport_reader_list *read;
 	struct transport_reader_list *to_read;
 	int last_end_pos;
+	struct firefly_packet *pkt; /**< The packet holding the data of the
+								  reader, NULL if none. */
 };
 
+static void send_data_sample_packet(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data, struct firefly_packet *pkt,
+		uint32_t *important_id);
+
 static int proto_reader_alloc(struct labcomm_reader *r,
 		struct labcomm_reader_action_context *context)
 {
@@ -157,8 +179,17 @@ void protocol_labcomm_reader_free(struct labcomm_reader *r)
 	FIREFLY_FREE(r);
 }
 
+static void trans_reader_release(struct firefly_connection *conn,
+		unsigned char *data, struct firefly_packet *pkt)
+{
+	if (pkt != NULL)
+		firefly_packet_release(pkt);
+	else
+		FIREFLY_RUNTIME_FREE(conn, data);
+}
+
 static int trans_reader_append_buffer(struct labcomm_reader *r,
-		unsigned char *data, size_t len)
+		unsigned char *data, size_t len, struct firefly_packet *pkt)
 {
 	struct transport_reader_context *ctx;
 	struct transport_reader_list *le;
@@ -169,6 +200,7 @@ static int trans_reader_append_buffer(struct labcomm_reader *r,
 		return -1;
 	le->data = data;
 	le->len = len;
+	le->pkt = pkt;
 	le->next = NULL;
 	for (next = &ctx->to_read; *next != NULL; next = &(*next)->next) {}
 	*next = le;
@@ -182,6 +214,7 @@ static int trans_reader_next_buffer(struct labcomm_reader *r)
 	struct transport_reader_list **next;
 	unsigned char *tmp_data;
 	size_t tmp_len;
+	struct firefly_packet *tmp_pkt;
 	ctx = r->action_context->context;
 	if (ctx->to_read == NULL)
 		return -1;
@@ -191,9 +224,11 @@ static int trans_reader_next_buffer(struct labcomm_reader *r)
 	// temporarily save buffer
 	tmp_data = le->data;
 	tmp_len = le->len;
+	tmp_pkt = le->pkt;
 	// Reuse buffer struct to save current buffer in backstack
 	le->data = r->data;
 	le->len = r->count;
+	le->pkt = ctx->pkt;
 	le->next = NULL;
 	// Save current buffer in backstack
 	for (next = &ctx->read; *next != NULL; next = &(*next)->next) {}
@@ -202,6 +237,7 @@ static int trans_reader_next_buffer(struct labcomm_reader *r)
 	r->data = tmp_data;
 	r->count = tmp_len;
 	r->pos = 0;
+	ctx->pkt = tmp_pkt;
 	return 0;
 }
 
@@ -219,6 +255,7 @@ static void trans_reader_pop_backstack(struct labcomm_reader *r)
 	struct transport_reader_list **next;
 	unsigned char *tmp_data;
 	size_t tmp_len;
+	struct firefly_packet *tmp_pkt;
 	ctx = r->action_context->context;
 	if (ctx->read == NULL)
 		return;
@@ -228,10 +265,13 @@ static void trans_reader_pop_backstack(struct labcomm_reader *r)
 	ctx->read = le->next;
 	tmp_data = r->data;
 	tmp_len = r->count;
+	tmp_pkt = ctx->pkt;
 	r->data = le->data;
 	r->count = le->len;
+	ctx->pkt = le->pkt;
 	le->data = tmp_data;
 	le->len = tmp_len;
+	le->pkt = tmp_pkt;
 	// Get previous buffer in backstack, the last one in the list
 	for (next = &ctx->read; *next != NULL; next = &(*next)->next) {}
 	// Let the previous buffer point to the current
@@ -251,7 +291,7 @@ static void trans_reader_free_backstack(struct labcomm_reader *r)
 	while (ctx->read != NULL) {
 		le = ctx->read;
 		ctx->read = le->next;
-		FIREFLY_RUNTIME_FREE(ctx->conn, le->data);
+		trans_reader_release(ctx->conn, le->data, le->pkt);
 		FIREFLY_RUNTIME_FREE(ctx->conn, le);
 	}
 }
@@ -314,8 +354,8 @@ static int trans_reader_end(struct labcomm_reader *r,
 	ctx = action_context->context;
 	if (r->pos >= r->count) {
 		if (trans_reader_next_buffer(r) < 0 && r->data != NULL) {
-			struct firefly_connection *conn = ctx->conn;
-			FIREFLY_RUNTIME_FREE(conn, r->data);
+			trans_reader_release(ctx->conn, r->data, ctx->pkt);
+			ctx->pkt = NULL;
 			r->data = NULL;
 			r->count = 0;
 			r->pos = 0;
@@ -328,19 +368,39 @@ static int trans_reader_end(struct labcomm_reader *r,
 	return 0;
 }
 
+static void trans_reader_set_buffer(struct labcomm_reader *r,
+		unsigned char *data, size_t size, struct firefly_packet *pkt)
+{
+	struct transport_reader_context *ctx;
+
+	ctx = r->action_context->context;
+	if (r->data == NULL) {
+		r->data = data;
+		r->data_size = size;
+		r->count = size;
+		r->pos = 0;
+		ctx->pkt = pkt;
+	} else {
+		trans_reader_append_buffer(r, data, size, pkt);
+	}
+	if (r->error) {
+		r->error = 0;
+		r->pos = ctx->last_end_pos;
+	}
+}
+
 static int trans_reader_ioctl(struct labcomm_reader *r,
 		struct labcomm_reader_action_context *action_context,
 		int local_index, int remote_index,
 		const struct labcomm_signature *signature,
 		uint32_t ioctl_action, va_list args)
 {
+	UNUSED_VAR(action_context);
 	UNUSED_VAR(local_index);
 	UNUSED_VAR(remote_index);
 	UNUSED_VAR(signature);
 
 	int result;
-	struct transport_reader_context *ctx;
-	ctx = action_context->context;
 
 	switch (ioctl_action) {
 	case FIREFLY_LABCOMM_IOCTL_READER_SET_BUFFER: {
@@ -349,19 +409,14 @@ static int trans_reader_ioctl(struct labcomm_reader *r,
 
 		buffer = va_arg(args, void*);
 		size = va_arg(args, size_t);
+		trans_reader_set_buffer(r, buffer, size, NULL);
+		result = 0;
+		} break;
+	case FIREFLY_LABCOMM_IOCTL_READER_SET_PACKET: {
+		struct firefly_packet *pkt;
 
-		if (r->data == NULL) {
-			r->data = buffer;
-			r->data_size = size;
-			r->count = size;
-			r->pos = 0;
-		} else {
-			trans_reader_append_buffer(r, buffer, size);
-		}
-		if (r->error) {
-			r->error = 0;
-			r->pos = ctx->last_end_pos;
-		}
+		pkt = va_arg(args, struct firefly_packet*);
+		trans_reader_set_buffer(r, pkt->data, pkt->size, pkt);
 		result = 0;
 		} break;
 	default:
@@ -396,6 +451,7 @@ struct labcomm_reader *transport_labcomm_reader_new(
 		reader_context->read    = NULL;
 		reader_context->to_read = NULL;
 		reader_context->last_end_pos = 0;
+		reader_context->pkt     = NULL;
 		reader_context->conn    = conn;
 
 		action_context->context = reader_context;
@@ -414,6 +470,29 @@ struct labcomm_reader *transport_labcomm_reader_new(
 	return reader;
 }
 
+unsigned char *transport_labcomm_reader_ref(struct labcomm_reader *r,
+		const unsigned char *decoded, size_t size, size_t trailer,
+		struct firefly_packet **pkt)
+{
+	struct transport_reader_context *ctx;
+	unsigned char *data;
+
+	ctx = r->action_context->context;
+	if (ctx->pkt == NULL || r->data != ctx->pkt->data || size == 0 ||
+			(size_t) r->pos < trailer + size)
+		return NULL;
+	/*
+	 * The reader is at the end of the sample being handled. The offset only
+	 * holds if the trailer is what the caller computed, so the whole array
+	 * is compared to not hand out other bytes of the packet.
+	 */
+	data = r->data + r->pos - trailer - size;
+	if (memcmp(data, decoded, size) != 0)
+		return NULL;
+	*pkt = firefly_packet_ref(ctx->pkt);
+	return data;
+}
+
 void transport_labcomm_reader_free(struct labcomm_reader *r)
 {
 	FIREFLY_FREE(r->action_context->context);
@@ -421,18 +500,74 @@ void transport_labcomm_reader_free(struct labcomm_reader *r)
 	FIREFLY_FREE(r);
 }
 
-static int comm_writer_alloc(struct labcomm_writer *w,
-		struct labcomm_writer_action_context *action_context)
+size_t firefly_labcomm_packed32_size(uint32_t v)
 {
-	UNUSED_VAR(action_context);
+	size_t n;
+
+	for (n = 1; v >= 0x80; v >>= 7)
+		n++;
+	return n;
+}
+
+/*
+ * Write a LabComm packed32 at p, in groups of seven bits with the most
+ * significant first. Returns the byte after it.
+ */
+static unsigned char *firefly_labcomm_put_packed32(unsigned char *p,
+		uint32_t v)
+{
+	size_t n;
+
+	n = firefly_labcomm_packed32_size(v);
+	p[n - 1] = v & 0x7f;
+	for (size_t i = n - 1; i > 0; i--) {
+		v >>= 7;
+		p[i - 1] = 0x80 | (v & 0x7f);
+	}
+	return p + n;
+}
 
-	w->data_size	= BUFFER_SIZE;
-	w->count	= w->data_size;
-	w->data		= FIREFLY_MALLOC(w->data_size);
+/*
+ * Write a LabComm int at p, big endian. Returns the byte after it.
+ */
+static unsigned char *firefly_labcomm_put_int(unsigned char *p, int32_t v)
+{
+	uint32_t u;
+
+	u = (uint32_t) v;
+	p[0] = u >> 24;
+	p[1] = u >> 16;
+	p[2] = u >> 8;
+	p[3] = u;
+	return p + FIREFLY_LABCOMM_INT_SIZE;
+}
+
+/*
+ * Encode into the packet after the room left for the header of the data
+ * sample, the payload is not moved again before it is sent.
+ */
+static void proto_writer_set_packet(struct labcomm_writer *w,
+		struct protocol_writer_context *ctx, struct firefly_packet *pkt)
+{
+	ctx->pkt = pkt;
+	w->data = pkt->data + FIREFLY_DATA_SAMPLE_HEADROOM;
+	w->data_size = pkt->capacity - FIREFLY_DATA_SAMPLE_HEADROOM;
+	w->count = w->data_size;
+}
+
+static int proto_writer_alloc(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct protocol_writer_context *ctx;
+	struct firefly_packet *pkt;
 
-	if (w->data == NULL) {
+	ctx = action_context->context;
+	pkt = firefly_packet_get(ctx->pool);
+	if (pkt == NULL) {
+		w->data = NULL;
 		w->error = -ENOMEM;
 	} else {
+		proto_writer_set_packet(w, ctx, pkt);
 		memset(w->data, 0, w->data_size);
 	}
 	w->pos = 0;
@@ -440,26 +575,63 @@ static int comm_writer_alloc(struct labcomm_writer *w,
 	return w->error;
 }
 
-static int comm_writer_free(struct labcomm_writer *w,
+static int proto_writer_free(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context)
 {
-	FIREFLY_FREE(w->data);
-	FIREFLY_FREE(action_context->context);
+	struct protocol_writer_context *ctx;
+
+	ctx = action_context->context;
+	if (ctx->pkt != NULL)
+		firefly_packet_release(ctx->pkt);
+	firefly_packet_pool_free(ctx->pool);
+	FIREFLY_FREE(ctx);
 	FIREFLY_FREE(action_context);
 	FIREFLY_FREE(w);
 
 	return 0;
 }
 
+/*
+ * Called by LabComm when the buffer is full, a packet may not grow past it.
+ */
 static int comm_writer_flush(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context)
 {
-	int result;
-
 	UNUSED_VAR(action_context);
-	result = w->count - w->pos;
 
-	return (result < 0) ? -ENOMEM : result;
+	return (w->pos >= w->count) ? -ENOMEM : 0;
+}
+
+/*
+ * Grow the buffer of a channel when it is full, samples larger than a packet
+ * are sent in fragments.
+ */
+static int proto_writer_flush(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct protocol_writer_context *ctx;
+	struct firefly_packet *pkt;
+	size_t size;
+
+	ctx = action_context->context;
+	if (w->pos < w->count)
+		return 0;
+	size = 2 * (size_t) w->data_size;
+	if (size > FIREFLY_SAMPLE_MAX_SIZE) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				"Sample larger than FIREFLY_SAMPLE_MAX_SIZE.");
+		return -ENOMEM;
+	}
+	pkt = firefly_packet_new(FIREFLY_DATA_SAMPLE_HEADROOM + size);
+	if (pkt == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		return -ENOMEM;
+	}
+	memcpy(pkt->data + FIREFLY_DATA_SAMPLE_HEADROOM, w->data, w->pos);
+	firefly_packet_release(ctx->pkt);
+	proto_writer_set_packet(w, ctx, pkt);
+
+	return 0;
 }
 
 static int proto_writer_start(struct labcomm_writer *w,
@@ -470,12 +642,13 @@ static int proto_writer_start(struct labcomm_writer *w,
 {
 	struct protocol_writer_context *ctx;
 
-	UNUSED_VAR(w);
-	UNUSED_VAR(index);
 	UNUSED_VAR(signature);
 
 	ctx = action_context->context;
 	ctx->important = (value == NULL);
+	ctx->index = index;
+	/* Left over if the last sample was too large. */
+	w->pos = 0;
 
 	if (!value && ctx->chan->restricted_local) {
 		/* Until we get the updated lc, just print an error. */
@@ -489,12 +662,170 @@ static int proto_writer_start(struct labcomm_writer *w,
 	return 0;
 }
 
+static void send_data_sample_destroy(void *event_arg)
+{
+	struct firefly_event_send_sample *fess;
+
+	fess = event_arg;
+	firefly_packet_release(fess->pkt);
+	__atomic_sub_fetch(&fess->chan->nbr_queued, 1, __ATOMIC_RELEASE);
+}
+
+static void send_fragments_destroy(void *event_arg)
+{
+	struct firefly_event_send_fragment *fesf;
+
+	fesf = event_arg;
+	send_fragment_destroy(fesf);
+	__atomic_sub_fetch(&fesf->chan->nbr_queued, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Replace the unsent sample of the same type with the encoded one, or offer
+ * an event sending it if there is none.
+ */
+static int proto_writer_end_latest(struct labcomm_writer *w,
+		struct protocol_writer_context *ctx)
+{
+	struct firefly_channel *chan;
+	struct firefly_connection *conn;
+	struct firefly_channel_latest *type;
+	struct firefly_sample_buffer *sample;
+	struct firefly_sample_buffer *old;
+
+	chan = ctx->chan;
+	conn = chan->conn;
+	type = chan->latest_types;
+	while (type != NULL && type->index != ctx->index)
+		type = type->next;
+	if (type == NULL) {
+		type = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*type));
+		if (type == NULL) {
+			FFL(FIREFLY_ERROR_ALLOC);
+			return -ENOMEM;
+		}
+		type->chan = chan;
+		type->index = ctx->index;
+		type->pending = NULL;
+		type->next = chan->latest_types;
+		chan->latest_types = type;
+	}
+	sample = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*sample) + w->pos);
+	if (sample == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		return -ENOMEM;
+	}
+	sample->refs = 1;
+	sample->size = w->pos;
+	memcpy(sample->data, w->data, w->pos);
+	w->pos = 0;
+
+	old = __atomic_exchange_n(&type->pending, sample, __ATOMIC_ACQ_REL);
+	if (old != NULL) {
+		firefly_sample_buffer_release(conn, old);
+		__atomic_add_fetch(&chan->stats.nbr_superseded, 1, __ATOMIC_RELAXED);
+	} else if (firefly_connection_offer_event_owned(conn, chan,
+				FIREFLY_PRIORITY_HIGH, send_latest_sample_event, type, 0,
+				NULL, 0, NULL) < 0) {
+		old = __atomic_exchange_n(&type->pending, NULL, __ATOMIC_ACQ_REL);
+		if (old != NULL)
+			firefly_sample_buffer_release(conn, old);
+	}
+
+	return 0;
+}
+
+/*
+ * Offer an event sending a sample too large for one packet in fragments.
+ * The sample is copied once, the fragments are slices of the copy.
+ */
+static int proto_writer_end_fragments(struct labcomm_writer *w,
+		struct protocol_writer_context *ctx, uint32_t credit_seqno)
+{
+	struct firefly_channel *chan;
+	struct firefly_connection *conn;
+	struct firefly_event_send_fragment fesf;
+
+	chan = ctx->chan;
+	conn = chan->conn;
+	fesf.buf = FIREFLY_RUNTIME_MALLOC(conn, sizeof(*fesf.buf) + w->pos);
+	if (fesf.buf == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		w->pos = 0;
+		return -ENOMEM;
+	}
+	fesf.buf->refs = 1;
+	fesf.buf->size = w->pos;
+	memcpy(fesf.buf->data, w->data, w->pos);
+	w->pos = 0;
+	fesf.chan = chan;
+	fesf.sample_id = 0;
+	fesf.offset = 0;
+	fesf.size = fesf.buf->size;
+	fesf.seqno = 0;
+	fesf.important = ctx->important;
+	fesf.credit_seqno = credit_seqno;
+
+	__atomic_add_fetch(&chan->nbr_queued, 1, __ATOMIC_RELAXED);
+	if (firefly_connection_offer_event_owned(conn, chan,
+			FIREFLY_PRIORITY_HIGH, send_fragments_event, &fesf,
+			sizeof(fesf), send_fragments_destroy, 0, NULL) < 0) {
+		firefly_sample_buffer_release(conn, fesf.buf);
+		__atomic_sub_fetch(&chan->nbr_queued, 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+/*
+ * Send a sample on the thread encoding it. The acks and sequence numbers of
+ * the channel belong to the event queue thread, so only samples without
+ * them are sent this way.
+ */
+static int proto_writer_end_direct(struct labcomm_writer *w,
+		struct protocol_writer_context *ctx, uint32_t credit_seqno)
+{
+	struct firefly_channel *chan;
+	firefly_protocol_data_sample data;
+	struct firefly_packet *pkt;
+	struct firefly_packet *next;
+
+	chan = ctx->chan;
+	next = firefly_packet_get(ctx->pool);
+	if (next == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		w->pos = 0;
+		return -ENOMEM;
+	}
+	data.dest_chan_id     = chan->remote_id;
+	data.src_chan_id      = chan->local_id;
+	data.seqno            = 0;
+	data.important        = false;
+	data.app_enc_data.n_0 = w->pos;
+	data.app_enc_data.a   = w->data;
+	data.ack_cumulative   = 0;
+	data.ack_ranges.n_0   = 0;
+	data.ack_ranges.a     = NULL;
+	pkt = ctx->pkt;
+	proto_writer_set_packet(w, ctx, next);
+	w->pos = 0;
+
+	send_data_sample_packet(chan, &data, pkt, NULL);
+	firefly_packet_release(pkt);
+	if (credit_seqno != 0)
+		__atomic_store_n(&chan->credit_released, credit_seqno,
+				__ATOMIC_RELEASE);
+	return 0;
+}
+
 static int proto_writer_end(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context)
 {
 	struct protocol_writer_context *ctx;
 	struct firefly_channel *chan;
 	struct firefly_connection *conn;
+	uint32_t credit_seqno;
+	int res;
 
 	ctx  = action_context->context;
 	chan = ctx->chan;
@@ -505,35 +836,69 @@ static int proto_writer_end(struct labcomm_writer *w,
 				"Cannot send data on a closed connection.");
 		return -EINVAL;
 	}
+	if (chan->latest && !ctx->important)
+		return proto_writer_end_latest(w, ctx);
+	credit_seqno = 0;
+	if (!ctx->important) {
+		res = firefly_channel_credit_take(chan, &credit_seqno);
+		if (res != 0) {
+			w->pos = 0;
+			return res < 0 ? res : 0;
+		}
+	}
+	if ((size_t) w->pos > firefly_connection_packet_size(conn) -
+			FIREFLY_DATA_SAMPLE_OVERHEAD)
+		return proto_writer_end_fragments(w, ctx, credit_seqno);
+	/*
+	 * A sample may only pass the event queue if no sample encoded before
+	 * it on the channel is still waiting there, and if it would not be held
+	 * waiting for credit.
+	 */
+	if (chan->direct && !ctx->important &&
+			__atomic_load_n(&chan->nbr_queued, __ATOMIC_ACQUIRE) == 0 &&
+			!__atomic_load_n(&chan->credit_limited, __ATOMIC_ACQUIRE))
+		return proto_writer_end_direct(w, ctx, credit_seqno);
 
-	// create protocol packet and encode it
-	struct firefly_event_send_sample *fess =
-		FIREFLY_RUNTIME_MALLOC(conn, sizeof(*fess));
+	/*
+	 * The event takes the packet the sample is encoded in, the header is
+	 * filled in front of it when it is sent. The next sample is encoded in
+	 * another packet.
+	 */
+	struct firefly_event_send_sample fess;
+	struct firefly_packet *next;
 
-	unsigned char *a = FIREFLY_RUNTIME_MALLOC(conn, w->pos);
-	if (fess == NULL || a == NULL) {
-		// TODO: Check if Labcomm reports error
+	next = firefly_packet_get(ctx->pool);
+	if (next == NULL) {
 		firefly_error(FIREFLY_ERROR_ALLOC, 1,
 				"Protocol writer could not allocate send event\n");
-		FIREFLY_FREE(fess);
-		FIREFLY_FREE(a);
-
+		w->pos = 0;
 		return -ENOMEM;
 	}
 
-	fess->chan                  = chan;
-	fess->data.dest_chan_id     = chan->remote_id;
-	fess->data.src_chan_id      = chan->local_id;
-	fess->data.seqno            = 0;
-	fess->data.important        = ctx->important;
-	fess->data.app_enc_data.n_0 = w->pos;
-	fess->data.app_enc_data.a   = a;
-	memcpy(fess->data.app_enc_data.a, w->data, w->pos);
-
-	conn->event_queue->offer_event_cb(conn->event_queue, FIREFLY_PRIORITY_HIGH,
-			send_data_sample_event, fess, 0, NULL);
+	fess.chan                  = chan;
+	fess.data.dest_chan_id     = chan->remote_id;
+	fess.data.src_chan_id      = chan->local_id;
+	fess.data.seqno            = 0;
+	fess.data.important        = ctx->important;
+	fess.data.app_enc_data.n_0 = w->pos;
+	fess.data.app_enc_data.a   = w->data;
+	fess.data.ack_cumulative   = 0;
+	fess.data.ack_ranges.n_0   = 0;
+	fess.data.ack_ranges.a     = NULL;
+	fess.pkt                   = ctx->pkt;
+	fess.important_id          = NULL;
+	fess.credit_seqno          = credit_seqno;
+	proto_writer_set_packet(w, ctx, next);
 	w->pos = 0;
 
+	__atomic_add_fetch(&chan->nbr_queued, 1, __ATOMIC_RELAXED);
+	if (firefly_connection_offer_event_owned(conn, chan,
+			FIREFLY_PRIORITY_HIGH, send_data_sample_event, &fess,
+			sizeof(fess), send_data_sample_destroy, 0, NULL) < 0) {
+		firefly_packet_release(fess.pkt);
+		__atomic_sub_fetch(&chan->nbr_queued, 1, __ATOMIC_RELAXED);
+	}
+
 	return 0;
 }
 
@@ -553,11 +918,11 @@ static int proto_writer_ioctl(struct labcomm_writer *w,
 }
 
 static const struct labcomm_writer_action proto_writer_action = {
-	.alloc = comm_writer_alloc,
-	.free = comm_writer_free,
+	.alloc = proto_writer_alloc,
+	.free = proto_writer_free,
 	.start = proto_writer_start,
 	.end = proto_writer_end,
-	.flush = comm_writer_flush,
+	.flush = proto_writer_flush,
 	.ioctl = proto_writer_ioctl
 };
 
@@ -593,6 +958,14 @@ struct labcomm_writer *protocol_labcomm_writer_new(struct firefly_channel *chan,
 	result = labcomm_writer_new(context, &proto_writer_action, mem);
 	if (context != NULL && result != NULL) {
 		context->chan = chan;
+		context->pkt = NULL;
+		context->pool = firefly_packet_pool_new(FIREFLY_DATA_SAMPLE_HEADROOM +
+				(firefly_connection_packet_size(chan->conn) > BUFFER_SIZE ?
+				firefly_connection_packet_size(chan->conn) : BUFFER_SIZE));
+		if (context->pool == NULL) {
+			proto_writer_free(result, result->action_context);
+			result = NULL;
+		}
 	} else {
 		FIREFLY_FREE(context);
 		FIREFLY_FREE(result);
@@ -604,7 +977,139 @@ struct labcomm_writer *protocol_labcomm_writer_new(struct firefly_channel *chan,
 
 void protocol_labcomm_writer_free(struct labcomm_writer *w)
 {
-	comm_writer_free(w, w->action_context);
+	proto_writer_free(w, w->action_context);
+}
+
+static int trans_writer_alloc(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct transport_writer_context *ctx;
+
+	ctx = action_context->context;
+	ctx->pkt = firefly_packet_get(ctx->pool);
+	if (ctx->pkt == NULL) {
+		w->data = NULL;
+		w->error = -ENOMEM;
+	} else {
+		w->data_size = ctx->pkt->capacity;
+		w->count = w->data_size;
+		w->data = ctx->pkt->data;
+		memset(w->data, 0, w->data_size);
+	}
+	w->pos = 0;
+
+	return w->error;
+}
+
+static int trans_writer_free(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct transport_writer_context *ctx;
+
+	ctx = action_context->context;
+	if (ctx->pkt != NULL)
+		firefly_packet_release(ctx->pkt);
+	firefly_packet_pool_free(ctx->pool);
+	FIREFLY_FREE(ctx);
+	FIREFLY_FREE(action_context);
+	FIREFLY_FREE(w);
+
+	return 0;
+}
+
+/*
+ * Send the first size bytes of the buffer as one packet, the bytes encoded
+ * after them are moved to the start of the buffer.
+ */
+static void trans_writer_send(struct labcomm_writer *w,
+		struct transport_writer_context *ctx, size_t size,
+		uint32_t *important_id)
+{
+	struct firefly_connection *conn;
+	struct firefly_packet *pkt;
+	struct firefly_packet *next;
+	size_t rest;
+
+	conn = ctx->conn;
+	pkt = ctx->pkt;
+	rest = w->pos - size;
+	next = NULL;
+	if (conn->transport->write_packet != NULL)
+		next = firefly_packet_get(ctx->pool);
+	if (next != NULL) {
+		/*
+		 * The transport keeps its own reference to the packet if it is
+		 * resent, the next one is encoded into another buffer.
+		 */
+		memcpy(next->data, w->data + size, rest);
+		pkt->size = size;
+		ctx->pkt = next;
+		w->data = next->data;
+		conn->transport->write_packet(pkt, conn,
+				important_id != NULL, important_id);
+		firefly_packet_release(pkt);
+	} else {
+		conn->transport->write(w->data, size, conn,
+				important_id != NULL, important_id);
+		memmove(w->data, w->data + size, rest);
+	}
+	w->pos = rest;
+	ctx->held = 0;
+}
+
+/*
+ * Called by LabComm when the buffer is full, the held back packets are sent
+ * to make room for the one being encoded.
+ */
+static int trans_writer_flush(struct labcomm_writer *w,
+		struct labcomm_writer_action_context *action_context)
+{
+	struct transport_writer_context *ctx;
+
+	ctx = action_context->context;
+	if (w->pos < w->count)
+		return 0;
+	if (ctx->held == 0)
+		return -ENOMEM;
+	trans_writer_send(w, ctx, ctx->held, NULL);
+	return 0;
+}
+
+static inline void trans_writer_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * The transport writer is used by the event queue thread and by the threads
+ * sending directly on channels, it is only held for as long as it takes to
+ * encode and send one packet. The holder may be writing to the transport, so
+ * waiters only spin for a short while before giving up the processor between
+ * the attempts.
+ */
+static void trans_writer_lock(struct transport_writer_context *ctx)
+{
+	int spins = 0;
+
+	while (__atomic_test_and_set(&ctx->locked, __ATOMIC_ACQUIRE)) {
+		do {
+			if (spins < FIREFLY_TRANS_WRITER_SPIN) {
+				spins++;
+				trans_writer_relax();
+			} else {
+				sched_yield();
+			}
+		} while (__atomic_load_n(&ctx->locked, __ATOMIC_RELAXED));
+	}
+}
+
+static void trans_writer_unlock(struct transport_writer_context *ctx)
+{
+	__atomic_clear(&ctx->locked, __ATOMIC_RELEASE);
 }
 
 static int trans_writer_start(struct labcomm_writer *w,
@@ -612,30 +1117,100 @@ static int trans_writer_start(struct labcomm_writer *w,
 		int index, const struct labcomm_signature *signature,
                 void *value)
 {
-	UNUSED_VAR(w);
-	UNUSED_VAR(action_context);
+	struct transport_writer_context *ctx;
+
 	UNUSED_VAR(index);
 	UNUSED_VAR(signature);
 	UNUSED_VAR(value);
+	ctx = action_context->context;
+	trans_writer_lock(ctx);
+	/* Important packets are resent alone, the held back ones go first. */
+	if (ctx->held > 0 && ctx->important_id != NULL)
+		trans_writer_send(w, ctx, ctx->held, NULL);
 	return 0;
 }
 
+/*
+ * Send the packet encoded last, or hold it back to be coalesced with the
+ * next ones.
+ */
+static void trans_writer_finish(struct labcomm_writer *w,
+		struct transport_writer_context *ctx, uint32_t *important_id)
+{
+	struct firefly_connection *conn;
+	size_t mtu;
+
+	conn = ctx->conn;
+	if (!conn->coalesce || important_id != NULL) {
+		trans_writer_send(w, ctx, w->pos, important_id);
+	} else {
+		mtu = firefly_connection_packet_size(conn);
+		if (ctx->held > 0 && (size_t) w->pos > mtu)
+			trans_writer_send(w, ctx, ctx->held, NULL);
+		ctx->held = w->pos;
+		if (ctx->held >= mtu || firefly_connection_coalesce(conn) < 0)
+			trans_writer_send(w, ctx, ctx->held, NULL);
+	}
+}
+
 static int trans_writer_end(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context)
 {
 	struct transport_writer_context *ctx;
-	struct firefly_connection *conn;
 
 	ctx = action_context->context;
-	conn = ctx->conn;
-	conn->transport->write(w->data, w->pos, conn,
-			ctx->important_id != NULL, ctx->important_id);
+	trans_writer_finish(w, ctx, ctx->important_id);
 	ctx->important_id = NULL;
-	w->pos = 0;
+	trans_writer_unlock(ctx);
 
 	return 0;
 }
 
+/*
+ * Send a sample of the given index encoded in place in a packet, what
+ * LabComm would encode is written in front of it. The packet is sent as it
+ * is unless it is coalesced with others.
+ */
+static int trans_writer_send_encoded(struct labcomm_writer *w,
+		struct transport_writer_context *ctx, int index,
+		struct firefly_packet *pkt, size_t offset, size_t size,
+		uint32_t *important_id)
+{
+	struct firefly_connection *conn;
+	size_t framing;
+
+	conn = ctx->conn;
+	framing = firefly_labcomm_packed32_size(index) +
+		firefly_labcomm_packed32_size(size);
+	if (index < 0 || offset < framing || offset + size > pkt->capacity)
+		return -EINVAL;
+	pkt->offset = offset - framing;
+	pkt->size = framing + size;
+	firefly_labcomm_put_packed32(
+			firefly_labcomm_put_packed32(pkt->data + pkt->offset, index),
+			size);
+
+	if (conn->coalesce && important_id == NULL) {
+		if (pkt->size > (size_t) (w->count - w->pos) && ctx->held > 0)
+			trans_writer_send(w, ctx, ctx->held, NULL);
+		if (pkt->size > (size_t) (w->count - w->pos))
+			return -ENOMEM;
+		memcpy(w->data + w->pos, pkt->data + pkt->offset, pkt->size);
+		w->pos += pkt->size;
+		trans_writer_finish(w, ctx, NULL);
+		return 0;
+	}
+	if (ctx->held > 0)
+		trans_writer_send(w, ctx, ctx->held, NULL);
+	if (conn->transport->write_packet != NULL)
+		conn->transport->write_packet(pkt, conn, important_id != NULL,
+				important_id);
+	else
+		conn->transport->write(pkt->data + pkt->offset, pkt->size, conn,
+				important_id != NULL, important_id);
+	return 0;
+}
+
 static int trans_writer_ioctl(struct labcomm_writer *w,
 		struct labcomm_writer_action_context *action_context,
 		int index, const struct labcomm_signature *signature,
@@ -644,15 +1219,35 @@ static int trans_writer_ioctl(struct labcomm_writer *w,
 	struct transport_writer_context *ctx;
 	int result;
 
-	UNUSED_VAR(w);
 	UNUSED_VAR(signature);
-	UNUSED_VAR(index);
 	ctx = action_context->context;
 
 	switch (ioctl_action) {
 	case FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID: {
 		result = 0;
-		ctx->important_id = va_arg(arg, unsigned char*);
+		ctx->important_id = va_arg(arg, uint32_t *);
+	} break;
+	case FIREFLY_LABCOMM_IOCTL_TRANS_FLUSH: {
+		result = 0;
+		trans_writer_lock(ctx);
+		if (ctx->held > 0)
+			trans_writer_send(w, ctx, ctx->held, NULL);
+		trans_writer_unlock(ctx);
+	} break;
+	case FIREFLY_LABCOMM_IOCTL_TRANS_SEND_ENCODED: {
+		struct firefly_packet *pkt;
+		size_t offset;
+		size_t size;
+		uint32_t *important_id;
+
+		pkt = va_arg(arg, struct firefly_packet *);
+		offset = va_arg(arg, size_t);
+		size = va_arg(arg, size_t);
+		important_id = va_arg(arg, uint32_t *);
+		trans_writer_lock(ctx);
+		result = trans_writer_send_encoded(w, ctx, index, pkt, offset, size,
+				important_id);
+		trans_writer_unlock(ctx);
 	} break;
 	default:
 		result = -ENOTSUP;
@@ -662,11 +1257,11 @@ static int trans_writer_ioctl(struct labcomm_writer *w,
 }
 
 static const struct labcomm_writer_action trans_writer_action = {
-	.alloc = comm_writer_alloc,
-	.free = comm_writer_free,
+	.alloc = trans_writer_alloc,
+	.free = trans_writer_free,
 	.start = trans_writer_start,
 	.end = trans_writer_end,
-	.flush = comm_writer_flush,
+	.flush = trans_writer_flush,
 	.ioctl = trans_writer_ioctl
 };
 
@@ -681,6 +1276,16 @@ struct labcomm_writer *transport_labcomm_writer_new(
 	if (result != NULL && context != NULL) {
 		context->conn = conn;
 		context->important_id = NULL;
+		context->pkt = NULL;
+		context->held = 0;
+		context->locked = false;
+		context->pool = firefly_packet_pool_new(
+				firefly_connection_packet_size(conn) > BUFFER_SIZE ?
+				firefly_connection_packet_size(conn) : BUFFER_SIZE);
+		if (context->pool == NULL) {
+			trans_writer_free(result, result->action_context);
+			result = NULL;
+		}
 	} else {
 		FIREFLY_FREE(context);
 		FIREFLY_FREE(result);
@@ -692,18 +1297,116 @@ struct labcomm_writer *transport_labcomm_writer_new(
 
 void transport_labcomm_writer_free(struct labcomm_writer *w)
 {
-	comm_writer_free(w, w->action_context);
+	trans_writer_free(w, w->action_context);
 }
 
 
+/*
+ * Let the pending acks of the channel ride along with a data sample if the
+ * application data and the ranges fit in max bytes.
+ */
+static void send_data_sample_acks(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data,
+		firefly_protocol_ack_range *ranges, size_t max)
+{
+	size_t nbr_ranges;
+
+	if (!chan->ack_pending)
+		return;
+	nbr_ranges = firefly_channel_received_ranges(chan, ranges);
+	if (data->app_enc_data.n_0 + nbr_ranges * 2 * FIREFLY_LABCOMM_INT_SIZE <=
+			max) {
+		data->ack_cumulative = chan->remote_seqno;
+		data->ack_ranges.n_0 = nbr_ranges;
+		data->ack_ranges.a = ranges;
+		chan->ack_pending = false;
+	}
+}
+
+/*
+ * Encode a data sample on the connection of the channel, with the pending
+ * acks of the channel.
+ */
+static void send_data_sample_encode(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data)
+{
+	firefly_protocol_ack_range ranges[FIREFLY_CHANNEL_WINDOW_MAX];
+
+	send_data_sample_acks(chan, data, ranges,
+			firefly_connection_packet_size(chan->conn) -
+			FIREFLY_DATA_SAMPLE_OVERHEAD);
+	labcomm_encode_firefly_protocol_data_sample(chan->conn->transport_encoder,
+			data);
+}
+
+/*
+ * The room for the application data and the ack ranges of a data sample
+ * encoded in place in a packet.
+ */
+static size_t send_data_sample_room(struct firefly_channel *chan,
+		struct firefly_packet *pkt)
+{
+	size_t max;
+
+	max = pkt->capacity - FIREFLY_DATA_SAMPLE_HEADROOM -
+		FIREFLY_LABCOMM_INT_SIZE - firefly_labcomm_packed32_size(UINT32_MAX);
+	if (max > firefly_connection_packet_size(chan->conn) -
+			FIREFLY_DATA_SAMPLE_OVERHEAD)
+		max = firefly_connection_packet_size(chan->conn) -
+			FIREFLY_DATA_SAMPLE_OVERHEAD;
+	return max;
+}
+
+/*
+ * Send a data sample whose application data is encoded in place in a
+ * packet. The fields before and after the application data are written
+ * around it as LabComm would encode them, so it is never copied.
+ */
+static void send_data_sample_packet(struct firefly_channel *chan,
+		firefly_protocol_data_sample *data, struct firefly_packet *pkt,
+		uint32_t *important_id)
+{
+	unsigned char *start;
+	unsigned char *p;
+	size_t n;
+
+	n = data->app_enc_data.n_0;
+	start = data->app_enc_data.a - 3 * FIREFLY_LABCOMM_INT_SIZE - 1 -
+		firefly_labcomm_packed32_size(n);
+	p = firefly_labcomm_put_int(start, data->dest_chan_id);
+	p = firefly_labcomm_put_int(p, data->src_chan_id);
+	p = firefly_labcomm_put_int(p, data->seqno);
+	*p++ = data->important ? 1 : 0;
+	firefly_labcomm_put_packed32(p, n);
+
+	p = data->app_enc_data.a + n;
+	p = firefly_labcomm_put_int(p, data->ack_cumulative);
+	p = firefly_labcomm_put_packed32(p, data->ack_ranges.n_0);
+	for (int i = 0; i < data->ack_ranges.n_0; i++) {
+		p = firefly_labcomm_put_int(p, data->ack_ranges.a[i].first);
+		p = firefly_labcomm_put_int(p, data->ack_ranges.a[i].last);
+	}
+	labcomm_encoder_ioctl_firefly_protocol_data_sample(
+			chan->conn->transport_encoder,
+			FIREFLY_LABCOMM_IOCTL_TRANS_SEND_ENCODED, pkt,
+			(size_t) (start - pkt->data), (size_t) (p - start),
+			important_id);
+}
+
 int send_data_sample_event(void *event_arg)
 {
 	struct firefly_event_send_sample *fess;
 	struct firefly_channel *chan;
+	firefly_protocol_ack_range ranges[FIREFLY_CHANNEL_WINDOW_MAX];
+	uint32_t *important_id;
 	bool restr;
 
 	fess = event_arg;
 	chan = fess->chan;
+	if (fess->credit_seqno != 0 && firefly_channel_credit_hold(chan,
+				fess->credit_seqno, send_data_sample_event, fess,
+				sizeof(*fess), send_data_sample_destroy))
+		return 0;
 	restr = chan->restricted_local && chan->restricted_remote;
 	if (restr && fess->data.important) {
 		firefly_channel_raise(chan, NULL, FIREFLY_ERROR_PROTO_STATE,
@@ -713,18 +1416,149 @@ int send_data_sample_event(void *event_arg)
 	 * If not important or if important but not queued, send the packet.
 	 */
 	if (!fess->data.important ||
-			!firefly_channel_enqueue_important(chan,
-				send_data_sample_event, fess)) {
+			!firefly_channel_enqueue_important(chan, true,
+				send_data_sample_event, fess, sizeof(*fess),
+				send_data_sample_destroy)) {
+		important_id = NULL;
 		if (fess->data.important) {
 			fess->data.seqno = firefly_channel_next_seqno(fess->chan);
-			labcomm_encoder_ioctl(fess->chan->conn->transport_encoder,
-					FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
-					&fess->chan->important_id);
+			important_id = &fess->chan->important_id;
 		}
-		labcomm_encode_firefly_protocol_data_sample(
-				fess->chan->conn->transport_encoder, &fess->data);
-		FIREFLY_RUNTIME_FREE(fess->chan->conn, fess->data.app_enc_data.a);
-		FIREFLY_RUNTIME_FREE(fess->chan->conn, event_arg);
+		send_data_sample_acks(chan, &fess->data, ranges,
+				send_data_sample_room(chan, fess->pkt));
+		send_data_sample_packet(chan, &fess->data, fess->pkt, important_id);
+		firefly_packet_release(fess->pkt);
+		__atomic_sub_fetch(&chan->nbr_queued, 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+int send_latest_sample_event(void *event_arg)
+{
+	struct firefly_channel_latest *type;
+	struct firefly_sample_buffer *sample;
+	struct firefly_channel *chan;
+	firefly_protocol_data_sample data;
+	struct firefly_event_send_fragment fesf;
+
+	type = event_arg;
+	chan = type->chan;
+	sample = __atomic_exchange_n(&type->pending, NULL, __ATOMIC_ACQ_REL);
+	if (sample == NULL)
+		return 0;
+	if (sample->size > firefly_connection_packet_size(chan->conn) -
+			FIREFLY_DATA_SAMPLE_OVERHEAD) {
+		/* All fragments carry the sequence number of the sample. */
+		fesf.chan = chan;
+		fesf.buf = sample;
+		fesf.sample_id = 0;
+		fesf.offset = 0;
+		fesf.size = sample->size;
+		fesf.seqno = firefly_channel_next_sample_seqno(chan);
+		fesf.important = false;
+		fesf.credit_seqno = 0;
+		/* Counted like the queued samples until its fragments are sent. */
+		__atomic_add_fetch(&chan->nbr_queued, 1, __ATOMIC_RELAXED);
+		return send_fragments_event(&fesf);
+	}
+	data.dest_chan_id     = chan->remote_id;
+	data.src_chan_id      = chan->local_id;
+	data.seqno            = firefly_channel_next_sample_seqno(chan);
+	data.important        = false;
+	data.app_enc_data.n_0 = sample->size;
+	data.app_enc_data.a   = sample->data;
+	data.ack_cumulative   = 0;
+	data.ack_ranges.n_0   = 0;
+	data.ack_ranges.a     = NULL;
+	send_data_sample_encode(chan, &data);
+	firefly_sample_buffer_release(chan->conn, sample);
+	return 0;
+}
+
+void firefly_sample_buffer_release(struct firefly_connection *conn,
+		struct firefly_sample_buffer *buf)
+{
+	if (--buf->refs == 0)
+		FIREFLY_RUNTIME_FREE(conn, buf);
+}
+
+void send_fragment_destroy(void *event_arg)
+{
+	struct firefly_event_send_fragment *fesf;
+
+	fesf = event_arg;
+	firefly_sample_buffer_release(fesf->chan->conn, fesf->buf);
+}
+
+int send_fragments_event(void *event_arg)
+{
+	struct firefly_event_send_fragment *sample;
+	struct firefly_event_send_fragment fesf;
+	struct firefly_channel *chan;
+	size_t max;
+
+	sample = event_arg;
+	chan = sample->chan;
+	if (sample->credit_seqno != 0 && firefly_channel_credit_hold(chan,
+				sample->credit_seqno, send_fragments_event, sample,
+				sizeof(*sample), send_fragments_destroy))
+		return 0;
+	max = firefly_connection_packet_size(chan->conn) -
+		FIREFLY_DATA_SAMPLE_OVERHEAD;
+	if (chan->fragment_id == INT_MAX)
+		chan->fragment_id = 0;
+	fesf = *sample;
+	fesf.sample_id = ++chan->fragment_id;
+	/*
+	 * Each fragment holds a reference to the sample, the one of the whole
+	 * sample is released when all are sent or queued.
+	 */
+	for (fesf.offset = 0; fesf.offset < sample->buf->size;
+			fesf.offset += max) {
+		fesf.size = sample->buf->size - fesf.offset;
+		if (fesf.size > max)
+			fesf.size = max;
+		fesf.buf->refs++;
+		send_fragment_event(&fesf);
+	}
+	firefly_sample_buffer_release(chan->conn, sample->buf);
+	__atomic_sub_fetch(&chan->nbr_queued, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int send_fragment_event(void *event_arg)
+{
+	struct firefly_event_send_fragment *fesf;
+	struct firefly_channel *chan;
+	firefly_protocol_data_fragment pkt;
+
+	fesf = event_arg;
+	chan = fesf->chan;
+	/*
+	 * Important fragments are acked one by one, only the lost ones are
+	 * resent.
+	 */
+	if (fesf->important && firefly_channel_enqueue_important(chan, true,
+				send_fragment_event, fesf, sizeof(*fesf),
+				send_fragment_destroy))
+		return 0;
+	pkt.dest_chan_id = chan->remote_id;
+	pkt.src_chan_id  = chan->local_id;
+	pkt.seqno        = fesf->seqno;
+	pkt.important    = fesf->important;
+	pkt.sample_id    = fesf->sample_id;
+	pkt.offset       = fesf->offset;
+	pkt.total_size   = fesf->buf->size;
+	pkt.data.n_0     = fesf->size;
+	pkt.data.a       = fesf->buf->data + fesf->offset;
+	if (fesf->important) {
+		pkt.seqno = firefly_channel_next_seqno(chan);
+		labcomm_encoder_ioctl(chan->conn->transport_encoder,
+				FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID,
+				&chan->important_id);
 	}
+	labcomm_encode_firefly_protocol_data_fragment(
+			chan->conn->transport_encoder, &pkt);
+	firefly_sample_buffer_release(chan->conn, fesf->buf);
 	return 0;
 }
@@ -20,6 +20,44 @@
  */
 #define BUFFER_SIZE			(1500)
 
+/**
+ * @brief Room left in a packet for the header of a data sample or fragment
+ * and the LabComm framing around it, the rest carries the encoded sample.
+ */
+#define FIREFLY_DATA_SAMPLE_OVERHEAD	(64)
+
+/**
+ * @brief Room left in front of a sample encoded on a channel for the header
+ * of its data sample and the LabComm framing, which are filled in place when
+ * it is sent.
+ */
+#define FIREFLY_DATA_SAMPLE_HEADROOM	(32)
+
+/**
+ * @brief The encoded size of a LabComm int.
+ */
+#define FIREFLY_LABCOMM_INT_SIZE	(4)
+
+/**
+ * @brief The time in ms between the probes for credit of a channel out of
+ * it, see #firefly_channel_set_credits().
+ */
+#define FIREFLY_CHANNEL_CREDIT_PROBE_DELAY	(100)
+
+/**
+ * @brief The number of samples a channel in #FIREFLY_CREDIT_BLOCK mode holds
+ * waiting for credit before encoding more fails as in #FIREFLY_CREDIT_FAIL
+ * mode, see #firefly_channel_set_credit_mode().
+ */
+#define FIREFLY_CHANNEL_CREDIT_HELD_MAX	(1024)
+
+/**
+ * @brief The number of times a thread waiting for the transport writer of a
+ * connection spins before it starts to yield the processor between the
+ * attempts, see #firefly_channel_set_direct().
+ */
+#define FIREFLY_TRANS_WRITER_SPIN	(128)
+
 /**
  * @defgroup conn_state Connection State Values
  * @brief The different values the state of a connection may have.
@@ -112,15 +150,39 @@ void FIREFLY_FREE(void *ptr);
 #define FIREFLY_LABCOMM_IOCTL_TRANS_SET_IMPORTANT_ID				\
   LABCOMM_IOW('f', 1, unsigned char*)
 
+/**
+ * @brief A macro for sending the packets held back to be coalesced
+ * through Labcomm's ioctl functionality.
+ */
+#define FIREFLY_LABCOMM_IOCTL_TRANS_FLUSH					\
+  LABCOMM_IOWN('f', 2, 0)
+
+/**
+ * @brief A macro for handing a received packet to the transport reader
+ * through Labcomm's ioctl functionality.
+ */
+#define FIREFLY_LABCOMM_IOCTL_READER_SET_PACKET					\
+  LABCOMM_IOW('f', 3, struct firefly_packet*)
+
+/**
+ * @brief A macro for sending a sample encoded in place in a packet through
+ * Labcomm's ioctl functionality. The arguments are the packet, the offset
+ * and size of the encoded sample in it and the important ID to set, or NULL
+ * if it is not important. The LabComm framing is written in front of it.
+ */
+#define FIREFLY_LABCOMM_IOCTL_TRANS_SEND_ENCODED				\
+  LABCOMM_IOW('f', 4, struct firefly_packet*)
+
 #define FF_ERRMSG_MAXLEN (128)
 
 #define FIREFLY_CONNECTION_RAISE(conn, reason, msg) \
 	do { \
 		bool prop = conn->actions->connection_error ? \
 			conn->actions->connection_error(conn, reason, msg) : false; \
-		for (struct channel_list_node *n = conn->chan_list; n != NULL && prop; \
-				n = n->next) { \
-			firefly_channel_raise(n->chan, NULL, reason, msg); \
+		for (size_t i = 0; i < conn->channels.size && prop; i++) { \
+			if (conn->channels.chans[i] != NULL) \
+				firefly_channel_raise(conn->channels.chans[i], NULL, \
+						reason, msg); \
 		} \
 	} while (false); \
 
@@ -150,12 +212,54 @@ typedef void (* protocol_data_received_f)(struct firefly_connection *conn,
 					  unsigned char *data,
 					  size_t size);
 
+struct firefly_packet;
+
 /**
- * @brief A structure for representing a node in a linked list of channels.
+ * @brief A prototype for the callback used by the transport layer to
+ * pass a received packet to the protocol layer without copying it.
+ *
+ * @param conn The connection the packet is received on.
+ * @param pkt The packet received, the reference to it is handed over.
+ */
+typedef void (* protocol_packet_received_f)(struct firefly_connection *conn,
+					  struct firefly_packet *pkt);
+
+/**
+ * @brief The initial size of the arrays of a #firefly_channel_table.
+ */
+#define FIREFLY_CHANNEL_TABLE_MIN_SIZE (8)
+
+/**
+ * @brief The number of local ids released after an id before it is handed
+ * out again, so that packets still in flight to a closed channel do not reach
+ * a new one.
  */
-struct channel_list_node {
-	struct channel_list_node *next;	/**< A pointer to the next list node. */
-	struct firefly_channel *chan;	/**< A pointer the channel struct for this node. */
+#define FIREFLY_CHANNEL_ID_QUARANTINE (32)
+
+/**
+ * @brief The channels of a connection, indexed by local and remote id.
+ *
+ * Local ids are handed out from zero and the ids of removed channels are
+ * handed out again in the order they were released, once
+ * #FIREFLY_CHANNEL_ID_QUARANTINE ids were released after them. This keeps the
+ * table dense and a stale id unused for as long as possible. The remote index
+ * is an open addressing hash table with linear probing.
+ */
+struct firefly_channel_table {
+	struct firefly_channel **chans; /**< The channels indexed by local id,
+									  NULL for unused ids. */
+	size_t size; /**< The number of entries in chans. */
+	size_t nbr_chans; /**< The number of channels in the table. */
+	struct firefly_channel **remote; /**< The channels with a remote id,
+									   hashed on it. */
+	size_t remote_size; /**< The number of entries in remote, zero or a
+						  power of two. */
+	size_t nbr_remote; /**< The number of channels in remote. */
+	int *free_ids; /**< A ring of released local ids. */
+	size_t free_size; /**< The number of entries in free_ids. */
+	size_t free_head; /**< The index of the oldest id in free_ids. */
+	size_t nbr_free_ids; /**< The number of ids in free_ids. */
+	int next_id; /**< The lowest local id never handed out. */
 };
 
 /**
@@ -175,7 +279,28 @@ struct channel_list_node {
  */
 typedef void (* firefly_transport_connection_write_f)(unsigned char *data, size_t data_size,
 					struct firefly_connection *conn, bool important,
-					unsigned char *id);
+					uint32_t *id);
+
+/**
+ * @brief A prototype for the function used to write a packet buffer on the
+ * specified connection.
+ *
+ * Optional for transport layers. The transport sends the packet without
+ * copying it and, if important, keeps a reference to it until it is
+ * acknowledged, see #firefly_packet_ref().
+ *
+ * @param pkt The packet to be written.
+ * @param conn The #firefly_connection to write the packet to.
+ * @param important If true the packet must be re-sent until
+ * acknowledged.
+ * @param id If important is true the id is a return value and will
+ * contain the identifier of the packet which must be used when
+ * acknowleding the packet.
+ */
+typedef void (* firefly_transport_connection_write_packet_f)(
+					struct firefly_packet *pkt,
+					struct firefly_connection *conn, bool important,
+					uint32_t *id);
 
 /**
  * @brief Inform transport that a packet is acknowledged and should not
@@ -184,7 +309,7 @@ typedef void (* firefly_transport_connection_write_f)(unsigned char *data, size_
  * @param pkg_id The id of the packet.
  * @param conn The #firefly_connection the packet is sent on.
  */
-typedef void (* firefly_transport_connection_ack_f)(unsigned char pkg_id,
+typedef void (* firefly_transport_connection_ack_f)(uint32_t pkg_id,
 					struct firefly_connection *conn);
 
 /**
@@ -227,9 +352,14 @@ struct firefly_transport_connection {
 	firefly_transport_connection_write_f write;/**< Used when writing
 												 data, see
 												 #firefly_transport_connection_write_f. */
+	firefly_transport_connection_write_packet_f write_packet;/**< Used when
+					writing packet buffers if not NULL, see
+					#firefly_transport_connection_write_packet_f. */
 	firefly_transport_connection_ack_f ack;/**< Inform transport that a packet
 											 is acked or should not be resent
 											 anymore, see #firefly_transport_connection_ack_f. */
+	size_t mtu; /**< The largest packet the transport sends in one piece,
+				  larger samples are fragmented. 0 means #BUFFER_SIZE. */
 	void *context;/**< A context used to pass data to the functions,
 					contains the platform specific
 					transport_connection_* type.  */
@@ -246,9 +376,10 @@ struct firefly_connection {
 															  this connection.
 															  */
 	struct labcomm_decoder			*transport_decoder;		/**< The transport layer decoder for this connection. */
-	struct channel_list_node		*chan_list;			/**< The list of channels associated with this connection. */
+	struct labcomm_reader *transport_reader; /**< The reader of
+											   transport_decoder. */
+	struct firefly_channel_table		channels;			/**< The channels associated with this connection. */
 	struct firefly_event_queue		*event_queue;			/**< The queue to which spawned events are added. */
-	int 					channel_id_counter;		/**< The unique id reserved to the next opened channel on the connection. */
 	struct firefly_memory_funcs		memory_replacements; /**< A struct containing function
 														   pointers to runtime memory
 														   replacement functions. See
@@ -258,6 +389,72 @@ struct firefly_connection {
 	void					*context;			/**< A reference to an optional, user defined context.  */
 	struct firefly_connection_actions 	*actions;			/**< Callbacks to the applicaiton. */
 	struct firefly_transport_connection *transport;	/**< Transport specific connection data. */
+	unsigned int ack_delay; /**< The longest time in ms an ack is held back to
+							  be sent together with others, see
+							  #firefly_connection_set_ack_delay(). */
+	unsigned int ack_max_pending; /**< The number of samples whose acks are
+									sent together at once, 1 sends a plain
+									ack for each sample. */
+	unsigned int nbr_ack_pending; /**< The number of samples received since the
+									acks were last sent. */
+	int64_t ack_flush_id; /**< The ID of the event sending the pending acks, 0
+							if none is offered. */
+	size_t reassembly_max; /**< The memory limit for reassembling samples,
+							 see #firefly_connection_set_reassembly_max(). */
+	size_t reassembly_size; /**< The memory used for reassembling samples on
+							  the channels of the connection. */
+	bool coalesce; /**< If true packets are held back to be sent together,
+					 see #firefly_connection_set_coalescing(). */
+	unsigned int coalesce_delay; /**< The longest time in us a packet is held
+								   back. */
+	int64_t coalesce_flush_id; /**< The ID of the event sending the held back
+								 packets, 0 if none is offered. */
+	unsigned int heartbeat_interval; /**< The time in ms between checks that
+									   the other end is alive, 0 if it is
+									   not checked, see
+									   #firefly_connection_set_heartbeat().
+									   */
+	unsigned int heartbeat_max_missed; /**< The number of checks in a row
+										 without hearing from the other end
+										 before it is declared dead. */
+	unsigned int heartbeat_missed; /**< The number of checks in a row without
+									 hearing from the other end. */
+	bool heartbeat_received; /**< Set by the reader when a packet is received,
+							   cleared by each check. */
+	bool heartbeat_replied; /**< Set by the reader when a heartbeat reply is
+							  received, cleared by each check. */
+	int64_t heartbeat_id; /**< The ID of the timer of the next check, 0 if
+							none is offered. */
+};
+
+/**
+ * @brief An encoded sample waiting to be sent, in latest value mode or in
+ * fragments.
+ *
+ * The fragments of a sample refer to slices of the same buffer, which is
+ * freed when the last of them is sent. Only the event queue thread takes
+ * and releases references after the buffer is handed over to it.
+ */
+struct firefly_sample_buffer {
+	size_t refs; /**< The number of references to the buffer. */
+	size_t size; /**< The size of data. */
+	unsigned char data[]; /**< The encoded sample. */
+};
+
+/**
+ * @brief The newest unsent sample of a type of a channel in latest value
+ * mode.
+ *
+ * The list of types is only used by the thread encoding on the channel,
+ * which swaps its sample into pending and offers an event sending it if
+ * pending was empty. The event swaps it out again.
+ */
+struct firefly_channel_latest {
+	struct firefly_channel_latest *next; /**< The next type. */
+	struct firefly_channel *chan; /**< The channel of the type. */
+	int index; /**< The LabComm index of the type. */
+	struct firefly_sample_buffer *pending; /**< The sample to send, NULL if
+											 none. */
 };
 
 /**
@@ -268,7 +465,68 @@ struct firefly_channel_important_queue {
 													element in the queue. */
 	firefly_event_execute_f event; /**< The event responsible for sending the
 									 important packet. */
-	void *event_arg; /**< The argument to the event. */
+	void *event_arg; /**< The argument to the event, if not copied. */
+	bool sample; /**< If the packet is a data sample, which may be sent
+				   while others are unacknowledged. */
+	size_t event_arg_size; /**< The size of the copied argument, 0 if
+							 event_arg is used. */
+	firefly_event_destroy_f destroy; /**< Releases the copied argument if
+									   the packet is never sent, may be
+									   NULL. */
+	union firefly_event_arg event_arg_copy; /**< The copied argument. */
+};
+
+/**
+ * @brief An important data sample that is sent but not acknowledged and
+ * is not the last one sent.
+ */
+struct firefly_channel_unacked {
+	int seqno; /**< The sequence number of the sample. */
+	uint32_t important_id; /**< The identifier used to reference the packet
+							 to the transport layer. */
+};
+
+/**
+ * @brief An important data sample or fragment received before the ones
+ * preceding it.
+ */
+struct firefly_channel_reorder {
+	struct firefly_channel_reorder *next; /**< The buffered sample with the
+											next larger sequence number. */
+	int seqno; /**< The sequence number of the sample. */
+	unsigned char *data; /**< The encoded sample, in pkt or allocated with
+						   #FIREFLY_RUNTIME_MALLOC(). */
+	struct firefly_packet *pkt; /**< The received packet data is a slice of,
+								  NULL if data is a copy. */
+	size_t size; /**< The size of data. */
+	int sample_id; /**< The sample the fragment is part of. */
+	int offset; /**< The offset of the fragment in its sample. */
+	int total_size; /**< The size of the whole sample, 0 if data is not a
+					  fragment. */
+};
+
+/**
+ * @brief A sample held until the other end grants credit for it.
+ */
+struct firefly_channel_held {
+	struct firefly_channel_held *next; /**< The sample encoded after. */
+	uint32_t credit_seqno; /**< The number of the sample counted against
+							 the credit. */
+	firefly_event_execute_f event; /**< The event sending the sample. */
+	firefly_event_destroy_f destroy; /**< Releases the argument if the
+									   sample is never sent. */
+	union firefly_event_arg event_arg; /**< The copied argument. */
+};
+
+/**
+ * @brief A fragmented sample being reassembled.
+ */
+struct firefly_channel_reassembly {
+	int sample_id; /**< The sample being reassembled. */
+	int seqno; /**< The sequence number of its first fragment. */
+	unsigned char *data; /**< The sample, NULL if none is reassembled. */
+	size_t size; /**< The size of the sample. */
+	size_t received; /**< The number of bytes received. */
 };
 
 /**
@@ -294,13 +552,75 @@ struct firefly_channel {
 	struct firefly_channel_important_queue *important_queue; /**< The
 	queue used to queue important packets when sending another. */
 
-	unsigned char important_id; /**< The identifier used to reference the packet
+	uint32_t important_id; /**< The identifier used to reference the packet
 								  to the transport layer. If 0 no packet is
 								  resent. */
+	bool important_sample; /**< If important_id is a data sample, which
+							 more samples may be sent after. */
 	int current_seqno; /**< The sequence number of the currently or last
 						 important packet. */
+	size_t window; /**< The largest number of important data samples sent
+					 but not acknowledged, see #firefly_channel_set_window(). */
+	struct firefly_channel_unacked *unacked; /**< The samples sent before the
+											   one of important_id and not
+											   yet acknowledged, room for
+											   window - 1. */
+	size_t nbr_unacked; /**< The number of samples in unacked. */
 	int remote_seqno; /**< The sequence number of the last received important
 						packet. */
+	struct firefly_channel_reorder *reorder; /**< The important samples
+											   received after remote_seqno + 1,
+											   in order. */
+	bool ack_pending; /**< If received important samples are not yet acked,
+						see #firefly_connection_set_ack_delay(). */
+	bool latest; /**< If samples are sent in latest value mode, see
+				   #firefly_channel_set_latest(). */
+	bool direct; /**< If samples may be sent by the thread encoding them,
+				   see #firefly_channel_set_direct(). */
+	size_t nbr_queued; /**< The number of samples encoded on the channel
+						 that the event queue thread has not yet sent or
+						 dropped. */
+	struct firefly_channel_latest *latest_types; /**< The types sent in
+												   latest value mode. */
+	int sample_seqno; /**< The sequence number of the last sample sent in
+						latest value mode. */
+	int remote_sample_seqno; /**< The sequence number of the last delivered
+							   sample sent in latest value mode. */
+	struct firefly_channel_stats stats; /**< The counters of samples not
+										  delivered. */
+	int fragment_id; /**< The ID of the last sample sent in fragments. */
+	struct firefly_channel_reassembly reassembly[2]; /**< The samples
+													   being reassembled,
+													   indexed by if they
+													   are important. */
+	enum firefly_credit_mode credit_mode; /**< What is done with samples
+											encoded without credit, see
+											#firefly_channel_set_credit_mode(). */
+	bool credit_limited; /**< If the other end limits the samples sent to
+						   credit_limit. */
+	uint32_t credit_limit; /**< The number of counted samples the other end
+							 allows to be sent. */
+	uint32_t credit_sent; /**< The number of samples counted against the
+							credit, by the thread encoding on the channel. */
+	uint32_t credit_released; /**< The number of the last counted sample
+								sent. */
+	struct firefly_channel_held *credit_held; /**< The samples held until
+												credit is granted, in
+												order. */
+	struct firefly_channel_held *credit_held_last; /**< The last sample in
+													 credit_held, NULL if
+													 none. */
+	size_t nbr_credit_held; /**< The number of samples in credit_held,
+							  read by the thread encoding on the
+							  channel. */
+	bool credit_probe_pending; /**< If the channel probes for credit. */
+	int64_t credit_probe_id; /**< The ID of the timer event probing, 0 if
+							   none is offered. */
+	unsigned int credits; /**< The credit granted to the other end, 0 if
+							not limited, see #firefly_channel_set_credits(). */
+	uint32_t credit_consumed; /**< The number of counted samples from the
+								other end delivered or dropped. */
+	uint32_t credit_granted; /**< The limit last granted to the other end. */
 	struct labcomm_encoder *proto_encoder; /**< LabComm encoder for this
 					   			channel.*/
 	struct labcomm_decoder *proto_decoder; /**< LabComm decoder for this
@@ -364,6 +684,35 @@ struct labcomm_reader *protocol_labcomm_reader_new(
 struct labcomm_reader *transport_labcomm_reader_new(
 		struct firefly_connection *conn, struct labcomm_memory *mem);
 
+/**
+ * @brief Find a byte array just decoded by a transport reader in the packet
+ * it was decoded from, to refer to it instead of copying it.
+ *
+ * Must be called by the handler of the sample the array is a field of. The
+ * array is looked for \p trailer bytes before the end of the sample and must
+ * equal the decoded copy in full.
+ *
+ * @param r The transport reader.
+ * @param decoded The decoded copy of the array.
+ * @param size The size of the array.
+ * @param trailer The number of encoded bytes of the sample after the array.
+ * @param pkt Set to a new reference to the packet if it is found.
+ * @return The array in the packet.
+ * @retval NULL if the sample was not received in a packet, or not in one
+ * piece, the copy must be used.
+ */
+unsigned char *transport_labcomm_reader_ref(struct labcomm_reader *r,
+		const unsigned char *decoded, size_t size, size_t trailer,
+		struct firefly_packet **pkt);
+
+/**
+ * @brief The encoded size of a LabComm packed32, the length of an array.
+ *
+ * @param v The value to encode.
+ * @return The number of bytes v is encoded in.
+ */
+size_t firefly_labcomm_packed32_size(uint32_t v);
+
 /**
  * @brief Frees the provided labcomm_reader (protocol layer).
  *
@@ -459,6 +808,29 @@ int firefly_connection_free_event(void *event_arg);
 void protocol_data_received(struct firefly_connection *conn,
 							unsigned char *data, size_t size);
 
+/**
+ * @brief The function called by the transport layer upon a received packet.
+ *
+ * The samples received are decoded straight out of the packet, which is
+ * released when the last of them is delivered.
+ *
+ * @param conn The connection the packet is associated with.
+ * @param pkt The received packet, the reference to it is handed over.
+ */
+void protocol_packet_received(struct firefly_connection *conn,
+		struct firefly_packet *pkt);
+
+/**
+ * @brief Release the data of a received sample or fragment.
+ *
+ * @param conn The connection the data was received on.
+ * @param data The data, allocated with #FIREFLY_RUNTIME_MALLOC() if pkt is
+ * NULL.
+ * @param pkt The packet data is a slice of, or NULL.
+ */
+void firefly_received_release(struct firefly_connection *conn,
+		unsigned char *data, struct firefly_packet *pkt);
+
 /**
  * @brief Create a new channel with some defaults.
  *
@@ -653,6 +1025,9 @@ struct firefly_event_recv_sample {
 	struct firefly_connection *conn; /**< The connection to send the sample
 						on. */
 	firefly_protocol_data_sample data; /**< The sample to send. */
+	struct firefly_packet *pkt; /**< The received packet the application
+								  data is a slice of, NULL if it is a
+								  copy. */
 };
 
 /**
@@ -665,12 +1040,100 @@ struct firefly_event_recv_sample {
  */
 int handle_data_sample_event(void *event_arg);
 
+/**
+ * @brief The callback registered with LabComm used to receive data fragment.
+ *
+ * Like #handle_data_sample, the event reassembles the sample and decodes it
+ * once all fragments are received.
+ *
+ * @param data The decoded data fragment.
+ * @param context The connection associated with the received data.
+ */
+void handle_data_fragment(firefly_protocol_data_fragment *data,
+		void *context);
+
+/**
+ * @brief The event argument of handle_data_fragment_event.
+ */
+struct firefly_event_recv_fragment {
+	struct firefly_connection *conn; /**< The connection the fragment was
+						received on. */
+	firefly_protocol_data_fragment data; /**< The received fragment. */
+	struct firefly_packet *pkt; /**< The received packet the fragment data
+								  is a slice of, NULL if it is a copy. */
+};
+
+/**
+ * @brief The event that parses a firefly_protocol_data_fragment.
+ *
+ * @param event_arg A firefly_event_recv_fragment.
+ * @return Integer idicating the resutlt of the event.
+ * @see #handle_data_fragment
+ */
+int handle_data_fragment_event(void *event_arg);
+
+/**
+ * @brief The callback registered with LabComm used to receive heartbeats.
+ * A reply is noted for the next check of the connection, a request is
+ * answered by #handle_heartbeat_event.
+ *
+ * @param hb The decoded heartbeat.
+ * @param context The connection associated with the received data.
+ */
+void handle_heartbeat(firefly_protocol_heartbeat *hb, void *context);
+
+/**
+ * @brief The event that answers a heartbeat request.
+ *
+ * @param event_arg The connection the request was received on.
+ * @return Integer idicating the resutlt of the event.
+ * @see #handle_heartbeat
+ */
+int handle_heartbeat_event(void *event_arg);
+
+/**
+ * @brief The callback registered with LabComm used to receive credit
+ * granted to a channel or probes for it.
+ *
+ * @param credit The decoded credit packet.
+ * @param context The connection associated with the received data.
+ */
+void handle_channel_credit(firefly_protocol_channel_credit *credit,
+		void *context);
+
+/**
+ * @brief The event argument of handle_channel_credit_event.
+ */
+struct firefly_event_recv_credit {
+	struct firefly_connection *conn; /**< The connection the packet was
+									   received on. */
+	firefly_protocol_channel_credit credit; /**< The received packet. */
+};
+
+/**
+ * @brief The event that parses a firefly_protocol_channel_credit.
+ *
+ * @param event_arg A firefly_event_recv_credit.
+ * @return Integer idicating the resutlt of the event.
+ * @see #handle_channel_credit
+ */
+int handle_channel_credit_event(void *event_arg);
+
 /**
  *
  */
 //TODO comments
 void handle_ack(firefly_protocol_ack *ack, void *context);
 
+/**
+ * @brief Acks the important samples covered by a cumulative ack. Called by
+ * the reader of the connection like #handle_ack.
+ *
+ * @param ack The decoded cumulative ack.
+ * @param context The connection the ack was received on.
+ */
+void handle_ack_ranges(firefly_protocol_ack_ranges *ack, void *context);
+
 struct firefly_event_channel_restrict_request {
 	struct firefly_connection *conn; /**< The connection the request was
 						received on. */
@@ -701,7 +1164,12 @@ int channel_restrict_ack_event(void *context);
 struct firefly_event_send_sample {
 	struct firefly_channel *chan; /**< The channel to send the sample on. */
 	firefly_protocol_data_sample data; /**< The sample to send. */
-	unsigned char *important_id;
+	struct firefly_packet *pkt; /**< The packet the application data is
+								  encoded in, after
+								  #FIREFLY_DATA_SAMPLE_HEADROOM bytes. */
+	uint32_t *important_id;
+	uint32_t credit_seqno; /**< The number of the sample counted against the
+							 credit of the channel, 0 if not counted. */
 };
 
 /**
@@ -713,6 +1181,99 @@ struct firefly_event_send_sample {
  */
 int send_data_sample_event(void *event_arg);
 
+/**
+ * @brief Encodes and sends the newest unsent sample of a type of a channel in
+ * latest value mode.
+ *
+ * @param event_arg The firefly_channel_latest of the type.
+ * @return Integer idicating the resutlt of the event.
+ */
+int send_latest_sample_event(void *event_arg);
+
+/**
+ * @brief The event argument of send_fragments_event and
+ * send_fragment_event.
+ */
+struct firefly_event_send_fragment {
+	struct firefly_channel *chan; /**< The channel to send on. */
+	struct firefly_sample_buffer *buf; /**< The sample, one reference is
+										 held by the event. */
+	int sample_id; /**< The ID of the sample. */
+	size_t offset; /**< The offset of the fragment in the sample. */
+	size_t size; /**< The size of the fragment. */
+	int seqno; /**< The sequence number of a sample in latest value mode,
+				 0 otherwise. */
+	bool important; /**< If the sample is important. */
+	uint32_t credit_seqno; /**< The number of the sample counted against the
+							 credit of the channel, 0 if not counted. */
+};
+
+/**
+ * @brief Split a sample too large for one packet into fragments and send
+ * them.
+ *
+ * @param event_arg A firefly_event_send_fragment with the whole sample.
+ * @return Integer idicating the resutlt of the event.
+ */
+int send_fragments_event(void *event_arg);
+
+/**
+ * @brief Encodes and sends one fragment of a sample. An important fragment
+ * is queued like an important sample if the window of the channel is full.
+ *
+ * @param event_arg A firefly_event_send_fragment.
+ * @return Integer idicating the resutlt of the event.
+ */
+int send_fragment_event(void *event_arg);
+
+/**
+ * @brief Releases the sample of a firefly_event_send_fragment that is never
+ * sent.
+ *
+ * @param event_arg A firefly_event_send_fragment.
+ */
+void send_fragment_destroy(void *event_arg);
+
+/**
+ * @brief Release a reference to a sample buffer, freeing it with the last
+ * one.
+ *
+ * @param conn The connection the buffer was allocated for.
+ * @param buf The buffer.
+ */
+void firefly_sample_buffer_release(struct firefly_connection *conn,
+		struct firefly_sample_buffer *buf);
+
+/**
+ * @brief The size of the packets sent on a connection, the MTU of its
+ * transport.
+ *
+ * @param conn The connection.
+ * @return The largest packet in bytes.
+ */
+size_t firefly_connection_packet_size(struct firefly_connection *conn);
+
+/**
+ * @brief Offer an event sending the packets held back to be coalesced on a
+ * connection, unless one is already offered.
+ *
+ * @param conn The connection.
+ * @return Integer indicating the result.
+ * @retval 0 if the event is offered.
+ * @retval <0 if it could not be offered, the packets must be sent at once.
+ */
+int firefly_connection_coalesce(struct firefly_connection *conn);
+
+/**
+ * @brief Send a heartbeat on the connection.
+ *
+ * @param conn The connection.
+ * @param reply If true the heartbeat answers a request, if false the other
+ * end is asked to answer it.
+ */
+void firefly_connection_send_heartbeat(struct firefly_connection *conn,
+		bool reply);
+
 /**
  * @brief Find and return the channel associated with the given connection with
  * the given remote channel id.
@@ -742,22 +1303,45 @@ void add_channel_to_connection(struct firefly_channel *chan,
 		struct firefly_connection *conn);
 
 /**
- * @brief Remove the channel from the connection.
+ * @brief Remove the channel from the connection and release its local ID to
+ * be handed out again.
  *
  * @param chan The channel to remove.
  * @param conn The connection to remove the channel from.
+ * @return The removed channel.
+ * @retval NULL if the channel was not in the connection.
  */
 struct firefly_channel *remove_channel_from_connection(struct firefly_channel *chan,
 		struct firefly_connection *conn);
 
+/**
+ * @brief Set the remote ID of a channel, keeping the remote index of its
+ * connection up to date if the channel is added to it.
+ *
+ * @param chan The channel to set the remote ID of.
+ * @param id The remote ID.
+ */
+void set_channel_remote_id(struct firefly_channel *chan, int id);
+
 /**
  * @brief Generates new uniqe channel ID for the supplied firefly_connection.
  *
+ * The ID of a removed channel is reused before a new one is generated, once
+ * #FIREFLY_CHANNEL_ID_QUARANTINE other IDs were released after it.
+ *
  * @param conn The connection the new channel ID is generated for.
  * @return The new uniqe channel ID.
  */
 int next_channel_id(struct firefly_connection *conn);
 
+/**
+ * @brief Free the memory of the channel table of the connection. The
+ * channels must be removed first.
+ *
+ * @param conn The connection with the channel table.
+ */
+void firefly_channel_table_free(struct firefly_connection *conn);
+
 /**
  * @brief Raise the specified error on the specified connection from the event
  * queue of the connection. Should only be called from outside events.
@@ -767,6 +1351,67 @@ int next_channel_id(struct firefly_connection *conn);
 void firefly_connection_raise_later(struct firefly_connection *conn,
 		enum firefly_error reason, const char *msg);
 
+/**
+ * @brief Offer an event operating on the specified connection to the event
+ * queue of the connection. The event is keyed to the connection and will not
+ * be executed at the same time as any other event of the connection.
+ *
+ * @param conn The connection the event operates on.
+ * @param prio The priority of the event.
+ * @param execute The function executed by the event.
+ * @param arg The argument passed to \p execute.
+ * @param nbr_deps The number of events the event depends on.
+ * @param deps The IDs of the events the event depends on.
+ * @return The ID of the new event.
+ * @retval <0 on error.
+ * @see #firefly_event_offer_keyed
+ */
+int64_t firefly_connection_offer_event(struct firefly_connection *conn,
+		unsigned char prio, firefly_event_execute_f execute, void *arg,
+		unsigned int nbr_deps, const int64_t *deps);
+
+/**
+ * @brief Same as firefly_connection_offer_event() but copies the argument into
+ * the event, saving an allocation. The event must not free its argument.
+ *
+ * @param conn The connection the event operates on.
+ * @param prio The priority of the event.
+ * @param execute The function executed by the event.
+ * @param arg The argument to copy, a copy is passed to \p execute.
+ * @param arg_size The size of the argument, at most #FIREFLY_EVENT_ARG_SIZE.
+ * @param nbr_deps The number of events the event depends on.
+ * @param deps The IDs of the events the event depends on.
+ * @return The ID of the new event.
+ * @retval <0 on error.
+ */
+int64_t firefly_connection_offer_event_copy(struct firefly_connection *conn,
+		unsigned char prio, firefly_event_execute_f execute, const void *arg,
+		size_t arg_size, unsigned int nbr_deps, const int64_t *deps);
+
+/**
+ * @brief Same as firefly_connection_offer_event_copy() but also records an
+ * owner and a destructor for the event. If the event is cancelled or purged
+ * before it is executed \p destroy is called with its argument instead.
+ *
+ * @param conn The connection the event operates on.
+ * @param owner The owner of the event, e.g. a channel of \p conn, or NULL.
+ * @param prio The priority of the event.
+ * @param execute The function executed by the event.
+ * @param arg The argument, copied if \p arg_size is non zero.
+ * @param arg_size The size of the argument, at most #FIREFLY_EVENT_ARG_SIZE.
+ * @param destroy Releases the argument of a dropped event, may be NULL.
+ * @param nbr_deps The number of events the event depends on.
+ * @param deps The IDs of the events the event depends on.
+ * @return The ID of the new event.
+ * @retval <0 on error.
+ * @see #firefly_event_offer_owned
+ */
+int64_t firefly_connection_offer_event_owned(struct firefly_connection *conn,
+		const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, const void *arg, size_t arg_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_deps,
+		const int64_t *deps);
+
 /**
  * @brief Call channel_error callback on the given connection with the given
  * channel.
@@ -785,11 +1430,22 @@ void firefly_channel_raise(
  * @brief Gets and updates the sequence number used to identify important
  * packets.
  *
+ * The unacknowledged sample sent last, if any, is moved to the unacked
+ * samples of the channel to make room for the next one in important_id.
+ *
  * @param chan The concerned channel.
  * @return The next sequence number.
  */
 int firefly_channel_next_seqno(struct firefly_channel *chan);
 
+/**
+ * @brief Get the next sequence number of a sample sent in latest value mode.
+ *
+ * @param chan The channel the sample is sent on.
+ * @return The sequence number.
+ */
+int firefly_channel_next_sample_seqno(struct firefly_channel *chan);
+
 /**
  * @brief The event couterpart to the user accessible function.
  * @param earg The channel.
@@ -811,19 +1467,138 @@ int firefly_channel_unrestrict_event(void *earg);
 void firefly_channel_ack(struct firefly_channel *chan);
 
 /**
- * @brief Enqueues an important packet if there is already another important
- * packet on the channel.
+ * @brief Internal function which will ack to the transport layer the
+ * important data sample with the provided sequence number, if it is not
+ * acked already.
+ *
+ * @param chan The channel the sample was sent on.
+ * @param seqno The sequence number of the sample.
+ */
+void firefly_channel_ack_seqno(struct firefly_channel *chan, int seqno);
+
+/**
+ * @brief Internal function which will ack to the transport layer the
+ * important data samples covered by a cumulative ack.
+ *
+ * @param chan The channel the samples were sent on.
+ * @param cumulative The sequence number up to which all samples are
+ * received, 0 if none are.
+ * @param ranges The ranges of samples received after \p cumulative.
+ * @param nbr_ranges The number of ranges.
+ */
+void firefly_channel_ack_ranges(struct firefly_channel *chan, int cumulative,
+		const firefly_protocol_ack_range *ranges, size_t nbr_ranges);
+
+/**
+ * @brief Get the ranges of the important samples received ahead of the next
+ * one in turn, which are acked together with the last in turn.
+ *
+ * @param chan The channel the samples were received on.
+ * @param ranges Filled with the ranges, room for
+ * #FIREFLY_CHANNEL_WINDOW_MAX.
+ * @return The number of ranges.
+ */
+size_t firefly_channel_received_ranges(struct firefly_channel *chan,
+		firefly_protocol_ack_range *ranges);
+
+/**
+ * @brief The distance from sequence number \p b to \p a, sequence numbers
+ * wrap from INT_MAX to 1.
+ *
+ * @param a The sequence number to measure to.
+ * @param b The sequence number to measure from.
+ * @return The number of sequence numbers \p a is after \p b, negative if
+ * it is before.
+ */
+int firefly_seqno_diff(int a, int b);
+
+/**
+ * @brief Enqueues an important packet if it may not be sent until other
+ * important packets on the channel are acknowledged.
+ *
+ * A data sample may be sent while fewer than the window of the channel are
+ * unacknowledged, other important packets only when none are.
  *
  * @param chan The channel to queue the packet on.
+ * @param sample If the packet is a data sample.
  * @param event An event which will send the packet.
  * @param event_arg The argument to the event.
+ * @param event_arg_size If non-zero the argument is copied, as is needed for
+ * arguments copied into the currently executing event.
+ * @param destroy Releases a copied argument if the packet is dropped with
+ * the channel, may be NULL.
  * @return bool Indicating whether or not the packet needed to be queued or if
  * it could be sent right away.
  * @retval true if the packet was queued and may not be sent now.
  * @retval false if the packet was not queued and may be sent right away.
  */
 bool firefly_channel_enqueue_important(struct firefly_channel *chan,
-		firefly_event_execute_f event, void *event_arg);
+		bool sample, firefly_event_execute_f event, void *event_arg,
+		size_t event_arg_size, firefly_event_destroy_f destroy);
+
+/**
+ * @brief The distance from credit number \p b to \p a, credit numbers wrap
+ * around.
+ *
+ * @param a The number to measure to.
+ * @param b The number to measure from.
+ * @return The number of samples \p a is after \p b, negative if it is
+ * before.
+ */
+int firefly_credit_diff(uint32_t a, uint32_t b);
+
+/**
+ * @brief Count a sample that is not important against the credit of the
+ * channel, from the thread encoding on the channel.
+ *
+ * @param chan The channel the sample is encoded on.
+ * @param credit_seqno Set to the number of the sample.
+ * @return Integer indicating the result.
+ * @retval 0 if the sample may be sent.
+ * @retval >0 if the sample is dropped for lack of credit.
+ * @retval -EAGAIN if the sample is refused for lack of credit, also in
+ * #FIREFLY_CREDIT_BLOCK mode once #FIREFLY_CHANNEL_CREDIT_HELD_MAX samples
+ * are held.
+ */
+int firefly_channel_credit_take(struct firefly_channel *chan,
+		uint32_t *credit_seqno);
+
+/**
+ * @brief Hold a counted sample if the other end has not granted credit
+ * for it yet, it is sent by the event once credit is granted.
+ *
+ * @param chan The channel to send the sample on.
+ * @param credit_seqno The number of the sample.
+ * @param event The event sending the sample.
+ * @param event_arg The argument of the event, copied if the sample is held.
+ * @param event_arg_size The size of the argument.
+ * @param destroy Releases the copied argument if the sample is dropped
+ * with the channel, may be NULL.
+ * @return If the sample is held.
+ * @retval true if the sample is held and may not be sent now.
+ * @retval false if the sample may be sent right away.
+ */
+bool firefly_channel_credit_hold(struct firefly_channel *chan,
+		uint32_t credit_seqno, firefly_event_execute_f event,
+		void *event_arg, size_t event_arg_size,
+		firefly_event_destroy_f destroy);
+
+/**
+ * @brief Count a sample from the other end as delivered or dropped, and
+ * grant more credit if the credit granted is half used.
+ *
+ * @param chan The channel the sample was received on.
+ */
+void firefly_channel_credit_consumed(struct firefly_channel *chan);
+
+/**
+ * @brief Handle credit granted by the other end, or a probe for credit.
+ *
+ * @param chan The channel the packet was received on.
+ * @param credit The packet.
+ */
+void firefly_channel_credit_received(struct firefly_channel *chan,
+		firefly_protocol_channel_credit *credit);
 
 struct labcomm_memory *firefly_labcomm_memory_new(
 		struct firefly_connection *conn);
@@ -0,0 +1,321 @@
+/**
+ * @file
+ * @brief Benchmark the event queue, the scheduler alone and the posix queue
+ * with its workers.
+ *
+ * Usage: bench_event_queue [max_producers [nbr_events [nbr_workers [wait]]]]
+ *
+ * Every scenario is run on a growing and on a strict pool. The scheduler
+ * alone is driven by one thread offering batches of events and then executing
+ * them. The posix queue is run with 1 to max_producers threads offering
+ * events, each keyed to its producer like the events of a connection.
+ * Offers to a full strict pool are retried.
+ *
+ * Prints a header and one line of comma separated values per run: the
+ * throughput and the percentiles of the time from offering an event to
+ * executing it.
+ */
+
+#define _POSIX_C_SOURCE (200112L)
+#include <pthread.h>
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <utils/firefly_errors.h>
+#include <utils/firefly_event_queue.h>
+#include <utils/firefly_event_queue_posix.h>
+
+#define BENCH_MAX_PRODUCERS (4)
+#define BENCH_NBR_EVENTS (200000)
+#define BENCH_NBR_WORKERS (2)
+
+/**
+ * @brief The number of events offered before executing them when
+ * benchmarking the scheduler alone, also the size of strict pools there.
+ */
+#define BENCH_BATCH (256)
+
+/**
+ * @brief The initial size of growing pools.
+ */
+#define BENCH_POOL (64)
+
+/**
+ * @brief The size of strict pools of posix queues.
+ */
+#define BENCH_STRICT_POOL (1024)
+
+/**
+ * @brief The number of events in a dependency chain.
+ */
+#define BENCH_CHAIN (8)
+
+struct bench_scenario {
+	const char *name;
+	bool prio_mix; /**< Offer events of several priorities. */
+	bool chain; /**< Make each event depend on the one before it. */
+};
+
+static const struct bench_scenario scenarios[] = {
+	{"fifo", false, false},
+	{"prio_mix", true, false},
+	{"dep_chain", true, true},
+};
+
+struct bench_arg {
+	uint64_t offered; /**< When the event was offered, in ns. */
+};
+
+struct bench_producer {
+	pthread_t thread;
+	struct firefly_event_queue *eq;
+	const struct bench_scenario *scenario;
+	size_t nbr_events;
+};
+
+static uint64_t *latencies;
+static size_t nbr_executed;
+static size_t nbr_full;
+
+/*
+ * Pool exhaustion is expected with strict pools, count it instead of
+ * printing it.
+ */
+void firefly_error(enum firefly_error error_id, size_t nbr_va_args, ...)
+{
+	va_list args;
+
+	if (error_id == FIREFLY_ERROR_ALLOC) {
+		__atomic_add_fetch(&nbr_full, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	fprintf(stderr, "error %d", error_id);
+	va_start(args, nbr_va_args);
+	if (nbr_va_args > 0)
+		vfprintf(stderr, va_arg(args, const char *), args);
+	va_end(args);
+	fprintf(stderr, "\n");
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static unsigned char bench_prio(const struct bench_scenario *sc, size_t i)
+{
+	static const unsigned char prios[] = {
+		FIREFLY_PRIORITY_LOW, FIREFLY_PRIORITY_MEDIUM, FIREFLY_PRIORITY_LOW,
+		FIREFLY_PRIORITY_HIGH, FIREFLY_PRIORITY_MEDIUM
+	};
+
+	return sc->prio_mix ? prios[i % (sizeof(prios) / sizeof(prios[0]))] :
+		FIREFLY_PRIORITY_MEDIUM;
+}
+
+static int bench_event(void *event_arg)
+{
+	struct bench_arg *arg = event_arg;
+	uint64_t now = bench_now();
+	size_t i = __atomic_fetch_add(&nbr_executed, 1, __ATOMIC_RELAXED);
+
+	latencies[i] = now - arg->offered;
+	return 0;
+}
+
+/*
+ * Offer the i:th event of a scenario, chained to the event with ID prev.
+ */
+static int64_t bench_offer(struct firefly_event_queue *eq, const void *key,
+		const struct bench_scenario *sc, size_t i, int64_t prev)
+{
+	struct bench_arg arg;
+	bool dep = sc->chain && i % BENCH_CHAIN != 0;
+
+	arg.offered = bench_now();
+	return firefly_event_offer_keyed(eq, key, bench_prio(sc, i), bench_event,
+			&arg, sizeof(arg), dep ? 1 : 0, dep ? &prev : NULL);
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(const char *queue, const struct bench_scenario *sc,
+		bool strict, size_t nbr_producers, size_t nbr_workers,
+		uint64_t elapsed)
+{
+	size_t n = nbr_executed;
+	double seconds = elapsed / 1e9;
+
+	qsort(latencies, n, sizeof(*latencies), bench_cmp);
+	printf("%s,%s,%s,%zu,%zu,%zu,%.6f,%.0f,%llu,%llu,%llu,%zu\n",
+			queue, sc->name, strict ? "strict" : "growing",
+			nbr_producers, nbr_workers, n, seconds, n / seconds,
+			(unsigned long long) latencies[n / 2],
+			(unsigned long long) latencies[n * 99 / 100],
+			(unsigned long long) latencies[n * 999 / 1000], nbr_full);
+	fflush(stdout);
+}
+
+static void bench_reset(void)
+{
+	nbr_executed = 0;
+	nbr_full = 0;
+}
+
+static int bench_core(const struct bench_scenario *sc, bool strict,
+		size_t nbr_events)
+{
+	struct firefly_event_queue *eq;
+	struct firefly_event *ev;
+	int64_t prev = 0;
+	uint64_t start;
+	size_t i = 0;
+
+	eq = firefly_event_queue_new(firefly_event_add,
+			strict ? BENCH_BATCH : BENCH_POOL, NULL);
+	if (eq == NULL)
+		return -1;
+	firefly_event_queue_set_strict_pool_size(eq, strict);
+	bench_reset();
+	start = bench_now();
+	while (i < nbr_events) {
+		for (size_t b = 0; b < BENCH_BATCH && i < nbr_events; b++, i++) {
+			prev = bench_offer(eq, NULL, sc, i, prev);
+			if (prev < 0) {
+				firefly_event_queue_free(&eq);
+				return -1;
+			}
+		}
+		while ((ev = firefly_event_pop(eq)) != NULL) {
+			firefly_event_execute(ev);
+			firefly_event_return(eq, &ev);
+		}
+	}
+	bench_report("core", sc, strict, 1, 1, bench_now() - start);
+	firefly_event_queue_free(&eq);
+	return 0;
+}
+
+static void *bench_produce(void *arg)
+{
+	struct bench_producer *p = arg;
+	int64_t prev = 0;
+	int64_t id;
+
+	for (size_t i = 0; i < p->nbr_events; i++) {
+		while ((id = bench_offer(p->eq, p, p->scenario, i, prev)) < 0)
+			sched_yield();
+		prev = id;
+	}
+	return NULL;
+}
+
+static int bench_posix(const struct bench_scenario *sc, bool strict,
+		size_t nbr_events, size_t nbr_producers, size_t nbr_workers,
+		enum firefly_event_queue_posix_wait_strategy wait)
+{
+	struct firefly_event_queue *eq;
+	struct bench_producer producers[nbr_producers];
+	struct timespec pause = {0, 100000};
+	uint64_t start;
+	uint64_t elapsed;
+	size_t total;
+
+	eq = firefly_event_queue_posix_new_pool(
+			strict ? BENCH_STRICT_POOL : BENCH_POOL, nbr_workers);
+	if (eq == NULL)
+		return -1;
+	firefly_event_queue_set_strict_pool_size(eq, strict);
+	firefly_event_queue_posix_set_wait_strategy(eq, wait, 50);
+	if (firefly_event_queue_posix_run(eq, NULL) != 0) {
+		firefly_event_queue_posix_free(&eq);
+		return -1;
+	}
+	bench_reset();
+	total = 0;
+	start = bench_now();
+	for (size_t i = 0; i < nbr_producers; i++) {
+		producers[i].eq = eq;
+		producers[i].scenario = sc;
+		producers[i].nbr_events = nbr_events / nbr_producers;
+		total += producers[i].nbr_events;
+		pthread_create(&producers[i].thread, NULL, bench_produce,
+				&producers[i]);
+	}
+	for (size_t i = 0; i < nbr_producers; i++)
+		pthread_join(producers[i].thread, NULL);
+	while (__atomic_load_n(&nbr_executed, __ATOMIC_RELAXED) < total)
+		nanosleep(&pause, NULL);
+	elapsed = bench_now() - start;
+	// Joins the workers, their latencies are visible after.
+	firefly_event_queue_posix_free(&eq);
+	bench_report("posix", sc, strict, nbr_producers, nbr_workers, elapsed);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_producers = BENCH_MAX_PRODUCERS;
+	size_t nbr_events = BENCH_NBR_EVENTS;
+	size_t nbr_workers = BENCH_NBR_WORKERS;
+	enum firefly_event_queue_posix_wait_strategy wait =
+		FIREFLY_EVENT_QUEUE_POSIX_BLOCK;
+	size_t nbr_scenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+	bool usage = false;
+	int res = 0;
+
+	if (argc > 1)
+		max_producers = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		nbr_events = strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		nbr_workers = strtoul(argv[3], NULL, 10);
+	if (argc > 4) {
+		if (strcmp(argv[4], "spin") == 0)
+			wait = FIREFLY_EVENT_QUEUE_POSIX_SPIN;
+		else if (strcmp(argv[4], "poll") == 0)
+			wait = FIREFLY_EVENT_QUEUE_POSIX_POLL;
+		else if (strcmp(argv[4], "block") != 0)
+			usage = true;
+	}
+	if (usage || max_producers < 1 || nbr_events < max_producers ||
+			nbr_workers < 1) {
+		fprintf(stderr, "Usage: %s [max_producers [nbr_events "
+				"[nbr_workers [block|spin|poll]]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	latencies = malloc(nbr_events * sizeof(*latencies));
+	if (latencies == NULL)
+		return EXIT_FAILURE;
+
+	printf("queue,scenario,pool,producers,workers,events,seconds,"
+			"events_per_s,p50_ns,p99_ns,p999_ns,pool_full\n");
+	for (size_t s = 0; s < nbr_scenarios && res == 0; s++) {
+		for (int strict = 0; strict <= 1 && res == 0; strict++) {
+			res = bench_core(&scenarios[s], strict, nbr_events);
+			for (size_t p = 1; p <= max_producers && res == 0; p++) {
+				res = bench_posix(&scenarios[s], strict, nbr_events, p,
+						nbr_workers, wait);
+			}
+		}
+	}
+	free(latencies);
+	if (res != 0)
+		fprintf(stderr, "Could not run the benchmark.\n");
+	return res == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -47,6 +47,9 @@ int main(int argc, char **argv)
 	sample.dest_chan_id = 1;
 	sample.app_enc_data.n_0 = 0;
 	sample.app_enc_data.a = NULL;
+	sample.ack_cumulative = 0;
+	sample.ack_ranges.n_0 = 0;
+	sample.ack_ranges.a = NULL;
 	create_lc_files_name(
 			labcomm_encoder_register_firefly_protocol_data_sample,
 			(lc_encode_f) labcomm_encode_firefly_protocol_data_sample,
@@ -23,12 +23,19 @@ struct labcomm_decoder *test_dec = NULL;
 struct labcomm_encoder *test_enc;
 
 unsigned char data_sample_data[DATA_SAMPLE_DATA_SIZE];
+firefly_protocol_ack_range data_sample_ack_ranges[FIREFLY_CHANNEL_WINDOW_MAX];
+firefly_protocol_ack_range ack_ranges_data[FIREFLY_CHANNEL_WINDOW_MAX];
+unsigned char data_fragment_data[DATA_SAMPLE_DATA_SIZE];
 firefly_protocol_data_sample data_sample;
 firefly_protocol_channel_request channel_request;
 firefly_protocol_channel_response channel_response;
 firefly_protocol_channel_ack channel_ack;
 firefly_protocol_channel_close channel_close;
 firefly_protocol_ack ack;
+firefly_protocol_ack_ranges ack_ranges;
+firefly_protocol_data_fragment data_fragment;
+firefly_protocol_channel_credit channel_credit;
+firefly_protocol_heartbeat heartbeat;
 firefly_protocol_channel_restrict_request restrict_request;
 firefly_protocol_channel_restrict_ack restrict_ack;
 
@@ -38,6 +45,11 @@ bool received_channel_response = false;
 bool received_channel_ack = false;
 bool received_channel_close = false;
 bool received_ack = false;
+bool received_ack_ranges = false;
+size_t nbr_data_fragments = 0;
+size_t data_fragment_received = 0;
+bool received_channel_credit = false;
+bool received_heartbeat = false;
 bool received_restrict_request = false;
 bool received_restrict_ack = false;
 bool received_important = false;
@@ -81,6 +93,8 @@ struct firefly_connection *setup_test_conn_new(
 	struct firefly_transport_connection *test_trsp_conn =
 		malloc(sizeof(*test_trsp_conn));
 	test_trsp_conn->write = transport_write_test_decoder;
+	test_trsp_conn->write_packet = NULL;
+	test_trsp_conn->mtu = 0;
 	test_trsp_conn->ack = transport_ack_test;
 	test_trsp_conn->open = test_conn_open;
 	test_trsp_conn->close = test_conn_close;
@@ -108,7 +122,7 @@ void chan_opened_mock(struct firefly_channel *chan)
 	chan_opened_called = true;
 }
 
-void transport_ack_test(unsigned char id, struct firefly_connection *conn)
+void transport_ack_test(uint32_t id, struct firefly_connection *conn)
 {
 	UNUSED_VAR(conn);
 	CU_ASSERT_EQUAL(id, IMPORTANT_ID);
@@ -117,7 +131,7 @@ void transport_ack_test(unsigned char id, struct firefly_connection *conn)
 
 void transport_write_test_decoder(unsigned char *data, size_t size,
 					  struct firefly_connection *conn, bool important,
-					   unsigned char *id)
+					   uint32_t *id)
 {
 	UNUSED_VAR(conn);
 	received_important = important;
@@ -141,7 +155,7 @@ bool chan_open_recv_accept_open(struct firefly_channel *chan)
 
 void chan_open_recv_write_open(unsigned char *data, size_t size,
 					   struct firefly_connection *conn, bool important,
-					   unsigned char *id)
+					   uint32_t *id)
 {
 	UNUSED_VAR(conn);
 	UNUSED_VAR(important);
@@ -159,7 +173,7 @@ bool chan_open_recv_accept_recv(struct firefly_channel *chan)
 
 void chan_open_recv_write_recv(unsigned char *data, size_t size,
 					   struct firefly_connection *conn, bool important,
-					   unsigned char *id)
+					   uint32_t *id)
 {
 	UNUSED_VAR(conn);
 	UNUSED_VAR(important);
@@ -187,6 +201,13 @@ void test_handle_data_sample(firefly_protocol_data_sample *d, void *ctx)
 	data_sample.app_enc_data.n_0 = d->app_enc_data.n_0;
 
 	memcpy(data_sample.app_enc_data.a, d->app_enc_data.a, d->app_enc_data.n_0);
+	if (d->ack_ranges.n_0 > FIREFLY_CHANNEL_WINDOW_MAX) {
+		CU_FAIL("Received too many ack ranges");
+		data_sample.ack_ranges.n_0 = FIREFLY_CHANNEL_WINDOW_MAX;
+	}
+	data_sample.ack_ranges.a = data_sample_ack_ranges;
+	memcpy(data_sample.ack_ranges.a, d->ack_ranges.a,
+			data_sample.ack_ranges.n_0 * sizeof(*d->ack_ranges.a));
 	received_data_sample = true;
 }
 void test_handle_channel_request(firefly_protocol_channel_request *d, void *ctx)
@@ -221,6 +242,48 @@ void test_handle_ack(firefly_protocol_ack *d, void *ctx)
 	received_ack = true;
 }
 
+void test_handle_ack_ranges(firefly_protocol_ack_ranges *d, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	memcpy(&ack_ranges, d, sizeof(*d));
+	if (d->ranges.n_0 > FIREFLY_CHANNEL_WINDOW_MAX) {
+		CU_FAIL("Received too many ack ranges");
+		ack_ranges.ranges.n_0 = FIREFLY_CHANNEL_WINDOW_MAX;
+	}
+	ack_ranges.ranges.a = ack_ranges_data;
+	memcpy(ack_ranges.ranges.a, d->ranges.a,
+			ack_ranges.ranges.n_0 * sizeof(*d->ranges.a));
+	received_ack_ranges = true;
+}
+
+void test_handle_data_fragment(firefly_protocol_data_fragment *d, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	memcpy(&data_fragment, d, sizeof(*d));
+	if (d->offset < 0 || d->offset + d->data.n_0 > DATA_SAMPLE_DATA_SIZE) {
+		CU_FAIL("Received too large fragmented sample, modify test accordingly");
+		return;
+	}
+	data_fragment.data.a = data_fragment_data + d->offset;
+	memcpy(data_fragment.data.a, d->data.a, d->data.n_0);
+	data_fragment_received += d->data.n_0;
+	nbr_data_fragments++;
+}
+
+void test_handle_channel_credit(firefly_protocol_channel_credit *d, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	memcpy(&channel_credit, d, sizeof(*d));
+	received_channel_credit = true;
+}
+
+void test_handle_heartbeat(firefly_protocol_heartbeat *d, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	memcpy(&heartbeat, d, sizeof(*d));
+	received_heartbeat = true;
+}
+
 void test_handle_restrict_request(firefly_protocol_channel_restrict_request *d,
 		void *ctx)
 {
@@ -271,6 +334,14 @@ int init_labcomm_test_enc_dec_custom(struct labcomm_reader *test_r,
 						test_handle_restrict_request, NULL);
 	labcomm_decoder_register_firefly_protocol_channel_restrict_ack(test_dec,
 						test_handle_restrict_ack, NULL);
+	labcomm_decoder_register_firefly_protocol_ack_ranges(test_dec,
+						test_handle_ack_ranges, NULL);
+	labcomm_decoder_register_firefly_protocol_data_fragment(test_dec,
+						test_handle_data_fragment, NULL);
+	labcomm_decoder_register_firefly_protocol_channel_credit(test_dec,
+						test_handle_channel_credit, NULL);
+	labcomm_decoder_register_firefly_protocol_heartbeat(test_dec,
+						test_handle_heartbeat, NULL);
 
 	void *buffer;
 	size_t buffer_size;
@@ -338,6 +409,38 @@ int init_labcomm_test_enc_dec_custom(struct labcomm_reader *test_r,
 	labcomm_decoder_decode_one(test_dec);
 	free(buffer);
 
+	labcomm_encoder_register_firefly_protocol_ack_ranges(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buffer, &buffer_size);
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			buffer, buffer_size);
+	labcomm_decoder_decode_one(test_dec);
+	free(buffer);
+
+	labcomm_encoder_register_firefly_protocol_data_fragment(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buffer, &buffer_size);
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			buffer, buffer_size);
+	labcomm_decoder_decode_one(test_dec);
+	free(buffer);
+
+	labcomm_encoder_register_firefly_protocol_channel_credit(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buffer, &buffer_size);
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			buffer, buffer_size);
+	labcomm_decoder_decode_one(test_dec);
+	free(buffer);
+
+	labcomm_encoder_register_firefly_protocol_heartbeat(test_enc);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buffer, &buffer_size);
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			buffer, buffer_size);
+	labcomm_decoder_decode_one(test_dec);
+	free(buffer);
+
 	return 0;
 }
 
@@ -20,23 +20,23 @@ struct firefly_connection *setup_test_conn_new(
 
 void chan_opened_mock(struct firefly_channel *chan);
 
-void transport_ack_test(unsigned char id, struct firefly_connection *conn);
+void transport_ack_test(uint32_t id, struct firefly_connection *conn);
 
 void transport_write_test_decoder(unsigned char *data, size_t size,
 					  struct firefly_connection *conn, bool important,
-					   unsigned char *id);
+					   uint32_t *id);
 
 bool chan_open_recv_accept_open(struct firefly_channel *chan);
 
 void chan_open_recv_write_open(unsigned char *data, size_t size,
 							   struct firefly_connection *conn, bool important,
-					   unsigned char *id);
+					   uint32_t *id);
 
 bool chan_open_recv_accept_recv(struct firefly_channel *chan);
 
 void chan_open_recv_write_recv(unsigned char *data, size_t size,
 					   struct firefly_connection *conn, bool important,
-					   unsigned char *id);
+					   uint32_t *id);
 
 void free_tmp_data(struct tmp_data *td);
 
@@ -50,5 +50,10 @@ void test_handle_channel_ack(firefly_protocol_channel_ack *d, void *ctx);
 void test_handle_channel_response(firefly_protocol_channel_response *d, void *ctx);
 void test_handle_channel_request(firefly_protocol_channel_request *d, void *ctx);
 void test_handle_data_sample(firefly_protocol_data_sample *d, void *ctx);
+void test_handle_ack_ranges(firefly_protocol_ack_ranges *d, void *ctx);
+void test_handle_data_fragment(firefly_protocol_data_fragment *d, void *ctx);
+void test_handle_channel_credit(firefly_protocol_channel_credit *d, void *ctx);
+
+void test_handle_heartbeat(firefly_protocol_heartbeat *d, void *ctx);
 
 #endif
@@ -3,14 +3,24 @@
  * @brief Test the event queue functionallity.
  */
 
+#define _POSIX_C_SOURCE (200112L)
+#include <pthread.h>
+
 #include "CUnit/Basic.h"
 #include "CUnit/Console.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
 
 #include <utils/firefly_event_queue.h>
+#include <utils/firefly_event_queue_posix.h>
 
 #include "utils/firefly_event_queue_private.h"
+#include "utils/firefly_event_queue_posix_private.h"
+#include "utils/cppmacros.h"
 
 int init_suite_event()
 {
@@ -29,13 +39,13 @@ void test_add_pop_event_simple()
 
 	int st = q->offer_event_cb(q, 1, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(q->head);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(q->head->depends);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(firefly_event_queue_top(q));
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->nbr_unsatisfied, 0);
 	struct firefly_event *test = firefly_event_pop(q);
 
 	CU_ASSERT_EQUAL(1, test->prio);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_top(q));
 
 	// Clean up
 	firefly_event_return(q, &test);
@@ -52,13 +62,13 @@ void test_queue_events_in_order()
 
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_EQUAL(q->head->id, 1);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 1);
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 2);
-	CU_ASSERT_EQUAL(q->head->id, 2);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 2);
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(st, 3);
-	CU_ASSERT_EQUAL(q->head->id, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 3);
 
 	ev = firefly_event_pop(q);
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_HIGH, ev->prio);
@@ -70,7 +80,7 @@ void test_queue_events_in_order()
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_LOW, ev->prio);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_top(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -101,7 +111,7 @@ void test_queue_event_same_prio()
 	CU_ASSERT_PTR_EQUAL(&id_3, ev->context);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_top(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -147,7 +157,7 @@ void test_queue_event_same_and_diff_prio()
 	CU_ASSERT_PTR_EQUAL(&id_l2, ev->context);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_top(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -279,27 +289,80 @@ void test_complex_priorities()
 	firefly_event_queue_free(&q);
 }
 
+void test_queue_event_all_prios()
+{
+	const unsigned char prios[] = {0, 32, 31, 255, 64, 63, 128, 1};
+	const size_t k_nbr_prios = sizeof(prios) / sizeof(prios[0]);
+	int ctx[2][8];
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 16, NULL);
+
+	for (int round = 0; round < 2; round++) {
+		for (size_t i = 0; i < k_nbr_prios; i++) {
+			q->offer_event_cb(q, prios[i], NULL, &ctx[round][i], 0, NULL);
+		}
+	}
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 2 * k_nbr_prios);
+
+	int last_prio = 256;
+	for (size_t i = 0; i < k_nbr_prios; i++) {
+		ev = firefly_event_pop(q);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		CU_ASSERT_TRUE(ev->prio < last_prio);
+		last_prio = ev->prio;
+		// Find the index of this priority to check FIFO order.
+		size_t j = 0;
+		while (prios[j] != ev->prio)
+			j++;
+		CU_ASSERT_PTR_EQUAL(&ctx[0][j], ev->context);
+		firefly_event_return(q, &ev);
+		ev = firefly_event_pop(q);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		CU_ASSERT_EQUAL(last_prio, ev->prio);
+		CU_ASSERT_PTR_EQUAL(&ctx[1][j], ev->context);
+		firefly_event_return(q, &ev);
+	}
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 0);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_top(q));
+
+	firefly_event_queue_free(&q);
+}
+
+static bool event_is_aligned(struct firefly_event *ev)
+{
+	return (uintptr_t) ev % FIREFLY_EVENT_QUEUE_CACHE_LINE == 0;
+}
+
 void test_event_pool_simple()
 {
 	struct firefly_event *ev;
+	struct firefly_event *pooled;
 	struct firefly_event_queue *q =
 		firefly_event_queue_new(firefly_event_add, 1, NULL);
 	CU_ASSERT_PTR_NOT_NULL_FATAL(q->event_pool);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[0]);
+	CU_ASSERT_PTR_NULL(q->event_pool->next);
+	CU_ASSERT_TRUE(event_is_aligned(q->event_pool));
+	pooled = q->event_pool;
 
 	// Test take and return an event
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[0]);
+	CU_ASSERT_PTR_NULL(q->event_pool);
+	CU_ASSERT_EQUAL(1, q->event_pool_in_use);
 	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(pooled, ev);
 	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[0]);
+	CU_ASSERT_PTR_EQUAL(pooled, q->event_pool);
+	CU_ASSERT_EQUAL(0, q->event_pool_in_use);
 
 	// Same test again to test reusability of event
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[0]);
+	CU_ASSERT_PTR_NULL(q->event_pool);
 	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(pooled, ev);
 	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[0]);
+	CU_ASSERT_PTR_EQUAL(pooled, q->event_pool);
+	CU_ASSERT_EQUAL(1, q->event_pool_size);
 
 	firefly_event_queue_free(&q);
 }
@@ -307,50 +370,47 @@ void test_event_pool_simple()
 void test_event_pool_three()
 {
 	struct firefly_event *ev;
+	struct firefly_event *evs[3];
 	struct firefly_event_queue *q =
 		firefly_event_queue_new(firefly_event_add, 3, NULL);
 	CU_ASSERT_PTR_NOT_NULL_FATAL(q->event_pool);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[0]);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[1]);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[2]);
+
+	// The events are contiguous, aligned and handed out in address order.
+	ev = q->event_pool;
+	for (int i = 0; i < 3; i++) {
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		CU_ASSERT_TRUE(event_is_aligned(ev));
+		if (i > 0)
+			CU_ASSERT_TRUE(ev > evs[i - 1]);
+		evs[i] = ev;
+		ev = ev->next;
+	}
+	CU_ASSERT_PTR_NULL(ev);
 
 	// Test take three events
-	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[0]);
-	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[1]);
-	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[2]);
+	for (int i = 0; i < 3; i++) {
+		q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
+		CU_ASSERT_EQUAL((size_t) i + 1, q->event_pool_in_use);
+	}
+	CU_ASSERT_PTR_NULL(q->event_pool);
 
 	// Test return one event and take it again
 	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL(evs[0], ev);
 	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[2]);
-	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[2]);
-
-	// Test return two events and take them again
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[2]);
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[1]);
-	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[1]);
+	CU_ASSERT_PTR_EQUAL(evs[0], q->event_pool);
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[2]);
+	CU_ASSERT_PTR_NULL(q->event_pool);
 
 	// Test return all events
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[2]);
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[1]);
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[0]);
+	for (int i = 0; i < 3; i++) {
+		ev = firefly_event_pop(q);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		firefly_event_return(q, &ev);
+		CU_ASSERT_PTR_NOT_NULL(q->event_pool);
+		CU_ASSERT_EQUAL((size_t) (2 - i), q->event_pool_in_use);
+	}
+	CU_ASSERT_EQUAL(3, q->event_pool_size);
 
 	firefly_event_queue_free(&q);
 }
@@ -361,49 +421,40 @@ void test_event_pool_resize()
 	struct firefly_event_queue *q =
 		firefly_event_queue_new(firefly_event_add, 1, NULL);
 	CU_ASSERT_PTR_NOT_NULL_FATAL(q->event_pool);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[0]);
 
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[0]);
+	CU_ASSERT_PTR_NULL(q->event_pool);
 
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL_FATAL(2, q->event_pool_size);
-	CU_ASSERT_PTR_NULL(q->event_pool[1]);
+	CU_ASSERT_PTR_NULL(q->event_pool);
 
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL_FATAL(4, q->event_pool_size);
-	CU_ASSERT_PTR_NULL(q->event_pool[2]);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[3]);
+	CU_ASSERT_PTR_NOT_NULL(q->event_pool);
+	CU_ASSERT_TRUE(event_is_aligned(q->event_pool));
 
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL(4, q->event_pool_size);
-	CU_ASSERT_PTR_NULL(q->event_pool[3]);
+	CU_ASSERT_PTR_NULL(q->event_pool);
 
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
 	CU_ASSERT_EQUAL_FATAL(8, q->event_pool_size);
-	CU_ASSERT_PTR_NULL(q->event_pool[4]);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[5]);
+	CU_ASSERT_EQUAL(5, q->event_pool_in_use);
 
 	// test return the events again
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[4]);
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[3]);
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[2]);
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[1]);
-	ev = firefly_event_pop(q);
-	firefly_event_return(q, &ev);
-	CU_ASSERT_PTR_NOT_NULL(q->event_pool[0]);
+	for (int i = 0; i < 5; i++) {
+		ev = firefly_event_pop(q);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		CU_ASSERT_TRUE(event_is_aligned(ev));
+		firefly_event_return(q, &ev);
+		CU_ASSERT_EQUAL((size_t) (4 - i), q->event_pool_in_use);
+	}
 
 	// test add one to make sure they were returned ok
 	q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL, 0, NULL);
-	CU_ASSERT_PTR_NULL(q->event_pool[0]);
+	CU_ASSERT_EQUAL(1, q->event_pool_in_use);
+	CU_ASSERT_EQUAL(8, q->event_pool_size);
 
 	// Cleanup
 	firefly_event_queue_free(&q);
@@ -422,15 +473,15 @@ void test_event_dependencies()
 
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_1, 0, NULL);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_EQUAL(q->head->id, 1);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 1);
 	id = st;
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, &id_2, 1, &id);
 	CU_ASSERT_EQUAL(st, 2);
-	CU_ASSERT_EQUAL(q->head->id, 2);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 1);
 	id = st;
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, &id_3, 1, &id);
 	CU_ASSERT_EQUAL(st, 3);
-	CU_ASSERT_EQUAL(q->head->id, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 1);
 
 	ev = firefly_event_pop(q);
 	CU_ASSERT_PTR_EQUAL(&id_1, ev->context);
@@ -445,7 +496,7 @@ void test_event_dependencies()
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_HIGH, ev->prio);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_top(q));
 
 	firefly_event_queue_free(&q);
 }
@@ -464,17 +515,17 @@ void test_event_dependencies_done()
 	int64_t dep_1[] = {4};
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_1, 1, dep_1);
 	CU_ASSERT_EQUAL(st, 1);
-	CU_ASSERT_EQUAL(q->head->id, 1);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 1);
 	id = st;
 	int64_t dep_2[] = {id, 5};
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, &id_2, 2, dep_2);
 	CU_ASSERT_EQUAL(st, 2);
-	CU_ASSERT_EQUAL(q->head->id, 2);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 1);
 	id = st;
 	int64_t dep_3[] = {id, 6};
 	st = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, &id_3, 2, dep_3);
 	CU_ASSERT_EQUAL(st, 3);
-	CU_ASSERT_EQUAL(q->head->id, 3);
+	CU_ASSERT_EQUAL(firefly_event_queue_top(q)->id, 1);
 
 	ev = firefly_event_pop(q);
 	CU_ASSERT_PTR_EQUAL(&id_1, ev->context);
@@ -489,12 +540,830 @@ void test_event_dependencies_done()
 	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_HIGH, ev->prio);
 	firefly_event_return(q, &ev);
 
-	CU_ASSERT_PTR_NULL(q->head);
+	CU_ASSERT_PTR_NULL(firefly_event_queue_top(q));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_dependencies_inherit_prio()
+{
+	struct firefly_event *ev;
+	int id_low = 1;
+	int id_med = 2;
+	int id_high = 3;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 3, NULL);
+
+	int64_t low = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, &id_low,
+			0, NULL);
+	q->offer_event_cb(q, FIREFLY_PRIORITY_MEDIUM, NULL, &id_med, 0, NULL);
+	q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, &id_high, 1, &low);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 3);
+
+	// The low event inherits the high priority and runs before medium.
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL_FATAL(&id_low, ev->context);
+	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_LOW, ev->prio);
+	// The high event may not run until the low one is returned.
+	struct firefly_event *next = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL_FATAL(&id_med, next->context);
+	firefly_event_return(q, &next);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 1);
+	firefly_event_return(q, &ev);
+
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL_FATAL(&id_high, ev->context);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_dependencies_many()
+{
+	const unsigned int k_nbr_deps = 4 * FIREFLY_EVENT_QUEUE_MAX_DEPENDS;
+	int64_t deps[4 * FIREFLY_EVENT_QUEUE_MAX_DEPENDS];
+	int waiter_ctx;
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 2, NULL);
+
+	for (unsigned int i = 0; i < k_nbr_deps; i++) {
+		deps[i] = q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, NULL, NULL,
+				0, NULL);
+		CU_ASSERT_TRUE(deps[i] > 0);
+	}
+	int64_t id = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL,
+			&waiter_ctx, k_nbr_deps, deps);
+	CU_ASSERT_TRUE_FATAL(id > 0);
+	// Depending on the same event twice is fine too.
+	int64_t dup_deps[] = {id, id};
+	int64_t dup = q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, NULL, NULL,
+			2, dup_deps);
+	CU_ASSERT_TRUE_FATAL(dup > 0);
+
+	for (unsigned int i = 0; i < k_nbr_deps; i++) {
+		ev = firefly_event_pop(q);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+		CU_ASSERT_EQUAL(deps[i], ev->id);
+		firefly_event_return(q, &ev);
+	}
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(id, ev->id);
+	CU_ASSERT_PTR_EQUAL(&waiter_ctx, ev->context);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(dup, ev->id);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 0);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_keyed_exclusive()
+{
+	struct firefly_event *ev_a1;
+	struct firefly_event *ev;
+	int key_a, key_b;
+	int a1, a2, a3, b1;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+	firefly_event_queue_set_offer_keyed(q, firefly_event_add_keyed, true);
+	CU_ASSERT_TRUE(firefly_event_queue_is_keyed(q));
+
+	firefly_event_offer_keyed(q, &key_a, FIREFLY_PRIORITY_HIGH, NULL, &a1,
+			0, 0, NULL);
+	firefly_event_offer_keyed(q, &key_a, FIREFLY_PRIORITY_HIGH, NULL, &a2,
+			0, 0, NULL);
+	firefly_event_offer_keyed(q, &key_a, FIREFLY_PRIORITY_MEDIUM, NULL, &a3,
+			0, 0, NULL);
+	firefly_event_offer_keyed(q, &key_b, FIREFLY_PRIORITY_LOW, NULL, &b1,
+			0, 0, NULL);
+
+	ev_a1 = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL_FATAL(&a1, ev_a1->context);
+	// Key a is busy, b may run but not the other events of a.
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL_FATAL(&b1, ev->context);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 2);
+
+	// Releasing a lets its events run in order.
+	firefly_event_return(q, &ev_a1);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL_FATAL(&a2, ev->context);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_EQUAL_FATAL(&a3, ev->context);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(firefly_event_queue_length(q), 0);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_keyed_ignored()
+{
+	struct firefly_event *ev1;
+	struct firefly_event *ev2;
+	int key;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 2, NULL);
+
+	CU_ASSERT_FALSE(firefly_event_queue_is_keyed(q));
+	firefly_event_offer_keyed(q, &key, FIREFLY_PRIORITY_LOW, NULL, NULL,
+			0, 0, NULL);
+	firefly_event_offer_keyed(q, &key, FIREFLY_PRIORITY_LOW, NULL, NULL,
+			0, 0, NULL);
+	ev1 = firefly_event_pop(q);
+	ev2 = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL(ev1);
+	CU_ASSERT_PTR_NOT_NULL(ev2);
+	firefly_event_return(q, &ev2);
+	firefly_event_return(q, &ev1);
+
+	firefly_event_queue_free(&q);
+}
+
+struct copy_arg {
+	int value;
+	char name[16];
+};
+
+static int copy_arg_value;
+
+static int copy_arg_event(void *event_arg)
+{
+	struct copy_arg *arg = event_arg;
+
+	copy_arg_value = arg->value;
+	return strcmp(arg->name, "copied") == 0 ? 0 : -1;
+}
+
+void test_event_copy_arg()
+{
+	struct firefly_event *ev;
+	struct copy_arg arg = {1, "copied"};
+	char big[FIREFLY_EVENT_ARG_SIZE + 1];
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 1, NULL);
+	CU_ASSERT_FALSE(firefly_event_queue_is_keyed(q));
+
+	CU_ASSERT_TRUE(firefly_event_offer_keyed(q, NULL, FIREFLY_PRIORITY_LOW,
+				copy_arg_event, &arg, sizeof(arg), 0, NULL) > 0);
+	// The event keeps its own copy.
+	arg.value = 2;
+	strcpy(arg.name, "changed");
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_PTR_EQUAL(&ev->arg, ev->context);
+	copy_arg_value = 0;
+	CU_ASSERT_EQUAL(0, firefly_event_execute(ev));
+	CU_ASSERT_EQUAL(1, copy_arg_value);
+	firefly_event_return(q, &ev);
+
+	CU_ASSERT_TRUE(firefly_event_offer_keyed(q, NULL, FIREFLY_PRIORITY_LOW,
+				copy_arg_event, big, sizeof(big), 0, NULL) < 0);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_length(q));
+
+	firefly_event_queue_free(&q);
+}
+
+static int64_t wrapped_event_add(struct firefly_event_queue *eq,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		unsigned int nbr_depends, const int64_t *depends)
+{
+	return firefly_event_add(eq, prio, execute, context, nbr_depends, depends);
+}
+
+void test_event_copy_arg_fallback()
+{
+	struct firefly_event *ev;
+	struct copy_arg arg = {3, "copied"};
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(wrapped_event_add, 1, NULL);
+
+	// Without a keyed callback the argument is copied to the heap.
+	CU_ASSERT_TRUE(firefly_event_offer_keyed(q, NULL, FIREFLY_PRIORITY_LOW,
+				copy_arg_event, &arg, sizeof(arg), 0, NULL) > 0);
+	arg.value = 4;
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_PTR_NOT_EQUAL(&arg, ev->context);
+	copy_arg_value = 0;
+	CU_ASSERT_EQUAL(0, firefly_event_execute(ev));
+	CU_ASSERT_EQUAL(3, copy_arg_value);
+	firefly_event_return(q, &ev);
+
+	firefly_event_queue_free(&q);
+}
+
+static uint64_t stats_now;
+
+static uint64_t stats_clock(void)
+{
+	return stats_now;
+}
+
+static int stats_event_a(void *event_arg)
+{
+	UNUSED_VAR(event_arg);
+	return 0;
+}
+
+static int stats_event_b(void *event_arg)
+{
+	UNUSED_VAR(event_arg);
+	return 1;
+}
+
+static struct firefly_event_stats_entry *find_stats_func(
+		struct firefly_event_queue_stats *stats,
+		firefly_event_execute_f execute)
+{
+	for (size_t i = 0; i < stats->nbr_funcs; i++)
+		if (stats->funcs[i].execute == execute)
+			return &stats->funcs[i];
+	return NULL;
+}
+
+void test_event_stats()
+{
+	struct firefly_event *ev;
+	struct firefly_event_queue_stats *stats;
+	struct firefly_event_stats_entry *e;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 1, NULL);
+	firefly_event_queue_set_clock(q, stats_clock);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_stats_name(q, stats_event_a, "a"));
+
+	stats_now = 1000;
+	CU_ASSERT_TRUE(q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, stats_event_a,
+				NULL, 0, NULL) > 0);
+	stats_now = 2000;
+	CU_ASSERT_TRUE(q->offer_event_cb(q, FIREFLY_PRIORITY_HIGH, stats_event_b,
+				NULL, 0, NULL) > 0);
+
+	// Waited 3 us, executed 1 us.
+	stats_now = 5000;
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	stats_now = 6000;
+	firefly_event_return(q, &ev);
+	// Waited 5 us, executed less than 1 us.
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	firefly_event_return(q, &ev);
+
+	stats = firefly_event_queue_stats_get(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(stats);
+	CU_ASSERT_EQUAL(0, stats->depth);
+	CU_ASSERT_EQUAL(2, stats->depth_high);
+	CU_ASSERT_EQUAL(2, stats->pool_size);
+	CU_ASSERT_EQUAL(0, stats->pool_in_use);
+	CU_ASSERT_EQUAL(2, stats->pool_in_use_high);
+	CU_ASSERT_EQUAL(1, stats->pool_grows);
+	CU_ASSERT_EQUAL(2, stats->nbr_added);
+	CU_ASSERT_EQUAL(2, stats->nbr_returned);
+
+	CU_ASSERT_EQUAL_FATAL(2, stats->nbr_prios);
+	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_HIGH, stats->prios[0].prio);
+	CU_ASSERT_EQUAL(1, stats->prios[0].wait.count);
+	CU_ASSERT_EQUAL(1, stats->prios[0].wait.buckets[2]);
+	CU_ASSERT_EQUAL(1, stats->prios[0].exec.buckets[1]);
+	CU_ASSERT_EQUAL(FIREFLY_PRIORITY_LOW, stats->prios[1].prio);
+	CU_ASSERT_EQUAL(1, stats->prios[1].wait.buckets[3]);
+	CU_ASSERT_EQUAL(1, stats->prios[1].exec.buckets[0]);
+
+	CU_ASSERT_EQUAL(2, stats->nbr_funcs);
+	e = find_stats_func(stats, stats_event_a);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(e);
+	CU_ASSERT_STRING_EQUAL("a", e->name);
+	CU_ASSERT_EQUAL(5000, e->wait.total_ns);
+	CU_ASSERT_EQUAL(5000, e->wait.max_ns);
+	CU_ASSERT_EQUAL(0, e->exec.max_ns);
+	e = find_stats_func(stats, stats_event_b);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(e);
+	CU_ASSERT_PTR_NULL(e->name);
+	CU_ASSERT_EQUAL(1000, e->exec.total_ns);
+	firefly_event_queue_stats_free(&stats);
+	CU_ASSERT_PTR_NULL(stats);
+
+	// Very long waits end up in the last bucket.
+	CU_ASSERT_TRUE(q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, stats_event_a,
+				NULL, 0, NULL) > 0);
+	firefly_event_queue_stats_reset(q);
+	stats_now += 3600000000000ull;
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	firefly_event_return(q, &ev);
+
+	stats = firefly_event_queue_stats_get(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(stats);
+	CU_ASSERT_EQUAL(1, stats->depth_high);
+	CU_ASSERT_EQUAL(0, stats->pool_grows);
+	CU_ASSERT_EQUAL(0, stats->nbr_added);
+	CU_ASSERT_EQUAL(1, stats->nbr_returned);
+	CU_ASSERT_EQUAL_FATAL(2, stats->nbr_prios);
+	CU_ASSERT_EQUAL(0, stats->prios[0].wait.count);
+	CU_ASSERT_EQUAL(1, stats->prios[1].wait.count);
+	CU_ASSERT_EQUAL(1, stats->prios[1].wait.buckets[
+			FIREFLY_EVENT_STATS_BUCKETS - 1]);
+	e = find_stats_func(stats, stats_event_a);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(e);
+	CU_ASSERT_STRING_EQUAL("a", e->name);
+	CU_ASSERT_EQUAL(1, e->wait.count);
+	firefly_event_queue_stats_free(&stats);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_stats_no_clock()
+{
+	struct firefly_event *ev;
+	struct firefly_event_queue_stats *stats;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+
+	CU_ASSERT_TRUE(q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, stats_event_a,
+				NULL, 0, NULL) > 0);
+	CU_ASSERT_TRUE(q->offer_event_cb(q, FIREFLY_PRIORITY_LOW, stats_event_b,
+				NULL, 0, NULL) > 0);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	firefly_event_return(q, &ev);
+
+	// Only counters and depths without a clock.
+	stats = firefly_event_queue_stats_get(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(stats);
+	CU_ASSERT_EQUAL(1, stats->depth);
+	CU_ASSERT_EQUAL(2, stats->depth_high);
+	CU_ASSERT_EQUAL(0, stats->pool_grows);
+	CU_ASSERT_EQUAL(2, stats->nbr_added);
+	CU_ASSERT_EQUAL(1, stats->nbr_returned);
+	CU_ASSERT_EQUAL(0, stats->nbr_prios);
+	CU_ASSERT_EQUAL(0, stats->nbr_funcs);
+	firefly_event_queue_stats_free(&stats);
+
+	firefly_event_queue_free(&q);
+}
+
+static int timer_event(void *event_arg)
+{
+	UNUSED_VAR(event_arg);
+	return 0;
+}
+
+void test_event_timer()
+{
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+	uint64_t deadline;
+	int64_t id_5, id_70, id_5000, id_far, id_dep;
+
+	CU_ASSERT_FALSE(firefly_event_queue_next_timer(q, &deadline));
+	id_5 = firefly_event_offer_at(q, NULL, NULL, 1, 5, timer_event, NULL);
+	id_70 = firefly_event_offer_at(q, NULL, NULL, 1, 70, timer_event, NULL);
+	id_5000 = firefly_event_offer_at(q, NULL, NULL, 1, 5000, timer_event,
+			NULL);
+	id_far = firefly_event_offer_at(q, NULL, NULL, 1, 1 << 25, timer_event,
+			NULL);
+	CU_ASSERT_TRUE(id_5 > 0 && id_70 > 0 && id_5000 > 0 && id_far > 0);
+	// Timers are not queued until due.
+	CU_ASSERT_EQUAL(0, firefly_event_queue_length(q));
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+
+	// An event depending on a timer waits for it.
+	id_dep = q->offer_event_cb(q, 2, timer_event, NULL, 1, &id_5);
+	CU_ASSERT_TRUE(id_dep > 0);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+
+	CU_ASSERT_TRUE_FATAL(firefly_event_queue_next_timer(q, &deadline));
+	CU_ASSERT_TRUE(deadline <= 5);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_expire(q, 4));
+	CU_ASSERT_TRUE_FATAL(firefly_event_queue_next_timer(q, &deadline));
+	CU_ASSERT_EQUAL(5, deadline);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_expire(q, 5));
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(id_5, ev->id);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	firefly_event_return(q, &ev);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(id_dep, ev->id);
+	firefly_event_return(q, &ev);
+
+	CU_ASSERT_EQUAL(0, firefly_event_queue_expire(q, 69));
+	CU_ASSERT_TRUE_FATAL(firefly_event_queue_next_timer(q, &deadline));
+	CU_ASSERT_EQUAL(70, deadline);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_expire(q, 100));
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(id_70, ev->id);
+	firefly_event_return(q, &ev);
+
+	// Timers that already fired can not be cancelled, nor cancelled twice.
+	CU_ASSERT_EQUAL(0, firefly_event_queue_cancel(q, id_5000));
+	CU_ASSERT_TRUE(firefly_event_queue_cancel(q, id_5000) < 0);
+	CU_ASSERT_TRUE(firefly_event_queue_cancel(q, id_70) < 0);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_expire(q, 6000));
+
+	// Deadlines beyond the span of the wheel.
+	CU_ASSERT_EQUAL(0, firefly_event_queue_expire(q, (1 << 25) - 1));
+	CU_ASSERT_EQUAL(1, firefly_event_queue_expire(q, 1 << 25));
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(id_far, ev->id);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_FALSE(firefly_event_queue_next_timer(q, &deadline));
+
+	// Deadlines already passed are queued at once.
+	CU_ASSERT_TRUE(firefly_event_offer_at(q, NULL, NULL, 1, 10, timer_event,
+				NULL) > 0);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_length(q));
+	CU_ASSERT_FALSE(firefly_event_queue_next_timer(q, &deadline));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_timer_keyed()
+{
+	struct firefly_event *running;
+	struct firefly_event *ev;
+	int conn, chan;
+	int64_t timer;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+	firefly_event_queue_set_offer_keyed(q, firefly_event_add_keyed, true);
+
+	firefly_event_add_keyed(q, &conn, NULL, FIREFLY_PRIORITY_LOW,
+			timer_event, NULL, 0, NULL, 0, NULL);
+	timer = firefly_event_offer_at(q, &conn, NULL, FIREFLY_PRIORITY_HIGH, 5,
+			timer_event, NULL);
+	CU_ASSERT_TRUE_FATAL(timer > 0);
+	running = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(running);
+
+	// A due timer waits for the running event of its key.
+	CU_ASSERT_EQUAL(1, firefly_event_queue_expire(q, 5));
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	firefly_event_return(q, &running);
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(timer, ev->id);
+	firefly_event_return(q, &ev);
+
+	// Timers not yet due are purged with their key or owner.
+	CU_ASSERT_TRUE(firefly_event_offer_at(q, &conn, NULL,
+				FIREFLY_PRIORITY_LOW, 100, timer_event, NULL) > 0);
+	CU_ASSERT_TRUE(firefly_event_offer_at(q, &conn, &chan,
+				FIREFLY_PRIORITY_LOW, 100, timer_event, NULL) > 0);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_purge(q, &chan));
+	CU_ASSERT_EQUAL(1, firefly_event_queue_purge(q, &conn));
+	CU_ASSERT_EQUAL(0, firefly_event_queue_expire(q, 200));
+	CU_ASSERT_EQUAL(0, firefly_event_queue_length(q));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_timer_random()
+{
+	struct firefly_event *ev;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 16, NULL);
+	uint64_t deadlines[512];
+	int64_t ids[512];
+	uint64_t now = 0;
+	uint64_t next;
+	size_t nbr_fired = 0;
+	size_t nbr_cancelled = 0;
+
+	srand(4711);
+	for (size_t i = 0; i < 512; i++) {
+		// Spread over all levels of the wheel.
+		int shift = rand() % 16;
+		deadlines[i] = (uint64_t) (rand() % 1000 + 1) << shift;
+		ids[i] = firefly_event_offer_at(q, NULL, NULL, 1, deadlines[i],
+				timer_event, &deadlines[i]);
+		CU_ASSERT_TRUE_FATAL(ids[i] > 0);
+	}
+	for (size_t i = 0; i < 512; i += 7) {
+		if (firefly_event_queue_cancel(q, ids[i]) == 0) {
+			deadlines[i] = 0;
+			nbr_cancelled++;
+		}
+	}
+	CU_ASSERT_EQUAL(0, firefly_event_queue_expire(q, now));
+	while (firefly_event_queue_next_timer(q, &next)) {
+		CU_ASSERT_TRUE_FATAL(next > now);
+		now = next + rand() % 3;
+		firefly_event_queue_expire(q, now);
+		while ((ev = firefly_event_pop(q)) != NULL) {
+			uint64_t *deadline = ev->context;
+
+			// Once, never early, and never later than the tick it is due.
+			CU_ASSERT_NOT_EQUAL(0, *deadline);
+			CU_ASSERT_TRUE(*deadline <= now);
+			CU_ASSERT_TRUE(*deadline > now - 3);
+			*deadline = 0;
+			nbr_fired++;
+			firefly_event_return(q, &ev);
+		}
+	}
+	CU_ASSERT_EQUAL(512, nbr_fired + nbr_cancelled);
 
 	firefly_event_queue_free(&q);
 }
 
 // TODO test errors when using event pool
+static int destroyed;
+
+static void count_destroy(void *event_arg)
+{
+	UNUSED_VAR(event_arg);
+	destroyed++;
+}
+
+void test_event_boxed_destroy()
+{
+	int conn, chan;
+	int64_t id;
+	struct copy_arg arg = {5, "boxed"};
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(wrapped_event_add, 4, NULL);
+	firefly_event_queue_set_cancel(q, firefly_event_cancel,
+			firefly_event_purge);
+
+	destroyed = 0;
+	id = firefly_event_offer_owned(q, &conn, NULL, FIREFLY_PRIORITY_LOW,
+			copy_arg_event, &arg, sizeof(arg), count_destroy, 0, NULL);
+	CU_ASSERT_TRUE(id > 0);
+	firefly_event_offer_owned(q, &conn, &chan, FIREFLY_PRIORITY_LOW,
+			copy_arg_event, NULL, 0, count_destroy, 0, NULL);
+	firefly_event_offer_owned(q, &conn, NULL, FIREFLY_PRIORITY_LOW,
+			copy_arg_event, NULL, 0, count_destroy, 0, NULL);
+	firefly_event_offer_owned(q, NULL, NULL, FIREFLY_PRIORITY_LOW,
+			copy_arg_event, &arg, sizeof(arg), count_destroy, 0, NULL);
+	CU_ASSERT_EQUAL(4, firefly_event_queue_length(q));
+
+	// The boxed events are dropped with their key, owner and destructor.
+	CU_ASSERT_EQUAL(0, firefly_event_queue_cancel(q, id));
+	CU_ASSERT_EQUAL(1, destroyed);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_purge(q, &chan));
+	CU_ASSERT_EQUAL(2, destroyed);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_purge(q, &conn));
+	CU_ASSERT_EQUAL(3, destroyed);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_length(q));
+
+	firefly_event_queue_free(&q);
+	CU_ASSERT_EQUAL(4, destroyed);
+}
+
+void test_event_cancel()
+{
+	struct firefly_event *ev;
+	struct firefly_event *running;
+	struct firefly_event_queue_stats *stats;
+	int key;
+	int64_t ready, blocked, held, run, waiter, dep[2];
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 8, NULL);
+	firefly_event_queue_set_offer_keyed(q, firefly_event_add_keyed, true);
+
+	destroyed = 0;
+	run = firefly_event_add_keyed(q, &key, NULL, FIREFLY_PRIORITY_HIGH,
+			NULL, NULL, 0, count_destroy, 0, NULL);
+	held = firefly_event_add_keyed(q, &key, NULL, FIREFLY_PRIORITY_HIGH,
+			NULL, NULL, 0, count_destroy, 0, NULL);
+	ready = firefly_event_add_keyed(q, NULL, NULL, FIREFLY_PRIORITY_LOW,
+			NULL, NULL, 0, count_destroy, 0, NULL);
+	dep[0] = ready;
+	blocked = firefly_event_add_keyed(q, NULL, NULL, FIREFLY_PRIORITY_LOW,
+			NULL, NULL, 0, count_destroy, 1, dep);
+	dep[1] = blocked;
+	waiter = firefly_event_add_keyed(q, NULL, NULL, FIREFLY_PRIORITY_LOW,
+			NULL, NULL, 0, count_destroy, 2, dep);
+	CU_ASSERT_EQUAL(5, firefly_event_queue_length(q));
+
+	running = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(running);
+	CU_ASSERT_EQUAL(run, running->id);
+	// A running event can not be cancelled.
+	CU_ASSERT_TRUE(firefly_event_queue_cancel(q, run) < 0);
+
+	CU_ASSERT_EQUAL(0, firefly_event_queue_cancel(q, held));
+	CU_ASSERT_EQUAL(0, firefly_event_queue_cancel(q, blocked));
+	CU_ASSERT_EQUAL(0, firefly_event_queue_cancel(q, ready));
+	CU_ASSERT_TRUE(firefly_event_queue_cancel(q, ready) < 0);
+	CU_ASSERT_EQUAL(3, destroyed);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_length(q));
+
+	// The waiter no longer waits for the cancelled events.
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(waiter, ev->id);
+	firefly_event_return(q, &ev);
+	firefly_event_return(q, &running);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	CU_ASSERT_EQUAL(0, firefly_event_queue_length(q));
+	CU_ASSERT_EQUAL(3, destroyed);
+
+	stats = firefly_event_queue_stats_get(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(stats);
+	CU_ASSERT_EQUAL(3, stats->nbr_dropped);
+	firefly_event_queue_stats_free(&stats);
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_cancel_handoff()
+{
+	struct firefly_event *ev;
+	int key;
+	int64_t first, second, third;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+	firefly_event_queue_set_offer_keyed(q, firefly_event_add_keyed, true);
+
+	first = firefly_event_add_keyed(q, &key, NULL, FIREFLY_PRIORITY_HIGH,
+			NULL, NULL, 0, NULL, 0, NULL);
+	second = firefly_event_add_keyed(q, &key, NULL, FIREFLY_PRIORITY_HIGH,
+			NULL, NULL, 0, NULL, 0, NULL);
+	third = firefly_event_add_keyed(q, &key, NULL, FIREFLY_PRIORITY_HIGH,
+			NULL, NULL, 0, NULL, 0, NULL);
+
+	ev = firefly_event_pop(q);
+	CU_ASSERT_EQUAL_FATAL(first, ev->id);
+	// Returning the first event hands the key over to the second.
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_cancel(q, second));
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(third, ev->id);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+	firefly_event_return(q, &ev);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_length(q));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_purge()
+{
+	struct firefly_event *ev;
+	int conn_a, conn_b, chan_a;
+	int64_t timer, kept;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+	firefly_event_queue_set_offer_keyed(q, firefly_event_add_keyed, true);
+
+	destroyed = 0;
+	for (int i = 0; i < 100; i++) {
+		firefly_event_add_keyed(q, &conn_a, i % 2 ? &chan_a : NULL,
+				FIREFLY_PRIORITY_LOW, NULL, NULL, 0, count_destroy,
+				0, NULL);
+	}
+	kept = firefly_event_add_keyed(q, &conn_b, NULL, FIREFLY_PRIORITY_LOW,
+			NULL, NULL, 0, count_destroy, 0, NULL);
+	timer = firefly_event_offer_at(q, NULL, NULL, FIREFLY_PRIORITY_LOW, 1000,
+			timer_event, &chan_a);
+	CU_ASSERT_TRUE(timer > 0);
+	CU_ASSERT_EQUAL(101, firefly_event_queue_length(q));
+
+	// Purging a channel drops only its events.
+	CU_ASSERT_EQUAL(50, firefly_event_queue_purge(q, &chan_a));
+	CU_ASSERT_EQUAL(50, destroyed);
+	CU_ASSERT_EQUAL(51, firefly_event_queue_length(q));
+
+	// Purging a connection drops every event keyed to it.
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_PTR_EQUAL(&conn_a, ev->key);
+	CU_ASSERT_EQUAL(49, firefly_event_queue_purge(q, &conn_a));
+	CU_ASSERT_EQUAL(99, destroyed);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_purge(q, &conn_a));
+	firefly_event_return(q, &ev);
+
+	ev = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	CU_ASSERT_EQUAL(kept, ev->id);
+	firefly_event_return(q, &ev);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(q));
+
+	// Timers are cancelled like any other event.
+	CU_ASSERT_TRUE(firefly_event_queue_cancel(q, timer) == 0);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_expire(q, 2000));
+	CU_ASSERT_EQUAL(0, firefly_event_queue_length(q));
+
+	firefly_event_queue_free(&q);
+}
+
+void test_event_queue_free_destroys()
+{
+	struct firefly_event *running;
+	int key;
+	int64_t ready, dep;
+	struct firefly_event_queue *q =
+		firefly_event_queue_new(firefly_event_add, 4, NULL);
+	firefly_event_queue_set_offer_keyed(q, firefly_event_add_keyed, true);
+
+	destroyed = 0;
+	firefly_event_add_keyed(q, &key, NULL, FIREFLY_PRIORITY_HIGH,
+			NULL, NULL, 0, count_destroy, 0, NULL);
+	firefly_event_add_keyed(q, &key, NULL, FIREFLY_PRIORITY_HIGH,
+			NULL, NULL, 0, count_destroy, 0, NULL);
+	ready = firefly_event_add_keyed(q, NULL, NULL, FIREFLY_PRIORITY_LOW,
+			NULL, NULL, 0, count_destroy, 0, NULL);
+	dep = ready;
+	firefly_event_add_keyed(q, NULL, NULL, FIREFLY_PRIORITY_LOW,
+			NULL, NULL, 0, count_destroy, 1, &dep);
+	CU_ASSERT_TRUE(firefly_event_offer_at(q, NULL, NULL,
+				FIREFLY_PRIORITY_LOW, 1000, timer_event, NULL) > 0);
+
+	// Keep the first keyed event running to hold the second back.
+	running = firefly_event_pop(q);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(running);
+	CU_ASSERT_EQUAL(0, destroyed);
+
+	// The held, ready and blocked events are destroyed, the running is not.
+	firefly_event_queue_free(&q);
+	CU_ASSERT_PTR_NULL(q);
+	CU_ASSERT_EQUAL(3, destroyed);
+}
+
+struct claimed_offer {
+	struct firefly_event_queue_posix_context *ctx;
+	size_t pos;
+};
+
+/*
+ * Publish an offer claimed in the ingress ring by the test after a while, as
+ * a producer preempted between claiming and publishing would.
+ */
+static void *publish_claimed(void *arg)
+{
+	struct claimed_offer *claimed = arg;
+	struct firefly_event_queue_posix_context *ctx = claimed->ctx;
+	struct firefly_event_ingress *slot =
+		&ctx->ring[claimed->pos & ctx->ring_mask];
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 20000000 };
+
+	nanosleep(&delay, NULL);
+	slot->id = __atomic_add_fetch(&ctx->next_id, 1, __ATOMIC_RELAXED);
+	slot->key = NULL;
+	slot->owner = NULL;
+	slot->prio = 1;
+	slot->enqueued = 0;
+	slot->execute = timer_event;
+	slot->context = NULL;
+	slot->context_size = 0;
+	slot->destroy = NULL;
+	slot->nbr_deps = 0;
+	__atomic_add_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, claimed->pos + 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+void test_event_posix_cancel_unpublished()
+{
+	struct claimed_offer claimed;
+	pthread_t producer;
+	int conn;
+	int64_t id;
+	struct firefly_event_queue *q = firefly_event_queue_posix_new(4);
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(q);
+	claimed.ctx = firefly_event_queue_get_context(q);
+
+	// Claim a slot, the offer after it is published behind it.
+	claimed.pos = claimed.ctx->ring_head++;
+	id = q->offer_event_cb(q, 1, timer_event, NULL, 0, NULL);
+	CU_ASSERT_TRUE_FATAL(id > 0);
+	pthread_create(&producer, NULL, publish_claimed, &claimed);
+	CU_ASSERT_EQUAL(0, firefly_event_queue_cancel(q, id));
+	pthread_join(producer, NULL);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_length(q));
+
+	claimed.pos = claimed.ctx->ring_head++;
+	destroyed = 0;
+	CU_ASSERT_TRUE_FATAL(firefly_event_offer_owned(q, &conn, NULL, 1,
+				timer_event, NULL, 0, count_destroy, 0, NULL) > 0);
+	pthread_create(&producer, NULL, publish_claimed, &claimed);
+	CU_ASSERT_EQUAL(1, firefly_event_queue_purge(q, &conn));
+	pthread_join(producer, NULL);
+	CU_ASSERT_EQUAL(1, destroyed);
+
+	// Only the events published by the producer are left.
+	CU_ASSERT_EQUAL(2, firefly_event_queue_length(q));
+	firefly_event_queue_posix_free(&q);
+}
+
 int main()
 {
 	CU_pSuite event_suite = NULL;
@@ -534,6 +1403,9 @@ int main()
 		(CU_add_test(event_suite, "test_complex_priorities",
 					 test_complex_priorities) == NULL)
 		||
+		(CU_add_test(event_suite, "test_queue_event_all_prios",
+					 test_queue_event_all_prios) == NULL)
+		||
 		(CU_add_test(event_suite, "test_event_pool_simple",
 					 test_event_pool_simple) == NULL)
 		||
@@ -548,6 +1420,44 @@ int main()
 		||
 		(CU_add_test(event_suite, "test_event_dependencies_done",
 					 test_event_dependencies_done) == NULL)
+		||
+		(CU_add_test(event_suite, "test_event_dependencies_inherit_prio",
+					 test_event_dependencies_inherit_prio) == NULL)
+		||
+		(CU_add_test(event_suite, "test_event_dependencies_many",
+					 test_event_dependencies_many) == NULL)
+		||
+		(CU_add_test(event_suite, "test_event_keyed_exclusive",
+					 test_event_keyed_exclusive) == NULL)
+		||
+		(CU_add_test(event_suite, "test_event_keyed_ignored",
+					 test_event_keyed_ignored) == NULL) ||
+		(CU_add_test(event_suite, "test_event_copy_arg",
+					 test_event_copy_arg) == NULL) ||
+		(CU_add_test(event_suite, "test_event_copy_arg_fallback",
+					 test_event_copy_arg_fallback) == NULL) ||
+		(CU_add_test(event_suite, "test_event_stats",
+					 test_event_stats) == NULL) ||
+		(CU_add_test(event_suite, "test_event_stats_no_clock",
+					 test_event_stats_no_clock) == NULL) ||
+		(CU_add_test(event_suite, "test_event_timer",
+					 test_event_timer) == NULL) ||
+		(CU_add_test(event_suite, "test_event_timer_keyed",
+					 test_event_timer_keyed) == NULL) ||
+		(CU_add_test(event_suite, "test_event_timer_random",
+					 test_event_timer_random) == NULL) ||
+		(CU_add_test(event_suite, "test_event_cancel",
+					 test_event_cancel) == NULL) ||
+		(CU_add_test(event_suite, "test_event_cancel_handoff",
+					 test_event_cancel_handoff) == NULL) ||
+		(CU_add_test(event_suite, "test_event_purge",
+					 test_event_purge) == NULL) ||
+		(CU_add_test(event_suite, "test_event_boxed_destroy",
+					 test_event_boxed_destroy) == NULL) ||
+		(CU_add_test(event_suite, "test_event_queue_free_destroys",
+					 test_event_queue_free_destroys) == NULL) ||
+		(CU_add_test(event_suite, "test_event_posix_cancel_unpublished",
+					 test_event_posix_cancel_unpublished) == NULL)
 	   ) {
 		CU_cleanup_registry();
 		return CU_get_error();
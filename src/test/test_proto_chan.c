@@ -21,6 +21,7 @@
 #include "test/labcomm_static_buffer_reader.h"
 #include "test/test_labcomm_utils.h"
 #include "utils/cppmacros.h"
+#include "utils/firefly_packet.h"
 
 #define REMOTE_CHAN_ID (2) // Chan id used by all simulated remote channels.
 
@@ -44,6 +45,10 @@ extern firefly_protocol_channel_restrict_request restrict_request;
 extern firefly_protocol_channel_restrict_ack restrict_ack;
 
 extern bool received_data_sample;
+extern unsigned char data_fragment_data[DATA_SAMPLE_DATA_SIZE];
+extern firefly_protocol_data_fragment data_fragment;
+extern size_t nbr_data_fragments;
+extern size_t data_fragment_received;
 extern bool received_channel_request;
 extern bool received_channel_response;
 extern bool received_channel_ack;
@@ -84,6 +89,28 @@ static void test_channel_error(struct firefly_channel *chan,
 
 extern bool chan_opened_called;
 
+/*
+ * Channels get increasing local ids as long as none is removed from the
+ * connection, the newest channel has the highest.
+ */
+static struct firefly_channel *newest_channel(struct firefly_connection *conn)
+{
+	for (size_t i = conn->channels.size; i-- > 0;) {
+		if (conn->channels.chans[i] != NULL)
+			return conn->channels.chans[i];
+	}
+	return NULL;
+}
+
+static struct firefly_channel *oldest_channel(struct firefly_connection *conn)
+{
+	for (size_t i = 0; i < conn->channels.size; i++) {
+		if (conn->channels.chans[i] != NULL)
+			return conn->channels.chans[i];
+	}
+	return NULL;
+}
+
 #define MAX_TESTED_ID (10)
 
 void test_next_channel_id()
@@ -141,13 +168,13 @@ void test_chan_open()
 	// Test that a chan open request is sent.
 	CU_ASSERT_TRUE(received_channel_request);
 	received_channel_request = false;
-	CU_ASSERT_EQUAL(conn->chan_list->chan->local_id, channel_request.source_chan_id);
+	CU_ASSERT_EQUAL(newest_channel(conn)->local_id, channel_request.source_chan_id);
 	CU_ASSERT_EQUAL(CHANNEL_ID_NOT_SET, channel_request.dest_chan_id);
 
 	// Simulate that we received a channel response from the other end
 	firefly_protocol_channel_response chan_resp;
 	chan_resp.source_chan_id = REMOTE_CHAN_ID;
-	chan_resp.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_resp.dest_chan_id = newest_channel(conn)->local_id;
 	chan_resp.ack = true;
 	labcomm_encode_firefly_protocol_channel_response(test_enc, &chan_resp);
 	int res = labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
@@ -163,9 +190,9 @@ void test_chan_open()
 	// Test that we sent an ack
 	CU_ASSERT_TRUE(received_channel_ack);
 	received_channel_ack = false;
-	CU_ASSERT_EQUAL(conn->chan_list->chan->local_id, channel_ack.source_chan_id);
-	CU_ASSERT_EQUAL(conn->chan_list->chan->remote_id, channel_ack.dest_chan_id);
-	CU_ASSERT_EQUAL(conn->chan_list->chan->remote_id, REMOTE_CHAN_ID);
+	CU_ASSERT_EQUAL(newest_channel(conn)->local_id, channel_ack.source_chan_id);
+	CU_ASSERT_EQUAL(newest_channel(conn)->remote_id, channel_ack.dest_chan_id);
+	CU_ASSERT_EQUAL(newest_channel(conn)->remote_id, REMOTE_CHAN_ID);
 	CU_ASSERT_TRUE(channel_ack.ack);
 
 	// test chan_is_open is called
@@ -220,14 +247,14 @@ void test_chan_recv_accept()
 	CU_ASSERT_TRUE(received_channel_response);
 	received_channel_response = false;
 	CU_ASSERT_EQUAL(channel_response.dest_chan_id, REMOTE_CHAN_ID);
-	CU_ASSERT_EQUAL(conn->chan_list->chan->remote_id, REMOTE_CHAN_ID);
-	CU_ASSERT_EQUAL(conn->chan_list->chan->local_id,
+	CU_ASSERT_EQUAL(newest_channel(conn)->remote_id, REMOTE_CHAN_ID);
+	CU_ASSERT_EQUAL(newest_channel(conn)->local_id,
 			channel_response.source_chan_id);
 
 	// simulate an ACK is sent from remote
 	firefly_protocol_channel_ack ack;
-	ack.dest_chan_id = conn->chan_list->chan->local_id;
-	ack.source_chan_id = conn->chan_list->chan->remote_id;
+	ack.dest_chan_id = newest_channel(conn)->local_id;
+	ack.source_chan_id = newest_channel(conn)->remote_id;
 	ack.ack = true;
 	// Recieving end and got an ack
 	labcomm_encode_firefly_protocol_channel_ack(test_enc, &ack);
@@ -292,7 +319,7 @@ void test_chan_recv_reject()
 	CU_ASSERT_FALSE(chan_opened_called);
 
 	// check channel is destroyed and all related resources dealloced
-	CU_ASSERT_PTR_NULL(conn->chan_list);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
 
 	// Clean up
 	chan_opened_called = false;
@@ -326,7 +353,7 @@ void test_chan_open_rejected()
 	received_channel_request = false;
 
 	firefly_protocol_channel_response chan_res;
-	chan_res.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_res.dest_chan_id = newest_channel(conn)->local_id;
 	chan_res.source_chan_id = CHANNEL_ID_NOT_SET;
 	chan_res.ack = false;
 
@@ -344,7 +371,7 @@ void test_chan_open_rejected()
 
 	CU_ASSERT_FALSE(received_channel_ack);
 	received_channel_ack = false;
-	CU_ASSERT_PTR_NULL(conn->chan_list);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
 	// test resources are destroyed again
 	CU_ASSERT_FALSE(chan_opened_called);
 	CU_ASSERT_TRUE(was_in_error);
@@ -414,12 +441,12 @@ void test_chan_open_recv()
 	CU_ASSERT_TRUE(chan_opened_called);
 	chan_opened_called = false;
 
-	CU_ASSERT_PTR_NOT_NULL(conn_open->chan_list->chan);
-	CU_ASSERT_PTR_NOT_NULL(conn_recv->chan_list->chan);
-	CU_ASSERT_EQUAL(conn_recv->chan_list->chan->local_id,
-			conn_open->chan_list->chan->remote_id);
-	CU_ASSERT_EQUAL(conn_recv->chan_list->chan->remote_id,
-			conn_open->chan_list->chan->local_id);
+	CU_ASSERT_PTR_NOT_NULL(newest_channel(conn_open));
+	CU_ASSERT_PTR_NOT_NULL(newest_channel(conn_recv));
+	CU_ASSERT_EQUAL(newest_channel(conn_recv)->local_id,
+			newest_channel(conn_open)->remote_id);
+	CU_ASSERT_EQUAL(newest_channel(conn_recv)->remote_id,
+			newest_channel(conn_open)->local_id);
 
 	// Clean up
 	chan_opened_called = false;
@@ -477,7 +504,7 @@ void test_chan_close()
 	firefly_event_execute(ev);
 	firefly_event_return(eq, &ev);
 	// test channel state, free'd
-	CU_ASSERT_PTR_NULL(conn->chan_list);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
 	CU_ASSERT_TRUE(chan_closed_called);
 
 	// clean up
@@ -505,7 +532,7 @@ void test_chan_recv_close()
 
 	// create close channel packet
 	firefly_protocol_channel_close chan_close;
-	chan_close.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_close.dest_chan_id = newest_channel(conn)->local_id;
 	chan_close.source_chan_id = REMOTE_CHAN_ID;
 	labcomm_encode_firefly_protocol_channel_close(test_enc, &chan_close);
 
@@ -521,7 +548,7 @@ void test_chan_recv_close()
 	// check callback called.
 	CU_ASSERT_TRUE(chan_closed_called);
 	// check channel state
-	CU_ASSERT_PTR_NULL(conn->chan_list);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
 
 	// clean up
 	chan_closed_called = false;
@@ -605,6 +632,59 @@ void test_send_app_data()
 	mock_test_event_queue_reset(eq);
 }
 
+void test_send_app_data_direct()
+{
+	test_test_var app_test_data = 1;
+	struct firefly_event *ev;
+	struct firefly_connection_actions ca = {
+		.channel_closed = chan_closed_cb
+	};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+	firefly_channel_set_direct(ch, true);
+
+	// The sample waits behind the signature encoded before it.
+	struct labcomm_encoder *ch_enc = firefly_protocol_get_output_stream(ch);
+	labcomm_encoder_register_test_test_var(ch_enc);
+	labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	CU_ASSERT_FALSE(received_data_sample);
+	CU_ASSERT_EQUAL(ch->nbr_queued, 2);
+
+	ev = firefly_event_pop(eq);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	firefly_event_execute(ev);
+	firefly_event_return(eq, &ev);
+	CU_ASSERT_TRUE(received_data_sample);
+	CU_ASSERT_TRUE(data_sample.important);
+	received_data_sample = false;
+
+	ev = firefly_event_pop(eq);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	firefly_event_execute(ev);
+	firefly_event_return(eq, &ev);
+	CU_ASSERT_TRUE(received_data_sample);
+	CU_ASSERT_FALSE(data_sample.important);
+	CU_ASSERT_EQUAL(ch->nbr_queued, 0);
+	received_data_sample = false;
+
+	// Nothing is queued, the sample is sent before encoding returns.
+	labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	CU_ASSERT_TRUE(received_data_sample);
+	CU_ASSERT_FALSE(data_sample.important);
+	CU_ASSERT_EQUAL(data_sample.src_chan_id, ch->local_id);
+	CU_ASSERT_EQUAL(data_sample.dest_chan_id, ch->remote_id);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(eq));
+	received_data_sample = false;
+
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
 void test_recv_app_data()
 {
 	unsigned char *buf;
@@ -646,6 +726,9 @@ void test_recv_app_data()
 	proto_sign_pkt.seqno = 1;
 	proto_sign_pkt.app_enc_data.a = buf;
 	proto_sign_pkt.app_enc_data.n_0 = buf_size;
+	proto_sign_pkt.ack_cumulative = 0;
+	proto_sign_pkt.ack_ranges.n_0 = 0;
+	proto_sign_pkt.ack_ranges.a = NULL;
 
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_sign_pkt);
 	free(buf);
@@ -669,6 +752,9 @@ void test_recv_app_data()
 	proto_data_pkt.seqno = 2;
 	proto_data_pkt.app_enc_data.a = buf;
 	proto_data_pkt.app_enc_data.n_0 = buf_size;
+	proto_data_pkt.ack_cumulative = 0;
+	proto_data_pkt.ack_ranges.n_0 = 0;
+	proto_data_pkt.ack_ranges.a = NULL;
 
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_data_pkt);
 	free(buf);
@@ -692,6 +778,568 @@ void test_recv_app_data()
 	mock_test_event_queue_reset(eq);
 }
 
+void test_recv_app_data_packet()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	struct firefly_event *ev;
+	struct firefly_packet *pkt;
+
+	struct labcomm_encoder *data_encoder;
+	struct labcomm_writer *w;
+	w = labcomm_static_buffer_writer_new(labcomm_default_memory);
+	data_encoder = labcomm_encoder_new(w, NULL, labcomm_default_memory,
+			NULL);
+
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	if (ch == NULL)
+		CU_FAIL("Could not create channel");
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+
+	struct labcomm_decoder *ch_dec = firefly_protocol_get_input_stream(ch);
+	labcomm_decoder_register_test_test_var(ch_dec, handle_test_test_var,
+			NULL);
+
+	test_test_var app_pkt;
+	app_pkt = 1;
+	labcomm_encoder_register_test_test_var(data_encoder);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+
+	firefly_protocol_data_sample proto_sign_pkt;
+	proto_sign_pkt.src_chan_id = REMOTE_CHAN_ID;
+	proto_sign_pkt.dest_chan_id = ch->local_id;
+	proto_sign_pkt.important = true;
+	proto_sign_pkt.seqno = 1;
+	proto_sign_pkt.app_enc_data.a = buf;
+	proto_sign_pkt.app_enc_data.n_0 = buf_size;
+	proto_sign_pkt.ack_cumulative = 0;
+	proto_sign_pkt.ack_ranges.n_0 = 0;
+	proto_sign_pkt.ack_ranges.a = NULL;
+
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_sign_pkt);
+	free(buf);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	ev = firefly_event_pop(eq);
+	CU_ASSERT_PTR_NOT_NULL(ev);
+	firefly_event_execute(ev);
+	firefly_event_return(eq, &ev);
+
+	// A sample with acks after the application data, received in a packet.
+	labcomm_encode_test_test_var(data_encoder, &app_pkt);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	firefly_protocol_ack_range range = { .first = 1, .last = 1 };
+	firefly_protocol_data_sample proto_data_pkt;
+	proto_data_pkt.src_chan_id = REMOTE_CHAN_ID;
+	proto_data_pkt.dest_chan_id = ch->local_id;
+	proto_data_pkt.important = false;
+	proto_data_pkt.seqno = 0;
+	proto_data_pkt.app_enc_data.a = buf;
+	proto_data_pkt.app_enc_data.n_0 = buf_size;
+	proto_data_pkt.ack_cumulative = 1;
+	proto_data_pkt.ack_ranges.n_0 = 1;
+	proto_data_pkt.ack_ranges.a = &range;
+
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_data_pkt);
+	free(buf);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	pkt = firefly_packet_new(buf_size);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(pkt);
+	memcpy(pkt->data, buf, buf_size);
+	pkt->size = buf_size;
+	free(buf);
+	firefly_packet_ref(pkt);
+	protocol_packet_received(conn, pkt);
+
+	// The event refers to the packet instead of a copy.
+	CU_ASSERT_EQUAL(pkt->refs, 2);
+	ev = firefly_event_pop(eq);
+	CU_ASSERT_PTR_NOT_NULL(ev);
+	firefly_event_execute(ev);
+	firefly_event_return(eq, &ev);
+	CU_ASSERT_TRUE(sent_app_data);
+	CU_ASSERT_EQUAL(pkt->refs, 1);
+	sent_app_data = false;
+	firefly_packet_release(pkt);
+
+	labcomm_encoder_free(data_encoder);
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
+static test_test_var latest_value;
+static size_t latest_nbr_delivered = 0;
+static void handle_latest_test_var(test_test_var *data, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	latest_value = *data;
+	latest_nbr_delivered++;
+}
+
+void test_send_latest()
+{
+	test_test_var app_test_data;
+	struct firefly_event *ev;
+	struct labcomm_decoder *test_dec_2;
+	struct firefly_channel_stats stats;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+	firefly_channel_set_latest(ch, true);
+
+	struct labcomm_reader *r;
+	r = labcomm_static_buffer_reader_new(labcomm_default_memory);
+	test_dec_2 = labcomm_decoder_new(r, NULL, labcomm_default_memory, NULL);
+	labcomm_decoder_register_test_test_var(test_dec_2,
+			handle_latest_test_var, NULL);
+
+	// The signature is important and sent as usual.
+	struct labcomm_encoder *ch_enc = firefly_protocol_get_output_stream(ch);
+	labcomm_encoder_register_test_test_var(ch_enc);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE_FATAL(received_data_sample);
+	received_data_sample = false;
+	labcomm_decoder_ioctl(test_dec_2, LABCOMM_IOCTL_READER_SET_BUFFER,
+			data_sample.app_enc_data.a,
+			data_sample.app_enc_data.n_0);
+	labcomm_decoder_decode_one(test_dec_2);
+
+	// Samples encoded before the first is sent replace it.
+	for (app_test_data = 1; app_test_data <= 3; app_test_data++)
+		labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	ev = firefly_event_pop(eq);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(ev);
+	firefly_event_execute(ev);
+	firefly_event_return(eq, &ev);
+	CU_ASSERT_PTR_NULL(firefly_event_pop(eq));
+	CU_ASSERT_TRUE_FATAL(received_data_sample);
+	received_data_sample = false;
+	CU_ASSERT_FALSE(data_sample.important);
+	CU_ASSERT_EQUAL(data_sample.seqno, 1);
+	labcomm_decoder_ioctl(test_dec_2, LABCOMM_IOCTL_READER_SET_BUFFER,
+			data_sample.app_enc_data.a,
+			data_sample.app_enc_data.n_0);
+	labcomm_decoder_decode_one(test_dec_2);
+	CU_ASSERT_EQUAL(latest_nbr_delivered, 1);
+	CU_ASSERT_EQUAL(latest_value, 3);
+
+	firefly_channel_get_stats(ch, &stats);
+	CU_ASSERT_EQUAL(stats.nbr_superseded, 2);
+
+	// A sample encoded after the last one is sent gets an event of its own.
+	app_test_data = 4;
+	labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE(received_data_sample);
+	received_data_sample = false;
+	CU_ASSERT_EQUAL(data_sample.seqno, 2);
+	firefly_channel_get_stats(ch, &stats);
+	CU_ASSERT_EQUAL(stats.nbr_superseded, 2);
+
+	latest_nbr_delivered = 0;
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	labcomm_decoder_free(test_dec_2);
+	mock_test_event_queue_reset(eq);
+}
+
+static void recv_latest_sample(struct firefly_connection *conn,
+		struct firefly_channel *ch, struct labcomm_encoder *data_encoder,
+		int seqno, test_test_var value)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_data_sample pkt;
+
+	labcomm_encode_test_test_var(data_encoder, &value);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	pkt.src_chan_id = REMOTE_CHAN_ID;
+	pkt.dest_chan_id = ch->local_id;
+	pkt.important = false;
+	pkt.seqno = seqno;
+	pkt.app_enc_data.a = buf;
+	pkt.app_enc_data.n_0 = buf_size;
+	pkt.ack_cumulative = 0;
+	pkt.ack_ranges.n_0 = 0;
+	pkt.ack_ranges.a = NULL;
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &pkt);
+	free(buf);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_test(eq, 1);
+}
+
+void test_recv_latest()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	struct firefly_channel_stats stats;
+	struct labcomm_encoder *data_encoder;
+	struct labcomm_writer *w;
+	w = labcomm_static_buffer_writer_new(labcomm_default_memory);
+	data_encoder = labcomm_encoder_new(w, NULL, labcomm_default_memory,
+			NULL);
+
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+	labcomm_decoder_register_test_test_var(
+			firefly_protocol_get_input_stream(ch),
+			handle_latest_test_var, NULL);
+
+	labcomm_encoder_register_test_test_var(data_encoder);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	firefly_protocol_data_sample proto_sign_pkt;
+	proto_sign_pkt.src_chan_id = REMOTE_CHAN_ID;
+	proto_sign_pkt.dest_chan_id = ch->local_id;
+	proto_sign_pkt.important = true;
+	proto_sign_pkt.seqno = 1;
+	proto_sign_pkt.app_enc_data.a = buf;
+	proto_sign_pkt.app_enc_data.n_0 = buf_size;
+	proto_sign_pkt.ack_cumulative = 0;
+	proto_sign_pkt.ack_ranges.n_0 = 0;
+	proto_sign_pkt.ack_ranges.a = NULL;
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_sign_pkt);
+	free(buf);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
+
+	recv_latest_sample(conn, ch, data_encoder, 1, 1);
+	CU_ASSERT_EQUAL(latest_value, 1);
+	// Sample 2 is lost, or late.
+	recv_latest_sample(conn, ch, data_encoder, 3, 3);
+	CU_ASSERT_EQUAL(latest_value, 3);
+	recv_latest_sample(conn, ch, data_encoder, 2, 2);
+	CU_ASSERT_EQUAL(latest_value, 3);
+	recv_latest_sample(conn, ch, data_encoder, 4, 4);
+	CU_ASSERT_EQUAL(latest_value, 4);
+	// Samples not sent in latest value mode are always delivered.
+	recv_latest_sample(conn, ch, data_encoder, 0, 5);
+	CU_ASSERT_EQUAL(latest_value, 5);
+	CU_ASSERT_EQUAL(latest_nbr_delivered, 4);
+
+	firefly_channel_get_stats(ch, &stats);
+	CU_ASSERT_EQUAL(stats.nbr_lost, 1);
+	CU_ASSERT_EQUAL(stats.nbr_stale, 1);
+	CU_ASSERT_EQUAL(stats.nbr_superseded, 0);
+
+	latest_nbr_delivered = 0;
+	labcomm_encoder_free(data_encoder);
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
+#define TEST_FRAGMENT_SIZE (16)
+
+static test_test_var_large large_value;
+static size_t large_nbr_delivered = 0;
+static void handle_large_test_var(test_test_var_large *data, void *ctx)
+{
+	UNUSED_VAR(ctx);
+	large_value = *data;
+	large_nbr_delivered++;
+}
+
+void test_send_fragmented()
+{
+	test_test_var_large app_test_data;
+	struct labcomm_decoder *test_dec_2;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+
+	struct labcomm_reader *r;
+	r = labcomm_static_buffer_reader_new(labcomm_default_memory);
+	test_dec_2 = labcomm_decoder_new(r, NULL, labcomm_default_memory, NULL);
+	labcomm_decoder_register_test_test_var_large(test_dec_2,
+			handle_large_test_var, NULL);
+
+	struct labcomm_encoder *ch_enc = firefly_protocol_get_output_stream(ch);
+	labcomm_encoder_register_test_test_var_large(ch_enc);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE_FATAL(received_data_sample);
+	received_data_sample = false;
+	labcomm_decoder_ioctl(test_dec_2, LABCOMM_IOCTL_READER_SET_BUFFER,
+			data_sample.app_enc_data.a,
+			data_sample.app_enc_data.n_0);
+	labcomm_decoder_decode_one(test_dec_2);
+
+	// A sample larger than a packet is sent in fragments.
+	conn->transport->mtu = FIREFLY_DATA_SAMPLE_OVERHEAD + TEST_FRAGMENT_SIZE;
+	for (int i = 0; i < 10; i++)
+		app_test_data.data.a[i] = i;
+	labcomm_encode_test_test_var_large(ch_enc, &app_test_data);
+	event_execute_test(eq, 1);
+	CU_ASSERT_FALSE(received_data_sample);
+	CU_ASSERT_TRUE_FATAL(nbr_data_fragments > 1);
+	CU_ASSERT_EQUAL(nbr_data_fragments,
+			(size_t) (data_fragment.total_size + TEST_FRAGMENT_SIZE - 1) /
+			TEST_FRAGMENT_SIZE);
+	CU_ASSERT_EQUAL_FATAL(data_fragment_received, (size_t) data_fragment.total_size);
+	CU_ASSERT_FALSE(data_fragment.important);
+	CU_ASSERT_EQUAL(data_fragment.sample_id, 1);
+	CU_ASSERT_EQUAL(data_fragment.seqno, 0);
+	labcomm_decoder_ioctl(test_dec_2, LABCOMM_IOCTL_READER_SET_BUFFER,
+			data_fragment_data, data_fragment.total_size);
+	labcomm_decoder_decode_one(test_dec_2);
+	CU_ASSERT_EQUAL(large_nbr_delivered, 1);
+	for (int i = 0; i < 10; i++)
+		CU_ASSERT_EQUAL(large_value.data.a[i], i);
+	nbr_data_fragments = 0;
+	data_fragment_received = 0;
+
+	// In latest value mode every fragment carries the sequence number.
+	firefly_channel_set_latest(ch, true);
+	labcomm_encode_test_test_var_large(ch_enc, &app_test_data);
+	event_execute_test(eq, 1);
+	CU_ASSERT_FALSE(received_data_sample);
+	CU_ASSERT_EQUAL(data_fragment_received, (size_t) data_fragment.total_size);
+	CU_ASSERT_EQUAL(data_fragment.sample_id, 2);
+	CU_ASSERT_EQUAL(data_fragment.seqno, 1);
+
+	nbr_data_fragments = 0;
+	data_fragment_received = 0;
+	large_nbr_delivered = 0;
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	labcomm_decoder_free(test_dec_2);
+	mock_test_event_queue_reset(eq);
+}
+
+static void recv_fragment(struct firefly_connection *conn,
+		struct firefly_channel *ch, unsigned char *sample, size_t size,
+		int sample_id, size_t index)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_data_fragment pkt;
+
+	pkt.src_chan_id = REMOTE_CHAN_ID;
+	pkt.dest_chan_id = ch->local_id;
+	pkt.seqno = 0;
+	pkt.important = false;
+	pkt.sample_id = sample_id;
+	pkt.offset = index * TEST_FRAGMENT_SIZE;
+	pkt.total_size = size;
+	pkt.data.a = sample + pkt.offset;
+	pkt.data.n_0 = size - pkt.offset < TEST_FRAGMENT_SIZE ?
+		size - pkt.offset : TEST_FRAGMENT_SIZE;
+	labcomm_encode_firefly_protocol_data_fragment(test_enc, &pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_test(eq, 1);
+}
+
+void test_recv_fragmented()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	unsigned char *sample;
+	size_t sample_size;
+	size_t nbr_fragments;
+	test_test_var_large app_test_data;
+	struct firefly_channel_stats stats;
+	struct labcomm_encoder *data_encoder;
+	struct labcomm_writer *w;
+	w = labcomm_static_buffer_writer_new(labcomm_default_memory);
+	data_encoder = labcomm_encoder_new(w, NULL, labcomm_default_memory,
+			NULL);
+
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+	labcomm_decoder_register_test_test_var_large(
+			firefly_protocol_get_input_stream(ch),
+			handle_large_test_var, NULL);
+
+	labcomm_encoder_register_test_test_var_large(data_encoder);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	firefly_protocol_data_sample proto_sign_pkt;
+	proto_sign_pkt.src_chan_id = REMOTE_CHAN_ID;
+	proto_sign_pkt.dest_chan_id = ch->local_id;
+	proto_sign_pkt.important = true;
+	proto_sign_pkt.seqno = 1;
+	proto_sign_pkt.app_enc_data.a = buf;
+	proto_sign_pkt.app_enc_data.n_0 = buf_size;
+	proto_sign_pkt.ack_cumulative = 0;
+	proto_sign_pkt.ack_ranges.n_0 = 0;
+	proto_sign_pkt.ack_ranges.a = NULL;
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &proto_sign_pkt);
+	free(buf);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
+
+	for (int i = 0; i < 10; i++)
+		app_test_data.data.a[i] = 10 - i;
+	labcomm_encode_test_test_var_large(data_encoder, &app_test_data);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&sample, &sample_size);
+	nbr_fragments = (sample_size + TEST_FRAGMENT_SIZE - 1) /
+		TEST_FRAGMENT_SIZE;
+	CU_ASSERT_TRUE_FATAL(nbr_fragments > 1);
+
+	// Fragments may arrive in any order, the sample is decoded once whole.
+	for (size_t i = nbr_fragments; i-- > 0;) {
+		recv_fragment(conn, ch, sample, sample_size, 1, i);
+		CU_ASSERT_EQUAL(large_nbr_delivered, i == 0 ? 1 : 0);
+	}
+	for (int i = 0; i < 10; i++)
+		CU_ASSERT_EQUAL(large_value.data.a[i], 10 - i);
+	CU_ASSERT_PTR_NULL(ch->reassembly[0].data);
+	CU_ASSERT_EQUAL(conn->reassembly_size, 0);
+
+	// A sample missing fragments is lost when the next one begins.
+	recv_fragment(conn, ch, sample, sample_size, 2, 0);
+	CU_ASSERT_PTR_NOT_NULL(ch->reassembly[0].data);
+	CU_ASSERT_EQUAL(conn->reassembly_size, sample_size);
+	for (size_t i = 0; i < nbr_fragments; i++)
+		recv_fragment(conn, ch, sample, sample_size, 3, i);
+	CU_ASSERT_EQUAL(large_nbr_delivered, 2);
+	CU_ASSERT_EQUAL(conn->reassembly_size, 0);
+	firefly_channel_get_stats(ch, &stats);
+	CU_ASSERT_EQUAL(stats.nbr_lost, 1);
+
+	// A sample exceeding the reassembly limit is dropped.
+	firefly_connection_set_reassembly_max(conn, sample_size);
+	conn->reassembly_size = 1;
+	recv_fragment(conn, ch, sample, sample_size, 4, 0);
+	CU_ASSERT_PTR_NULL(ch->reassembly[0].data);
+	CU_ASSERT_EQUAL(conn->reassembly_size, 1);
+	firefly_channel_get_stats(ch, &stats);
+	CU_ASSERT_EQUAL(stats.nbr_lost, 2);
+	conn->reassembly_size = 0;
+
+	free(sample);
+	large_nbr_delivered = 0;
+	labcomm_encoder_free(data_encoder);
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
+static size_t nbr_coalesced_writes = 0;
+static size_t nbr_coalesced_frames = 0;
+static size_t coalesced_size = 0;
+static void transport_write_coalesced(unsigned char *data, size_t size,
+		struct firefly_connection *conn, bool important, uint32_t *id)
+{
+	UNUSED_VAR(conn);
+	UNUSED_VAR(important);
+	UNUSED_VAR(id);
+	nbr_coalesced_writes++;
+	coalesced_size = size;
+	labcomm_decoder_ioctl(test_dec, LABCOMM_IOCTL_READER_SET_BUFFER,
+			data, size);
+	while (labcomm_decoder_decode_one(test_dec) > 0)
+		nbr_coalesced_frames++;
+}
+
+void test_send_coalesced()
+{
+	test_test_var app_test_data = 1;
+	size_t frame_size;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn =
+		setup_test_conn_new(&ca, eq);
+
+	struct firefly_channel *ch = firefly_channel_new(conn);
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+
+	struct labcomm_encoder *ch_enc = firefly_protocol_get_output_stream(ch);
+	labcomm_encoder_register_test_test_var(ch_enc);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE_FATAL(received_data_sample);
+	received_data_sample = false;
+
+	// Packets are held back until the queued events are executed.
+	conn->transport->write = transport_write_coalesced;
+	firefly_connection_set_coalescing(conn, true, 0);
+	for (int i = 0; i < 3; i++)
+		labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	event_execute_test(eq, 3);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 0);
+	event_execute_test(eq, 1);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 1);
+	CU_ASSERT_EQUAL(nbr_coalesced_frames, 3);
+	CU_ASSERT_EQUAL(coalesced_size % 3, 0);
+	frame_size = coalesced_size / 3;
+	nbr_coalesced_writes = 0;
+	nbr_coalesced_frames = 0;
+
+	// The held back packets are sent when the next does not fit.
+	conn->transport->mtu = 2 * frame_size;
+	for (int i = 0; i < 3; i++)
+		labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	event_execute_test(eq, 3);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 1);
+	CU_ASSERT_EQUAL(nbr_coalesced_frames, 2);
+	CU_ASSERT_EQUAL(coalesced_size, 2 * frame_size);
+	event_execute_test(eq, 1);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 2);
+	CU_ASSERT_EQUAL(nbr_coalesced_frames, 3);
+	CU_ASSERT_EQUAL(coalesced_size, frame_size);
+	nbr_coalesced_writes = 0;
+	nbr_coalesced_frames = 0;
+	conn->transport->mtu = 0;
+
+	// Disabling the coalescing sends the held back packets at once.
+	labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	event_execute_test(eq, 1);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 0);
+	firefly_connection_set_coalescing(conn, false, 0);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 1);
+	CU_ASSERT_EQUAL(nbr_coalesced_frames, 1);
+	labcomm_encode_test_test_var(ch_enc, &app_test_data);
+	event_execute_test(eq, 1);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 2);
+	CU_ASSERT_EQUAL(nbr_coalesced_frames, 2);
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(nbr_coalesced_writes, 2);
+	CU_ASSERT_EQUAL(conn->coalesce_flush_id, 0);
+
+	nbr_coalesced_writes = 0;
+	nbr_coalesced_frames = 0;
+	received_data_sample = false;
+	conn->transport->write = transport_write_test_decoder;
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
 static bool chan_restrict_called = false;
 static bool chan_restrict_accept = true;
 static bool test_chan_restrict(struct firefly_channel *chan)
@@ -729,7 +1377,7 @@ void test_restrict_recv()
 
 	// create restrict channel packet
 	firefly_protocol_channel_restrict_request chan_rest;
-	chan_rest.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_rest.dest_chan_id = newest_channel(conn)->local_id;
 	chan_rest.source_chan_id = REMOTE_CHAN_ID;
 	chan_rest.restricted = true;
 	labcomm_encode_firefly_protocol_channel_restrict_request(test_enc, &chan_rest);
@@ -777,7 +1425,7 @@ void test_restrict_recv_dup()
 
 	// create restrict channel packet
 	firefly_protocol_channel_restrict_request chan_rest;
-	chan_rest.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_rest.dest_chan_id = newest_channel(conn)->local_id;
 	chan_rest.source_chan_id = REMOTE_CHAN_ID;
 	chan_rest.restricted = true;
 	labcomm_encode_firefly_protocol_channel_restrict_request(test_enc, &chan_rest);
@@ -823,7 +1471,7 @@ void test_restrict_recv_reject()
 
 	// create restrict channel packet
 	firefly_protocol_channel_restrict_request chan_rest;
-	chan_rest.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_rest.dest_chan_id = newest_channel(conn)->local_id;
 	chan_rest.source_chan_id = REMOTE_CHAN_ID;
 	chan_rest.restricted = true;
 	labcomm_encode_firefly_protocol_channel_restrict_request(test_enc, &chan_rest);
@@ -871,7 +1519,7 @@ void test_unrestrict_recv()
 
 	// create restrict channel packet
 	firefly_protocol_channel_restrict_request chan_rest;
-	chan_rest.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_rest.dest_chan_id = newest_channel(conn)->local_id;
 	chan_rest.source_chan_id = REMOTE_CHAN_ID;
 	chan_rest.restricted = false;
 	labcomm_encode_firefly_protocol_channel_restrict_request(test_enc, &chan_rest);
@@ -923,7 +1571,7 @@ void test_unrestrict_recv_dup()
 
 	// create restrict channel packet
 	firefly_protocol_channel_restrict_request chan_rest;
-	chan_rest.dest_chan_id = conn->chan_list->chan->local_id;
+	chan_rest.dest_chan_id = newest_channel(conn)->local_id;
 	chan_rest.source_chan_id = REMOTE_CHAN_ID;
 	chan_rest.restricted = false;
 	labcomm_encode_firefly_protocol_channel_restrict_request(test_enc, &chan_rest);
@@ -985,7 +1633,7 @@ void test_restrict_req()
 
 	// create restrict channel packet
 	firefly_protocol_channel_restrict_ack rest_ack;
-	rest_ack.dest_chan_id = conn->chan_list->chan->local_id;
+	rest_ack.dest_chan_id = newest_channel(conn)->local_id;
 	rest_ack.source_chan_id = REMOTE_CHAN_ID;
 	rest_ack.restricted = true;
 	labcomm_encode_firefly_protocol_channel_restrict_ack(test_enc, &rest_ack);
@@ -1045,7 +1693,7 @@ void test_restrict_req_dup()
 
 	// create restrict channel packet
 	firefly_protocol_channel_restrict_ack rest_ack;
-	rest_ack.dest_chan_id = conn->chan_list->chan->local_id;
+	rest_ack.dest_chan_id = newest_channel(conn)->local_id;
 	rest_ack.source_chan_id = REMOTE_CHAN_ID;
 	rest_ack.restricted = true;
 	labcomm_encode_firefly_protocol_channel_restrict_ack(test_enc, &rest_ack);
@@ -1128,7 +1776,7 @@ void trans_w(struct data_space **space,
 			 size_t data_size,
 			 struct firefly_connection *conn,
 			 bool important,
-			 unsigned char *id)
+			 uint32_t *id)
 {
 	UNUSED_VAR(conn);
 	UNUSED_VAR(important);
@@ -1155,14 +1803,14 @@ void trans_w(struct data_space **space,
 
 void trans_w_from_conn_0(unsigned char *data, size_t data_size,
 					 struct firefly_connection *conn, bool important,
-					 unsigned char *id)
+					 uint32_t *id)
 {
 	trans_w(&space_from_conn[0], data, data_size, conn, important, id);
 }
 
 void trans_w_from_conn_1(unsigned char *data, size_t data_size,
 					 struct firefly_connection *conn, bool important,
-					 unsigned char *id)
+					 uint32_t *id)
 {
 	trans_w(&space_from_conn[1], data, data_size, conn, important, id);
 }
@@ -1212,7 +1860,7 @@ void handle_ttv(test_test_var *ttv, void *cont)
 	*((test_test_var *) cont) = *ttv;
 }
 
-void mock_ack(unsigned char id, struct firefly_connection *conn) {
+void mock_ack(uint32_t id, struct firefly_connection *conn) {
 	UNUSED_VAR(id);
 	UNUSED_VAR(conn);
 }
@@ -1627,14 +2275,14 @@ void test_chan_open_close_multiple()
 	chan_opened_called = false;
 
 	// Test first channel is created with correct id's
-	CU_ASSERT_PTR_NOT_NULL(conn_open->chan_list->chan);
-	CU_ASSERT_PTR_NOT_NULL(conn_recv->chan_list->chan);
-	CU_ASSERT_EQUAL(conn_recv->chan_list->chan->local_id,
-			conn_open->chan_list->chan->remote_id);
-	CU_ASSERT_EQUAL(conn_recv->chan_list->chan->remote_id,
-			conn_open->chan_list->chan->local_id);
-	int chan_id_conn_recv = conn_recv->chan_list->chan->local_id;
-	int chan_id_conn_open = conn_open->chan_list->chan->local_id;
+	CU_ASSERT_PTR_NOT_NULL(newest_channel(conn_open));
+	CU_ASSERT_PTR_NOT_NULL(newest_channel(conn_recv));
+	CU_ASSERT_EQUAL(newest_channel(conn_recv)->local_id,
+			newest_channel(conn_open)->remote_id);
+	CU_ASSERT_EQUAL(newest_channel(conn_recv)->remote_id,
+			newest_channel(conn_open)->local_id);
+	int chan_id_conn_recv = newest_channel(conn_recv)->local_id;
+	int chan_id_conn_open = newest_channel(conn_open)->local_id;
 
 	// Init open channel from conn_recv
 	firefly_channel_open(conn_recv);
@@ -1675,43 +2323,43 @@ void test_chan_open_close_multiple()
 	// asserted
 	// here, if these assertions ever change it must be reflected in the app
 	// data transfer test.
-	CU_ASSERT_PTR_NOT_NULL(conn_open->chan_list->next->chan);
-	CU_ASSERT_PTR_NOT_NULL(conn_recv->chan_list->next->chan);
-	CU_ASSERT_NOT_EQUAL(conn_recv->chan_list->chan->local_id,
+	CU_ASSERT_PTR_NOT_NULL(oldest_channel(conn_open));
+	CU_ASSERT_PTR_NOT_NULL(oldest_channel(conn_recv));
+	CU_ASSERT_NOT_EQUAL(newest_channel(conn_recv)->local_id,
 			chan_id_conn_recv);
-	CU_ASSERT_NOT_EQUAL(conn_open->chan_list->chan->local_id,
+	CU_ASSERT_NOT_EQUAL(newest_channel(conn_open)->local_id,
 			chan_id_conn_open);
-	CU_ASSERT_EQUAL(conn_recv->chan_list->chan->local_id,
-			conn_open->chan_list->chan->remote_id);
-	CU_ASSERT_EQUAL(conn_recv->chan_list->chan->remote_id,
-			conn_open->chan_list->chan->local_id);
+	CU_ASSERT_EQUAL(newest_channel(conn_recv)->local_id,
+			newest_channel(conn_open)->remote_id);
+	CU_ASSERT_EQUAL(newest_channel(conn_recv)->remote_id,
+			newest_channel(conn_open)->local_id);
 
 	// Setup app data transfer, assumes the channels are placed identically
 	// in both connections, ie the first channel in conn_open corresponds to
 	// the first channel in conn_recv.
 	struct labcomm_encoder *open_chan1_enc =
-		firefly_protocol_get_output_stream( conn_open->chan_list->chan);
+		firefly_protocol_get_output_stream( newest_channel(conn_open));
 	struct labcomm_decoder *open_chan1_dec =
-		firefly_protocol_get_input_stream( conn_open->chan_list->chan);
+		firefly_protocol_get_input_stream( newest_channel(conn_open));
 
 	struct labcomm_encoder *open_chan2_enc =
 		firefly_protocol_get_output_stream(
-				conn_open->chan_list->next->chan);
+				oldest_channel(conn_open));
 	struct labcomm_decoder *open_chan2_dec =
 		firefly_protocol_get_input_stream(
-				conn_open->chan_list->next->chan);
+				oldest_channel(conn_open));
 
 	struct labcomm_encoder *recv_chan1_enc =
-		firefly_protocol_get_output_stream( conn_recv->chan_list->chan);
+		firefly_protocol_get_output_stream( newest_channel(conn_recv));
 	struct labcomm_decoder *recv_chan1_dec =
-		firefly_protocol_get_input_stream( conn_recv->chan_list->chan);
+		firefly_protocol_get_input_stream( newest_channel(conn_recv));
 
 	struct labcomm_encoder *recv_chan2_enc =
 		firefly_protocol_get_output_stream(
-				conn_recv->chan_list->next->chan);
+				oldest_channel(conn_recv));
 	struct labcomm_decoder *recv_chan2_dec =
 		firefly_protocol_get_input_stream(
-				conn_recv->chan_list->next->chan);
+				oldest_channel(conn_recv));
 
 	// Register type on the decoders
 	labcomm_decoder_register_test_test_var(open_chan1_dec,
@@ -1824,9 +2472,9 @@ void test_chan_open_close_multiple()
 
 	// Close both channels from conn_open
 	// save channel id's form testing later
-	chan_id_conn_open = conn_open->chan_list->chan->local_id;
-	chan_id_conn_recv = conn_open->chan_list->chan->remote_id;
-	firefly_channel_close(conn_open->chan_list->chan);
+	chan_id_conn_open = newest_channel(conn_open)->local_id;
+	chan_id_conn_recv = newest_channel(conn_open)->remote_id;
+	firefly_channel_close(newest_channel(conn_open));
 	ev = firefly_event_pop(eq);
 	CU_ASSERT_PTR_NOT_NULL(ev);
 	firefly_event_execute(ev);
@@ -1843,16 +2491,16 @@ void test_chan_open_close_multiple()
 	firefly_event_return(eq, &ev);
 
 	// Test only one channel remains
-	CU_ASSERT_PTR_NULL(conn_open->chan_list->next);
-	CU_ASSERT_PTR_NULL(conn_recv->chan_list->next);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn_open), 1);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn_recv), 1);
 	// Test the not closed channel remains
-	CU_ASSERT_NOT_EQUAL(conn_recv->chan_list->chan->local_id,
+	CU_ASSERT_NOT_EQUAL(newest_channel(conn_recv)->local_id,
 			chan_id_conn_recv);
-	CU_ASSERT_NOT_EQUAL(conn_open->chan_list->chan->local_id,
+	CU_ASSERT_NOT_EQUAL(newest_channel(conn_open)->local_id,
 			chan_id_conn_open);
 
 	// Close the remaining channel
-	firefly_channel_close(conn_open->chan_list->chan);
+	firefly_channel_close(newest_channel(conn_open));
 	ev = firefly_event_pop(eq);
 	CU_ASSERT_PTR_NOT_NULL(ev);
 	firefly_event_execute(ev);
@@ -1868,8 +2516,8 @@ void test_chan_open_close_multiple()
 	firefly_event_execute(ev);
 	firefly_event_return(eq, &ev);
 	// Test no channel remains
-	CU_ASSERT_PTR_NULL(conn_open->chan_list);
-	CU_ASSERT_PTR_NULL(conn_recv->chan_list);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn_open), 0);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn_recv), 0);
 
 	// Clean up
 	firefly_connection_close(conn_open);
@@ -1880,18 +2528,132 @@ void test_chan_open_close_multiple()
 
 void test_nbr_chan()
 {
-	struct firefly_connection conn;
-	struct channel_list_node ln[2];
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn = setup_test_conn_new(&ca, eq);
+	struct firefly_channel *chans[2];
+
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 0);
+
+	chans[0] = firefly_channel_new(conn);
+	add_channel_to_connection(chans[0], conn);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 1);
 
-	conn.chan_list = NULL;
-	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(&conn), 0);
+	chans[1] = firefly_channel_new(conn);
+	add_channel_to_connection(chans[1], conn);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 2);
+
+	firefly_channel_free(remove_channel_from_connection(chans[0], conn));
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn), 1);
+
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
 
-	ln[0].next = NULL;
-	conn.chan_list = &ln[0];
-	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(&conn), 1);
+#define NBR_TABLE_CHANS (100)
 
-	ln[1].next = NULL;
-	conn.chan_list->next = &ln[1];
-	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(&conn), 2);
+void test_chan_table()
+{
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn = setup_test_conn_new(&ca, eq);
+	struct firefly_channel *chans[NBR_TABLE_CHANS];
+	struct firefly_channel *ch;
+
+	// Remote ids spaced to make them collide in the remote index.
+	for (int i = 0; i < NBR_TABLE_CHANS; i++) {
+		chans[i] = firefly_channel_new(conn);
+		CU_ASSERT_EQUAL(chans[i]->local_id, i);
+		chans[i]->remote_id = 1024 * i;
+		add_channel_to_connection(chans[i], conn);
+	}
+	for (int i = 0; i < NBR_TABLE_CHANS; i++) {
+		CU_ASSERT_PTR_EQUAL(find_channel_by_local_id(conn, i), chans[i]);
+		CU_ASSERT_PTR_EQUAL(find_channel_by_remote_id(conn, 1024 * i),
+				chans[i]);
+	}
+	CU_ASSERT_PTR_NULL(find_channel_by_local_id(conn, NBR_TABLE_CHANS));
+	CU_ASSERT_PTR_NULL(find_channel_by_local_id(conn, CHANNEL_ID_NOT_SET));
+	CU_ASSERT_PTR_NULL(find_channel_by_remote_id(conn, 1));
+
+	// Removing every other channel leaves the rest to be found.
+	for (int i = 0; i < NBR_TABLE_CHANS; i += 2)
+		firefly_channel_free(remove_channel_from_connection(chans[i], conn));
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn),
+			NBR_TABLE_CHANS / 2);
+	for (int i = 0; i < NBR_TABLE_CHANS; i++) {
+		if (i % 2 == 0) {
+			CU_ASSERT_PTR_NULL(find_channel_by_local_id(conn, i));
+			CU_ASSERT_PTR_NULL(find_channel_by_remote_id(conn, 1024 * i));
+		} else {
+			CU_ASSERT_PTR_EQUAL(find_channel_by_local_id(conn, i), chans[i]);
+			CU_ASSERT_PTR_EQUAL(find_channel_by_remote_id(conn, 1024 * i),
+					chans[i]);
+		}
+	}
+
+	/*
+	 * The released ids are reused in the order they were released, but not
+	 * the last ones released.
+	 */
+	for (int i = 0; i < NBR_TABLE_CHANS; i += 2) {
+		int reused = (NBR_TABLE_CHANS / 2 - FIREFLY_CHANNEL_ID_QUARANTINE) * 2;
+
+		ch = firefly_channel_new(conn);
+		if (i < reused) {
+			CU_ASSERT_EQUAL(ch->local_id, i);
+		} else {
+			CU_ASSERT_EQUAL(ch->local_id, NBR_TABLE_CHANS + (i - reused) / 2);
+		}
+		add_channel_to_connection(ch, conn);
+		CU_ASSERT_PTR_NULL(find_channel_by_remote_id(conn, 1024 * i));
+		set_channel_remote_id(ch, 1024 * i + 1);
+		CU_ASSERT_PTR_EQUAL(find_channel_by_remote_id(conn, 1024 * i + 1),
+				ch);
+	}
+	ch = firefly_channel_new(conn);
+	CU_ASSERT_EQUAL(ch->local_id,
+			NBR_TABLE_CHANS + FIREFLY_CHANNEL_ID_QUARANTINE);
+	firefly_channel_free(ch);
+
+	// Changing the remote id moves the channel in the remote index.
+	set_channel_remote_id(chans[1], 7);
+	CU_ASSERT_PTR_NULL(find_channel_by_remote_id(conn, 1024));
+	CU_ASSERT_PTR_EQUAL(find_channel_by_remote_id(conn, 7), chans[1]);
+	CU_ASSERT_EQUAL(firefly_number_channels_in_connection(conn),
+			NBR_TABLE_CHANS);
+
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
+	mock_test_event_queue_reset(eq);
+}
+
+void test_chan_stale_packet()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_ack pkt;
+	struct firefly_connection_actions ca = {0};
+	struct firefly_connection *conn = setup_test_conn_new(&ca, eq);
+	struct firefly_channel *ch = firefly_channel_new(conn);
+
+	ch->remote_id = REMOTE_CHAN_ID;
+	add_channel_to_connection(ch, conn);
+
+	// An ack from an earlier remote channel on the same local id.
+	pkt.dest_chan_id = ch->local_id;
+	pkt.src_chan_id = REMOTE_CHAN_ID + 1;
+	pkt.seqno = 1;
+	labcomm_encode_firefly_protocol_ack(test_enc, &pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_all_test(eq);
+
+	// It is dropped without closing the remote channel.
+	CU_ASSERT_FALSE(received_channel_close);
+	CU_ASSERT_PTR_EQUAL(find_channel_by_local_id(conn, ch->local_id), ch);
+
+	firefly_connection_close(conn);
+	event_execute_all_test(eq);
 	mock_test_event_queue_reset(eq);
 }
@@ -29,10 +29,19 @@ void test_restrict_req_dup();
 
 /* Test data exchange */
 void test_send_app_data();
+void test_send_app_data_direct();
 void test_recv_app_data();
+void test_recv_app_data_packet();
+void test_send_latest();
+void test_recv_latest();
+void test_send_fragmented();
+void test_recv_fragmented();
+void test_send_coalesced();
 void test_transmit_app_data_over_mock_trans_layer();
 void test_chan_open_close_multiple();
 void test_chan_app_data_multiple();
 void test_nbr_chan();
+void test_chan_table();
+void test_chan_stale_packet();
 
 #endif
@@ -71,7 +71,7 @@ static int free_plat_conn_test(struct firefly_connection *conn)
 
 static bool transport_sent = false;
 static void transport_write_mock(unsigned char *data, size_t size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, uint32_t *id)
 {
 	UNUSED_VAR(data);
 	UNUSED_VAR(size);
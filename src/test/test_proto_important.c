@@ -1,10 +1,12 @@
 
+#include <errno.h>
 #include <stdbool.h>
 
 #include "CUnit/Basic.h"
 #include <limits.h>
 #include <labcomm.h>
 #include <labcomm_ioctl.h>
+#include <labcomm_default_memory.h>
 
 #include <utils/firefly_event_queue.h>
 #include <utils/cppmacros.h>
@@ -30,6 +32,19 @@ extern firefly_protocol_channel_request channel_request;
 extern firefly_protocol_channel_response channel_response;
 extern firefly_protocol_channel_ack channel_ack;
 extern bool received_ack;
+extern bool received_data_sample;
+extern firefly_protocol_ack_ranges ack_ranges;
+extern bool received_ack_ranges;
+extern firefly_protocol_data_fragment data_fragment;
+extern size_t nbr_data_fragments;
+extern size_t data_fragment_received;
+extern firefly_protocol_channel_credit channel_credit;
+extern bool received_channel_credit;
+extern firefly_protocol_heartbeat heartbeat;
+extern bool received_heartbeat;
+
+extern bool was_in_error;
+extern enum firefly_error expected_error;
 
 struct firefly_event_queue *eq;
 
@@ -57,7 +72,7 @@ int clean_suit_proto_important()
 
 bool mock_transport_written = false;
 void mock_transport_write_important(unsigned char *data, size_t size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, uint32_t *id)
 {
 	UNUSED_VAR(data);
 	UNUSED_VAR(size);
@@ -73,7 +88,7 @@ void mock_transport_write_important(unsigned char *data, size_t size,
 }
 
 bool mock_transport_acked = false;
-void mock_transport_ack(unsigned char id, struct firefly_connection *conn)
+void mock_transport_ack(uint32_t id, struct firefly_connection *conn)
 {
 	UNUSED_VAR(conn);
 	CU_ASSERT_EQUAL(id, TEST_IMPORTANT_ID);
@@ -260,6 +275,9 @@ void test_important_send_ack()
 	sample_pkt.important = true;
 	sample_pkt.app_enc_data.a = NULL;
 	sample_pkt.app_enc_data.n_0 = 0;
+	sample_pkt.ack_cumulative = 0;
+	sample_pkt.ack_ranges.n_0 = 0;
+	sample_pkt.ack_ranges.a = NULL;
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -301,6 +319,9 @@ void test_not_important_not_send_ack()
 	sample_pkt.important = false;
 	sample_pkt.app_enc_data.a = NULL;
 	sample_pkt.app_enc_data.n_0 = 0;
+	sample_pkt.ack_cumulative = 0;
+	sample_pkt.ack_ranges.n_0 = 0;
+	sample_pkt.ack_ranges.a = NULL;
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
 			&buf, &buf_size);
@@ -490,6 +511,9 @@ void test_important_recv_duplicate()
 	sample_pkt.important = true;
 	sample_pkt.app_enc_data.a = buf;
 	sample_pkt.app_enc_data.n_0 = buf_size;
+	sample_pkt.ack_cumulative = 0;
+	sample_pkt.ack_ranges.n_0 = 0;
+	sample_pkt.ack_ranges.a = NULL;
 	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
 	free(buf);
 	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
@@ -528,6 +552,962 @@ void test_important_recv_duplicate()
 	firefly_connection_free(&conn);
 }
 
+void test_important_window_send()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = mock_transport_write_important,
+		.ack = mock_transport_ack,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+	expected_error = FIREFLY_ERROR_PROTO_STATE;
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 0), -1);
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan,
+				FIREFLY_CHANNEL_WINDOW_MAX + 1), -1);
+	CU_ASSERT_TRUE(was_in_error);
+	was_in_error = false;
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 2), 0);
+
+	firefly_protocol_ack ack_pkt;
+	ack_pkt.dest_chan_id = chan->local_id;
+	ack_pkt.src_chan_id = chan->remote_id;
+
+	labcomm_encoder_register_test_test_var(
+			firefly_protocol_get_output_stream(chan));
+	labcomm_encoder_register_test_test_var_2(
+			firefly_protocol_get_output_stream(chan));
+	labcomm_encoder_register_test_test_var_3(
+			firefly_protocol_get_output_stream(chan));
+	event_execute_all_test(eq);
+
+	// Two samples are sent before the first is acked, the third waits.
+	CU_ASSERT_TRUE(mock_transport_written);
+	CU_ASSERT_EQUAL(chan->current_seqno, 2);
+	CU_ASSERT_EQUAL(chan->important_id, TEST_IMPORTANT_ID);
+	CU_ASSERT_EQUAL(chan->nbr_unacked, 1);
+	CU_ASSERT_EQUAL(chan->unacked[0].seqno, 1);
+	CU_ASSERT_PTR_NOT_NULL(chan->important_queue);
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 1), -1);
+	CU_ASSERT_TRUE(was_in_error);
+	was_in_error = false;
+	expected_error = FIREFLY_ERROR_FIRST;
+	mock_transport_written = false;
+
+	// Acking the first sample makes room for the third.
+	ack_pkt.seqno = 1;
+	labcomm_encode_firefly_protocol_ack(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->nbr_unacked, 0);
+	mock_transport_acked = false;
+
+	event_execute_all_test(eq);
+	CU_ASSERT_TRUE(mock_transport_written);
+	CU_ASSERT_EQUAL(chan->current_seqno, 3);
+	CU_ASSERT_EQUAL(chan->nbr_unacked, 1);
+	CU_ASSERT_EQUAL(chan->unacked[0].seqno, 2);
+	CU_ASSERT_PTR_NULL(chan->important_queue);
+	mock_transport_written = false;
+
+	// Acks may come in any order.
+	ack_pkt.seqno = 3;
+	labcomm_encode_firefly_protocol_ack(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->important_id, 0);
+	CU_ASSERT_EQUAL(chan->nbr_unacked, 1);
+	mock_transport_acked = false;
+
+	ack_pkt.seqno = 2;
+	labcomm_encode_firefly_protocol_ack(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->nbr_unacked, 0);
+
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(mock_transport_written);
+
+	mock_transport_written = false;
+	mock_transport_acked = false;
+	firefly_connection_free(&conn);
+}
+
+static void recv_important_sample(struct firefly_connection *conn,
+		struct firefly_channel *chan, int seqno)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_data_sample sample_pkt;
+
+	sample_pkt.dest_chan_id = chan->local_id;
+	sample_pkt.src_chan_id = chan->remote_id;
+	sample_pkt.seqno = seqno;
+	sample_pkt.important = true;
+	sample_pkt.app_enc_data.a = NULL;
+	sample_pkt.app_enc_data.n_0 = 0;
+	sample_pkt.ack_cumulative = 0;
+	sample_pkt.ack_ranges.n_0 = 0;
+	sample_pkt.ack_ranges.a = NULL;
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_test(eq, 1);
+}
+
+void test_important_window_recv_reorder()
+{
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 3), 0);
+
+	// Received ahead of a lost sample, acked and buffered.
+	recv_important_sample(conn, chan, 3);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 3);
+	CU_ASSERT_EQUAL(chan->remote_seqno, 0);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(chan->reorder);
+	CU_ASSERT_EQUAL(chan->reorder->seqno, 3);
+	received_ack = false;
+
+	// Beyond the window, not acked so it is resent.
+	recv_important_sample(conn, chan, 4);
+	CU_ASSERT_FALSE(received_ack);
+	CU_ASSERT_PTR_NULL(chan->reorder->next);
+
+	recv_important_sample(conn, chan, 2);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 2);
+	CU_ASSERT_EQUAL(chan->reorder->seqno, 2);
+	CU_ASSERT_EQUAL(chan->reorder->next->seqno, 3);
+	received_ack = false;
+
+	// A resent buffered sample is acked again but buffered once.
+	recv_important_sample(conn, chan, 3);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 3);
+	CU_ASSERT_PTR_NULL(chan->reorder->next->next);
+	received_ack = false;
+
+	// The lost sample releases the buffered ones in order.
+	recv_important_sample(conn, chan, 1);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 1);
+	CU_ASSERT_EQUAL(chan->remote_seqno, 3);
+	CU_ASSERT_PTR_NULL(chan->reorder);
+	received_ack = false;
+
+	recv_important_sample(conn, chan, 4);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 4);
+	CU_ASSERT_EQUAL(chan->remote_seqno, 4);
+
+	received_ack = false;
+	firefly_connection_free(&conn);
+}
+
+void test_important_window_recv_wrap()
+{
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 2), 0);
+	chan->remote_seqno = INT_MAX - 1;
+
+	recv_important_sample(conn, chan, 1);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_PTR_NOT_NULL(chan->reorder);
+	received_ack = false;
+	recv_important_sample(conn, chan, INT_MAX);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(chan->remote_seqno, 1);
+	CU_ASSERT_PTR_NULL(chan->reorder);
+
+	received_ack = false;
+	firefly_connection_free(&conn);
+}
+
+void test_important_ack_coalesce()
+{
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 4), 0);
+	firefly_connection_set_ack_delay(conn, 10, 3);
+
+	// Held back until the delay has passed.
+	recv_important_sample(conn, chan, 1);
+	recv_important_sample(conn, chan, 3);
+	CU_ASSERT_FALSE(received_ack);
+	CU_ASSERT_FALSE(received_ack_ranges);
+	CU_ASSERT_TRUE(chan->ack_pending);
+	CU_ASSERT_NOT_EQUAL(conn->ack_flush_id, 0);
+
+	firefly_event_queue_expire(eq, 10);
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(received_ack);
+	CU_ASSERT_TRUE_FATAL(received_ack_ranges);
+	CU_ASSERT_EQUAL(ack_ranges.dest_chan_id, chan->remote_id);
+	CU_ASSERT_EQUAL(ack_ranges.cumulative, 1);
+	CU_ASSERT_EQUAL_FATAL(ack_ranges.ranges.n_0, 1);
+	CU_ASSERT_EQUAL(ack_ranges.ranges.a[0].first, 3);
+	CU_ASSERT_EQUAL(ack_ranges.ranges.a[0].last, 3);
+	CU_ASSERT_FALSE(chan->ack_pending);
+	CU_ASSERT_EQUAL(conn->ack_flush_id, 0);
+	received_ack_ranges = false;
+
+	// Sent at once when max_pending samples are received.
+	recv_important_sample(conn, chan, 2);
+	recv_important_sample(conn, chan, 4);
+	CU_ASSERT_FALSE(received_ack_ranges);
+	recv_important_sample(conn, chan, 5);
+	CU_ASSERT_FALSE(received_ack);
+	CU_ASSERT_TRUE_FATAL(received_ack_ranges);
+	CU_ASSERT_EQUAL(ack_ranges.cumulative, 5);
+	CU_ASSERT_EQUAL(ack_ranges.ranges.n_0, 0);
+	CU_ASSERT_EQUAL(conn->nbr_ack_pending, 0);
+	received_ack_ranges = false;
+
+	// Nothing is left for the timer.
+	firefly_event_queue_expire(eq, 20);
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(received_ack_ranges);
+	CU_ASSERT_EQUAL(conn->ack_flush_id, 0);
+
+	// Without a delay the acks are sent once the queued events are executed.
+	firefly_connection_set_ack_delay(conn, 0, 3);
+	recv_important_sample(conn, chan, 6);
+	CU_ASSERT_FALSE(received_ack_ranges);
+	event_execute_all_test(eq);
+	CU_ASSERT_TRUE(received_ack_ranges);
+	CU_ASSERT_EQUAL(ack_ranges.cumulative, 6);
+
+	received_ack_ranges = false;
+	firefly_connection_free(&conn);
+}
+
+void test_important_ack_ranges_recv()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = mock_transport_write_important,
+		.ack = mock_transport_ack,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 3), 0);
+
+	labcomm_encoder_register_test_test_var(
+			firefly_protocol_get_output_stream(chan));
+	labcomm_encoder_register_test_test_var_2(
+			firefly_protocol_get_output_stream(chan));
+	labcomm_encoder_register_test_test_var_3(
+			firefly_protocol_get_output_stream(chan));
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(chan->current_seqno, 3);
+	CU_ASSERT_EQUAL(chan->nbr_unacked, 2);
+	mock_transport_written = false;
+
+	firefly_protocol_ack_range range = { .first = 2, .last = 3 };
+	firefly_protocol_ack_ranges ack_pkt;
+	ack_pkt.dest_chan_id = chan->local_id;
+	ack_pkt.src_chan_id = chan->remote_id;
+	ack_pkt.cumulative = 0;
+	ack_pkt.ranges.n_0 = 1;
+	ack_pkt.ranges.a = &range;
+	labcomm_encode_firefly_protocol_ack_ranges(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->important_id, 0);
+	CU_ASSERT_EQUAL_FATAL(chan->nbr_unacked, 1);
+	CU_ASSERT_EQUAL(chan->unacked[0].seqno, 1);
+	mock_transport_acked = false;
+
+	ack_pkt.cumulative = 1;
+	ack_pkt.ranges.n_0 = 0;
+	ack_pkt.ranges.a = NULL;
+	labcomm_encode_firefly_protocol_ack_ranges(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->nbr_unacked, 0);
+	mock_transport_acked = false;
+
+	// A late cumulative ack does not ack anything more.
+	ack_pkt.cumulative = 3;
+	labcomm_encode_firefly_protocol_ack_ranges(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_FALSE(mock_transport_acked);
+
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(mock_transport_written);
+	firefly_connection_free(&conn);
+}
+
+void test_important_ack_piggyback()
+{
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = mock_transport_write_important,
+		.ack = mock_transport_ack,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+	firefly_connection_set_ack_delay(conn, 10, 8);
+
+	recv_important_sample(conn, chan, 1);
+	CU_ASSERT_TRUE(chan->ack_pending);
+	CU_ASSERT_FALSE(mock_transport_written);
+
+	// The pending ack rides on the next data sample.
+	labcomm_encoder_register_test_test_var(
+			firefly_protocol_get_output_stream(chan));
+	event_execute_all_test(eq);
+	CU_ASSERT_TRUE_FATAL(received_data_sample);
+	CU_ASSERT_EQUAL(data_sample.ack_cumulative, 1);
+	CU_ASSERT_EQUAL(data_sample.ack_ranges.n_0, 0);
+	CU_ASSERT_FALSE(chan->ack_pending);
+	received_data_sample = false;
+	mock_transport_written = false;
+
+	firefly_event_queue_expire(eq, 10);
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(mock_transport_written);
+	CU_ASSERT_FALSE(received_ack_ranges);
+
+	// Acks on incoming data samples are handled like cumulative acks.
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_data_sample sample_pkt;
+	sample_pkt.dest_chan_id = chan->local_id;
+	sample_pkt.src_chan_id = chan->remote_id;
+	sample_pkt.seqno = 0;
+	sample_pkt.important = false;
+	sample_pkt.app_enc_data.a = NULL;
+	sample_pkt.app_enc_data.n_0 = 0;
+	sample_pkt.ack_cumulative = chan->current_seqno;
+	sample_pkt.ack_ranges.n_0 = 0;
+	sample_pkt.ack_ranges.a = NULL;
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL(chan->important_id, 0);
+	event_execute_all_test(eq);
+
+	mock_transport_acked = false;
+	firefly_connection_free(&conn);
+}
+
+void test_important_ack_ranges_piggyback()
+{
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = mock_transport_write_important,
+		.ack = mock_transport_ack,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 3), 0);
+	firefly_connection_set_ack_delay(conn, 10, 8);
+
+	recv_important_sample(conn, chan, 1);
+	recv_important_sample(conn, chan, 3);
+	CU_ASSERT_TRUE(chan->ack_pending);
+	CU_ASSERT_FALSE(mock_transport_written);
+
+	// The header and the ranges are written around the encoded sample.
+	labcomm_encoder_register_test_test_var(
+			firefly_protocol_get_output_stream(chan));
+	event_execute_all_test(eq);
+	CU_ASSERT_TRUE_FATAL(received_data_sample);
+	CU_ASSERT_EQUAL(data_sample.dest_chan_id, chan->remote_id);
+	CU_ASSERT_EQUAL(data_sample.src_chan_id, chan->local_id);
+	CU_ASSERT_EQUAL(data_sample.seqno, 1);
+	CU_ASSERT_TRUE(data_sample.important);
+	CU_ASSERT_TRUE(data_sample.app_enc_data.n_0 > 0);
+	CU_ASSERT_EQUAL(data_sample.ack_cumulative, 1);
+	CU_ASSERT_EQUAL_FATAL(data_sample.ack_ranges.n_0, 1);
+	CU_ASSERT_EQUAL(data_sample.ack_ranges.a[0].first, 3);
+	CU_ASSERT_EQUAL(data_sample.ack_ranges.a[0].last, 3);
+	CU_ASSERT_FALSE(chan->ack_pending);
+	received_data_sample = false;
+	mock_transport_written = false;
+
+	firefly_event_queue_expire(eq, 10);
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(mock_transport_written);
+	CU_ASSERT_FALSE(received_ack_ranges);
+
+	firefly_connection_free(&conn);
+}
+
+#define TEST_FRAGMENT_SIZE (4)
+
+void test_important_fragments_send()
+{
+	unsigned char *buf;
+	size_t buf_size;
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = mock_transport_write_important,
+		.ack = mock_transport_ack,
+		.open = test_conn_open,
+		.close = NULL,
+		.mtu = FIREFLY_DATA_SAMPLE_OVERHEAD + TEST_FRAGMENT_SIZE,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 3), 0);
+
+	// Each fragment of a large signature is an important packet of its own.
+	labcomm_encoder_register_test_test_var_large(
+			firefly_protocol_get_output_stream(chan));
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL_FATAL(nbr_data_fragments, 3);
+	CU_ASSERT_TRUE(data_fragment.important);
+	CU_ASSERT_EQUAL(data_fragment.seqno, 3);
+	CU_ASSERT_EQUAL(data_fragment.offset, 2 * TEST_FRAGMENT_SIZE);
+	CU_ASSERT_EQUAL(chan->current_seqno, 3);
+	CU_ASSERT_PTR_NOT_NULL(chan->important_queue);
+	mock_transport_written = false;
+
+	// Only the acked fragments are released, the lost one is resent alone.
+	firefly_protocol_ack_range range = { .first = 2, .last = 3 };
+	firefly_protocol_ack_ranges ack_pkt;
+	ack_pkt.dest_chan_id = chan->local_id;
+	ack_pkt.src_chan_id = chan->remote_id;
+	ack_pkt.cumulative = 0;
+	ack_pkt.ranges.n_0 = 1;
+	ack_pkt.ranges.a = &range;
+	labcomm_encode_firefly_protocol_ack_ranges(test_enc, &ack_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	CU_ASSERT_TRUE(mock_transport_acked);
+	CU_ASSERT_EQUAL_FATAL(chan->nbr_unacked, 1);
+	CU_ASSERT_EQUAL(chan->unacked[0].seqno, 1);
+	mock_transport_acked = false;
+
+	event_execute_all_test(eq);
+	CU_ASSERT_EQUAL(nbr_data_fragments, 5);
+	CU_ASSERT_EQUAL(chan->current_seqno, 5);
+
+	ack_pkt.ranges.n_0 = 0;
+	ack_pkt.ranges.a = NULL;
+	while (chan->important_id != 0 || chan->nbr_unacked > 0) {
+		ack_pkt.cumulative = chan->current_seqno;
+		labcomm_encode_firefly_protocol_ack_ranges(test_enc, &ack_pkt);
+		labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+				&buf, &buf_size);
+		protocol_data_received(conn, buf, buf_size);
+		event_execute_all_test(eq);
+	}
+	CU_ASSERT_PTR_NULL(chan->important_queue);
+	CU_ASSERT_EQUAL(nbr_data_fragments, (size_t) chan->current_seqno);
+	CU_ASSERT_EQUAL(data_fragment_received, (size_t) data_fragment.total_size);
+
+	nbr_data_fragments = 0;
+	data_fragment_received = 0;
+	mock_transport_written = false;
+	mock_transport_acked = false;
+	firefly_connection_free(&conn);
+}
+
+static void recv_important_fragment(struct firefly_connection *conn,
+		struct firefly_channel *chan, unsigned char *sample, size_t size,
+		int seqno, size_t index)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_data_fragment pkt;
+
+	pkt.dest_chan_id = chan->local_id;
+	pkt.src_chan_id = chan->remote_id;
+	pkt.seqno = seqno;
+	pkt.important = true;
+	pkt.sample_id = 1;
+	pkt.offset = index * TEST_FRAGMENT_SIZE;
+	pkt.total_size = size;
+	pkt.data.a = sample + pkt.offset;
+	pkt.data.n_0 = index == 2 ? size - pkt.offset : TEST_FRAGMENT_SIZE;
+	labcomm_encode_firefly_protocol_data_fragment(test_enc, &pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_test(eq, 1);
+}
+
+void test_important_fragments_recv()
+{
+	unsigned char *sample;
+	size_t sample_size;
+	struct labcomm_encoder *data_encoder;
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	CU_ASSERT_EQUAL(firefly_channel_set_window(chan, 3), 0);
+
+	// A signature in three fragments, the last one holds the rest.
+	data_encoder = labcomm_encoder_new(labcomm_static_buffer_writer_new(),
+			NULL, labcomm_default_memory, NULL);
+	labcomm_encoder_register_test_test_var_large(data_encoder);
+	labcomm_encoder_ioctl(data_encoder, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&sample, &sample_size);
+	CU_ASSERT_TRUE_FATAL(sample_size > 2 * TEST_FRAGMENT_SIZE);
+
+	// Ahead of its turn, buffered and acked.
+	firefly_connection_set_reassembly_max(conn, sample_size);
+	recv_important_fragment(conn, chan, sample, sample_size, 2, 1);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 2);
+	CU_ASSERT_PTR_NOT_NULL(chan->reorder);
+	received_ack = false;
+
+	// No room to reassemble it yet, not acked so it is resent.
+	conn->reassembly_size = 1;
+	recv_important_fragment(conn, chan, sample, sample_size, 1, 0);
+	CU_ASSERT_FALSE(received_ack);
+	CU_ASSERT_EQUAL(chan->remote_seqno, 0);
+	CU_ASSERT_PTR_NULL(chan->reassembly[1].data);
+	conn->reassembly_size = 0;
+
+	recv_important_fragment(conn, chan, sample, sample_size, 1, 0);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(ack.seqno, 1);
+	CU_ASSERT_EQUAL(chan->remote_seqno, 2);
+	CU_ASSERT_PTR_NULL(chan->reorder);
+	CU_ASSERT_PTR_NOT_NULL(chan->reassembly[1].data);
+	CU_ASSERT_EQUAL(chan->reassembly[1].received, 2 * TEST_FRAGMENT_SIZE);
+	CU_ASSERT_EQUAL(conn->reassembly_size, sample_size);
+	received_ack = false;
+
+	// The last fragment completes the sample.
+	recv_important_fragment(conn, chan, sample, sample_size, 3, 2);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_EQUAL(chan->remote_seqno, 3);
+	CU_ASSERT_PTR_NULL(chan->reassembly[1].data);
+	CU_ASSERT_EQUAL(conn->reassembly_size, 0);
+	received_ack = false;
+
+	// A resent fragment is acked again but not reassembled.
+	recv_important_fragment(conn, chan, sample, sample_size, 2, 1);
+	CU_ASSERT_TRUE(received_ack);
+	CU_ASSERT_PTR_NULL(chan->reassembly[1].data);
+
+	free(sample);
+	labcomm_encoder_free(data_encoder);
+	received_ack = false;
+	firefly_connection_free(&conn);
+}
+
+static void recv_credit_sample(struct firefly_connection *conn,
+		struct firefly_channel *chan)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_data_sample sample_pkt;
+
+	sample_pkt.dest_chan_id = chan->local_id;
+	sample_pkt.src_chan_id = chan->remote_id;
+	sample_pkt.seqno = 0;
+	sample_pkt.important = false;
+	sample_pkt.app_enc_data.a = NULL;
+	sample_pkt.app_enc_data.n_0 = 0;
+	sample_pkt.ack_cumulative = 0;
+	sample_pkt.ack_ranges.n_0 = 0;
+	sample_pkt.ack_ranges.a = NULL;
+	labcomm_encode_firefly_protocol_data_sample(test_enc, &sample_pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_test(eq, 1);
+}
+
+static void recv_credit(struct firefly_connection *conn,
+		struct firefly_channel *chan, int limit, int credits, bool probe)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_channel_credit pkt;
+
+	pkt.dest_chan_id = chan->local_id;
+	pkt.src_chan_id = chan->remote_id;
+	pkt.limit = limit;
+	pkt.credits = credits;
+	pkt.probe = probe;
+	labcomm_encode_firefly_protocol_channel_credit(test_enc, &pkt);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+	event_execute_test(eq, 1);
+}
+
+void test_credit_recv()
+{
+	struct firefly_channel_credits credits;
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+
+	firefly_channel_set_credits(chan, 4);
+	CU_ASSERT_TRUE_FATAL(received_channel_credit);
+	CU_ASSERT_EQUAL(channel_credit.limit, 4);
+	CU_ASSERT_EQUAL(channel_credit.credits, 4);
+	CU_ASSERT_FALSE(channel_credit.probe);
+	received_channel_credit = false;
+
+	// More credit is granted once half of it is used.
+	recv_credit_sample(conn, chan);
+	CU_ASSERT_FALSE(received_channel_credit);
+	recv_credit_sample(conn, chan);
+	CU_ASSERT_TRUE_FATAL(received_channel_credit);
+	CU_ASSERT_EQUAL(channel_credit.limit, 6);
+	received_channel_credit = false;
+
+	// A probe counts the samples sent before it as used, lost or not.
+	recv_credit(conn, chan, 10, 0, true);
+	CU_ASSERT_TRUE_FATAL(received_channel_credit);
+	CU_ASSERT_EQUAL(channel_credit.limit, 14);
+	CU_ASSERT_FALSE(channel_credit.probe);
+	received_channel_credit = false;
+
+	firefly_channel_set_credits(chan, 0);
+	CU_ASSERT_TRUE_FATAL(received_channel_credit);
+	CU_ASSERT_EQUAL(channel_credit.credits, 0);
+	firefly_channel_get_credits(chan, &credits);
+	CU_ASSERT_EQUAL(credits.granted, 0);
+
+	received_channel_credit = false;
+	received_data_sample = false;
+	firefly_connection_free(&conn);
+}
+
+void test_credit_send()
+{
+	struct firefly_channel_credits credits;
+	struct firefly_channel_stats stats;
+	struct labcomm_encoder *ch_enc;
+	test_test_var value = 1;
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(NULL, NULL, eq, &test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	struct firefly_channel *chan = firefly_channel_new(conn);
+	add_channel_to_connection(chan, conn);
+	chan->state = FIREFLY_CHANNEL_OPEN;
+	ch_enc = firefly_protocol_get_output_stream(chan);
+	labcomm_encoder_register_test_test_var(ch_enc);
+	event_execute_all_test(eq);
+
+	recv_credit(conn, chan, 2, 2, false);
+	firefly_channel_get_credits(chan, &credits);
+	CU_ASSERT_TRUE(credits.limited);
+	CU_ASSERT_EQUAL(credits.available, 2);
+
+	// The sample beyond the limit is held.
+	received_data_sample = false;
+	labcomm_encode_test_test_var(ch_enc, &value);
+	labcomm_encode_test_test_var(ch_enc, &value);
+	labcomm_encode_test_test_var(ch_enc, &value);
+	event_execute_test(eq, 2);
+	CU_ASSERT_TRUE(received_data_sample);
+	received_data_sample = false;
+	event_execute_test(eq, 1);
+	CU_ASSERT_FALSE(received_data_sample);
+	firefly_channel_get_credits(chan, &credits);
+	CU_ASSERT_EQUAL(credits.available, -1);
+	CU_ASSERT_EQUAL(credits.nbr_held, 1);
+
+	// Out of credit, the other end is probed after a while.
+	event_execute_test(eq, 1);
+	CU_ASSERT_FALSE(received_channel_credit);
+	firefly_event_queue_expire(eq, firefly_event_queue_now(eq) +
+			FIREFLY_CHANNEL_CREDIT_PROBE_DELAY);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE_FATAL(received_channel_credit);
+	CU_ASSERT_TRUE(channel_credit.probe);
+	CU_ASSERT_EQUAL(channel_credit.limit, 2);
+	received_channel_credit = false;
+
+	recv_credit(conn, chan, 4, 2, false);
+	CU_ASSERT_TRUE(received_data_sample);
+	firefly_channel_get_credits(chan, &credits);
+	CU_ASSERT_EQUAL(credits.available, 1);
+	CU_ASSERT_EQUAL(credits.nbr_held, 0);
+	received_data_sample = false;
+
+	// The next probe finds credit and stops probing.
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(received_channel_credit);
+	labcomm_encode_test_test_var(ch_enc, &value);
+	event_execute_all_test(eq);
+	CU_ASSERT_TRUE(received_data_sample);
+	received_data_sample = false;
+
+	firefly_channel_set_credit_mode(chan, FIREFLY_CREDIT_FAIL);
+	CU_ASSERT_EQUAL(labcomm_encode_test_test_var(ch_enc, &value), -EAGAIN);
+
+	firefly_channel_set_credit_mode(chan, FIREFLY_CREDIT_DROP);
+	CU_ASSERT_EQUAL(labcomm_encode_test_test_var(ch_enc, &value), 0);
+	firefly_channel_get_stats(chan, &stats);
+	CU_ASSERT_EQUAL(stats.nbr_no_credit, 1);
+	firefly_channel_get_credits(chan, &credits);
+	CU_ASSERT_EQUAL(credits.available, 0);
+	CU_ASSERT_EQUAL(credits.nbr_held, 0);
+
+	// A blocking channel holding too many samples refuses more.
+	firefly_channel_set_credit_mode(chan, FIREFLY_CREDIT_BLOCK);
+	for (int i = 0; i < FIREFLY_CHANNEL_CREDIT_HELD_MAX; i++)
+		labcomm_encode_test_test_var(ch_enc, &value);
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(received_data_sample);
+	firefly_channel_get_credits(chan, &credits);
+	CU_ASSERT_EQUAL(credits.nbr_held, FIREFLY_CHANNEL_CREDIT_HELD_MAX);
+	CU_ASSERT_EQUAL(labcomm_encode_test_test_var(ch_enc, &value), -EAGAIN);
+	recv_credit(conn, chan, 4 + FIREFLY_CHANNEL_CREDIT_HELD_MAX, 2, false);
+	CU_ASSERT_TRUE(received_data_sample);
+	firefly_channel_get_credits(chan, &credits);
+	CU_ASSERT_EQUAL(credits.available, 0);
+	CU_ASSERT_EQUAL(credits.nbr_held, 0);
+	received_data_sample = false;
+
+	received_channel_credit = false;
+	firefly_connection_free(&conn);
+}
+
+static uint64_t heartbeat_clock_now;
+static uint64_t heartbeat_clock(void)
+{
+	return heartbeat_clock_now;
+}
+
+static void heartbeat_advance(unsigned int ms)
+{
+	heartbeat_clock_now += ms * 1000000ULL;
+	firefly_event_queue_expire(eq, firefly_event_queue_now(eq));
+}
+
+static void recv_heartbeat(struct firefly_connection *conn, bool reply)
+{
+	unsigned char *buf;
+	size_t buf_size;
+	firefly_protocol_heartbeat hb;
+
+	hb.reply = reply;
+	labcomm_encode_firefly_protocol_heartbeat(test_enc, &hb);
+	labcomm_encoder_ioctl(test_enc, LABCOMM_IOCTL_WRITER_GET_BUFFER,
+			&buf, &buf_size);
+	protocol_data_received(conn, buf, buf_size);
+}
+
+bool heartbeat_timeout = false;
+static bool heartbeat_conn_error(struct firefly_connection *conn,
+		enum firefly_error reason, const char *message)
+{
+	UNUSED_VAR(conn);
+	UNUSED_VAR(message);
+	CU_ASSERT_EQUAL(reason, FIREFLY_ERROR_CONN_TIMEOUT);
+	heartbeat_timeout = true;
+	return false;
+}
+
+void test_heartbeat()
+{
+	struct firefly_connection_actions conn_actions = {
+		.connection_error = heartbeat_conn_error
+	};
+	struct firefly_connection *conn;
+	struct test_conn_platspec ps = { .important = true, .conn = &conn };
+	struct firefly_transport_connection test_trsp_conn = {
+		.write = transport_write_test_decoder,
+		.ack = NULL,
+		.open = test_conn_open,
+		.close = NULL,
+		.context = &ps
+	};
+
+	int res = firefly_connection_open(&conn_actions, NULL, eq,
+			&test_trsp_conn, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	heartbeat_clock_now = 10000 * 1000000ULL;
+	firefly_event_queue_set_clock(eq, heartbeat_clock);
+	firefly_connection_set_heartbeat(conn, 10, 2);
+	CU_ASSERT_TRUE(conn->heartbeat_id > 0);
+
+	// A request is answered, and passes the check without asking back.
+	heartbeat_advance(5);
+	recv_heartbeat(conn, false);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE_FATAL(received_heartbeat);
+	CU_ASSERT_TRUE(heartbeat.reply);
+	received_heartbeat = false;
+	heartbeat_advance(5);
+	event_execute_test(eq, 1);
+	CU_ASSERT_FALSE(received_heartbeat);
+
+	// An idle connection is asked for heartbeats.
+	heartbeat_advance(10);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE_FATAL(received_heartbeat);
+	CU_ASSERT_FALSE(heartbeat.reply);
+	CU_ASSERT_EQUAL(conn->heartbeat_missed, 1);
+	received_heartbeat = false;
+	recv_heartbeat(conn, true);
+	heartbeat_advance(10);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE(received_heartbeat);
+	CU_ASSERT_EQUAL(conn->heartbeat_missed, 0);
+	received_heartbeat = false;
+
+	// Declared dead after two checks in a row without an answer.
+	heartbeat_advance(10);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE(received_heartbeat);
+	CU_ASSERT_FALSE(heartbeat_timeout);
+	heartbeat_advance(10);
+	event_execute_test(eq, 1);
+	CU_ASSERT_TRUE(heartbeat_timeout);
+	CU_ASSERT_EQUAL(conn->heartbeat_id, 0);
+
+	firefly_event_queue_set_clock(eq, NULL);
+	received_heartbeat = false;
+	heartbeat_timeout = false;
+	firefly_connection_free(&conn);
+}
+
 bool handshake_chan_open_called = false;
 void important_handshake_chan_open(struct firefly_channel *chan)
 {
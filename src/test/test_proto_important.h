@@ -18,5 +18,17 @@ void test_important_handshake_recv_errors();
 void test_important_handshake_open();
 void test_important_handshake_open_errors();
 void test_important_ack_on_close();
+void test_important_window_send();
+void test_important_window_recv_reorder();
+void test_important_window_recv_wrap();
+void test_important_ack_coalesce();
+void test_important_ack_ranges_recv();
+void test_important_ack_piggyback();
+void test_important_ack_ranges_piggyback();
+void test_important_fragments_send();
+void test_important_fragments_recv();
+void test_credit_recv();
+void test_credit_send();
+void test_heartbeat();
 
 #endif
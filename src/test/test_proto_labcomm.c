@@ -65,7 +65,7 @@ void labcomm_handle_data_sample(firefly_protocol_data_sample *v, void *context)
 // previously encoded.
 static size_t last_written_size = 0;
 void transport_write_udp_posix_mock(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, uint32_t *id)
 {
 	UNUSED_VAR(important);
 	UNUSED_VAR(id);
@@ -183,6 +183,7 @@ void test_encode_decode_app()
 	chan.important_queue	= NULL;
 	chan.important_id		= 0;
 	chan.current_seqno		= 0;
+	chan.window			= 1;
 	chan.remote_seqno		= 0;
 	chan.conn               = &conn;
 
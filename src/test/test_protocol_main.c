@@ -142,9 +142,30 @@ int main()
 			(CU_add_test(chan_suite, "test_send_app_data",
 					test_send_app_data) == NULL)
 			||
+			(CU_add_test(chan_suite, "test_send_app_data_direct",
+					test_send_app_data_direct) == NULL)
+			||
 			(CU_add_test(chan_suite, "test_recv_app_data",
 					test_recv_app_data) == NULL)
 			||
+			(CU_add_test(chan_suite, "test_recv_app_data_packet",
+					test_recv_app_data_packet) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_send_latest",
+					test_send_latest) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_recv_latest",
+					test_recv_latest) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_send_fragmented",
+					test_send_fragmented) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_recv_fragmented",
+					test_recv_fragmented) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_send_coalesced",
+					test_send_coalesced) == NULL)
+			||
 			(CU_add_test(chan_suite, "test_restrict_recv",
 					test_restrict_recv) == NULL)
 			||
@@ -220,6 +241,43 @@ int main()
 			||
 			(CU_add_test(important_suite, "test_important_ack_on_close",
 					test_important_ack_on_close) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_window_send",
+					test_important_window_send) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_window_recv_reorder",
+					test_important_window_recv_reorder) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_window_recv_wrap",
+					test_important_window_recv_wrap) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_ack_coalesce",
+					test_important_ack_coalesce) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_ack_ranges_recv",
+					test_important_ack_ranges_recv) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_ack_piggyback",
+					test_important_ack_piggyback) == NULL)
+			||
+			(CU_add_test(important_suite,
+					"test_important_ack_ranges_piggyback",
+					test_important_ack_ranges_piggyback) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_fragments_send",
+					test_important_fragments_send) == NULL)
+			||
+			(CU_add_test(important_suite, "test_important_fragments_recv",
+					test_important_fragments_recv) == NULL)
+			||
+			(CU_add_test(important_suite, "test_credit_recv",
+					test_credit_recv) == NULL)
+			||
+			(CU_add_test(important_suite, "test_credit_send",
+					test_credit_send) == NULL)
+			||
+			(CU_add_test(important_suite, "test_heartbeat",
+					test_heartbeat) == NULL)
 		) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -241,6 +299,12 @@ int main()
 			||
 			(CU_add_test(chan_suite, "test_nbr_chan",
 					test_nbr_chan) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_chan_table",
+					test_chan_table) == NULL)
+			||
+			(CU_add_test(chan_suite, "test_chan_stale_packet",
+					test_chan_stale_packet) == NULL)
 			) {
 				CU_cleanup_registry();
 				return CU_get_error();
@@ -14,11 +14,25 @@
 
 static unsigned char data[DATA_SIZE] = {1,2,3,4,5};
 
-unsigned char *data_test_new()
+struct firefly_packet *data_test_new()
 {
-	unsigned char *d = malloc(DATA_SIZE);
-	memcpy(d, data, DATA_SIZE);
-	return d;
+	struct firefly_packet *pkt = firefly_packet_new(DATA_SIZE);
+	memcpy(pkt->data, data, DATA_SIZE);
+	pkt->size = DATA_SIZE;
+	return pkt;
+}
+
+/*
+ * Add a new packet to the queue, leaving the queue with the only reference.
+ */
+static uint32_t resend_add_test(struct resend_queue *rq, long timeout_ms,
+		unsigned char retries)
+{
+	struct firefly_packet *pkt = data_test_new();
+	uint32_t id = firefly_resend_add(rq, pkt, timeout_ms, retries, NULL);
+
+	firefly_packet_release(pkt);
+	return id;
 }
 
 int setup_resend_posix()
@@ -36,29 +50,50 @@ static inline long timespec_diff_ms(struct timespec *f, struct timespec *t)
 	return (t->tv_sec - f->tv_sec)*1000 + (t->tv_nsec - f->tv_nsec)/1000000;
 }
 
+/*
+ * Check that every packet is due no earlier than its parent in the heap and
+ * knows its position.
+ */
+static bool resend_heap_valid(struct resend_queue *rq)
+{
+	for (size_t i = 0; i < rq->nbr_elems; i++) {
+		struct timespec *at = &rq->heap[i]->resend_at;
+		struct timespec *parent = &rq->heap[i > 0 ? (i - 1) / 2 : 0]->resend_at;
+
+		if (rq->heap[i]->heap_pos != i)
+			return false;
+		if (at->tv_sec < parent->tv_sec || (at->tv_sec == parent->tv_sec &&
+					at->tv_nsec < parent->tv_nsec))
+			return false;
+	}
+	return true;
+}
+
 void test_add_simple()
 {
 	struct timespec at;
 	struct resend_queue *rq = firefly_resend_queue_new();
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
-
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			1500, 1, NULL);
-	clock_gettime(CLOCK_REALTIME, &at);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
+
+	struct firefly_packet *pkt = data_test_new();
+	uint32_t id = firefly_resend_add(rq, pkt, 1500, 1, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &at);
+	// The queue holds a reference instead of a copy.
+	CU_ASSERT_EQUAL(pkt->refs, 2);
+	firefly_packet_release(pkt);
 	CU_ASSERT_TRUE(id != 0);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1);
 	CU_ASSERT_NOT_EQUAL(id, rq->next_id);
-	struct resend_elem *re = rq->first;
+	struct resend_elem *re = firefly_resend_top(rq);
 	CU_ASSERT_EQUAL(re->id, id);
-	CU_ASSERT_EQUAL(re->size, DATA_SIZE);
-	CU_ASSERT_EQUAL(memcmp(data, re->data, DATA_SIZE), 0);
+	CU_ASSERT_PTR_EQUAL(re->pkt, pkt);
+	CU_ASSERT_EQUAL(re->pkt->size, DATA_SIZE);
+	CU_ASSERT_EQUAL(memcmp(data, re->pkt->data, DATA_SIZE), 0);
 	long diff = timespec_diff_ms(&at, &re->resend_at);
 	CU_ASSERT_TRUE(diff <= 1500);
 	CU_ASSERT_TRUE(diff > 1470);
-	CU_ASSERT_PTR_NULL(re->prev);
+	CU_ASSERT_EQUAL(re->heap_pos, 0);
+	CU_ASSERT_FALSE(re->resent);
 	
 	firefly_resend_queue_free(rq);
 }
@@ -67,12 +102,10 @@ void test_remove_empty()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
-	unsigned char id = 1;
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
+	uint32_t id = 1;
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -83,11 +116,9 @@ void test_remove_simple()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			1500, 1, NULL);
+	uint32_t id = resend_add_test(rq, 1500, 1);
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -98,34 +129,30 @@ void test_add_many()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	uint32_t id_1 = resend_add_test(rq, 0, 1);
 	CU_ASSERT_TRUE(id_1 != 0);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1);
 	CU_ASSERT_NOT_EQUAL(id_1, rq->next_id);
-	struct resend_elem *re = rq->first;
+	struct resend_elem *re = firefly_resend_top(rq);
 	CU_ASSERT_EQUAL(re->id, id_1);
-	CU_ASSERT_PTR_NULL(re->prev);
+	CU_ASSERT_EQUAL(re->heap_pos, 0);
 
-	unsigned char id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	uint32_t id_2 = resend_add_test(rq, 0, 1);
 	CU_ASSERT_TRUE(id_2 != 0);
 	CU_ASSERT_NOT_EQUAL(id_1, id_2);
 	CU_ASSERT_NOT_EQUAL(id_2, rq->next_id);
-	CU_ASSERT_PTR_NOT_EQUAL(rq->first, rq->last);
-	CU_ASSERT_PTR_EQUAL(re->prev, rq->last);
-	re = rq->last;
-	CU_ASSERT_PTR_NULL(re->prev);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 2);
+	CU_ASSERT_PTR_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
 
-	unsigned char id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	uint32_t id_3 = resend_add_test(rq, 0, 1);
 	CU_ASSERT_TRUE(id_3 != 0);
 	CU_ASSERT_NOT_EQUAL(id_1, id_3);
 	CU_ASSERT_NOT_EQUAL(id_2, id_3);
 	CU_ASSERT_NOT_EQUAL(id_3, rq->next_id);
-	CU_ASSERT_PTR_EQUAL(re->prev, rq->last);
-	re = rq->last;
-	CU_ASSERT_PTR_NULL(re->prev);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 3);
+	CU_ASSERT_PTR_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
 
 	firefly_resend_queue_free(rq);
 }
@@ -136,22 +163,17 @@ void test_remove_many()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	uint32_t id_1 = resend_add_test(rq, 0, 1);
+	uint32_t id_2 = resend_add_test(rq, 0, 1);
+	uint32_t id_3 = resend_add_test(rq, 0, 1);
 	firefly_resend_remove(rq, id_1);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 2);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
 	firefly_resend_remove(rq, id_2);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_3);
 	firefly_resend_remove(rq, id_3);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -162,22 +184,17 @@ void test_remove_not_ordered()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id_1 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_2 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	unsigned char id_3 = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	uint32_t id_1 = resend_add_test(rq, 0, 1);
+	uint32_t id_2 = resend_add_test(rq, 0, 1);
+	uint32_t id_3 = resend_add_test(rq, 0, 1);
 	firefly_resend_remove(rq, id_2);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 2);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
 	firefly_resend_remove(rq, id_1);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
-	CU_ASSERT_PTR_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, id_3);
 	firefly_resend_remove(rq, id_3);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -186,15 +203,12 @@ void test_remove_non_existing_elem()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	uint32_t id = resend_add_test(rq, 0, 1);
 
 	firefly_resend_remove(rq, id + 1);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1);
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -203,17 +217,14 @@ void test_top_simple()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	unsigned char id = firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
+	uint32_t id = resend_add_test(rq, 0, 1);
 
 	struct resend_elem *elem = firefly_resend_top(rq);
-	CU_ASSERT_PTR_NOT_NULL(rq->first);
-	CU_ASSERT_PTR_NOT_NULL(rq->last);
+	CU_ASSERT_PTR_NOT_NULL(elem);
 	CU_ASSERT_EQUAL(elem->id, id);
 
 	firefly_resend_remove(rq, id);
-	CU_ASSERT_PTR_NULL(rq->first);
-	CU_ASSERT_PTR_NULL(rq->last);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
 
 	firefly_resend_queue_free(rq);
 }
@@ -222,19 +233,20 @@ void test_readd_simple()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
-	struct resend_elem *re = rq->first;
+	resend_add_test(rq, 0, 2);
+	struct resend_elem *re = firefly_resend_top(rq);
 	re->resend_at.tv_sec = 1;
 	re->resend_at.tv_nsec = 2;
-	re->timeout = 500;
+	re->timeout = 250;
 	firefly_resend_readd(rq, re->id);
 
 	CU_ASSERT_EQUAL(re->num_retries, 1);
+	CU_ASSERT_EQUAL(re->timeout, 500);
+	CU_ASSERT_TRUE(re->resent);
 	CU_ASSERT_EQUAL(re->resend_at.tv_sec, 1);
 	CU_ASSERT_EQUAL(re->resend_at.tv_nsec, 500000002);
-	CU_ASSERT_EQUAL(rq->first, re);
-	CU_ASSERT_EQUAL(rq->first, rq->last);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1);
 
 
 	firefly_resend_queue_free(rq);
@@ -244,23 +256,24 @@ void test_readd_complex()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
-	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 1, NULL);
-	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
-	struct resend_elem *re = rq->first;
+	resend_add_test(rq, 0, 2);
+	resend_add_test(rq, 0, 1);
+	resend_add_test(rq, 0, 2);
+	struct resend_elem *re = firefly_resend_top(rq);
 	re->resend_at.tv_sec = 1;
 	re->resend_at.tv_nsec = 600000002;
-	re->timeout = 2500;
+	re->timeout = 1250;
+	// The others are due before re after its readd.
+	rq->heap[1]->resend_at.tv_sec = 2;
+	rq->heap[2]->resend_at.tv_sec = 3;
 	firefly_resend_readd(rq, re->id);
 
 	CU_ASSERT_EQUAL(re->num_retries, 1);
 	CU_ASSERT_EQUAL(re->resend_at.tv_sec, 4);
 	CU_ASSERT_EQUAL(re->resend_at.tv_nsec, 100000002);
-	CU_ASSERT_NOT_EQUAL(rq->first, re);
-	CU_ASSERT_EQUAL(rq->last, re);
+	CU_ASSERT_NOT_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_NOT_EQUAL(re->heap_pos, 0);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
 
 	firefly_resend_queue_free(rq);
 }
@@ -269,9 +282,8 @@ void test_readd_removed()
 {
 	struct resend_queue *rq = firefly_resend_queue_new();
 
-	firefly_resend_add(rq, data_test_new(), DATA_SIZE,
-			0, 2, NULL);
-	struct resend_elem *re = rq->first;
+	resend_add_test(rq, 0, 2);
+	struct resend_elem *re = firefly_resend_top(rq);
 	struct timespec t = re->resend_at;
 	re->timeout = 500;
 	firefly_resend_readd(rq, 5);
@@ -279,12 +291,251 @@ void test_readd_removed()
 	CU_ASSERT_EQUAL(re->num_retries, 2);
 	CU_ASSERT_EQUAL(re->resend_at.tv_sec, t.tv_sec);
 	CU_ASSERT_EQUAL(re->resend_at.tv_nsec, t.tv_nsec);
-	CU_ASSERT_EQUAL(rq->first, re);
-	CU_ASSERT_EQUAL(rq->first, rq->last);
+	CU_ASSERT_FALSE(re->resent);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq), re);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1);
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_add_remove_wide_ids()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	uint32_t ids[1000];
+
+	// More packets than fit in 8 bit IDs and in the initial index.
+	for (int i = 0; i < 1000; i++) {
+		ids[i] = resend_add_test(rq, 0, 1);
+		CU_ASSERT_NOT_EQUAL(ids[i], 0);
+		CU_ASSERT_TRUE(i == 0 || ids[i] != ids[i - 1]);
+	}
+	CU_ASSERT_EQUAL(rq->nbr_elems, 1000);
+	CU_ASSERT_TRUE(rq->index_size >= 1000);
+	for (int i = 0; i < 1000; i += 2)
+		firefly_resend_remove(rq, ids[i]);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 500);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
+	for (int i = 999; i > 0; i -= 2)
+		firefly_resend_remove(rq, ids[i]);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
+	CU_ASSERT_EQUAL(rq->nbr_elems, 0);
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_id_wrap()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	uint32_t a, b, c, d, e;
+
+	rq->next_id = UINT32_MAX - 1;
+	a = resend_add_test(rq, 0, 1);
+	b = resend_add_test(rq, 0, 1);
+	c = resend_add_test(rq, 0, 1);
+	CU_ASSERT_EQUAL(a, UINT32_MAX - 1);
+	CU_ASSERT_EQUAL(b, UINT32_MAX);
+	CU_ASSERT_EQUAL(c, 1);
+
+	// IDs still in the queue are not handed out again.
+	firefly_resend_remove(rq, b);
+	rq->next_id = UINT32_MAX - 1;
+	d = resend_add_test(rq, 0, 1);
+	e = resend_add_test(rq, 0, 1);
+	CU_ASSERT_EQUAL(d, UINT32_MAX);
+	CU_ASSERT_EQUAL(e, 2);
 
 	firefly_resend_queue_free(rq);
 }
 
+void test_deadline_order()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	struct firefly_packet *pkt;
+	struct firefly_connection *conn;
+	uint32_t id;
+	uint32_t a, b, c;
+
+	a = resend_add_test(rq, 300, 2);
+	b = resend_add_test(rq, 100, 2);
+	c = resend_add_test(rq, 200, 2);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, b);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
+
+	// The packet due first is returned, not the one added first.
+	CU_ASSERT_EQUAL(firefly_resend_wait(rq, &pkt, &conn, &id), 0);
+	CU_ASSERT_EQUAL(id, b);
+	CU_ASSERT_EQUAL(pkt->size, DATA_SIZE);
+	// Shared by the queue and the caller.
+	CU_ASSERT_EQUAL(pkt->refs, 2);
+	firefly_packet_release(pkt);
+	firefly_resend_remove(rq, b);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, c);
+
+	// Resent after 200 + 400 ms, behind the packet due after 300 ms.
+	firefly_resend_readd(rq, c);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, a);
+	// Resent after 300 + 600 ms, behind c again.
+	firefly_resend_readd(rq, a);
+	CU_ASSERT_EQUAL(firefly_resend_top(rq)->id, c);
+	CU_ASSERT_TRUE(resend_heap_valid(rq));
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_readd_backoff_max()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	uint32_t id;
+	struct resend_elem *re;
+
+	id = resend_add_test(rq, FIREFLY_RESEND_TIMEOUT_MAX / 2 + 1, 3);
+	re = firefly_resend_top(rq);
+	firefly_resend_readd(rq, id);
+	CU_ASSERT_EQUAL(re->timeout, FIREFLY_RESEND_TIMEOUT_MAX);
+	firefly_resend_readd(rq, id);
+	CU_ASSERT_EQUAL(re->timeout, FIREFLY_RESEND_TIMEOUT_MAX);
+	CU_ASSERT_EQUAL(re->num_retries, 1);
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_remove_rtt()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	uint32_t id;
+	long rtt;
+
+	id = resend_add_test(rq, 500, 1);
+	rtt = firefly_resend_remove(rq, id);
+	CU_ASSERT_TRUE(rtt >= 0);
+	CU_ASSERT_TRUE(rtt < 500000);
+
+	// The ack of a resent packet may be for any of its sends.
+	id = resend_add_test(rq, 500, 1);
+	firefly_resend_readd(rq, id);
+	CU_ASSERT_EQUAL(firefly_resend_remove(rq, id), -1);
+
+	CU_ASSERT_EQUAL(firefly_resend_remove(rq, id), -1);
+
+	firefly_resend_queue_free(rq);
+}
+
+void test_rto_sample()
+{
+	struct firefly_resend_rto rto;
+
+	firefly_resend_rto_init(&rto, 500, 5);
+	CU_ASSERT_EQUAL(rto.timeout, 500);
+	CU_ASSERT_EQUAL(rto.retries, 5);
+	firefly_resend_rto_sample(&rto, -1);
+	CU_ASSERT_EQUAL(rto.timeout, 500);
+
+	// srtt = 200 ms, rttvar = 100 ms.
+	firefly_resend_rto_sample(&rto, 200000);
+	CU_ASSERT_EQUAL(rto.srtt, 200000);
+	CU_ASSERT_EQUAL(rto.rttvar, 100000);
+	CU_ASSERT_EQUAL(rto.timeout, 600);
+	// A steady round trip time shrinks rttvar.
+	firefly_resend_rto_sample(&rto, 200000);
+	CU_ASSERT_EQUAL(rto.srtt, 200000);
+	CU_ASSERT_EQUAL(rto.rttvar, 75000);
+	CU_ASSERT_EQUAL(rto.timeout, 500);
+
+	// Short round trip times give the smallest timeout.
+	firefly_resend_rto_init(&rto, 500, 5);
+	firefly_resend_rto_sample(&rto, 100);
+	CU_ASSERT_EQUAL(rto.timeout, FIREFLY_RESEND_TIMEOUT_MIN);
+
+	firefly_resend_rto_init(&rto, 500, 5);
+	firefly_resend_rto_sample(&rto, 100000000);
+	CU_ASSERT_EQUAL(rto.timeout, FIREFLY_RESEND_TIMEOUT_MAX);
+}
+
+void test_packet_ref()
+{
+	struct firefly_packet *pkt = firefly_packet_new(DATA_SIZE);
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(pkt);
+	CU_ASSERT_EQUAL(pkt->refs, 1);
+	CU_ASSERT_EQUAL(pkt->size, 0);
+	CU_ASSERT_EQUAL(pkt->capacity, DATA_SIZE);
+	CU_ASSERT_PTR_NULL(pkt->pool);
+	CU_ASSERT_PTR_EQUAL(firefly_packet_ref(pkt), pkt);
+	CU_ASSERT_EQUAL(pkt->refs, 2);
+	firefly_packet_release(pkt);
+	CU_ASSERT_EQUAL(pkt->refs, 1);
+	firefly_packet_release(pkt);
+}
+
+void test_packet_pool_recycle()
+{
+	struct firefly_packet_pool *pool = firefly_packet_pool_new(DATA_SIZE);
+	struct firefly_packet *a;
+	struct firefly_packet *b;
+
+	a = firefly_packet_get(pool);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+	CU_ASSERT_PTR_EQUAL(a->pool, pool);
+	CU_ASSERT_EQUAL(a->capacity, DATA_SIZE);
+	CU_ASSERT_EQUAL(pool->refs, 2);
+	a->size = DATA_SIZE;
+	firefly_packet_release(a);
+	CU_ASSERT_EQUAL(pool->nbr_free, 1);
+	CU_ASSERT_EQUAL(pool->refs, 1);
+
+	// The released packet is reused and reset.
+	b = firefly_packet_get(pool);
+	CU_ASSERT_PTR_EQUAL(b, a);
+	CU_ASSERT_EQUAL(b->refs, 1);
+	CU_ASSERT_EQUAL(b->size, 0);
+	CU_ASSERT_EQUAL(pool->nbr_free, 0);
+	firefly_packet_release(b);
+
+	firefly_packet_pool_free(pool);
+}
+
+void test_packet_pool_max_free()
+{
+	struct firefly_packet_pool *pool = firefly_packet_pool_new(DATA_SIZE);
+	struct firefly_packet *pkts[FIREFLY_PACKET_POOL_MAX_FREE + 2];
+	size_t n = sizeof(pkts) / sizeof(pkts[0]);
+
+	for (size_t i = 0; i < n; i++)
+		pkts[i] = firefly_packet_get(pool);
+	CU_ASSERT_EQUAL(pool->refs, n + 1);
+	for (size_t i = 0; i < n; i++)
+		firefly_packet_release(pkts[i]);
+	CU_ASSERT_EQUAL(pool->nbr_free, FIREFLY_PACKET_POOL_MAX_FREE);
+	CU_ASSERT_EQUAL(pool->refs, 1);
+
+	firefly_packet_pool_free(pool);
+}
+
+void test_packet_pool_outlives_owner()
+{
+	struct firefly_packet_pool *pool = firefly_packet_pool_new(DATA_SIZE);
+	struct firefly_packet *pkt = firefly_packet_get(pool);
+
+	// The resend queue may hold packets after the connection is gone.
+	firefly_packet_pool_free(pool);
+	CU_ASSERT_EQUAL(pool->refs, 1);
+	memcpy(pkt->data, data, DATA_SIZE);
+	firefly_packet_release(pkt);
+}
+
+void test_queue_free_releases()
+{
+	struct resend_queue *rq = firefly_resend_queue_new();
+	struct firefly_packet *pkt = data_test_new();
+
+	firefly_resend_add(rq, pkt, 500, 1, NULL);
+	firefly_resend_add(rq, pkt, 500, 1, NULL);
+	CU_ASSERT_EQUAL(pkt->refs, 3);
+	firefly_resend_queue_free(rq);
+	CU_ASSERT_EQUAL(pkt->refs, 1);
+	firefly_packet_release(pkt);
+}
+
 int main()
 {
 	CU_pSuite resend_posix = NULL;
@@ -332,6 +583,34 @@ int main()
 			   ||
 		(CU_add_test(resend_posix, "test_readd_removed",
 				test_readd_removed) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_add_remove_wide_ids",
+				test_add_remove_wide_ids) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_id_wrap",
+				test_id_wrap) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_deadline_order",
+				test_deadline_order) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_readd_backoff_max",
+				test_readd_backoff_max) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_remove_rtt",
+				test_remove_rtt) == NULL)
+			   ||
+		(CU_add_test(resend_posix, "test_rto_sample",
+				test_rto_sample) == NULL) ||
+		(CU_add_test(resend_posix, "test_packet_ref",
+				test_packet_ref) == NULL) ||
+		(CU_add_test(resend_posix, "test_packet_pool_recycle",
+				test_packet_pool_recycle) == NULL) ||
+		(CU_add_test(resend_posix, "test_packet_pool_max_free",
+				test_packet_pool_max_free) == NULL) ||
+		(CU_add_test(resend_posix, "test_packet_pool_outlives_owner",
+				test_packet_pool_outlives_owner) == NULL) ||
+		(CU_add_test(resend_posix, "test_queue_free_releases",
+				test_queue_free_releases) == NULL)
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -8,6 +8,7 @@
 
 #include <protocol/firefly_protocol.h>
 #include <utils/cppmacros.h>
+#include <utils/firefly_packet.h>
 #include "test_transport.h"
 
 unsigned char send_buf[] = {0,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16};
@@ -17,11 +18,10 @@ size_t data_recv_size;
 unsigned char *data_recv_buf;
 struct firefly_connection *data_recv_expected_conn = NULL;
 
-void protocol_data_received_repl(struct firefly_connection *conn,
+static void check_data_received(struct firefly_connection *conn,
 								 unsigned char *data,
 								 size_t size)
 {
-	UNUSED_VAR(conn);
 	if (!data_recv_buf) {
 		data_recv_buf = send_buf;
 		data_recv_size = sizeof(send_buf);
@@ -39,5 +39,19 @@ void protocol_data_received_repl(struct firefly_connection *conn,
 		CU_ASSERT_PTR_EQUAL(data_recv_expected_conn, conn);
 	}
 	data_received = true;
+}
+
+void protocol_data_received_repl(struct firefly_connection *conn,
+								 unsigned char *data,
+								 size_t size)
+{
+	check_data_received(conn, data, size);
 	free(data);
 }
+
+void protocol_packet_received_repl(struct firefly_connection *conn,
+								   struct firefly_packet *pkt)
+{
+	check_data_received(conn, pkt->data, pkt->size);
+	firefly_packet_release(pkt);
+}
@@ -5,4 +5,9 @@ void protocol_data_received_repl(struct firefly_connection *conn,
 								 unsigned char *data,
 								 size_t size);
 
+struct firefly_packet;
+
+void protocol_packet_received_repl(struct firefly_connection *conn,
+								   struct firefly_packet *pkt);
+
 #endif
@@ -163,3 +163,74 @@ void test_find_conn_by_addr()
 	}
 	free(llp);
 }
+
+static size_t conn_hash_test(void *context)
+{
+	return firefly_transport_hash_bytes(context, sizeof(long));
+}
+
+static void *conn_key_test(struct firefly_connection *conn)
+{
+	return conn->transport->context;
+}
+
+#define NBR_INDEXED_CONNS (100)
+
+void test_find_conn_indexed()
+{
+	struct firefly_transport_llp *llp = calloc(1, sizeof(*llp));
+	long data[NBR_INDEXED_CONNS];
+	struct firefly_transport_connection tc[NBR_INDEXED_CONNS];
+	struct firefly_connection *conns[NBR_INDEXED_CONNS];
+	struct firefly_connection *conn;
+	long missing = -1;
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(llp);
+	llp_connection_index_init(llp, conn_eq_test, conn_hash_test,
+			conn_key_test);
+	for (int i = 0; i < NBR_INDEXED_CONNS; i++) {
+		data[i] = 1000 * i;
+		tc[i].context = &data[i];
+		conns[i] = calloc(1, sizeof(*conns[i]));
+		CU_ASSERT_PTR_NOT_NULL_FATAL(conns[i]);
+		conns[i]->transport = &tc[i];
+		add_connection_to_llp(conns[i], llp);
+	}
+	for (int i = 0; i < NBR_INDEXED_CONNS; i++)
+		CU_ASSERT_PTR_EQUAL(find_connection(llp, &data[i], conn_eq_test),
+				conns[i]);
+	CU_ASSERT_PTR_NULL(find_connection(llp, &missing, conn_eq_test));
+
+	// Remove every other connection, by address and by pointer.
+	for (int i = 0; i < NBR_INDEXED_CONNS; i += 2) {
+		if (i % 4 == 0)
+			conn = remove_connection_from_llp(llp, &data[i], conn_eq_test);
+		else
+			conn = remove_connection_from_llp(llp, conns[i],
+					firefly_connection_eq_ptr);
+		CU_ASSERT_PTR_EQUAL(conn, conns[i]);
+	}
+	for (int i = 0; i < NBR_INDEXED_CONNS; i++) {
+		conn = find_connection(llp, &data[i], conn_eq_test);
+		if (i % 2 == 0) {
+			CU_ASSERT_PTR_NULL(conn);
+		} else {
+			CU_ASSERT_PTR_EQUAL(conn, conns[i]);
+		}
+	}
+	int nbr_listed = 0;
+	for (struct llp_connection_list_node *node = llp->conn_list;
+			node != NULL; node = node->next)
+		nbr_listed++;
+	CU_ASSERT_EQUAL(nbr_listed, NBR_INDEXED_CONNS / 2);
+
+	for (int i = 1; i < NBR_INDEXED_CONNS; i += 2)
+		CU_ASSERT_PTR_EQUAL(remove_connection_from_llp(llp, conns[i],
+					firefly_connection_eq_ptr), conns[i]);
+	CU_ASSERT_PTR_NULL(llp->conn_list);
+
+	for (int i = 0; i < NBR_INDEXED_CONNS; i++)
+		free(conns[i]);
+	llp_connection_index_free(llp);
+	free(llp);
+}
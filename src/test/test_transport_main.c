@@ -31,6 +31,9 @@ int main()
 			   ||
 		(CU_add_test(trans_gen, "test_remove_conn_by_addr",
 				test_remove_conn_by_addr) == NULL)
+			   ||
+		(CU_add_test(trans_gen, "test_find_conn_indexed",
+				test_find_conn_indexed) == NULL)
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -68,6 +71,9 @@ int main()
 		(CU_add_test(trans_udp_posix, "test_conn_open_and_recv",
 				test_conn_open_and_recv) == NULL)
 			   ||
+		(CU_add_test(trans_udp_posix, "test_conn_purge_queued_read",
+				test_conn_purge_queued_read) == NULL)
+			   ||
 		(CU_add_test(trans_udp_posix, "test_open_and_recv_with_two_llp",
 				test_open_and_recv_with_two_llp) == NULL)
 				||
@@ -149,7 +149,7 @@ void test_recv_connection()
 	struct sockaddr_in remote_addr;
 
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 	// send data
 	send_data(&remote_addr, remote_port, send_buf, sizeof(send_buf));
@@ -172,7 +172,7 @@ void test_recv_conn_null_cb()
 	struct sockaddr_in remote_addr;
 
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 	// send data
 	send_data(&remote_addr, remote_port, send_buf, sizeof(send_buf));
@@ -219,7 +219,7 @@ void test_recv_data()
 	struct firefly_transport_llp *llp = firefly_transport_llp_udp_posix_new(
 					local_port, recv_data_recv_conn, eq);
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 	send_data(&remote_addr, remote_port, send_buf, sizeof(send_buf));
 	sockaddr_in_ipaddr(&remote_addr, ipaddr);
 	port = sockaddr_in_port(&remote_addr);
@@ -247,7 +247,7 @@ void test_recv_conn_and_data()
 	struct firefly_transport_llp *llp = firefly_transport_llp_udp_posix_new(
 					local_port, recv_conn_recv_conn, eq);
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 	// send data
 	send_data(&remote_addr, remote_port, send_buf, sizeof(send_buf));
@@ -276,7 +276,7 @@ void test_recv_conn_and_two_data()
 	struct sockaddr_in remote_addr;
 
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 	// send data
 	send_data(&remote_addr, remote_port, send_buf, sizeof(send_buf));
@@ -309,7 +309,7 @@ void test_recv_conn_keep()
 					local_port, recv_conn_recv_conn, eq);
 
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 // send data
 	struct sockaddr_in remote_addr;
@@ -349,7 +349,7 @@ void test_recv_conn_keep_two()
 						local_port, recv_conn_keep_two, eq);
 
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 	// send data
 	struct sockaddr_in remote_addr;
@@ -458,7 +458,7 @@ void test_conn_open_and_recv()
 	struct firefly_transport_llp *llp = firefly_transport_llp_udp_posix_new(
 					local_port, recv_data_recv_conn, eq);
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 	struct firefly_connection_actions actions = {
 		.connection_opened = tmp_on_conn_open,
 	};
@@ -484,6 +484,45 @@ void test_conn_open_and_recv()
 	event_execute_all_test(eq);
 }
 
+void test_conn_purge_queued_read()
+{
+	struct firefly_connection *conn;
+	struct transport_llp_udp_posix *llp_udp;
+	struct firefly_transport_llp *llp = firefly_transport_llp_udp_posix_new(
+					local_port, recv_data_recv_conn, eq);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
+	struct firefly_connection_actions actions = {
+		.connection_opened = tmp_on_conn_open,
+	};
+	struct firefly_transport_connection *conn_udp =
+		firefly_transport_connection_udp_posix_new(llp,
+				"127.0.0.1", 55550, 1000);
+
+	// Key the read events by connection as a pool of workers would.
+	firefly_event_queue_set_offer_keyed(eq, firefly_event_add_keyed, true);
+	llp_udp = llp->llp_platspec;
+	int res = firefly_connection_open(&actions, NULL, eq, conn_udp, NULL);
+	CU_ASSERT_TRUE_FATAL(res > 0);
+	event_execute_test(eq, 1);
+	conn = tmp_conn;
+	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
+
+	struct sockaddr_in send_addr;
+	send_data(&send_addr, 55550, send_buf, sizeof(send_buf));
+	firefly_transport_udp_posix_read(llp);
+	CU_ASSERT_EQUAL(llp_udp->read_pool->refs, 2);
+
+	// The datagram goes back to the pool with the purged read event.
+	CU_ASSERT_EQUAL(firefly_event_purge(eq, conn), 1);
+	CU_ASSERT_EQUAL(llp_udp->read_pool->refs, 1);
+	event_execute_all_test(eq);
+	CU_ASSERT_FALSE(data_received);
+
+	firefly_event_queue_set_offer_keyed(eq, NULL, false);
+	firefly_transport_llp_udp_posix_free(llp);
+	event_execute_all_test(eq);
+}
+
 int64_t open_and_recv_conn_recv_conn(struct firefly_transport_llp *llp,
 		const char *ipaddr, unsigned short port)
 {
@@ -501,13 +540,13 @@ void test_open_and_recv_with_two_llp()
 		firefly_transport_llp_udp_posix_new(local_port,
 				open_and_recv_conn_recv_conn, eq);
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp_recv, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp_recv, protocol_packet_received_repl);
 
 	struct firefly_transport_llp *llp_send =
 		firefly_transport_llp_udp_posix_new(remote_port,
 					recv_data_recv_conn, eq);
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp_send, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp_send, protocol_packet_received_repl);
 
 	struct firefly_connection_actions actions = {
 		.connection_opened = tmp_on_conn_open,
@@ -557,7 +596,7 @@ void test_recv_big_connection()
 							recv_conn_recv_conn, eq);
 
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 	struct sockaddr_in remote_addr;
 	send_data(&remote_addr, remote_port, send_buf, sizeof(send_buf));
@@ -616,7 +655,7 @@ void test_read_mult_threads()
 	struct firefly_transport_llp *llp = firefly_transport_llp_udp_posix_new(
 					local_port, recv_data_recv_conn, eq);
 	/* Replace the ordinary data recv. callback. */
-	replace_protocol_data_received_cb(llp, protocol_data_received_repl);
+	replace_protocol_packet_received_cb(llp, protocol_packet_received_repl);
 
 	setup_sockaddr(&remote_addr, remote_port);
 	sockaddr_in_ipaddr(&remote_addr, ipaddr);
@@ -805,24 +844,23 @@ void test_send_important()
 	conn = tmp_conn;
 	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
 
-	unsigned char id;
+	uint32_t id;
 	struct timespec before;
-	clock_gettime(CLOCK_REALTIME, &before);
+	clock_gettime(CLOCK_MONOTONIC, &before);
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, &id);
 	struct timespec after;
-	clock_gettime(CLOCK_REALTIME, &after);
+	clock_gettime(CLOCK_MONOTONIC, &after);
 
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->last);
+	CU_ASSERT_EQUAL_FATAL(llp_udp->resend_queue->nbr_elems, 1);
 
-	CU_ASSERT_TRUE(memcmp(send_buf, llp_udp->resend_queue->first->data,
+	CU_ASSERT_TRUE(memcmp(send_buf, llp_udp->resend_queue->heap[0]->pkt->data,
 				sizeof(send_buf)) == 0);
 
 	bool test_before = time_ms_diff(&before,
-			&llp_udp->resend_queue->first->resend_at) >=
+			&llp_udp->resend_queue->heap[0]->resend_at) >=
 			FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_TIMEOUT;
 	bool test_after = time_ms_diff(&after,
-			&llp_udp->resend_queue->first->resend_at) <=
+			&llp_udp->resend_queue->heap[0]->resend_at) <=
 			FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_TIMEOUT;
 	CU_ASSERT_TRUE(test_before);
 	CU_ASSERT_TRUE(test_after);
@@ -832,10 +870,10 @@ void test_send_important()
 		print_timepsec(before);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(llp_udp->resend_queue->heap[0]->resend_at);
 		printf("\n");
 		printf("diff:\t%d\n", time_ms_diff(&before,
-					&llp_udp->resend_queue->first->resend_at));
+					&llp_udp->resend_queue->heap[0]->resend_at));
 	}
 	if (!test_after) {
 		printf("\n");
@@ -843,10 +881,10 @@ void test_send_important()
 		print_timepsec(after);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(llp_udp->resend_queue->heap[0]->resend_at);
 		printf("\n");
 		printf("diff:\t%d\n", time_ms_diff(&after,
-					&llp_udp->resend_queue->first->resend_at));
+					&llp_udp->resend_queue->heap[0]->resend_at));
 	}
 
 	firefly_transport_llp_udp_posix_free(llp);
@@ -873,16 +911,20 @@ void test_send_important_ack()
 	conn = tmp_conn;
 	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
 
-	unsigned char id;
+	uint32_t id;
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, &id);
 
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->last);
+	CU_ASSERT_EQUAL_FATAL(llp_udp->resend_queue->nbr_elems, 1);
 
 	firefly_transport_udp_posix_ack(id, conn);
 
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->last);
+	CU_ASSERT_EQUAL(llp_udp->resend_queue->nbr_elems, 0);
+	// The round trip time of the ack replaces the default timeout.
+	struct firefly_transport_connection_udp_posix *tcup =
+		conn->transport->context;
+	CU_ASSERT_TRUE(tcup->rto.srtt > 0);
+	CU_ASSERT_TRUE(tcup->rto.timeout <
+			FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_TIMEOUT);
 
 	firefly_transport_llp_udp_posix_free(llp);
 	event_execute_all_test(eq);
@@ -912,8 +954,7 @@ void test_send_important_id_null()
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, NULL);
 	CU_ASSERT_TRUE(was_in_error);
 
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NULL(llp_udp->resend_queue->last);
+	CU_ASSERT_EQUAL(llp_udp->resend_queue->nbr_elems, 0);
 
 	firefly_transport_llp_udp_posix_free(llp);
 	event_execute_all_test(eq);
@@ -940,23 +981,22 @@ void test_send_important_long_timeout()
 	conn = tmp_conn;
 	CU_ASSERT_PTR_NOT_NULL_FATAL(conn);
 
-	unsigned char id;
+	uint32_t id;
 	struct timespec before;
-	clock_gettime(CLOCK_REALTIME, &before);
+	clock_gettime(CLOCK_MONOTONIC, &before);
 	firefly_transport_udp_posix_write(send_buf, sizeof(send_buf), conn, true, &id);
 	struct timespec after;
-	clock_gettime(CLOCK_REALTIME, &after);
+	clock_gettime(CLOCK_MONOTONIC, &after);
 
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->first);
-	CU_ASSERT_PTR_NOT_NULL_FATAL(llp_udp->resend_queue->last);
+	CU_ASSERT_EQUAL_FATAL(llp_udp->resend_queue->nbr_elems, 1);
 
-	CU_ASSERT_TRUE(memcmp(send_buf, llp_udp->resend_queue->first->data,
+	CU_ASSERT_TRUE(memcmp(send_buf, llp_udp->resend_queue->heap[0]->pkt->data,
 				sizeof(send_buf)) == 0);
 
 	bool test_before = time_ms_diff(&before,
-			&llp_udp->resend_queue->first->resend_at) >= long_timeout;
+			&llp_udp->resend_queue->heap[0]->resend_at) >= long_timeout;
 	bool test_after = time_ms_diff(&after,
-			&llp_udp->resend_queue->first->resend_at) <= long_timeout;
+			&llp_udp->resend_queue->heap[0]->resend_at) <= long_timeout;
 	CU_ASSERT_TRUE(test_before);
 	CU_ASSERT_TRUE(test_after);
 	if (!test_before) {
@@ -965,7 +1005,7 @@ void test_send_important_long_timeout()
 		print_timepsec(before);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(llp_udp->resend_queue->heap[0]->resend_at);
 		printf("\n");
 	}
 	if (!test_after) {
@@ -974,7 +1014,7 @@ void test_send_important_long_timeout()
 		print_timepsec(after);
 		printf("\n");
 		printf("at:\t");
-		print_timepsec(llp_udp->resend_queue->first->resend_at);
+		print_timepsec(llp_udp->resend_queue->heap[0]->resend_at);
 		printf("\n");
 	}
 
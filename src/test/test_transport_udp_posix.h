@@ -17,6 +17,8 @@ void test_recv_conn_and_two_data();
 void test_conn_open_and_send();
 void test_conn_open_and_recv();
 
+void test_conn_purge_queued_read();
+
 // test free llp
 void test_llp_free_empty();
 void test_llp_free_mult_conns();
@@ -5,15 +5,133 @@
 #include "transport/firefly_transport_private.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 #include <transport/firefly_transport.h>
 
 #include "protocol/firefly_protocol_private.h"
 #include "utils/firefly_errors.h"
 
+/** The initial number of buckets of the index of the connections of a llp. */
+#define LLP_CONNECTION_INDEX_MIN_BUCKETS (16)
+
+void llp_connection_index_init(struct firefly_transport_llp *llp,
+		conn_eq_f conn_eq, conn_hash_f conn_hash, conn_key_f conn_key)
+{
+	llp->conn_index.buckets = NULL;
+	llp->conn_index.nbr_buckets = 0;
+	llp->conn_index.nbr_conns = 0;
+	llp->conn_index.eq = conn_eq;
+	llp->conn_index.hash = conn_hash;
+	llp->conn_index.key = conn_key;
+}
+
+void llp_connection_index_free(struct firefly_transport_llp *llp)
+{
+	FIREFLY_FREE(llp->conn_index.buckets);
+	llp->conn_index.buckets = NULL;
+	llp->conn_index.nbr_buckets = 0;
+	llp->conn_index.nbr_conns = 0;
+}
+
+size_t firefly_transport_hash_bytes(const void *data, size_t size)
+{
+	const unsigned char *bytes = data;
+	uint32_t hash = 2166136261u;
+
+	/* FNV-1a */
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void llp_index_link(struct llp_connection_index *index,
+		struct llp_connection_list_node *node)
+{
+	struct llp_connection_list_node **bucket;
+
+	bucket = &index->buckets[node->hash & (index->nbr_buckets - 1)];
+	node->hash_next = *bucket;
+	*bucket = node;
+}
+
+/*
+ * Grow the buckets to keep the chains short. If the first buckets can not be
+ * allocated the index is dropped and connections are found by comparing each
+ * of them instead.
+ */
+static void llp_index_grow(struct firefly_transport_llp *llp)
+{
+	struct llp_connection_index *index;
+	struct llp_connection_list_node **old_buckets;
+	size_t old_nbr;
+	size_t nbr;
+
+	index = &llp->conn_index;
+	if (index->nbr_conns < index->nbr_buckets)
+		return;
+	nbr = index->nbr_buckets > 0 ?
+		2 * index->nbr_buckets : LLP_CONNECTION_INDEX_MIN_BUCKETS;
+	old_buckets = index->buckets;
+	old_nbr = index->nbr_buckets;
+	index->buckets = FIREFLY_MALLOC(nbr * sizeof(*index->buckets));
+	if (index->buckets == NULL) {
+		index->buckets = old_buckets;
+		if (old_buckets == NULL) {
+			FFL(FIREFLY_ERROR_ALLOC);
+			index->eq = NULL;
+		}
+		return;
+	}
+	memset(index->buckets, 0, nbr * sizeof(*index->buckets));
+	index->nbr_buckets = nbr;
+	for (size_t i = 0; i < old_nbr; i++) {
+		struct llp_connection_list_node *node = old_buckets[i];
+
+		while (node != NULL) {
+			struct llp_connection_list_node *next = node->hash_next;
+
+			llp_index_link(index, node);
+			node = next;
+		}
+	}
+	FIREFLY_FREE(old_buckets);
+}
+
+static struct llp_connection_list_node *llp_index_find(
+		struct llp_connection_index *index, size_t hash,
+		void *context, conn_eq_f conn_eq)
+{
+	struct llp_connection_list_node *node;
+
+	if (index->nbr_buckets == 0)
+		return NULL;
+	node = index->buckets[hash & (index->nbr_buckets - 1)];
+	while (node != NULL &&
+			(node->hash != hash || !conn_eq(node->conn, context)))
+		node = node->hash_next;
+	return node;
+}
+
+static void llp_index_unlink(struct llp_connection_index *index,
+		struct llp_connection_list_node *node)
+{
+	struct llp_connection_list_node **bucket;
+
+	bucket = &index->buckets[node->hash & (index->nbr_buckets - 1)];
+	while (*bucket != node)
+		bucket = &(*bucket)->hash_next;
+	*bucket = node->hash_next;
+	index->nbr_conns--;
+}
+
 void add_connection_to_llp(struct firefly_connection *conn,
 		struct firefly_transport_llp *llp)
 {
+	struct llp_connection_index *index;
 	struct llp_connection_list_node *tmp;
 	struct llp_connection_list_node *new_node;
 
@@ -25,27 +143,64 @@ void add_connection_to_llp(struct firefly_connection *conn,
 	}
 	new_node->conn = conn;
 	new_node->next = tmp;
+	new_node->prev = NULL;
+	if (tmp != NULL)
+		tmp->prev = new_node;
 	llp->conn_list = new_node;
+
+	index = &llp->conn_index;
+	if (index->eq != NULL) {
+		llp_index_grow(llp);
+		if (index->eq != NULL) {
+			new_node->hash = index->hash(index->key(conn));
+			llp_index_link(index, new_node);
+			index->nbr_conns++;
+		}
+	}
 }
 
 struct firefly_connection *remove_connection_from_llp(
 		struct firefly_transport_llp *llp,
 		void *context, conn_eq_f conn_eq)
 {
-	struct firefly_connection *ret = NULL;
-	struct llp_connection_list_node **head = &llp->conn_list;
-	/*printf("head: %p\n", head);*/
-	while (head != NULL && (*head) != NULL) {
-		if (conn_eq((*head)->conn, context)) {
-			ret = (*head)->conn;
-			struct llp_connection_list_node *tmp = (*head)->next;
-			FIREFLY_FREE(*head);
-			*head = tmp;
-			head = NULL;
+	struct llp_connection_index *index;
+	struct llp_connection_list_node **head;
+	struct llp_connection_list_node *node;
+	struct firefly_connection *ret;
+
+	index = &llp->conn_index;
+	if (index->eq == NULL) {
+		head = &llp->conn_list;
+		while (*head != NULL && !conn_eq((*head)->conn, context))
+			head = &(*head)->next;
+		node = *head;
+		if (node == NULL)
+			return NULL;
+		*head = node->next;
+	} else {
+		if (conn_eq == index->eq) {
+			node = llp_index_find(index, index->hash(context), context,
+					conn_eq);
+		} else if (conn_eq == firefly_connection_eq_ptr) {
+			node = llp_index_find(index, index->hash(index->key(context)),
+					context, conn_eq);
 		} else {
-			*head = (*head)->next;
+			node = llp->conn_list;
+			while (node != NULL && !conn_eq(node->conn, context))
+				node = node->next;
 		}
+		if (node == NULL)
+			return NULL;
+		llp_index_unlink(index, node);
+		if (node->prev != NULL)
+			node->prev->next = node->next;
+		else
+			llp->conn_list = node->next;
+		if (node->next != NULL)
+			node->next->prev = node->prev;
 	}
+	ret = node->conn;
+	FIREFLY_FREE(node);
 	return ret;
 }
 
@@ -55,6 +210,11 @@ struct firefly_connection *find_connection(struct firefly_transport_llp *llp,
 	struct llp_connection_list_node *head = llp->conn_list;
 	struct firefly_connection *conn;
 
+	if (llp->conn_index.eq != NULL && conn_eq == llp->conn_index.eq) {
+		head = llp_index_find(&llp->conn_index,
+				llp->conn_index.hash(context), context, conn_eq);
+		return head != NULL ? head->conn : NULL;
+	}
 	while (head != NULL) {
 		conn = head->conn;
 		if (conn_eq(conn, context)) {
@@ -76,3 +236,9 @@ void replace_protocol_data_received_cb(struct firefly_transport_llp *llp,
 {
 	llp->protocol_data_received_cb = protocol_data_received_cb;
 }
+
+void replace_protocol_packet_received_cb(struct firefly_transport_llp *llp,
+		protocol_packet_received_f protocol_packet_received_cb)
+{
+	llp->protocol_packet_received_cb = protocol_packet_received_cb;
+}
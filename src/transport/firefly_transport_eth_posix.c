@@ -89,6 +89,17 @@ struct firefly_transport_llp *firefly_transport_llp_eth_posix_new(
 		FFL(FIREFLY_ERROR_SOCKET);
 		return NULL;
 	}
+	/* Jumbo frames are used if the interface is configured for them. */
+	err = ioctl(llp_eth->socket, SIOCGIFMTU, &ifr);
+	llp_eth->mtu = (err < 0 || ifr.ifr_mtu <= 0) ?
+		FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_MTU : (size_t) ifr.ifr_mtu;
+	llp_eth->read_buffer = malloc(llp_eth->mtu);
+	if (!llp_eth->read_buffer) {
+		close(llp_eth->socket);
+		free(llp_eth);
+		FFL(FIREFLY_ERROR_ALLOC);
+		return NULL;
+	}
 
 	llp_eth->on_conn_recv		= on_conn_recv;
 	llp_eth->event_queue		= event_queue;
@@ -96,17 +107,23 @@ struct firefly_transport_llp *firefly_transport_llp_eth_posix_new(
 	memset(&llp_eth->read_thread, 0, sizeof(llp_eth->read_thread));
 	memset(&llp_eth->resend_thread, 0, sizeof(llp_eth->read_thread));
 	llp_eth->running = false;
+	pthread_mutex_init(&llp_eth->conn_list_lock, NULL);
 
 	llp				= malloc(sizeof(*llp));
 	if (!llp) {
 		close(llp_eth->socket);
+		pthread_mutex_destroy(&llp_eth->conn_list_lock);
+		free(llp_eth->read_buffer);
 		free(llp_eth);
 		FFL(FIREFLY_ERROR_ALLOC);
 		return NULL;
 	}
 	llp->llp_platspec		= llp_eth;
 	llp->conn_list			= NULL;
+	llp_connection_index_init(llp, connection_eq_addr,
+			connection_hash_addr, connection_key_addr);
 	llp->protocol_data_received_cb	= protocol_data_received;
+	llp->protocol_packet_received_cb	= protocol_packet_received;
 	llp->state				= FIREFLY_LLP_OPEN;
 	return llp;
 }
@@ -128,7 +145,10 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 		llp_eth = llp->llp_platspec;
 		close(llp_eth->socket);
 		firefly_resend_queue_free(llp_eth->resend_queue);
+		pthread_mutex_destroy(&llp_eth->conn_list_lock);
+		free(llp_eth->read_buffer);
 		free(llp_eth);
+		llp_connection_index_free(llp);
 		free(llp);
 	}
 }
@@ -141,11 +161,14 @@ int firefly_transport_llp_eth_posix_free_event(void *event_arg)
 	llp->state = FIREFLY_LLP_CLOSING;
 
 	// Close all connections.
+	struct transport_llp_eth_posix *llp_eth = llp->llp_platspec;
+	pthread_mutex_lock(&llp_eth->conn_list_lock);
 	struct llp_connection_list_node *head = llp->conn_list;
 	while (head != NULL) {
 		firefly_connection_close(head->conn);
 		head = head->next;
 	}
+	pthread_mutex_unlock(&llp_eth->conn_list_lock);
 	check_llp_free(llp);
 	return 0;
 }
@@ -153,8 +176,12 @@ int firefly_transport_llp_eth_posix_free_event(void *event_arg)
 static int connection_open(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_eth_posix *tcep;
+	struct transport_llp_eth_posix *llp_eth;
 	tcep = conn->transport->context;
+	llp_eth = tcep->llp->llp_platspec;
+	pthread_mutex_lock(&llp_eth->conn_list_lock);
 	add_connection_to_llp(conn, tcep->llp);
+	pthread_mutex_unlock(&llp_eth->conn_list_lock);
 	return 0;
 }
 
@@ -162,11 +189,15 @@ static int connection_close(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_eth_posix *tcep;
 	struct firefly_transport_llp *llp;
+	struct transport_llp_eth_posix *llp_eth;
 	tcep = conn->transport->context;
 	llp = tcep->llp;
+	llp_eth = llp->llp_platspec;
 
+	pthread_mutex_lock(&llp_eth->conn_list_lock);
 	remove_connection_from_llp(tcep->llp, conn,
 			firefly_connection_eq_ptr);
+	pthread_mutex_unlock(&llp_eth->conn_list_lock);
 	free(tcep->remote_addr);
 	free(tcep);
 	free(conn->transport);
@@ -222,18 +253,30 @@ struct firefly_transport_connection *firefly_transport_connection_eth_posix_new(
 
 	tcep->socket = llp_eth->socket;
 	tcep->llp = llp;
-	tcep->timeout = FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_TIMEOUT;
+	firefly_resend_rto_init(&tcep->rto,
+			FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_TIMEOUT,
+			FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_RETRIES);
 	tc->context = tcep;
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_eth_posix_write;
+	tc->write_packet = firefly_transport_eth_posix_write_packet;
 	tc->ack = firefly_transport_eth_posix_ack;
+	tc->mtu = llp_eth->mtu;
 
 	return tc;
 }
 
-void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+void firefly_transport_connection_eth_posix_set_retries(
+		struct firefly_transport_connection *tc, unsigned char retries)
+{
+	struct firefly_transport_connection_eth_posix *tcep = tc->context;
+
+	tcep->rto.retries = retries;
+}
+
+static void eth_posix_send(unsigned char *data, size_t data_size,
+		struct firefly_connection *conn)
 {
 	int err;
 	struct firefly_transport_connection_eth_posix *tcep =
@@ -246,24 +289,47 @@ void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
 		firefly_connection_raise_later(conn,
 				FIREFLY_ERROR_TRANS_WRITE, "sendto() failed");
 	}
+}
+
+static void eth_posix_resend_add(struct firefly_packet *pkt,
+		struct firefly_connection *conn, uint32_t *id)
+{
+	struct firefly_transport_connection_eth_posix *tcep =
+		 conn->transport->context;
+	struct transport_llp_eth_posix *llp_ps = tcep->llp->llp_platspec;
+
+	*id = firefly_resend_add(llp_ps->resend_queue, pkt,
+			tcep->rto.timeout, tcep->rto.retries, conn);
+}
+
+void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
+		struct firefly_connection *conn, bool important, uint32_t *id)
+{
+	eth_posix_send(data, data_size, conn);
 	if (important && id != NULL) {
-		unsigned char *new_data;
-		struct transport_llp_eth_posix *llp_ps;
+		struct firefly_packet *pkt;
 
-		new_data = malloc(data_size);
-		if (!new_data) {
+		pkt = firefly_packet_new(data_size);
+		if (!pkt) {
 			FFL(FIREFLY_ERROR_ALLOC);
 			return;
 		}
-		memcpy(new_data, data, data_size);
-		llp_ps = tcep->llp->llp_platspec;
-		*id = firefly_resend_add(llp_ps->resend_queue,
-				new_data, data_size, tcep->timeout,
-				FIREFLY_TRANSPORT_ETH_POSIX_DEFAULT_RETRIES, conn);
+		memcpy(pkt->data, data, data_size);
+		pkt->size = data_size;
+		eth_posix_resend_add(pkt, conn, id);
+		firefly_packet_release(pkt);
 	}
 }
 
-void firefly_transport_eth_posix_ack(unsigned char pkt_id,
+void firefly_transport_eth_posix_write_packet(struct firefly_packet *pkt,
+		struct firefly_connection *conn, bool important, uint32_t *id)
+{
+	eth_posix_send(pkt->data + pkt->offset, pkt->size, conn);
+	if (important && id != NULL)
+		eth_posix_resend_add(pkt, conn, id);
+}
+
+void firefly_transport_eth_posix_ack(uint32_t pkt_id,
 		struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_eth_posix *conn_eth;
@@ -271,7 +337,8 @@ void firefly_transport_eth_posix_ack(unsigned char pkt_id,
 
 	conn_eth = conn->transport->context;
 	llpep = conn_eth->llp->llp_platspec;
-	firefly_resend_remove(llpep->resend_queue, pkt_id);
+	firefly_resend_rto_sample(&conn_eth->rto,
+			firefly_resend_remove(llpep->resend_queue, pkt_id));
 }
 
 struct firefly_event_llp_read_eth_posix {
@@ -279,8 +346,52 @@ struct firefly_event_llp_read_eth_posix {
 	struct sockaddr_ll addr;
 	size_t len;
 	unsigned char *data;
+	struct firefly_connection *conn; /* The connection the event is keyed to,
+										NULL if keyed to the llp. */
 };
 
+static struct firefly_connection *find_connection_locked(
+		struct firefly_transport_llp *llp, struct sockaddr_ll *addr)
+{
+	struct transport_llp_eth_posix *llp_eth = llp->llp_platspec;
+	struct firefly_connection *conn;
+
+	pthread_mutex_lock(&llp_eth->conn_list_lock);
+	conn = find_connection(llp, addr, connection_eq_addr);
+	pthread_mutex_unlock(&llp_eth->conn_list_lock);
+	return conn;
+}
+
+static int firefly_transport_eth_posix_read_event(void *event_args);
+
+/*
+ * Free the frame of a read event that is never run, e.g. purged with its
+ * connection.
+ */
+static void read_event_destroy(void *event_args)
+{
+	struct firefly_event_llp_read_eth_posix *ev_a = event_args;
+
+	free(ev_a->data);
+}
+
+/*
+ * Offer the read event keyed to the connection it is for, or to the llp if
+ * the frame is from an unknown address. The argument is copied into the
+ * event.
+ */
+static int64_t offer_read_event(struct firefly_event_llp_read_eth_posix *ev_a,
+		unsigned int nbr_deps, const int64_t *deps)
+{
+	struct transport_llp_eth_posix *llp_eth = ev_a->llp->llp_platspec;
+	const void *key = ev_a->conn != NULL ?
+		(const void *) ev_a->conn : (const void *) ev_a->llp;
+
+	return firefly_event_offer_owned(llp_eth->event_queue, key, NULL,
+			FIREFLY_PRIORITY_HIGH, firefly_transport_eth_posix_read_event,
+			ev_a, sizeof(*ev_a), read_event_destroy, nbr_deps, deps);
+}
+
 static int firefly_transport_eth_posix_read_event(void *event_args)
 {
 	struct firefly_event_llp_read_eth_posix *ev_a;
@@ -289,7 +400,13 @@ static int firefly_transport_eth_posix_read_event(void *event_args)
 
 	ev_a = event_args;
 	llp_eth = ev_a->llp->llp_platspec;
-	conn = find_connection(ev_a->llp, &ev_a->addr, connection_eq_addr);
+	conn = find_connection_locked(ev_a->llp, &ev_a->addr);
+	if (conn != NULL && conn != ev_a->conn &&
+			firefly_event_queue_is_keyed(llp_eth->event_queue)) {
+		// Not keyed to the connection, run again keyed correctly.
+		ev_a->conn = conn;
+		return offer_read_event(ev_a, 0, NULL);
+	}
 	if (conn == NULL) {
 		char mac_addr[MACADDR_STRLEN];
 		get_mac_addr(&ev_a->addr, mac_addr);
@@ -297,18 +414,14 @@ static int firefly_transport_eth_posix_read_event(void *event_args)
 		if (llp_eth->on_conn_recv != NULL &&
 				(ev_id = llp_eth->on_conn_recv(ev_a->llp, mac_addr)) > 0) {
 			/* Connection accepted; reschedule event. */
-			return llp_eth->event_queue->offer_event_cb(
-					llp_eth->event_queue,
-					FIREFLY_PRIORITY_HIGH,
-					firefly_transport_eth_posix_read_event,
-					ev_a, 1, &ev_id);
+			ev_a->conn = NULL;
+			return offer_read_event(ev_a, 1, &ev_id);
 		} else {
 			free(ev_a->data);
 		}
 	} else {
 		ev_a->llp->protocol_data_received_cb(conn, ev_a->data, ev_a->len);
 	}
-	free(ev_a);
 
 	return 0;
 }
@@ -316,10 +429,9 @@ static int firefly_transport_eth_posix_read_event(void *event_args)
 void firefly_transport_eth_posix_read(struct firefly_transport_llp *llp,
 		struct timeval *tv)
 {
-	struct firefly_event_llp_read_eth_posix *ev_arg;
+	struct firefly_event_llp_read_eth_posix ev_arg;
 	struct transport_llp_eth_posix *llp_eth;
 	socklen_t addr_len;
-	unsigned char tmp_buffer[1500];
 	struct sockaddr_ll tmp_address;
 	fd_set fs;
 	int res;
@@ -336,7 +448,8 @@ void firefly_transport_eth_posix_read(struct firefly_transport_llp *llp,
 	}
 
 	addr_len = sizeof(tmp_address);
-	res = recvfrom(llp_eth->socket, tmp_buffer, 1500, MSG_DONTWAIT,
+	res = recvfrom(llp_eth->socket, llp_eth->read_buffer, llp_eth->mtu,
+			MSG_DONTWAIT,
 			(struct sockaddr *) &tmp_address, &addr_len);
 	if (res == -EWOULDBLOCK || res == -EAGAIN) {
 		return;
@@ -348,24 +461,21 @@ void firefly_transport_eth_posix_read(struct firefly_transport_llp *llp,
 			      __FUNCTION__, err_buf);
 		return;
 	}
-	ev_arg = malloc(sizeof(*ev_arg));
-	if (!ev_arg) {
+	ev_arg.data = malloc(res);
+	if (!ev_arg.data) {
 		FFL(FIREFLY_ERROR_ALLOC);
 		return;
 	}
-	ev_arg->data = malloc(res);
-	if (!ev_arg->data) {
-		FFL(FIREFLY_ERROR_ALLOC);
-		return;
-	}
-	ev_arg->len = res;
-	ev_arg->addr = tmp_address;
-	ev_arg->llp = llp;
-	memcpy(ev_arg->data, tmp_buffer, ev_arg->len);
-
-	llp_eth->event_queue->offer_event_cb(llp_eth->event_queue,
-			FIREFLY_PRIORITY_HIGH,
-			firefly_transport_eth_posix_read_event, ev_arg, 0, NULL);
+	ev_arg.len = res;
+	ev_arg.addr = tmp_address;
+	ev_arg.llp = llp;
+	ev_arg.conn = NULL;
+	memcpy(ev_arg.data, llp_eth->read_buffer, ev_arg.len);
+	if (firefly_event_queue_is_keyed(llp_eth->event_queue))
+		ev_arg.conn = find_connection_locked(llp, &tmp_address);
+
+	if (offer_read_event(&ev_arg, 0, NULL) < 0)
+		free(ev_arg.data);
 }
 
 void *firefly_transport_eth_posix_read_run(void *arg)
@@ -458,3 +568,16 @@ bool connection_eq_addr(struct firefly_connection *conn, void *context)
 	}
 	return result == 0;
 }
+
+size_t connection_hash_addr(void *context)
+{
+	struct sockaddr_ll *addr = context;
+
+	return firefly_transport_hash_bytes(addr->sll_addr, addr->sll_halen);
+}
+
+void *connection_key_addr(struct firefly_connection *conn)
+{
+	return ((struct firefly_transport_connection_eth_posix *)
+			conn->transport->context)->remote_addr;
+}
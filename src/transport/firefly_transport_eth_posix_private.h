@@ -9,6 +9,7 @@
 
 #include <transport/firefly_transport.h>
 #include <transport/firefly_transport_eth_posix.h>
+#include <utils/firefly_resend_posix.h>
 
 #include "transport/firefly_transport_private.h"
 
@@ -40,6 +41,13 @@ struct transport_llp_eth_posix {
 	pthread_t resend_thread; /**< The handle to the thread running the resend
 							   loop. */
 	bool running; /**< Whether or not the read loop should exit. */
+	size_t mtu; /**< The MTU of the interface, the largest payload of the
+				  frames sent and received. */
+	unsigned char *read_buffer; /**< The buffer frames are read into, mtu
+								  bytes. */
+	pthread_mutex_t conn_list_lock; /**< Protects the connection list of the
+									  llp when read events run on several
+									  workers. */
 };
 
 /**
@@ -51,7 +59,8 @@ struct firefly_transport_connection_eth_posix {
 	struct firefly_transport_llp *llp; /**< The \a llp this connection is
 										 associated with. */
 	int socket; /**< The socket. */
-	unsigned int timeout; /**< The time between resends on this connection. */
+	struct firefly_resend_rto rto; /**< The timeout and retries of important
+									 packets on this connection. */
 };
 
 /**
@@ -76,7 +85,22 @@ int firefly_transport_llp_eth_posix_free_event(void *event_arg);
  * @see #firefly_transport_eth_posix_ack()
  */
 void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, uint32_t *id);
+
+/**
+ * @brief Write a packet buffer on the specified connection without copying
+ * it. Implements #firefly_transport_connection_write_packet_f.
+ *
+ * @param pkt The packet to be written.
+ * @param conn The connection to written the packet on.
+ * @param important If true the resend queue keeps a reference to the packet
+ * and resends it until it is acked by calling #firefly_transport_eth_posix_ack or max retries is
+ * reached.
+ * @param id The variable to save the resend packed id in.
+ * @see #firefly_transport_connection_write_packet_f()
+ */
+void firefly_transport_eth_posix_write_packet(struct firefly_packet *pkt,
+		struct firefly_connection *conn, bool important, uint32_t *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -87,7 +111,7 @@ void firefly_transport_eth_posix_write(unsigned char *data, size_t data_size,
  * @see #firefly_transport_connection_ack_f()
  * @see #firefly_transport_eth_posix_write()
  */
-void firefly_transport_eth_posix_ack(unsigned char pkt_id,
+void firefly_transport_eth_posix_ack(uint32_t pkt_id,
 		struct firefly_connection *conn);
 
 /**
@@ -112,4 +136,21 @@ void get_mac_addr(struct sockaddr_ll *addr, char *mac_addr);
  */
 bool connection_eq_addr(struct firefly_connection *conn, void *context);
 
+/**
+ * @brief Hashes an address compared by connection_eq_addr().
+ *
+ * @param context The address, must be of type \c struct \c sockaddr_ll.
+ * @return The hash of the hardware address.
+ */
+size_t connection_hash_addr(void *context);
+
+/**
+ * @brief Gives the remote address of a connection, as compared by
+ * connection_eq_addr().
+ *
+ * @param conn The connection.
+ * @return The \c struct \c sockaddr_ll of the remote node.
+ */
+void *connection_key_addr(struct firefly_connection *conn);
+
 #endif
@@ -115,6 +115,8 @@ struct firefly_transport_llp *firefly_transport_llp_eth_stellaris_new(
 	}
 	llp->llp_platspec = llp_eth_stellaris;
 	llp->conn_list    = NULL;
+	llp_connection_index_init(llp, connection_eq_remmac,
+			connection_hash_remmac, connection_key_remmac);
 
 	return llp;
 }
@@ -144,6 +146,7 @@ int firefly_transport_llp_eth_stellaris_free_event(void *event_arg)
 	if (empty) {
 		struct transport_llp_eth_stellaris *llp_eth = llp->llp_platspec;
 		free(llp_eth);
+		llp_connection_index_free(llp);
 		free(llp);
 	} else {
 		firefly_transport_llp_eth_stellaris_free(llp);
@@ -197,13 +200,15 @@ firefly_transport_connection_eth_stellaris_new(
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_eth_stellaris_write;
+	tc->write_packet = NULL;
+	tc->mtu = 0;
 	tc->ack = firefly_transport_eth_stellaris_ack;
 
 	return tc;
 }
 
 void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, uint32_t *id)
 {
 	struct firefly_transport_connection_eth_stellaris *conn_eth;
 	struct transport_llp_eth_stellaris *llp_eth;
@@ -231,7 +236,7 @@ void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size
 	}
 }
 
-void firefly_transport_eth_stellaris_ack(unsigned char pkg_id,
+void firefly_transport_eth_stellaris_ack(uint32_t pkg_id,
 		struct firefly_connection *conn)
 {
 	UNUSED_VAR(pkg_id);
@@ -252,6 +257,20 @@ bool connection_eq_remmac(struct firefly_connection *conn, void *context)
 	return !memcmp(addr1, addr2, ETH_ADDR_LEN);
 }
 
+size_t connection_hash_remmac(void *context)
+{
+	return firefly_transport_hash_bytes(context, ETH_ADDR_LEN);
+}
+
+void *connection_key_remmac(struct firefly_connection *conn)
+{
+	struct firefly_transport_connection_eth_stellaris *conn_eth;
+
+	conn_eth = conn->transport->context;
+
+	return conn_eth->remote_addr;
+}
+
 void firefly_transport_eth_stellaris_read(struct firefly_transport_llp *llp)
 {
 	struct transport_llp_eth_stellaris *llp_eth;
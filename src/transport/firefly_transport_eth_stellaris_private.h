@@ -184,7 +184,7 @@ int firefly_transport_llp_eth_stellaris_free_event(void *event_arg);
  * @see #firefly_transport_eth_stellaris_ack()
  */
 void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, uint32_t *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -196,9 +196,38 @@ void firefly_transport_eth_stellaris_write(unsigned char *data, size_t data_size
  * @see #firefly_transport_connection_ack_f()
  * @see #firefly_transport_eth_posix_write()
  */
-void firefly_transport_eth_stellaris_ack(unsigned char pkt_id,
+void firefly_transport_eth_stellaris_ack(uint32_t pkt_id,
 		struct firefly_connection *conn);
 
+/**
+ * @brief Compares the remote MAC address of a connection to the one in the
+ * context.
+ *
+ * @param conn The connection to compare the remote address of.
+ * @param context The MAC address, #ETH_ADDR_LEN bytes.
+ * @retval true If the addresses are equal.
+ * @retval false otherwise.
+ * @see #conn_eq_f()
+ */
+bool connection_eq_remmac(struct firefly_connection *conn, void *context);
+
+/**
+ * @brief Hashes a MAC address compared by connection_eq_remmac().
+ *
+ * @param context The MAC address, #ETH_ADDR_LEN bytes.
+ * @return The hash.
+ */
+size_t connection_hash_remmac(void *context);
+
+/**
+ * @brief Gives the remote MAC address of a connection, as compared by
+ * connection_eq_remmac().
+ *
+ * @param conn The connection.
+ * @return The remote MAC address.
+ */
+void *connection_key_remmac(struct firefly_connection *conn);
+
 /**
  * @brief The event callback executing a read.
  *
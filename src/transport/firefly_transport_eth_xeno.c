@@ -126,7 +126,10 @@ struct firefly_transport_llp *firefly_transport_llp_eth_xeno_new(
 	}
 	llp->llp_platspec		= llp_eth;
 	llp->conn_list			= NULL;
+	llp_connection_index_init(llp, connection_eq_addr,
+			connection_hash_addr, connection_key_addr);
 	llp->protocol_data_received_cb	= protocol_data_received;
+	llp->protocol_packet_received_cb	= protocol_packet_received;
 
 	return llp;
 }
@@ -149,6 +152,7 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 		rt_dev_close(llp_eth->socket);
 		rt_heap_delete(&llp_eth->dyn_mem);
 		free(llp_eth);
+		llp_connection_index_free(llp);
 		free(llp);
 	}
 }
@@ -294,13 +298,15 @@ struct firefly_transport_connection *firefly_transport_connection_eth_xeno_new(
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_eth_xeno_write;
+	tc->write_packet = NULL;
+	tc->mtu = 0;
 	tc->ack = firefly_transport_eth_xeno_ack;
 
 	return tc;
 }
 
 void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, uint32_t *id)
 {
 	int err;
 	struct firefly_transport_connection_eth_xeno *conn_eth =
@@ -317,7 +323,7 @@ void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
 	}
 }
 
-void firefly_transport_eth_xeno_ack(unsigned char pkt_id,
+void firefly_transport_eth_xeno_ack(uint32_t pkt_id,
 		struct firefly_connection *conn)
 {
 	UNUSED_VAR(pkt_id);
@@ -509,3 +515,16 @@ bool connection_eq_addr(struct firefly_connection *conn, void *context)
 	}
 	return result == 0;
 }
+
+size_t connection_hash_addr(void *context)
+{
+	struct sockaddr_ll *addr = context;
+
+	return firefly_transport_hash_bytes(addr->sll_addr, addr->sll_halen);
+}
+
+void *connection_key_addr(struct firefly_connection *conn)
+{
+	return ((struct firefly_transport_connection_eth_xeno *)
+			conn->transport->context)->remote_addr;
+}
@@ -78,7 +78,7 @@ int firefly_transport_llp_eth_xeno_free_event(void *event_arg);
  * @see #firefly_transport_eth_xeno_ack()
  */
 void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, uint32_t *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -89,7 +89,7 @@ void firefly_transport_eth_xeno_write(unsigned char *data, size_t data_size,
  * @see #firefly_transport_connection_ack_f()
  * @see #firefly_transport_eth_xeno_write()
  */
-void firefly_transport_eth_xeno_ack(unsigned char pkt_id,
+void firefly_transport_eth_xeno_ack(uint32_t pkt_id,
 		struct firefly_connection *conn);
 
 /**
@@ -114,4 +114,21 @@ void get_mac_addr(struct sockaddr_ll *addr, char *mac_addr);
  */
 bool connection_eq_addr(struct firefly_connection *conn, void *context);
 
+/**
+ * @brief Hashes an address compared by connection_eq_addr().
+ *
+ * @param context The address, must be of type \c struct \c sockaddr_ll.
+ * @return The hash of the hardware address.
+ */
+size_t connection_hash_addr(void *context);
+
+/**
+ * @brief Gives the remote address of a connection, as compared by
+ * connection_eq_addr().
+ *
+ * @param conn The connection.
+ * @return The \c struct \c sockaddr_ll of the remote node.
+ */
+void *connection_key_addr(struct firefly_connection *conn);
+
 #endif
@@ -19,6 +19,58 @@ enum firefly_llp_state {
 	FIREFLY_LLP_CLOSING /**< Defines the closed state of a \a llp. */
 };
 
+/**
+ * @brief Compares a connection to some value. This function is used by
+ * find_connection to test if a connection is the one searched for.
+ *
+ * @param conn The connection to compare.
+ * @param context The data to compare the connection to.
+ * @retval true if the context is considered identifying the connection.
+ * @retval false otherwise.
+ */
+typedef bool (*conn_eq_f)(struct firefly_connection *conn, void *context);
+
+/**
+ * @brief Hashes a value of the kind a #conn_eq_f compares connections to,
+ * such as a transport address.
+ *
+ * Values considered equal by the #conn_eq_f must have the same hash.
+ *
+ * @param context The value to hash.
+ * @return The hash.
+ */
+typedef size_t (*conn_hash_f)(void *context);
+
+/**
+ * @brief Gives the value of a connection that identifies it to a #conn_eq_f,
+ * such as its transport address.
+ *
+ * @param conn The connection.
+ * @return The value identifying the connection, valid as long as the
+ * connection is added to a llp.
+ */
+typedef void *(*conn_key_f)(struct firefly_connection *conn);
+
+/**
+ * @brief A hash index of the connections of a llp, letting find_connection()
+ * find a connection in constant time instead of comparing it to every
+ * connection.
+ *
+ * The index answers lookups made with the #conn_eq_f it is set up with. Each
+ * bucket is a chain of the list nodes of the connections whose hash maps to
+ * it.
+ */
+struct llp_connection_index {
+	struct llp_connection_list_node **buckets; /**< The chains of nodes. */
+	size_t nbr_buckets; /**< The number of buckets, zero or a power of
+						  two. */
+	size_t nbr_conns; /**< The number of connections in the index. */
+	conn_eq_f eq; /**< The comparator lookups are answered for, NULL if the
+					connections are not indexed. */
+	conn_hash_f hash; /**< Hashes the values compared by eq. */
+	conn_key_f key; /**< Gives the value identifying a connection. */
+};
+
 /**
  * @brief A general data structure representing a link layer port on the
  * transport layer.
@@ -29,12 +81,21 @@ struct firefly_transport_llp {
 									layer. */
 	struct llp_connection_list_node *conn_list; /**< A linked list of all
 												  connections. */
+	struct llp_connection_index conn_index; /**< An index of the connections
+											  in conn_list. */
 	void *llp_platspec; /**< Platform, and transport method, specific data. */
 	protocol_data_received_f protocol_data_received_cb; /** The function which
 														  passes data received
 														  by the transport
 														  layer. Replacable for
 														  testability. */
+	protocol_packet_received_f protocol_packet_received_cb; /**< The function
+															  which passes
+															  packets received
+															  by the transport
+															  layer. Replacable
+															  for testability.
+															  */
 };
 
 /**
@@ -43,18 +104,42 @@ struct firefly_transport_llp {
 struct llp_connection_list_node {
 	struct llp_connection_list_node *next;
 	struct firefly_connection *conn;
+	struct llp_connection_list_node *prev; /**< The previous node, only kept
+											 when the llp is indexed. */
+	struct llp_connection_list_node *hash_next; /**< The next node in the
+												  same bucket of the
+												  index. */
+	size_t hash; /**< The hash of the key of conn. */
 };
 
 /**
- * @brief Compares a connection to some value. This function is used by
- * find_connection to test if a connection is the one searched for.
+ * @brief Set up the index of the connections of a llp. Must be called before
+ * any connection is added to the llp.
  *
- * @param conn The connection to compare.
- * @param context The data to compare the connection to.
- * @retval true if the context is considered identifying the connection.
- * @retval false otherwise.
+ * @param llp The llp to index the connections of.
+ * @param conn_eq The comparator to answer lookups for.
+ * @param conn_hash Hashes the values compared by \p conn_eq.
+ * @param conn_key Gives the value identifying a connection.
  */
-typedef bool (*conn_eq_f)(struct firefly_connection *conn, void *context);
+void llp_connection_index_init(struct firefly_transport_llp *llp,
+		conn_eq_f conn_eq, conn_hash_f conn_hash, conn_key_f conn_key);
+
+/**
+ * @brief Free the memory of the index of the connections of a llp.
+ *
+ * @param llp The llp with the index.
+ */
+void llp_connection_index_free(struct firefly_transport_llp *llp);
+
+/**
+ * @brief Hash a sequence of bytes, for use by implementations of
+ * #conn_hash_f.
+ *
+ * @param data The bytes to hash.
+ * @param size The number of bytes.
+ * @return The hash.
+ */
+size_t firefly_transport_hash_bytes(const void *data, size_t size);
 
 /**
  * @brief Adds a connection to the connection list in \a llp.
@@ -85,6 +170,9 @@ struct firefly_connection *remove_connection_from_llp(
  * @brief Finds the first \c struct #firefly_connection, associated with the
  * given \a llp, for which the equals function returns true.
  *
+ * If the connections of the llp are indexed for \p conn_eq the connection is
+ * found in the index, otherwise every connection is compared.
+ *
  * @param llp The link layer port to search for the #firefly_connection in.
  * @param context The context passed to the equals function.
  * @param conn_eq The function used to determine if any connection is the
@@ -112,4 +200,12 @@ bool firefly_connection_eq_ptr(struct firefly_connection *conn, void *context);
 void replace_protocol_data_received_cb(struct firefly_transport_llp *llp,
 		protocol_data_received_f protocol_data_received_cb);
 
+/**
+ * @brief Replaces the callback called when a packet is received.
+ *
+ * Should normally not be used except when testing *only* transport layers.
+ */
+void replace_protocol_packet_received_cb(struct firefly_transport_llp *llp,
+		protocol_packet_received_f protocol_packet_received_cb);
+
 #endif
@@ -39,6 +39,20 @@ static bool connection_eq_sock(struct firefly_connection *conn, void *context)
 	return tc_tcp->socket == socket;
 }
 
+static size_t connection_hash_sock(void *context)
+{
+	return firefly_transport_hash_bytes(context, sizeof(int));
+}
+
+static void *connection_key_sock(struct firefly_connection *conn)
+{
+	struct firefly_transport_connection_tcp_posix *tc_tcp;
+
+	tc_tcp = conn->transport->context;
+
+	return &tc_tcp->socket;
+}
+
 static void sockaddr_get_addr(struct sockaddr_in *addr, char *ip_addr)
 {
 	if (!inet_ntop(AF_INET, &addr->sin_addr.s_addr, ip_addr, INET_ADDRSTRLEN)) {
@@ -144,9 +158,13 @@ struct firefly_transport_llp *firefly_transport_llp_tcp_posix_new(
 
 	llp_tcp->on_conn_recv          = on_conn_recv;
 	llp_tcp->event_queue           = event_queue;
+	pthread_mutex_init(&llp_tcp->conn_list_lock, NULL);
 	llp->llp_platspec              = llp_tcp;
 	llp->conn_list                 = NULL;
+	llp_connection_index_init(llp, connection_eq_sock,
+			connection_hash_sock, connection_key_sock);
 	llp->protocol_data_received_cb = protocol_data_received;
+	llp->protocol_packet_received_cb = protocol_packet_received;
 	llp->state                     = FIREFLY_LLP_OPEN;
 
 	return llp;
@@ -170,7 +188,9 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 						  __func__, __LINE__, err_buf);
 		}
 		free(llp_tcp->local_addr);
+		pthread_mutex_destroy(&llp_tcp->conn_list_lock);
 		free(llp_tcp);
+		llp_connection_index_free(llp);
 		free(llp);
 	}
 }
@@ -178,18 +198,22 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 static int free_event(void *event_arg)
 {
 	struct firefly_transport_llp *llp;
+	struct transport_llp_tcp_posix *llp_tcp;
 	struct llp_connection_list_node *head;
 
 	llp = event_arg;
+	llp_tcp = llp->llp_platspec;
 
 	llp->state = FIREFLY_LLP_CLOSING;
 
 	// Close all connections.
+	pthread_mutex_lock(&llp_tcp->conn_list_lock);
 	head = llp->conn_list;
 	while (head != NULL) {
 		firefly_connection_close(head->conn);
 		head = head->next;
 	}
+	pthread_mutex_unlock(&llp_tcp->conn_list_lock);
 	check_llp_free(llp);
 
 	return 0;
@@ -213,9 +237,13 @@ void firefly_transport_llp_tcp_posix_free(struct firefly_transport_llp *llp)
 static int connection_open(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_tcp_posix *tcup;
+	struct transport_llp_tcp_posix *llp_tcp;
 
 	tcup = conn->transport->context;
+	llp_tcp = tcup->llp->llp_platspec;
+	pthread_mutex_lock(&llp_tcp->conn_list_lock);
 	add_connection_to_llp(conn, tcup->llp);
+	pthread_mutex_unlock(&llp_tcp->conn_list_lock);
 
 	return 0;
 }
@@ -224,11 +252,15 @@ static int connection_close(struct firefly_connection *conn)
 {
 	struct firefly_transport_llp *llp;
 	struct firefly_transport_connection_tcp_posix *tcup;
+	struct transport_llp_tcp_posix *llp_tcp;
 
 	tcup = conn->transport->context;
 	llp = tcup->llp;
+	llp_tcp = llp->llp_platspec;
 
+	pthread_mutex_lock(&llp_tcp->conn_list_lock);
 	remove_connection_from_llp(tcup->llp, conn, firefly_connection_eq_ptr);
+	pthread_mutex_unlock(&llp_tcp->conn_list_lock);
 	close(tcup->socket);
 	free(tcup->remote_addr);
 	free(conn->transport);
@@ -312,13 +344,15 @@ struct firefly_transport_connection *firefly_transport_connection_tcp_posix_new(
 	tc->open      = connection_open;
 	tc->close     = connection_close;
 	tc->write     = firefly_transport_tcp_posix_write;
+	tc->write_packet = NULL;
+	tc->mtu       = 0;
 	tc->ack       = NULL;
 
 	return tc;
 }
 
 void firefly_transport_tcp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, uint32_t *id)
 {
 	struct firefly_transport_connection_tcp_posix *conn_tcp;
 	int res;
@@ -391,27 +425,78 @@ struct firefly_event_llp_read_tcp_posix {
 	int socket;
 	size_t len;
 	unsigned char *data;
+	struct firefly_connection *conn; /* The connection the event is keyed to,
+										NULL if keyed to the llp. */
 };
 
+static struct firefly_connection *find_connection_locked(
+		struct firefly_transport_llp *llp, int *socket)
+{
+	struct transport_llp_tcp_posix *llp_tcp;
+	struct firefly_connection *conn;
+
+	llp_tcp = llp->llp_platspec;
+	pthread_mutex_lock(&llp_tcp->conn_list_lock);
+	conn = find_connection(llp, socket, connection_eq_sock);
+	pthread_mutex_unlock(&llp_tcp->conn_list_lock);
+
+	return conn;
+}
+
+static int read_event(void *event_arg);
+
+/*
+ * Free the data of a read event that is never run, e.g. purged with its
+ * connection.
+ */
+static void read_event_destroy(void *event_arg)
+{
+	struct firefly_event_llp_read_tcp_posix *ev_arg = event_arg;
+
+	free(ev_arg->data);
+}
+
+/*
+ * Offer the read event keyed to the connection of the socket, or to the llp
+ * while the connection is not yet opened. The argument is copied into the
+ * event.
+ */
+static int64_t offer_read_event(struct firefly_event_llp_read_tcp_posix *ev_arg,
+		unsigned int nbr_deps, const int64_t *deps)
+{
+	struct transport_llp_tcp_posix *llp_tcp;
+	const void *key;
+
+	llp_tcp = ev_arg->llp->llp_platspec;
+	key     = ev_arg->conn != NULL ?
+		(const void *) ev_arg->conn : (const void *) ev_arg->llp;
+
+	return firefly_event_offer_owned(llp_tcp->event_queue, key, NULL,
+			FIREFLY_PRIORITY_HIGH, read_event, ev_arg, sizeof(*ev_arg),
+			read_event_destroy, nbr_deps, deps);
+}
+
 static int read_event(void *event_arg)
 {
 	struct firefly_event_llp_read_tcp_posix *ev_arg;
 	struct transport_llp_tcp_posix *llp_tcp;
 	struct firefly_connection *conn;
-	struct firefly_event_queue *eq;
-	firefly_on_conn_recv_ptcp on_conn_recv;
 
-	ev_arg       = event_arg;
-	llp_tcp      = ev_arg->llp->llp_platspec;
-	eq           = llp_tcp->event_queue;
-	on_conn_recv = llp_tcp->on_conn_recv;
+	ev_arg  = event_arg;
+	llp_tcp = ev_arg->llp->llp_platspec;
 
 	// Find existing connection.
-	conn = find_connection(ev_arg->llp, &ev_arg->socket, connection_eq_sock);
+	conn = find_connection_locked(ev_arg->llp, &ev_arg->socket);
+	if (conn != NULL && conn != ev_arg->conn &&
+			firefly_event_queue_is_keyed(llp_tcp->event_queue)) {
+		// Not keyed to the connection, run again keyed correctly.
+		ev_arg->conn = conn;
+		return offer_read_event(ev_arg, 0, NULL);
+	}
 	if (conn != NULL)
 		ev_arg->llp->protocol_data_received_cb(conn, ev_arg->data, ev_arg->len);
-
-	free(ev_arg);
+	else
+		free(ev_arg->data);
 
 	return 0;
 }
@@ -441,7 +526,8 @@ void firefly_transport_tcp_posix_read(struct firefly_transport_llp *llp)
 		struct sockaddr_in remote_addr;
 		socklen_t len;
 		int64_t eid;
-		struct firefly_event_llp_read_tcp_posix *ev_arg;
+		int64_t ev_id;
+		struct firefly_event_llp_read_tcp_posix ev_arg;
 
 		eid      = -1;
 		sock     = -1;
@@ -481,19 +567,13 @@ void firefly_transport_tcp_posix_read(struct firefly_transport_llp *llp)
 			if (pkg_len == 0) // If there's nothing to read, continue loop
 				continue;
 
-			ev_arg = malloc(sizeof(*ev_arg) + pkg_len);
-			if (!ev_arg) {
+			ev_arg.data = malloc(pkg_len);
+			if (!ev_arg.data) {
 				FFL(FIREFLY_ERROR_ALLOC);
 				return;
 			}
-			ev_arg->data = malloc(pkg_len);
-			if (!ev_arg->data) {
-				FFL(FIREFLY_ERROR_ALLOC);
-				free(ev_arg);
-				return;
-			}
 
-			res = recv(sock, ev_arg->data, pkg_len, 0);
+			res = recv(sock, ev_arg.data, pkg_len, 0);
 			if (res == -1) {
 				char err_buf[ERROR_STR_MAX_LEN];
 				strerror_r(errno, err_buf, ERROR_STR_MAX_LEN);
@@ -515,19 +595,21 @@ void firefly_transport_tcp_posix_read(struct firefly_transport_llp *llp)
 				return;
 			}
 
-			ev_arg->llp    = llp;
-			ev_arg->socket = sock;
-			ev_arg->len    = pkg_len;
-			ev_arg->addr   = remote_addr;
+			ev_arg.llp    = llp;
+			ev_arg.socket = sock;
+			ev_arg.len    = pkg_len;
+			ev_arg.addr   = remote_addr;
+			ev_arg.conn   = NULL;
 			/* Member 'data' already filled in recvfrom(). */
-
-			if (eid != -1) {
-				eq->offer_event_cb(eq, FIREFLY_PRIORITY_HIGH, read_event,
-								   ev_arg, 1, &eid);
-			} else {
-				eq->offer_event_cb(eq, FIREFLY_PRIORITY_HIGH, read_event,
-								   ev_arg, 0, NULL);
-			}
+			if (eid == -1 && firefly_event_queue_is_keyed(eq))
+				ev_arg.conn = find_connection_locked(llp, &sock);
+
+			if (eid != -1)
+				ev_id = offer_read_event(&ev_arg, 1, &eid);
+			else
+				ev_id = offer_read_event(&ev_arg, 0, NULL);
+			if (ev_id < 0)
+				free(ev_arg.data);
 		}
 	}
 }
@@ -26,6 +26,7 @@ struct transport_llp_tcp_posix {
 	firefly_on_conn_recv_ptcp on_conn_recv;  /**< Callback when receiving new connection */
 	struct firefly_event_queue *event_queue; /**< Event queue */
 	pthread_t read_thread;                   /**< Thread running the read loop */
+	pthread_mutex_t conn_list_lock;          /**< Protects the connection list */
 };
 
 /**
@@ -49,6 +50,6 @@ struct firefly_transport_connection_tcp_posix {
  * @see #firefly_transport_connection_write_f()
  */
 void firefly_transport_tcp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, uint32_t *id);
 
 #endif
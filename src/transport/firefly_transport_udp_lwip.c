@@ -135,6 +135,9 @@ struct firefly_transport_llp *firefly_transport_llp_udp_lwip_new(
 
 	llp->llp_platspec = llp_udp;
 	llp->conn_list = NULL;
+	llp_connection_index_init(llp, transport_udp_lwip_conn_eq_ipaddr,
+			transport_udp_lwip_conn_hash_ipaddr,
+			transport_udp_lwip_conn_key_ipaddr);
 	// Set recieve callback.
 	udp_recv(llp_udp->upcb, udp_lwip_recv_callback, llp);
 
@@ -168,6 +171,7 @@ int firefly_transport_llp_udp_lwip_free_event(void *event_arg)
 		udp_remove(llp_udp->upcb);
 		free(llp_udp->local_ip_addr);
 		free(llp_udp);
+		llp_connection_index_free(llp);
 		free(llp);
 	} else {
 		firefly_transport_llp_udp_lwip_free(llp);
@@ -199,7 +203,7 @@ static int connection_close(struct firefly_connection *conn)
 // TODO we should not have to memcpy the data to write. Can we make memory alloc
 // transport specific or avoid this problem somehow?
 void firefly_transport_udp_lwip_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+		struct firefly_connection *conn, bool important, uint32_t *id)
 {
 	struct firefly_transport_connection_udp_lwip *conn_udp;
 	conn_udp = conn->transport->context;
@@ -224,7 +228,7 @@ void firefly_transport_udp_lwip_write(unsigned char *data, size_t data_size,
 	}
 }
 
-void firefly_transport_udp_lwip_ack(unsigned char pkt_id,
+void firefly_transport_udp_lwip_ack(uint32_t pkt_id,
 		struct firefly_connection *conn)
 {
 	UNUSED_VAR(pkt_id);
@@ -264,6 +268,8 @@ struct firefly_transport_connection *firefly_transport_connection_udp_lwip_new(
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_udp_lwip_write;
+	tc->write_packet = NULL;
+	tc->mtu = 0;
 	tc->ack = firefly_transport_udp_lwip_ack;
 
 	return tc;
@@ -277,6 +283,19 @@ bool transport_udp_lwip_conn_eq_ipaddr(struct firefly_connection *conn,
 			 conn->transport->context)->remote_ip_addr);
 }
 
+size_t transport_udp_lwip_conn_hash_ipaddr(void *context)
+{
+	return firefly_transport_hash_bytes(
+			&((struct ip_addr *) context)->addr,
+			sizeof(((struct ip_addr *) context)->addr));
+}
+
+void *transport_udp_lwip_conn_key_ipaddr(struct firefly_connection *conn)
+{
+	return ((struct firefly_transport_connection_udp_lwip *)
+			conn->transport->context)->remote_ip_addr;
+}
+
 struct ip_addr *str_to_ip_addr(const char *ip_str)
 {
 	unsigned char ip_parts[4];
@@ -63,7 +63,7 @@ struct firefly_event_llp_read_udp_lwip {
  * should be removed.
  * @param conn The conn the packet was sent on.
  */
-void firefly_transport_udp_lwip_ack(unsigned char pkt_id,
+void firefly_transport_udp_lwip_ack(uint32_t pkt_id,
 		struct firefly_connection *conn);
 
 /**
@@ -101,6 +101,24 @@ int firefly_transport_llp_udp_lwip_free_event(void *event_arg);
 bool transport_udp_lwip_conn_eq_ipaddr(struct firefly_connection *conn,
 		void *context);
 
+/**
+ * @brief Hashes an IP address compared by
+ * transport_udp_lwip_conn_eq_ipaddr().
+ *
+ * @param context The IP address.
+ * @return The hash.
+ */
+size_t transport_udp_lwip_conn_hash_ipaddr(void *context);
+
+/**
+ * @brief Gives the remote IP address of a connection, as compared by
+ * transport_udp_lwip_conn_eq_ipaddr().
+ *
+ * @param conn The connection.
+ * @return The remote IP address.
+ */
+void *transport_udp_lwip_conn_key_ipaddr(struct firefly_connection *conn);
+
 /**
  * @brief Converts a string representation of an IPv4 address of the format
  * "a.b.c.d" to an LWIP representation of that address.
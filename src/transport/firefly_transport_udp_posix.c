@@ -115,13 +115,28 @@ struct firefly_transport_llp *firefly_transport_llp_udp_posix_new(
 
 		return NULL;
 	}
+	llp_udp->read_pool = firefly_packet_pool_new(
+			FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_MTU);
+	if (llp_udp->read_pool == NULL) {
+		FFL(FIREFLY_ERROR_ALLOC);
+		close(llp_udp->local_udp_socket);
+		free(llp_udp->local_addr);
+		free(llp_udp);
+		free(llp);
+
+		return NULL;
+	}
 	llp_udp->on_conn_recv = on_conn_recv;
 	llp_udp->event_queue = event_queue;
 	llp_udp->resend_queue = firefly_resend_queue_new();
+	pthread_mutex_init(&llp_udp->conn_list_lock, NULL);
 
 	llp->llp_platspec = llp_udp;
 	llp->conn_list = NULL;
+	llp_connection_index_init(llp, connection_eq_inaddr,
+			connection_hash_inaddr, connection_key_inaddr);
 	llp->protocol_data_received_cb = protocol_data_received;
+	llp->protocol_packet_received_cb = protocol_packet_received;
 	llp->state = FIREFLY_LLP_OPEN;
 
 	return llp;
@@ -150,6 +165,9 @@ static void check_llp_free(struct firefly_transport_llp *llp)
 		close(llp_udp->local_udp_socket);
 		free(llp_udp->local_addr);
 		firefly_resend_queue_free(llp_udp->resend_queue);
+		firefly_packet_pool_free(llp_udp->read_pool);
+		pthread_mutex_destroy(&llp_udp->conn_list_lock);
+		llp_connection_index_free(llp);
 		free(llp_udp);
 		free(llp);
 	}
@@ -163,11 +181,14 @@ int firefly_transport_llp_udp_posix_free_event(void *event_arg)
 	llp->state = FIREFLY_LLP_CLOSING;
 
 	// Close all connections.
+	struct transport_llp_udp_posix *llp_udp = llp->llp_platspec;
+	pthread_mutex_lock(&llp_udp->conn_list_lock);
 	struct llp_connection_list_node *head = llp->conn_list;
 	while (head != NULL) {
 		firefly_connection_close(head->conn);
 		head = head->next;
 	}
+	pthread_mutex_unlock(&llp_udp->conn_list_lock);
 	check_llp_free(llp);
 
 	return 0;
@@ -176,8 +197,12 @@ int firefly_transport_llp_udp_posix_free_event(void *event_arg)
 static int connection_open(struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_udp_posix *tcup;
+	struct transport_llp_udp_posix *llp_udp;
 	tcup = conn->transport->context;
+	llp_udp = tcup->llp->llp_platspec;
+	pthread_mutex_lock(&llp_udp->conn_list_lock);
 	add_connection_to_llp(conn, tcup->llp);
+	pthread_mutex_unlock(&llp_udp->conn_list_lock);
 	return 0;
 }
 
@@ -185,11 +210,15 @@ static int connection_close(struct firefly_connection *conn)
 {
 	struct firefly_transport_llp *llp;
 	struct firefly_transport_connection_udp_posix *tcup;
+	struct transport_llp_udp_posix *llp_udp;
 	tcup = conn->transport->context;
 	llp = tcup->llp;
+	llp_udp = llp->llp_platspec;
 
+	pthread_mutex_lock(&llp_udp->conn_list_lock);
 	remove_connection_from_llp(tcup->llp, conn,
 			firefly_connection_eq_ptr);
+	pthread_mutex_unlock(&llp_udp->conn_list_lock);
 	free(tcup->remote_addr);
 	free(conn->transport);
 	free(tcup);
@@ -232,16 +261,33 @@ struct firefly_transport_connection *firefly_transport_connection_udp_posix_new(
 	}
 	tcup->socket = llp_udp->local_udp_socket;
 	tcup->llp = llp;
-	tcup->timeout = timeout;
+	firefly_resend_rto_init(&tcup->rto, timeout,
+			FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_RETRIES);
 	tc->context = tcup;
 	tc->open = connection_open;
 	tc->close = connection_close;
 	tc->write = firefly_transport_udp_posix_write;
+	tc->write_packet = firefly_transport_udp_posix_write_packet;
 	tc->ack = firefly_transport_udp_posix_ack;
+	tc->mtu = FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_MTU;
 	return tc;
 }
 
-void firefly_transport_udp_posix_ack(unsigned char pkt_id,
+void firefly_transport_connection_udp_posix_set_retries(
+		struct firefly_transport_connection *tc, unsigned char retries)
+{
+	struct firefly_transport_connection_udp_posix *tcup = tc->context;
+
+	tcup->rto.retries = retries;
+}
+
+void firefly_transport_connection_udp_posix_set_mtu(
+		struct firefly_transport_connection *tc, size_t mtu)
+{
+	tc->mtu = mtu;
+}
+
+void firefly_transport_udp_posix_ack(uint32_t pkt_id,
 		struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_udp_posix *conn_udp;
@@ -249,11 +295,12 @@ void firefly_transport_udp_posix_ack(unsigned char pkt_id,
 
 	conn_udp = conn->transport->context;
 	llpup = conn_udp->llp->llp_platspec;
-	firefly_resend_remove(llpup->resend_queue, pkt_id);
+	firefly_resend_rto_sample(&conn_udp->rto,
+			firefly_resend_remove(llpup->resend_queue, pkt_id));
 }
 
-void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id)
+static void udp_posix_send(unsigned char *data, size_t data_size,
+		struct firefly_connection *conn)
 {
 	struct firefly_transport_connection_udp_posix *conn_udp;
 	int res;
@@ -267,25 +314,55 @@ void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
 		firefly_connection_raise_later(conn,
 				FIREFLY_ERROR_TRANS_WRITE, "sendto() failed");
 	}
+}
+
+static void udp_posix_resend_add(struct firefly_packet *pkt,
+		struct firefly_connection *conn, uint32_t *id)
+{
+	struct firefly_transport_connection_udp_posix *conn_udp;
+	struct transport_llp_udp_posix *llp_ps;
+
+	conn_udp = conn->transport->context;
+	llp_ps = conn_udp->llp->llp_platspec;
+	*id = firefly_resend_add(llp_ps->resend_queue, pkt,
+			conn_udp->rto.timeout, conn_udp->rto.retries, conn);
+}
+
+void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
+		struct firefly_connection *conn, bool important, uint32_t *id)
+{
+	udp_posix_send(data, data_size, conn);
 	if (important) {
-		unsigned char *new_data;
-		struct transport_llp_udp_posix *llp_ps;
+		struct firefly_packet *pkt;
 
 		if (!id) {
 			firefly_error(FIREFLY_ERROR_TRANS_WRITE, 1,
 					"Parameter id was NULL.\n");
 			return;
 		}
-		new_data = malloc(data_size);
-		if (!new_data) {
+		pkt = firefly_packet_new(data_size);
+		if (!pkt) {
 			FFL(FIREFLY_ERROR_ALLOC);
 			return;
 		}
-		memcpy(new_data, data, data_size);
-		llp_ps = conn_udp->llp->llp_platspec;
-		*id = firefly_resend_add(llp_ps->resend_queue,
-				new_data, data_size, conn_udp->timeout,
-				FIREFLY_TRANSPORT_UDP_POSIX_DEFAULT_RETRIES, conn);
+		memcpy(pkt->data, data, data_size);
+		pkt->size = data_size;
+		udp_posix_resend_add(pkt, conn, id);
+		firefly_packet_release(pkt);
+	}
+}
+
+void firefly_transport_udp_posix_write_packet(struct firefly_packet *pkt,
+		struct firefly_connection *conn, bool important, uint32_t *id)
+{
+	udp_posix_send(pkt->data + pkt->offset, pkt->size, conn);
+	if (important) {
+		if (!id) {
+			firefly_error(FIREFLY_ERROR_TRANS_WRITE, 1,
+					"Parameter id was NULL.\n");
+			return;
+		}
+		udp_posix_resend_add(pkt, conn, id);
 	}
 }
 
@@ -378,10 +455,54 @@ int firefly_transport_udp_posix_stop(struct firefly_transport_llp *llp)
 struct firefly_event_llp_read_udp_posix {
 	struct firefly_transport_llp *llp;
 	struct sockaddr_in addr;
-	size_t len;
-	unsigned char *data;
+	struct firefly_packet *pkt; /* The datagram, decoded in place. */
+	struct firefly_connection *conn; /* The connection the event is keyed to,
+										NULL if keyed to the llp. */
 };
 
+static struct firefly_connection *find_connection_locked(
+		struct firefly_transport_llp *llp, struct sockaddr_in *addr)
+{
+	struct transport_llp_udp_posix *llp_udp = llp->llp_platspec;
+	struct firefly_connection *conn;
+
+	pthread_mutex_lock(&llp_udp->conn_list_lock);
+	conn = find_connection(llp, addr, connection_eq_inaddr);
+	pthread_mutex_unlock(&llp_udp->conn_list_lock);
+	return conn;
+}
+
+static int firefly_transport_udp_posix_read_event(void *event_arg);
+
+/*
+ * Release the datagram of a read event that is never run, e.g. purged with its
+ * connection.
+ */
+static void read_event_destroy(void *event_arg)
+{
+	struct firefly_event_llp_read_udp_posix *ev_arg = event_arg;
+
+	firefly_packet_release(ev_arg->pkt);
+}
+
+/*
+ * Offer the read event keyed to the connection it is for so that it is never
+ * run at the same time as other events of that connection. Datagrams from
+ * unknown addresses are keyed to the llp. The argument is copied into the
+ * event.
+ */
+static int64_t offer_read_event(struct firefly_event_llp_read_udp_posix *ev_arg,
+		unsigned int nbr_deps, const int64_t *deps)
+{
+	struct transport_llp_udp_posix *llp_udp = ev_arg->llp->llp_platspec;
+	const void *key = ev_arg->conn != NULL ?
+		(const void *) ev_arg->conn : (const void *) ev_arg->llp;
+
+	return firefly_event_offer_owned(llp_udp->event_queue, key, NULL,
+			FIREFLY_PRIORITY_HIGH, firefly_transport_udp_posix_read_event,
+			ev_arg, sizeof(*ev_arg), read_event_destroy, nbr_deps, deps);
+}
+
 static int firefly_transport_udp_posix_read_event(void *event_arg)
 {
 	struct firefly_event_llp_read_udp_posix *ev_arg;
@@ -392,7 +513,13 @@ static int firefly_transport_udp_posix_read_event(void *event_arg)
 	llp_udp = ev_arg->llp->llp_platspec;
 
 	// Find existing connection or create new.
-	conn = find_connection(ev_arg->llp, &ev_arg->addr, connection_eq_inaddr);
+	conn = find_connection_locked(ev_arg->llp, &ev_arg->addr);
+	if (conn != NULL && conn != ev_arg->conn &&
+			firefly_event_queue_is_keyed(llp_udp->event_queue)) {
+		// Not keyed to the connection, run again keyed correctly.
+		ev_arg->conn = conn;
+		return offer_read_event(ev_arg, 0, NULL);
+	}
 	if (conn == NULL) {
 		char ip_addr[INET_ADDRSTRLEN];
 		sockaddr_in_ipaddr(&ev_arg->addr, ip_addr);
@@ -401,17 +528,14 @@ static int firefly_transport_udp_posix_read_event(void *event_arg)
 				(ev_id = llp_udp->on_conn_recv(ev_arg->llp, ip_addr,
 					sockaddr_in_port(&ev_arg->addr))) > 0)
 		{
-			return llp_udp->event_queue->offer_event_cb(llp_udp->event_queue,
-					FIREFLY_PRIORITY_HIGH,
-					firefly_transport_udp_posix_read_event,
-					ev_arg, 1, &ev_id);
+			ev_arg->conn = NULL;
+			return offer_read_event(ev_arg, 1, &ev_id);
 		} else {
-			free(ev_arg->data);
+			firefly_packet_release(ev_arg->pkt);
 		}
 	} else {
-		ev_arg->llp->protocol_data_received_cb(conn, ev_arg->data, ev_arg->len);
+		ev_arg->llp->protocol_packet_received_cb(conn, ev_arg->pkt);
 	}
-	free(ev_arg);
 
 	return 0;
 }
@@ -423,7 +547,7 @@ void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp)
 	int res;
 	size_t pkg_len = 0;	/* ioctl() sets only the lower 32 bit. */
 	struct sockaddr_in remote_addr;
-	struct firefly_event_llp_read_udp_posix *ev_arg;
+	struct firefly_event_llp_read_udp_posix ev_arg;
 	socklen_t len;
 
 	llp_udp = llp->llp_platspec;
@@ -462,21 +586,17 @@ void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp)
 					  "Select/FIONREAD inconsistent\n");
 		return;
 	}
-	ev_arg = malloc(sizeof(*ev_arg));
-	if (!ev_arg) {
-		FFL(FIREFLY_ERROR_ALLOC);
-		free(ev_arg);
-		return;
-	}
-	ev_arg->data = malloc(pkg_len);
-	if (!ev_arg->data) {
+	if (pkg_len <= llp_udp->read_pool->capacity)
+		ev_arg.pkt = firefly_packet_get(llp_udp->read_pool);
+	else
+		ev_arg.pkt = firefly_packet_new(pkg_len);
+	if (!ev_arg.pkt) {
 		FFL(FIREFLY_ERROR_ALLOC);
-		free(ev_arg);
 		return;
 	}
 	len = sizeof(remote_addr);
 	res = recvfrom(llp_udp->local_udp_socket,
-				   (void *) ev_arg->data,
+				   (void *) ev_arg.pkt->data,
 				   pkg_len,
 				   0, (struct sockaddr *) &remote_addr, (void *) &len);
 
@@ -489,17 +609,20 @@ void firefly_transport_udp_posix_read(struct firefly_transport_llp *llp)
 #endif
 		firefly_error(FIREFLY_ERROR_SOCKET, 3, "Failed in %s.\n%s()\n",
 			      __FUNCTION__, err_buf);
+		firefly_packet_release(ev_arg.pkt);
+		return;
 	}
 
-	ev_arg->llp	= llp;
-	ev_arg->addr = remote_addr;
-	ev_arg->len	= res;
-	/* Member 'data' already filled in recvfrom(). */
+	ev_arg.llp	= llp;
+	ev_arg.addr = remote_addr;
+	ev_arg.pkt->size = res;
+	ev_arg.conn = NULL;
+	/* Member 'pkt' already filled in recvfrom(). */
+	if (firefly_event_queue_is_keyed(llp_udp->event_queue))
+		ev_arg.conn = find_connection_locked(llp, &remote_addr);
 
-	llp_udp->event_queue->offer_event_cb(llp_udp->event_queue,
-			FIREFLY_PRIORITY_HIGH,
-			firefly_transport_udp_posix_read_event,
-			ev_arg, 0, NULL);
+	if (offer_read_event(&ev_arg, 0, NULL) < 0)
+		firefly_packet_release(ev_arg.pkt);
 }
 
 bool sockaddr_in_eq(struct sockaddr_in *one, struct sockaddr_in *other)
@@ -517,6 +640,23 @@ bool connection_eq_inaddr(struct firefly_connection *conn, void *context)
 					*) context);
 }
 
+size_t connection_hash_inaddr(void *context)
+{
+	struct sockaddr_in *addr = context;
+	unsigned char key[sizeof(addr->sin_addr) + sizeof(addr->sin_port)];
+
+	memcpy(key, &addr->sin_addr, sizeof(addr->sin_addr));
+	memcpy(key + sizeof(addr->sin_addr), &addr->sin_port,
+			sizeof(addr->sin_port));
+	return firefly_transport_hash_bytes(key, sizeof(key));
+}
+
+void *connection_key_inaddr(struct firefly_connection *conn)
+{
+	return ((struct firefly_transport_connection_udp_posix *)
+			conn->transport->context)->remote_addr;
+}
+
 void sockaddr_in_ipaddr(struct sockaddr_in *addr, char *ip_addr)
 {
 	inet_ntop(AF_INET, &addr->sin_addr.s_addr, ip_addr, INET_ADDRSTRLEN);
@@ -30,6 +30,12 @@ struct transport_llp_udp_posix {
 											   events on. */
 	struct resend_queue *resend_queue; /**< The resend queue managing important
 										 packets. */
+	struct firefly_packet_pool *read_pool; /**< The packets datagrams are
+											 read into, owned by the read
+											 thread. */
+	pthread_mutex_t conn_list_lock; /**< Protects the connection list of the
+									  llp when read events run on several
+									  workers. */
 #ifndef LABCOMM_COMPAT
 	pthread_t read_thread; /**< The handle to the thread running the read loop. */
 	pthread_t resend_thread; /**< The handle to the thread running the resend
@@ -50,7 +56,8 @@ struct firefly_transport_connection_udp_posix {
 				  connection. */
 	struct firefly_transport_llp *llp; /**< The \a llp this connection is
 										 associated with. */
-	unsigned int timeout; /**< The time between resends on this connection. */
+	struct firefly_resend_rto rto; /**< The timeout and retries of important
+									 packets on this connection. */
 };
 
 /**
@@ -73,6 +80,23 @@ int firefly_transport_llp_udp_posix_free_event(void *event_arg);
  */
 bool connection_eq_inaddr(struct firefly_connection *conn, void *context);
 
+/**
+ * @brief Hashes an address compared by connection_eq_inaddr().
+ *
+ * @param context The address, must be of type \c struct \c sockaddr_in.
+ * @return The hash of the ip address and port number.
+ */
+size_t connection_hash_inaddr(void *context);
+
+/**
+ * @brief Gives the remote address of a connection, as compared by
+ * connection_eq_inaddr().
+ *
+ * @param conn The connection.
+ * @return The \c struct \c sockaddr_in of the remote node.
+ */
+void *connection_key_inaddr(struct firefly_connection *conn);
+
 
 /**
  * @brief Compares two \c struct \c sockaddr_in.
@@ -115,7 +139,22 @@ unsigned short sockaddr_in_port(struct sockaddr_in *addr);
  * @see #firefly_transport_connection_write_f()
  */
 void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
-		struct firefly_connection *conn, bool important, unsigned char *id);
+		struct firefly_connection *conn, bool important, uint32_t *id);
+
+/**
+ * @brief Write a packet buffer on the specified connection without copying
+ * it. Implements #firefly_transport_connection_write_packet_f.
+ *
+ * @param pkt The packet to be written.
+ * @param conn The connection to written the packet on.
+ * @param important If true the resend queue keeps a reference to the packet
+ * and resends it until it is acked by calling #firefly_transport_udp_posix_ack or max retries is
+ * reached.
+ * @param id The variable to save the resend packed id in.
+ * @see #firefly_transport_connection_write_packet_f()
+ */
+void firefly_transport_udp_posix_write_packet(struct firefly_packet *pkt,
+		struct firefly_connection *conn, bool important, uint32_t *id);
 
 /**
  * @brief Ack an important packed. Removes the packet from the resend queue.
@@ -125,7 +164,7 @@ void firefly_transport_udp_posix_write(unsigned char *data, size_t data_size,
  * @param conn The connection the packet was sent on.
  * @see #firefly_transport_connection_ack_f()
  */
-void firefly_transport_udp_posix_ack(unsigned char pkt_id,
+void firefly_transport_udp_posix_ack(uint32_t pkt_id,
 		struct firefly_connection *conn);
 
 #endif
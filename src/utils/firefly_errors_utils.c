@@ -28,6 +28,9 @@ const char *firefly_error_strings[] = {
 	"User defined error.",
 	"User has not set callback.",
 	"Event type does not exist.",
+	"Invalid connection state.",
+	"Remote end refused channel request.",
+	"Remote end of connection timed out.",
 	"End guard. Don't use this \"error\".",
 };
 
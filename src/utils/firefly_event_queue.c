@@ -16,23 +16,111 @@
 #include <utils/firefly_errors.h>
 #include "protocol/firefly_protocol_private.h"
 
+#define FIREFLY_EVENT_INDEX_MIN_SIZE (16)
+
+/**
+ * @brief The distance between two events in a slab, the size of an event
+ * rounded up to a whole number of cache lines.
+ */
+#define FIREFLY_EVENT_STRIDE \
+	((sizeof(struct firefly_event) + FIREFLY_EVENT_QUEUE_CACHE_LINE - 1) / \
+	 FIREFLY_EVENT_QUEUE_CACHE_LINE * FIREFLY_EVENT_QUEUE_CACHE_LINE)
+
+/**
+ * @brief An argument copied to the heap, used when the queue can not copy
+ * arguments into its events.
+ */
+struct firefly_event_boxed {
+	firefly_event_execute_f execute; /**< The function of the event. */
+	void *context; /**< The argument passed to the function. */
+	const void *key; /**< The affinity key the event is purged with. */
+	const void *owner; /**< What else the event is purged with. */
+	firefly_event_destroy_f destroy; /**< Called if the event is dropped. */
+	union firefly_event_arg arg; /**< The copied argument. */
+};
+
+static void firefly_event_release(struct firefly_event_queue *eq,
+		struct firefly_event *ev);
+
+static int firefly_event_pool_grow(struct firefly_event_queue *q, size_t nbr);
+
+static void firefly_event_drop_all(struct firefly_event_queue *eq);
+
+static void firefly_event_stats_popped(struct firefly_event_queue *eq,
+		struct firefly_event *ev);
+
+static void firefly_event_stats_returned(struct firefly_event_queue *eq,
+		struct firefly_event *ev);
+
+/**
+ * @brief Get the current time of the clock of the queue, 0 if it has none.
+ */
+static inline uint64_t firefly_event_now(struct firefly_event_queue *eq)
+{
+	return eq->stats.clock != NULL ? eq->stats.clock() : 0;
+}
+
+/**
+ * @brief Get the smallest power of two large enough to index twice the number
+ * of events in a pool of the given size.
+ */
+static size_t firefly_event_index_size(size_t pool_size)
+{
+	size_t size = FIREFLY_EVENT_INDEX_MIN_SIZE;
+
+	while (size < pool_size * 2)
+		size *= 2;
+	return size;
+}
+
 struct firefly_event_queue *firefly_event_queue_new(
 		firefly_offer_event offer_cb, size_t pool_size, void *context)
 {
 	struct firefly_event_queue *q = NULL;
 
 	if ((q = FIREFLY_MALLOC(sizeof(struct firefly_event_queue))) != NULL) {
-		q->head = NULL;
+		memset(q->buckets, 0, sizeof(q->buckets));
+		memset(q->prio_map, 0, sizeof(q->prio_map));
+		q->prio_map_summary = 0;
+		q->nbr_events = 0;
+		q->id_index_size = firefly_event_index_size(pool_size);
+		q->id_index = FIREFLY_MALLOC(
+				sizeof(struct firefly_event *)*q->id_index_size);
+		if (q->id_index == NULL) {
+			FIREFLY_FREE(q);
+			return NULL;
+		}
+		memset(q->id_index, 0,
+				sizeof(struct firefly_event *)*q->id_index_size);
+		q->dep_pool = NULL;
+		memset(q->key_index, 0, sizeof(q->key_index));
+		q->key_pool = NULL;
 		q->offer_event_cb = offer_cb;
+		// The default callbacks share the same (lack of) locking.
+		q->offer_keyed_event_cb = offer_cb == firefly_event_add ?
+			firefly_event_add_keyed : NULL;
+		q->offer_event_at_cb = offer_cb == firefly_event_add ?
+			firefly_event_add_at : NULL;
+		q->cancel_event_cb = offer_cb == firefly_event_add ?
+			firefly_event_cancel : NULL;
+		q->purge_events_cb = offer_cb == firefly_event_add ?
+			firefly_event_purge : NULL;
+		q->by_key = false;
 		q->event_id = 0;
 		q->context = context;
-		q->event_pool = FIREFLY_MALLOC(sizeof(struct firefly_event *)*pool_size);
-		for (size_t i = 0; i < pool_size; i++) {
-			q->event_pool[i] = FIREFLY_MALLOC(sizeof(struct firefly_event));
-		}
-		q->event_pool_size = pool_size;
+		q->event_pool = NULL;
+		q->event_slabs = NULL;
+		q->event_pool_size = 0;
 		q->event_pool_in_use = 0;
 		q->event_pool_strict_size = false;
+		memset(&q->stats, 0, sizeof(q->stats));
+		q->stats.clock = NULL;
+		memset(&q->wheel, 0, sizeof(q->wheel));
+		if (pool_size > 0 && firefly_event_pool_grow(q, pool_size) < 0) {
+			FIREFLY_FREE(q->id_index);
+			FIREFLY_FREE(q);
+			q = NULL;
+		}
 	}
 
 	return q;
@@ -40,14 +128,34 @@ struct firefly_event_queue *firefly_event_queue_new(
 
 void firefly_event_queue_free(struct firefly_event_queue **q)
 {
-	struct firefly_event *ev;
+	struct firefly_event_dep *dep;
+	struct firefly_event_key *key;
+	struct firefly_event_slab *slab;
 
-	while ((ev = firefly_event_pop(*q)) != NULL)
-		firefly_event_return(*q, &ev);
-	for (size_t i = 0; i < (*q)->event_pool_size; i++) {
-		firefly_event_free((*q)->event_pool[i]);
+	firefly_event_drop_all(*q);
+	while ((slab = (*q)->event_slabs) != NULL) {
+		(*q)->event_slabs = slab->next;
+		FIREFLY_FREE(slab);
+	}
+	while ((dep = (*q)->dep_pool) != NULL) {
+		(*q)->dep_pool = dep->next_waiter;
+		FIREFLY_FREE(dep);
+	}
+	while ((key = (*q)->key_pool) != NULL) {
+		(*q)->key_pool = key->next;
+		FIREFLY_FREE(key);
 	}
-	FIREFLY_FREE((*q)->event_pool);
+	// Keys of events still running are left in the index.
+	for (size_t i = 0; i < FIREFLY_EVENT_QUEUE_KEY_INDEX_SIZE; i++) {
+		while ((key = (*q)->key_index[i]) != NULL) {
+			(*q)->key_index[i] = key->next;
+			FIREFLY_FREE(key);
+		}
+	}
+	for (size_t i = 0; i < FIREFLY_EVENT_QUEUE_NBR_PRIOS; i++)
+		FIREFLY_FREE((*q)->stats.prios[i]);
+	FIREFLY_FREE((*q)->stats.funcs);
+	FIREFLY_FREE((*q)->id_index);
 	FIREFLY_FREE(*q);
 	*q = NULL;
 }
@@ -58,67 +166,180 @@ void firefly_event_queue_set_strict_pool_size(struct firefly_event_queue *eq,
 	eq->event_pool_strict_size = strict_size;
 }
 
-struct firefly_event *firefly_event_new(unsigned char prio,
-		firefly_event_execute_f execute, void *context)
+void firefly_event_queue_set_offer_keyed(struct firefly_event_queue *eq,
+		firefly_offer_keyed_event offer_keyed_cb, bool by_key)
 {
-	struct firefly_event *ev;
+	eq->offer_keyed_event_cb = offer_keyed_cb;
+	eq->by_key = offer_keyed_cb != NULL && by_key;
+}
 
-	if ((ev = FIREFLY_MALLOC(sizeof(struct firefly_event))) != NULL) {
-		ev->prio = prio;
-		ev->execute = execute;
-		ev->context = context;
-		memset(ev->depends, 0, FIREFLY_EVENT_QUEUE_MAX_DEPENDS);
-	}
+bool firefly_event_queue_is_keyed(struct firefly_event_queue *eq)
+{
+	return eq->by_key;
+}
 
-	return ev;
+void firefly_event_queue_set_timers(struct firefly_event_queue *eq,
+		firefly_offer_event_at offer_at_cb)
+{
+	eq->offer_event_at_cb = offer_at_cb;
 }
 
-void firefly_event_free(struct firefly_event *ev)
+void firefly_event_queue_set_cancel(struct firefly_event_queue *eq,
+		firefly_cancel_event cancel_cb, firefly_purge_events purge_cb)
 {
-	FIREFLY_FREE(ev);
+	eq->cancel_event_cb = cancel_cb;
+	eq->purge_events_cb = purge_cb;
 }
 
 void firefly_event_init(struct firefly_event *ev, int64_t id, unsigned char prio,
-		firefly_event_execute_f execute, void *context,
-		unsigned int nbr_depends, const int64_t *depends)
+		firefly_event_execute_f execute, void *context)
 {
 		ev->prio = prio;
+		ev->eff_prio = prio;
+		ev->state = FIREFLY_EVENT_FREE;
 		ev->id = id;
 		ev->execute = execute;
 		ev->context = context;
-		memset(ev->depends, 0, sizeof(ev->depends));
-		if (nbr_depends > 0)
-			memcpy(ev->depends, depends, nbr_depends);
+		ev->key = NULL;
+		ev->owner = NULL;
+		ev->destroy = NULL;
+		ev->nbr_unsatisfied = 0;
+		ev->prereqs = NULL;
+		ev->waiters = NULL;
+		ev->waiters_last = NULL;
+		ev->index_next = NULL;
+		ev->next = NULL;
+		ev->prev = NULL;
+		ev->enqueued = 0;
+		ev->started = 0;
+		ev->deadline = 0;
+		ev->timer_slot = 0;
+}
+
+static inline size_t firefly_event_index_slot(struct firefly_event_queue *eq,
+		int64_t id)
+{
+	return (size_t) id & (eq->id_index_size - 1);
+}
+
+static void firefly_event_index_insert(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	size_t slot = firefly_event_index_slot(eq, ev->id);
+
+	ev->index_next = eq->id_index[slot];
+	eq->id_index[slot] = ev;
+}
+
+static void firefly_event_index_remove(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event **n = &eq->id_index[firefly_event_index_slot(eq,
+			ev->id)];
+
+	while (*n != NULL && *n != ev)
+		n = &(*n)->index_next;
+	if (*n != NULL)
+		*n = ev->index_next;
+	ev->index_next = NULL;
+}
+
+static struct firefly_event *firefly_event_index_find(
+		struct firefly_event_queue *eq, int64_t id)
+{
+	struct firefly_event *ev = eq->id_index[firefly_event_index_slot(eq, id)];
+
+	while (ev != NULL && ev->id != id)
+		ev = ev->index_next;
+	return ev;
+}
+
+/**
+ * @brief Rehash the ID index to fit a pool of the given size. On allocation
+ * failure the old, smaller, index is kept which is still correct but slower.
+ */
+static void firefly_event_index_resize(struct firefly_event_queue *eq,
+		size_t pool_size)
+{
+	size_t new_size = firefly_event_index_size(pool_size);
+	struct firefly_event **old = eq->id_index;
+	size_t old_size = eq->id_index_size;
+	struct firefly_event **new_index;
+
+	if (new_size <= old_size)
+		return;
+	new_index = FIREFLY_MALLOC(sizeof(struct firefly_event *)*new_size);
+	if (new_index == NULL)
+		return;
+	memset(new_index, 0, sizeof(struct firefly_event *)*new_size);
+	eq->id_index = new_index;
+	eq->id_index_size = new_size;
+	for (size_t i = 0; i < old_size; i++) {
+		struct firefly_event *ev = old[i];
+		while (ev != NULL) {
+			struct firefly_event *next = ev->index_next;
+			firefly_event_index_insert(eq, ev);
+			ev = next;
+		}
+	}
+	FIREFLY_FREE(old);
+}
+
+/**
+ * @brief Add a slab of nbr cache line aligned events to the pool.
+ */
+static int firefly_event_pool_grow(struct firefly_event_queue *q, size_t nbr)
+{
+	struct firefly_event_slab *slab;
+	unsigned char *mem;
+
+	slab = FIREFLY_MALLOC(sizeof(struct firefly_event_slab) +
+			FIREFLY_EVENT_QUEUE_CACHE_LINE - 1 + nbr * FIREFLY_EVENT_STRIDE);
+	if (slab == NULL)
+		return -1;
+	mem = (unsigned char *) (slab + 1);
+	mem += (FIREFLY_EVENT_QUEUE_CACHE_LINE -
+			(uintptr_t) mem % FIREFLY_EVENT_QUEUE_CACHE_LINE) %
+		FIREFLY_EVENT_QUEUE_CACHE_LINE;
+	// Chain backwards to hand out events in address order.
+	for (size_t i = nbr; i > 0; i--) {
+		struct firefly_event *ev =
+			(struct firefly_event *) (mem + (i - 1) * FIREFLY_EVENT_STRIDE);
+		ev->state = FIREFLY_EVENT_FREE;
+		ev->next = q->event_pool;
+		q->event_pool = ev;
+	}
+	slab->next = q->event_slabs;
+	q->event_slabs = slab;
+	q->event_pool_size += nbr;
+	firefly_event_index_resize(q, q->event_pool_size);
+	return 0;
 }
 
 struct firefly_event *firefly_event_take(struct firefly_event_queue *q)
 {
-	if (q->event_pool_in_use > q->event_pool_size) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-				"EVENT: Inconsistent state, more events in use than possible.");
-		return NULL;
-	} else if (q->event_pool_in_use == q->event_pool_size) {
+	struct firefly_event *ev;
+
+	if (q->event_pool == NULL) {
 		if (q->event_pool_strict_size) {
 			firefly_error(FIREFLY_ERROR_ALLOC, 1,
 					"No available events in the pool.");
 			return NULL;
-		} else {
-			// Double the size of the new pool
-			size_t new_size = q->event_pool_size*2;
-			struct firefly_event **new_pool =
-				FIREFLY_MALLOC(sizeof(struct firefly_event*)*new_size);
-			memcpy(new_pool, q->event_pool, q->event_pool_size);
-			for (size_t i = q->event_pool_in_use; i < new_size; i++) {
-				new_pool[i] = FIREFLY_MALLOC(sizeof(struct firefly_event));
-			}
-			FIREFLY_FREE(q->event_pool);
-			q->event_pool = new_pool;
-			q->event_pool_size = new_size;
 		}
+		// Double the size of the pool
+		if (firefly_event_pool_grow(q, q->event_pool_size > 0 ?
+					q->event_pool_size : 1) < 0) {
+			firefly_error(FIREFLY_ERROR_ALLOC, 1,
+					"Could not grow the pool of events.");
+			return NULL;
+		}
+		q->stats.pool_grows++;
 	}
-	struct firefly_event *ev = q->event_pool[q->event_pool_in_use];
-	q->event_pool[q->event_pool_in_use] = NULL;
+	ev = q->event_pool;
+	q->event_pool = ev->next;
 	q->event_pool_in_use++;
+	if (q->event_pool_in_use > q->stats.pool_in_use_high)
+		q->stats.pool_in_use_high = q->event_pool_in_use;
 
 	return ev;
 }
@@ -127,101 +348,877 @@ struct firefly_event *firefly_event_take(struct firefly_event_queue *q)
 void firefly_event_return(struct firefly_event_queue *q,
 		struct firefly_event **ev)
 {
-	if (q->event_pool_in_use > q->event_pool_size) {
-		firefly_error(FIREFLY_ERROR_ALLOC, 1,
-				"EVENT: Inconsistent state, more events in use than possible.");
+	if ((*ev)->state == FIREFLY_EVENT_RUNNING)
+		firefly_event_stats_returned(q, *ev);
+	firefly_event_release(q, *ev);
+	(*ev)->next = q->event_pool;
+	q->event_pool = *ev;
+	q->event_pool_in_use--;
+	*ev = NULL;
+}
+
+/**
+ * @brief Find the index of the most significant set bit in a non-zero word.
+ */
+static inline unsigned int firefly_event_fls(uint32_t word)
+{
+#ifdef __GNUC__
+	return 31 - __builtin_clz(word);
+#else
+	unsigned int i = 0;
+	while (word >>= 1)
+		i++;
+	return i;
+#endif
+}
+
+static inline int firefly_event_highest_prio(struct firefly_event_queue *eq)
+{
+	unsigned int w;
+
+	if (eq->prio_map_summary == 0)
+		return -1;
+	w = firefly_event_fls(eq->prio_map_summary);
+	return w * 32 + firefly_event_fls(eq->prio_map[w]);
+}
+
+static inline void firefly_event_bucket_push(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_bucket *b = &eq->buckets[ev->eff_prio];
+
+	ev->state = FIREFLY_EVENT_READY;
+	ev->next = NULL;
+	ev->prev = b->tail;
+	if (b->tail != NULL) {
+		b->tail->next = ev;
+	} else {
+		b->head = ev;
+		eq->prio_map[ev->eff_prio / 32] |= 1u << (ev->eff_prio % 32);
+		eq->prio_map_summary |= 1u << (ev->eff_prio / 32);
+	}
+	b->tail = ev;
+}
+
+static inline void firefly_event_bucket_push_front(
+		struct firefly_event_queue *eq, struct firefly_event *ev)
+{
+	struct firefly_event_bucket *b = &eq->buckets[ev->eff_prio];
+
+	ev->state = FIREFLY_EVENT_READY;
+	ev->prev = NULL;
+	ev->next = b->head;
+	if (b->head != NULL) {
+		b->head->prev = ev;
 	} else {
-		q->event_pool_in_use--;
-		q->event_pool[q->event_pool_in_use] = *ev;
-		*ev = NULL;
+		b->tail = ev;
+		eq->prio_map[ev->eff_prio / 32] |= 1u << (ev->eff_prio % 32);
+		eq->prio_map_summary |= 1u << (ev->eff_prio / 32);
+	}
+	b->head = ev;
+}
+
+static inline void firefly_event_bucket_remove(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_bucket *b = &eq->buckets[ev->eff_prio];
+
+	if (ev->prev != NULL)
+		ev->prev->next = ev->next;
+	else
+		b->head = ev->next;
+	if (ev->next != NULL)
+		ev->next->prev = ev->prev;
+	else
+		b->tail = ev->prev;
+	if (b->head == NULL) {
+		eq->prio_map[ev->eff_prio / 32] &= ~(1u << (ev->eff_prio % 32));
+		if (eq->prio_map[ev->eff_prio / 32] == 0)
+			eq->prio_map_summary &= ~(1u << (ev->eff_prio / 32));
+	}
+	ev->next = NULL;
+	ev->prev = NULL;
+}
+
+/**
+ * @brief Let ev, and transitively everything it waits for, inherit prio.
+ */
+static void firefly_event_boost(struct firefly_event_queue *eq,
+		struct firefly_event *ev, unsigned char prio)
+{
+	struct firefly_event_dep *dep;
+
+	if (ev->eff_prio >= prio)
+		return;
+	switch (ev->state) {
+	case FIREFLY_EVENT_READY:
+		firefly_event_bucket_remove(eq, ev);
+		ev->eff_prio = prio;
+		firefly_event_bucket_push(eq, ev);
+		break;
+	case FIREFLY_EVENT_BLOCKED:
+		ev->eff_prio = prio;
+		for (dep = ev->prereqs; dep != NULL; dep = dep->next_prereq)
+			firefly_event_boost(eq, dep->prereq, prio);
+		break;
+	default:
+		ev->eff_prio = prio;
+		break;
 	}
 }
 
+/**
+ * @brief Take nbr edges from the pool of dependency edges and chain them
+ * through next_waiter. All or none are taken.
+ */
+static struct firefly_event_dep *firefly_event_dep_take(
+		struct firefly_event_queue *eq, unsigned int nbr)
+{
+	struct firefly_event_dep *chain = NULL;
+	struct firefly_event_dep *dep;
+
+	for (unsigned int i = 0; i < nbr; i++) {
+		if ((dep = eq->dep_pool) != NULL) {
+			eq->dep_pool = dep->next_waiter;
+		} else if ((dep = FIREFLY_MALLOC(sizeof(*dep))) == NULL) {
+			while ((dep = chain) != NULL) {
+				chain = dep->next_waiter;
+				dep->next_waiter = eq->dep_pool;
+				eq->dep_pool = dep;
+			}
+			return NULL;
+		}
+		dep->next_waiter = chain;
+		chain = dep;
+	}
+	return chain;
+}
+
 int64_t firefly_event_add(struct firefly_event_queue *eq, unsigned char prio,
 		firefly_event_execute_f execute, void *context,
 		unsigned int nbr_depends, const int64_t *depends)
 {
-	struct firefly_event **n = &eq->head;
-	if (nbr_depends > FIREFLY_EVENT_QUEUE_MAX_DEPENDS)
-		return -2;
+	return firefly_event_add_keyed(eq, NULL, NULL, prio, execute, context, 0,
+			NULL, nbr_depends, depends);
+}
+
+/**
+ * @brief Execute an event whose argument is copied to the heap and free the
+ * copy.
+ */
+static int firefly_event_boxed_execute(void *event_arg)
+{
+	struct firefly_event_boxed *box = event_arg;
+	int res;
+
+	res = box->execute(box->context);
+	FIREFLY_FREE(box);
+	return res;
+}
+
+int64_t firefly_event_offer_keyed(struct firefly_event_queue *eq,
+		const void *key, unsigned char prio, firefly_event_execute_f execute,
+		void *context, size_t context_size, unsigned int nbr_depends,
+		const int64_t *depends)
+{
+	return firefly_event_offer_owned(eq, key, NULL, prio, execute, context,
+			context_size, NULL, nbr_depends, depends);
+}
+
+int64_t firefly_event_offer_owned(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_depends,
+		const int64_t *depends)
+{
+	struct firefly_event_boxed *box;
+	int64_t res;
+
+	if (context_size > FIREFLY_EVENT_ARG_SIZE) {
+		firefly_error(FIREFLY_ERROR_EVENT, 1,
+				"Event argument too large to copy.");
+		return -1;
+	}
+	if (eq->offer_keyed_event_cb != NULL)
+		return eq->offer_keyed_event_cb(eq, key, owner, prio, execute,
+				context, context_size, destroy, nbr_depends, depends);
+	if (context_size == 0 && key == NULL && owner == NULL && destroy == NULL)
+		return eq->offer_event_cb(eq, prio, execute, context, nbr_depends,
+				depends);
+	// The box also keeps what the event is dropped with.
+	box = FIREFLY_MALLOC(sizeof(struct firefly_event_boxed));
+	if (box == NULL)
+		return -1;
+	box->execute = execute;
+	box->key = key;
+	box->owner = owner;
+	box->destroy = destroy;
+	if (context_size > 0) {
+		memcpy(&box->arg, context, context_size);
+		box->context = &box->arg;
+	} else {
+		box->context = context;
+	}
+	res = eq->offer_event_cb(eq, prio, firefly_event_boxed_execute, box,
+			nbr_depends, depends);
+	if (res < 0)
+		FIREFLY_FREE(box);
+	return res;
+}
+
+static inline size_t firefly_event_key_slot(const void *key)
+{
+	uintptr_t k = (uintptr_t) key;
+
+	return (size_t) ((k >> 4) ^ (k >> 10)) %
+		FIREFLY_EVENT_QUEUE_KEY_INDEX_SIZE;
+}
+
+static struct firefly_event_key *firefly_event_key_find(
+		struct firefly_event_queue *eq, const void *key)
+{
+	struct firefly_event_key *k = eq->key_index[firefly_event_key_slot(key)];
+
+	while (k != NULL && k->key != key)
+		k = k->next;
+	return k;
+}
+
+static struct firefly_event_key *firefly_event_key_get(
+		struct firefly_event_queue *eq, const void *key)
+{
+	struct firefly_event_key *k = firefly_event_key_find(eq, key);
+	size_t slot;
+
+	if (k != NULL)
+		return k;
+	if ((k = eq->key_pool) != NULL) {
+		eq->key_pool = k->next;
+	} else if ((k = FIREFLY_MALLOC(sizeof(*k))) == NULL) {
+		return NULL;
+	}
+	slot = firefly_event_key_slot(key);
+	k->key = key;
+	k->busy = false;
+	k->handoff = NULL;
+	k->held = NULL;
+	k->held_last = NULL;
+	k->next = eq->key_index[slot];
+	eq->key_index[slot] = k;
+	return k;
+}
+
+static void firefly_event_key_put(struct firefly_event_queue *eq,
+		struct firefly_event_key *k)
+{
+	struct firefly_event_key **n = &eq->key_index[firefly_event_key_slot(
+			k->key)];
 
-	// Find the node to insert the event before, it may be NULL and eq->head
-	while (*n != NULL && (*n)->prio >= prio) {
+	while (*n != k)
 		n = &(*n)->next;
+	*n = k->next;
+	k->next = eq->key_pool;
+	eq->key_pool = k;
+}
+
+/**
+ * @brief Release the key of a finished event. If events are held back on the
+ * key, the key is handed over to the oldest of them which is put first in its
+ * bucket.
+ */
+static void firefly_event_key_release(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_key *k;
+	struct firefly_event *held;
+
+	if (ev->key == NULL || (k = firefly_event_key_find(eq, ev->key)) == NULL)
+		return;
+	if ((held = k->held) != NULL) {
+		k->held = held->next;
+		if (k->held == NULL)
+			k->held_last = NULL;
+		else
+			k->held->prev = NULL;
+		k->handoff = held;
+		firefly_event_bucket_push_front(eq, held);
+	} else {
+		firefly_event_key_put(eq, k);
+	}
+}
+
+int64_t firefly_event_add_keyed(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_depends,
+		const int64_t *depends)
+{
+	int64_t id = eq->event_id + 1;
+	int64_t res;
+
+	res = firefly_event_insert(eq, id, key, owner, prio, execute, context,
+			context_size, destroy, nbr_depends, depends, 0);
+	if (res > 0)
+		eq->event_id = id == INT64_MAX ? 0 : id;
+	return res;
+}
+
+int64_t firefly_event_insert(struct firefly_event_queue *eq, int64_t id,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_depends,
+		const int64_t *depends, uint64_t enqueued)
+{
+	struct firefly_event_dep *deps = NULL;
+	struct firefly_event_dep *dep;
+	unsigned int nbr_unsatisfied = 0;
+
+	if (context_size > FIREFLY_EVENT_ARG_SIZE) {
+		firefly_error(FIREFLY_ERROR_EVENT, 1,
+				"Event argument too large to copy.");
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < nbr_depends; i++) {
+		if (firefly_event_index_find(eq, depends[i]) != NULL)
+			nbr_unsatisfied++;
+	}
+	if (nbr_unsatisfied > 0 &&
+			(deps = firefly_event_dep_take(eq, nbr_unsatisfied)) == NULL) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				"Could not allocate event dependencies.");
+		return -1;
 	}
 
 	struct firefly_event *ev = firefly_event_take(eq);
 	if (ev == NULL) {
+		while ((dep = deps) != NULL) {
+			deps = dep->next_waiter;
+			dep->next_waiter = eq->dep_pool;
+			eq->dep_pool = dep;
+		}
 		return -1;
 	}
-	firefly_event_init(ev, ++eq->event_id, prio, execute, context,
-			nbr_depends, depends);
-	if (eq->event_id == INT64_MAX) {
-		eq->event_id = 0;
+	if (context_size > 0) {
+		memcpy(&ev->arg, context, context_size);
+		context = &ev->arg;
+	}
+	firefly_event_init(ev, id, prio, execute, context);
+	ev->key = key;
+	ev->owner = owner;
+	ev->destroy = destroy;
+
+	// Prepend in reverse to keep prereqs in the order given.
+	for (unsigned int i = nbr_depends; i > 0 && deps != NULL; i--) {
+		struct firefly_event *prereq =
+			firefly_event_index_find(eq, depends[i - 1]);
+		if (prereq == NULL)
+			continue;
+		dep = deps;
+		deps = dep->next_waiter;
+		dep->waiter = ev;
+		dep->prereq = prereq;
+		dep->next_waiter = NULL;
+		dep->prev_waiter = prereq->waiters_last;
+		if (prereq->waiters_last != NULL)
+			prereq->waiters_last->next_waiter = dep;
+		else
+			prereq->waiters = dep;
+		prereq->waiters_last = dep;
+		dep->prev_prereq = NULL;
+		dep->next_prereq = ev->prereqs;
+		if (ev->prereqs != NULL)
+			ev->prereqs->prev_prereq = dep;
+		ev->prereqs = dep;
+		ev->nbr_unsatisfied++;
+	}
+
+	firefly_event_index_insert(eq, ev);
+	eq->nbr_events++;
+	eq->stats.nbr_added++;
+	if (eq->nbr_events > eq->stats.depth_high)
+		eq->stats.depth_high = eq->nbr_events;
+	ev->enqueued = enqueued != 0 ? enqueued : firefly_event_now(eq);
+	if (ev->nbr_unsatisfied == 0) {
+		firefly_event_bucket_push(eq, ev);
+	} else {
+		ev->state = FIREFLY_EVENT_BLOCKED;
+		for (dep = ev->prereqs; dep != NULL; dep = dep->next_prereq)
+			firefly_event_boost(eq, dep->prereq, prio);
 	}
-	ev->next = (*n);
-	*n = ev;
 
 	return ev->id;
 }
 
-void firefly_event_remove(struct firefly_event **ev)
+/**
+ * @brief Put a timer in the slot of the wheel given by the time left to its
+ * deadline.
+ */
+static void firefly_event_wheel_place(struct firefly_event_wheel *w,
+		struct firefly_event *ev)
+{
+	const uint64_t span = (uint64_t) 1 <<
+		(FIREFLY_EVENT_WHEEL_BITS * FIREFLY_EVENT_WHEEL_LEVELS);
+	uint64_t deadline = ev->deadline > w->now ? ev->deadline : w->now;
+	uint64_t delta = deadline - w->now;
+	unsigned int level = 0;
+	unsigned int slot;
+
+	if (delta >= span) {
+		// Park it as far away as possible, it is placed again from there.
+		delta = span - 1;
+		deadline = w->now + delta;
+	}
+	while (delta >= (uint64_t) 1 << (FIREFLY_EVENT_WHEEL_BITS * (level + 1)))
+		level++;
+	slot = (deadline >> (FIREFLY_EVENT_WHEEL_BITS * level)) &
+		(FIREFLY_EVENT_WHEEL_SLOTS - 1);
+	ev->timer_slot = level * FIREFLY_EVENT_WHEEL_SLOTS + slot;
+	ev->prev = NULL;
+	ev->next = w->slots[level][slot];
+	if (ev->next != NULL)
+		ev->next->prev = ev;
+	w->slots[level][slot] = ev;
+	w->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+static void firefly_event_wheel_remove(struct firefly_event_wheel *w,
+		struct firefly_event *ev)
 {
-	*ev = (*ev)->next;
+	unsigned int level = ev->timer_slot / FIREFLY_EVENT_WHEEL_SLOTS;
+	unsigned int slot = ev->timer_slot % FIREFLY_EVENT_WHEEL_SLOTS;
+
+	if (ev->prev != NULL)
+		ev->prev->next = ev->next;
+	else
+		w->slots[level][slot] = ev->next;
+	if (ev->next != NULL)
+		ev->next->prev = ev->prev;
+	if (w->slots[level][slot] == NULL)
+		w->occupied[level] &= ~((uint64_t) 1 << slot);
+	ev->next = NULL;
+	ev->prev = NULL;
 }
 
-struct firefly_event **firefly_event_find(struct firefly_event_queue *eq,
-		int64_t id)
+/**
+ * @brief Move the timers of the current slot of each level above 0 down the
+ * wheel, the next level only if the current one wrapped around.
+ */
+static void firefly_event_wheel_cascade(struct firefly_event_wheel *w)
+{
+	for (unsigned int level = 1; level < FIREFLY_EVENT_WHEEL_LEVELS;
+			level++) {
+		unsigned int slot = (w->now >> (FIREFLY_EVENT_WHEEL_BITS * level)) &
+			(FIREFLY_EVENT_WHEEL_SLOTS - 1);
+		struct firefly_event *ev = w->slots[level][slot];
+
+		w->slots[level][slot] = NULL;
+		w->occupied[level] &= ~((uint64_t) 1 << slot);
+		while (ev != NULL) {
+			struct firefly_event *next = ev->next;
+
+			firefly_event_wheel_place(w, ev);
+			ev = next;
+		}
+		if (slot != 0)
+			break;
+	}
+}
+
+/**
+ * @brief Queue a timer event which deadline has passed.
+ */
+static void firefly_event_timer_queue(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
 {
+	eq->nbr_events++;
+	if (eq->nbr_events > eq->stats.depth_high)
+		eq->stats.depth_high = eq->nbr_events;
+	ev->enqueued = firefly_event_now(eq);
+	firefly_event_bucket_push(eq, ev);
+}
+
+int64_t firefly_event_add_at(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline, firefly_event_execute_f execute,
+		void *context)
+{
+	int64_t id = eq->event_id + 1;
+	int64_t res;
+
+	res = firefly_event_insert_at(eq, id, key, owner, prio, deadline,
+			execute, context);
+	if (res > 0)
+		eq->event_id = id == INT64_MAX ? 0 : id;
+	return res;
+}
+
+int64_t firefly_event_insert_at(struct firefly_event_queue *eq, int64_t id,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline, firefly_event_execute_f execute,
+		void *context)
+{
+	struct firefly_event_wheel *w = &eq->wheel;
 	struct firefly_event *ev;
-	if (eq->head == NULL)
-		return NULL;
-	else if (eq->head->id == id)
-		return &eq->head;
-	ev = eq->head;
-	while (ev->next != NULL && ev->next->id != id) {
-		ev = ev->next;
+
+	if (w->nbr_timers == 0 && eq->stats.clock != NULL) {
+		// Catch up at once instead of stepping through the idle time.
+		uint64_t now = firefly_event_queue_now(eq);
+		if (now > w->now)
+			w->now = now;
 	}
+	ev = firefly_event_take(eq);
+	if (ev == NULL)
+		return -1;
+	firefly_event_init(ev, id, prio, execute, context);
+	// Once due the event is held back on its key like any other event.
+	ev->key = key;
+	ev->owner = owner;
+	ev->deadline = deadline;
+	firefly_event_index_insert(eq, ev);
+	eq->stats.nbr_added++;
+	if (deadline < w->now) {
+		firefly_event_timer_queue(eq, ev);
+	} else {
+		ev->state = FIREFLY_EVENT_TIMED;
+		firefly_event_wheel_place(w, ev);
+		w->nbr_timers++;
+	}
+	return id;
+}
 
-	return &ev->next;
+/**
+ * @brief Unlink a blocked event from the waiter lists of the events it waits
+ * for.
+ */
+static void firefly_event_unblock(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_dep *dep;
+
+	while ((dep = ev->prereqs) != NULL) {
+		struct firefly_event *prereq = dep->prereq;
+
+		ev->prereqs = dep->next_prereq;
+		if (dep->prev_waiter != NULL)
+			dep->prev_waiter->next_waiter = dep->next_waiter;
+		else
+			prereq->waiters = dep->next_waiter;
+		if (dep->next_waiter != NULL)
+			dep->next_waiter->prev_waiter = dep->prev_waiter;
+		else
+			prereq->waiters_last = dep->prev_waiter;
+		dep->next_waiter = eq->dep_pool;
+		eq->dep_pool = dep;
+	}
+	ev->nbr_unsatisfied = 0;
 }
 
-struct firefly_event **firefly_event_get_depends(struct firefly_event_queue *eq,
-		struct firefly_event **ev)
+/**
+ * @brief Unlink an event held back on its key.
+ */
+static void firefly_event_unhold(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
 {
-	for (int i = 0; i < FIREFLY_EVENT_QUEUE_MAX_DEPENDS; i++) {
-		if ((*ev)->depends[i] != 0) {
-			struct firefly_event **tmp =
-				firefly_event_find(eq, (*ev)->depends[i]);
-			if (*tmp != NULL) {
-				struct firefly_event **tmp2 =
-					firefly_event_get_depends(eq, tmp);
-				if (*tmp2 == *tmp)
-					(*ev)->depends[i] = 0;
-				return tmp2;
-			} else {
-				(*ev)->depends[i] = 0;
+	struct firefly_event_key *k = firefly_event_key_find(eq, ev->key);
+
+	if (ev->prev != NULL)
+		ev->prev->next = ev->next;
+	else
+		k->held = ev->next;
+	if (ev->next != NULL)
+		ev->next->prev = ev->prev;
+	else
+		k->held_last = ev->prev;
+	ev->next = NULL;
+	ev->prev = NULL;
+}
+
+/**
+ * @brief Drop an event not yet popped, calling its destructor.
+ *
+ * @return 0 if dropped, <0 if the event is running.
+ */
+static int firefly_event_drop(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_key *k;
+
+	switch (ev->state) {
+	case FIREFLY_EVENT_TIMED:
+		firefly_event_wheel_remove(&eq->wheel, ev);
+		eq->wheel.nbr_timers--;
+		break;
+	case FIREFLY_EVENT_READY:
+		firefly_event_bucket_remove(eq, ev);
+		eq->nbr_events--;
+		// The key may have been handed over to this event.
+		if (eq->by_key && ev->key != NULL &&
+				(k = firefly_event_key_find(eq, ev->key)) != NULL &&
+				k->handoff == ev)
+			firefly_event_key_release(eq, ev);
+		break;
+	case FIREFLY_EVENT_BLOCKED:
+		firefly_event_unblock(eq, ev);
+		eq->nbr_events--;
+		break;
+	case FIREFLY_EVENT_HELD:
+		firefly_event_unhold(eq, ev);
+		eq->nbr_events--;
+		break;
+	default:
+		return -1;
+	}
+	if (ev->destroy != NULL)
+		ev->destroy(ev->context);
+	if (ev->execute == firefly_event_boxed_execute) {
+		struct firefly_event_boxed *box = ev->context;
+
+		if (box->destroy != NULL)
+			box->destroy(box->context);
+		FIREFLY_FREE(box);
+	}
+	eq->stats.nbr_dropped++;
+	firefly_event_return(eq, &ev);
+	return 0;
+}
+
+int firefly_event_cancel(struct firefly_event_queue *eq, int64_t id)
+{
+	struct firefly_event *ev = firefly_event_index_find(eq, id);
+
+	return ev != NULL ? firefly_event_drop(eq, ev) : -1;
+}
+
+/**
+ * @brief Check if an event is keyed to or owned by \p owner.
+ */
+static bool firefly_event_owned_by(struct firefly_event *ev,
+		const void *owner)
+{
+	if (ev->execute == firefly_event_boxed_execute) {
+		struct firefly_event_boxed *box = ev->context;
+
+		return box->key == owner || box->owner == owner;
+	}
+	return ev->key == owner || ev->owner == owner;
+}
+
+size_t firefly_event_purge(struct firefly_event_queue *eq, const void *owner)
+{
+	size_t n = 0;
+
+	if (owner == NULL)
+		return 0;
+	// Dropping an event only releases others, the index chains stay intact.
+	for (size_t i = 0; i < eq->id_index_size; i++) {
+		struct firefly_event *ev = eq->id_index[i];
+
+		while (ev != NULL) {
+			struct firefly_event *next = ev->index_next;
+
+			if (firefly_event_owned_by(ev, owner) &&
+					firefly_event_drop(eq, ev) == 0)
+				n++;
+			ev = next;
+		}
+	}
+	return n;
+}
+
+/**
+ * @brief Drop every event not yet popped, in any state, calling their
+ * destructors.
+ */
+static void firefly_event_drop_all(struct firefly_event_queue *eq)
+{
+	size_t n;
+
+	// Dropping an event may make a blocked one ready, repeat until none is left.
+	do {
+		n = 0;
+		for (size_t i = 0; i < eq->id_index_size; i++) {
+			struct firefly_event *ev = eq->id_index[i];
+
+			while (ev != NULL) {
+				struct firefly_event *next = ev->index_next;
+
+				if (firefly_event_drop(eq, ev) == 0)
+					n++;
+				ev = next;
 			}
 		}
+	} while (n > 0);
+}
+
+int64_t firefly_event_offer_at(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline, firefly_event_execute_f execute,
+		void *context)
+{
+	if (eq->offer_event_at_cb == NULL) {
+		firefly_error(FIREFLY_ERROR_EVENT, 1,
+				"The event queue does not support timers.");
+		return -1;
 	}
-	return ev;
+	return eq->offer_event_at_cb(eq, key, owner, prio, deadline, execute,
+			context);
+}
+
+int firefly_event_queue_cancel(struct firefly_event_queue *eq, int64_t id)
+{
+	if (eq->cancel_event_cb == NULL) {
+		firefly_error(FIREFLY_ERROR_EVENT, 1,
+				"The event queue does not support cancelling events.");
+		return -1;
+	}
+	return eq->cancel_event_cb(eq, id);
+}
+
+size_t firefly_event_queue_purge(struct firefly_event_queue *eq,
+		const void *owner)
+{
+	return eq->purge_events_cb != NULL ? eq->purge_events_cb(eq, owner) : 0;
+}
+
+uint64_t firefly_event_queue_now(struct firefly_event_queue *eq)
+{
+	return firefly_event_now(eq) / 1000000;
+}
+
+size_t firefly_event_queue_expire(struct firefly_event_queue *eq,
+		uint64_t now)
+{
+	struct firefly_event_wheel *w = &eq->wheel;
+	struct firefly_event *ev;
+	size_t n = 0;
+
+	while (w->now <= now) {
+		unsigned int slot = w->now & (FIREFLY_EVENT_WHEEL_SLOTS - 1);
+
+		if (w->nbr_timers == 0) {
+			w->now = now + 1;
+			break;
+		}
+		if (slot == 0)
+			firefly_event_wheel_cascade(w);
+		if ((w->occupied[0] >> slot) == 0) {
+			// Nothing is due before the next cascade, skip to it.
+			uint64_t next = (w->now | (FIREFLY_EVENT_WHEEL_SLOTS - 1)) + 1;
+			w->now = next <= now ? next : now + 1;
+			continue;
+		}
+		while ((ev = w->slots[0][slot]) != NULL) {
+			firefly_event_wheel_remove(w, ev);
+			w->nbr_timers--;
+			firefly_event_timer_queue(eq, ev);
+			n++;
+		}
+		w->now++;
+	}
+	return n;
+}
+
+bool firefly_event_queue_next_timer(struct firefly_event_queue *eq,
+		uint64_t *deadline)
+{
+	struct firefly_event_wheel *w = &eq->wheel;
+	unsigned int slot = w->now & (FIREFLY_EVENT_WHEEL_SLOTS - 1);
+
+	if (w->nbr_timers == 0)
+		return false;
+	if (slot == 0) {
+		// Timers may be cascaded down to the current tick.
+		*deadline = w->now;
+	} else if ((w->occupied[0] >> slot) != 0) {
+		while (((w->occupied[0] >> slot) & 1) == 0)
+			slot++;
+		*deadline = (w->now & ~(uint64_t) (FIREFLY_EVENT_WHEEL_SLOTS - 1)) +
+			slot;
+	} else {
+		*deadline = (w->now | (FIREFLY_EVENT_WHEEL_SLOTS - 1)) + 1;
+	}
+	return true;
+}
+
+/**
+ * @brief Mark ev as finished, releasing any event waiting only for it, and
+ * remove it from the ID index.
+ */
+static void firefly_event_release(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_dep *dep;
+
+	if (ev->state == FIREFLY_EVENT_FREE)
+		return;
+	while ((dep = ev->waiters) != NULL) {
+		struct firefly_event *waiter = dep->waiter;
+
+		ev->waiters = dep->next_waiter;
+		if (dep->prev_prereq != NULL)
+			dep->prev_prereq->next_prereq = dep->next_prereq;
+		else
+			waiter->prereqs = dep->next_prereq;
+		if (dep->next_prereq != NULL)
+			dep->next_prereq->prev_prereq = dep->prev_prereq;
+		dep->next_waiter = eq->dep_pool;
+		eq->dep_pool = dep;
+
+		if (--waiter->nbr_unsatisfied == 0)
+			firefly_event_bucket_push(eq, waiter);
+	}
+	ev->waiters_last = NULL;
+	if (ev->state == FIREFLY_EVENT_RUNNING && eq->by_key)
+		firefly_event_key_release(eq, ev);
+	firefly_event_index_remove(eq, ev);
+	ev->state = FIREFLY_EVENT_FREE;
+}
+
+struct firefly_event *firefly_event_queue_top(struct firefly_event_queue *eq)
+{
+	int prio = firefly_event_highest_prio(eq);
+
+	return prio < 0 ? NULL : eq->buckets[prio].head;
 }
 
 struct firefly_event *firefly_event_pop(struct firefly_event_queue *eq)
 {
-	// The actual event
-	struct firefly_event **ev;
-	struct firefly_event *tmp;
+	struct firefly_event *ev;
+
+	while ((ev = firefly_event_queue_top(eq)) != NULL) {
+		struct firefly_event_key *k;
 
-	ev = &eq->head;
-	if ((*ev) == NULL) {
+		firefly_event_bucket_remove(eq, ev);
+		if (!eq->by_key || ev->key == NULL)
+			break;
+		if ((k = firefly_event_key_get(eq, ev->key)) == NULL) {
+			firefly_error(FIREFLY_ERROR_ALLOC, 1,
+					"Could not allocate event key, ordering not kept.");
+			break;
+		}
+		if (!k->busy || k->handoff == ev) {
+			k->busy = true;
+			k->handoff = NULL;
+			break;
+		}
+		ev->state = FIREFLY_EVENT_HELD;
+		ev->next = NULL;
+		ev->prev = k->held_last;
+		if (k->held_last != NULL)
+			k->held_last->next = ev;
+		else
+			k->held = ev;
+		k->held_last = ev;
+	}
+	if (ev == NULL) {
 		return NULL;
 	}
-	ev = firefly_event_get_depends(eq, ev);
-	tmp = *ev;
-	firefly_event_remove(ev);
+	ev->state = FIREFLY_EVENT_RUNNING;
+	eq->nbr_events--;
+	firefly_event_stats_popped(eq, ev);
 
-	return tmp;
+	return ev;
 }
 
 int firefly_event_execute(struct firefly_event *ev)
@@ -238,16 +1235,7 @@ int firefly_event_execute(struct firefly_event *ev)
 
 size_t firefly_event_queue_length(struct firefly_event_queue *eq)
 {
-	struct firefly_event *ev;
-	size_t n = 0;
-
-	ev = eq->head;
-	while (ev) {
-		ev = ev->next;
-		n++;
-	}
-
-	return n;
+	return eq->nbr_events;
 }
 
 void *firefly_event_queue_get_context(struct firefly_event_queue *eq)
@@ -259,3 +1247,228 @@ int64_t firefly_event_queue_event_id(struct firefly_event *ev)
 {
 	return ev->id;
 }
+
+void firefly_event_queue_set_clock(struct firefly_event_queue *eq,
+		firefly_event_clock_f clock)
+{
+	eq->stats.clock = clock;
+}
+
+/**
+ * @brief Record a duration in a histogram.
+ */
+static void firefly_event_histogram_add(struct firefly_event_histogram *h,
+		uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int b = 0;
+
+	if (us > UINT32_MAX)
+		b = FIREFLY_EVENT_STATS_BUCKETS - 1;
+	else if (us > 0)
+		b = firefly_event_fls((uint32_t) us) + 1;
+	if (b >= FIREFLY_EVENT_STATS_BUCKETS)
+		b = FIREFLY_EVENT_STATS_BUCKETS - 1;
+	h->buckets[b]++;
+	h->count++;
+	h->total_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+/**
+ * @brief Get the statistics of a priority, allocating them if needed.
+ *
+ * @return The statistics or NULL on allocation failure.
+ */
+static struct firefly_event_stats_entry *firefly_event_stats_prio(
+		struct firefly_event_queue *eq, unsigned char prio)
+{
+	struct firefly_event_stats_entry *e = eq->stats.prios[prio];
+
+	if (e == NULL) {
+		e = FIREFLY_MALLOC(sizeof(*e));
+		if (e == NULL)
+			return NULL;
+		memset(e, 0, sizeof(*e));
+		e->prio = prio;
+		eq->stats.prios[prio] = e;
+	}
+	return e;
+}
+
+/**
+ * @brief Get the statistics of an execute function, claiming a slot in the
+ * table if needed. Functions not fitting in the table share the last slot.
+ *
+ * @return The statistics or NULL on allocation failure.
+ */
+static struct firefly_event_stats_entry *firefly_event_stats_func(
+		struct firefly_event_queue *eq, firefly_event_execute_f execute)
+{
+	struct firefly_event_stats_entry *funcs = eq->stats.funcs;
+	size_t slot;
+
+	if (funcs == NULL) {
+		funcs = FIREFLY_MALLOC(sizeof(*funcs) *
+				(FIREFLY_EVENT_STATS_FUNCS + 1));
+		if (funcs == NULL)
+			return NULL;
+		memset(funcs, 0, sizeof(*funcs) * (FIREFLY_EVENT_STATS_FUNCS + 1));
+		eq->stats.funcs = funcs;
+	}
+	if (execute == NULL)
+		return &funcs[FIREFLY_EVENT_STATS_FUNCS];
+	slot = (size_t) (((uintptr_t) execute >> 4) * 2654435761u);
+	for (size_t i = 0; i < FIREFLY_EVENT_STATS_FUNCS; i++) {
+		struct firefly_event_stats_entry *e =
+			&funcs[(slot + i) % FIREFLY_EVENT_STATS_FUNCS];
+		if (e->execute == execute) {
+			return e;
+		} else if (e->execute == NULL) {
+			e->execute = execute;
+			return e;
+		}
+	}
+	return &funcs[FIREFLY_EVENT_STATS_FUNCS];
+}
+
+static void firefly_event_stats_popped(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_stats_entry *e;
+	uint64_t now;
+	uint64_t wait;
+
+	if (eq->stats.clock == NULL)
+		return;
+	now = eq->stats.clock();
+	ev->started = now;
+	wait = now > ev->enqueued ? now - ev->enqueued : 0;
+	if ((e = firefly_event_stats_prio(eq, ev->prio)) != NULL)
+		firefly_event_histogram_add(&e->wait, wait);
+	if ((e = firefly_event_stats_func(eq, ev->execute)) != NULL)
+		firefly_event_histogram_add(&e->wait, wait);
+}
+
+static void firefly_event_stats_returned(struct firefly_event_queue *eq,
+		struct firefly_event *ev)
+{
+	struct firefly_event_stats_entry *e;
+	uint64_t now;
+	uint64_t exec;
+
+	eq->stats.nbr_returned++;
+	if (eq->stats.clock == NULL || ev->started == 0)
+		return;
+	now = eq->stats.clock();
+	exec = now > ev->started ? now - ev->started : 0;
+	if ((e = firefly_event_stats_prio(eq, ev->prio)) != NULL)
+		firefly_event_histogram_add(&e->exec, exec);
+	if ((e = firefly_event_stats_func(eq, ev->execute)) != NULL)
+		firefly_event_histogram_add(&e->exec, exec);
+}
+
+int firefly_event_queue_stats_name(struct firefly_event_queue *eq,
+		firefly_event_execute_f execute, const char *name)
+{
+	struct firefly_event_stats_entry *e;
+
+	e = firefly_event_stats_func(eq, execute);
+	if (e == NULL || e == &eq->stats.funcs[FIREFLY_EVENT_STATS_FUNCS]) {
+		firefly_error(FIREFLY_ERROR_EVENT, 1,
+				"No room for the function in the statistics.");
+		return -1;
+	}
+	e->name = name;
+	return 0;
+}
+
+struct firefly_event_queue_stats *firefly_event_queue_stats_get(
+		struct firefly_event_queue *eq)
+{
+	struct firefly_event_queue_stats *s;
+	struct firefly_event_stats_entry *funcs = eq->stats.funcs;
+
+	s = FIREFLY_MALLOC(sizeof(*s));
+	if (s == NULL) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				"Could not allocate event queue statistics.");
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+	s->depth = eq->nbr_events;
+	s->nbr_timers = eq->wheel.nbr_timers;
+	s->depth_high = eq->stats.depth_high;
+	s->pool_size = eq->event_pool_size;
+	s->pool_in_use = eq->event_pool_in_use;
+	s->pool_in_use_high = eq->stats.pool_in_use_high;
+	s->pool_grows = eq->stats.pool_grows;
+	s->nbr_added = eq->stats.nbr_added;
+	s->nbr_returned = eq->stats.nbr_returned;
+	s->nbr_dropped = eq->stats.nbr_dropped;
+
+	for (size_t i = 0; i < FIREFLY_EVENT_QUEUE_NBR_PRIOS; i++)
+		if (eq->stats.prios[i] != NULL)
+			s->nbr_prios++;
+	for (size_t i = 0; funcs != NULL && i <= FIREFLY_EVENT_STATS_FUNCS; i++)
+		if (funcs[i].execute != NULL || funcs[i].wait.count > 0)
+			s->nbr_funcs++;
+
+	if (s->nbr_prios > 0)
+		s->prios = FIREFLY_MALLOC(sizeof(*s->prios) * s->nbr_prios);
+	if (s->nbr_funcs > 0)
+		s->funcs = FIREFLY_MALLOC(sizeof(*s->funcs) * s->nbr_funcs);
+	if ((s->nbr_prios > 0 && s->prios == NULL) ||
+			(s->nbr_funcs > 0 && s->funcs == NULL)) {
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				"Could not allocate event queue statistics.");
+		firefly_event_queue_stats_free(&s);
+		return NULL;
+	}
+
+	for (size_t i = FIREFLY_EVENT_QUEUE_NBR_PRIOS, n = 0; i-- > 0;)
+		if (eq->stats.prios[i] != NULL)
+			s->prios[n++] = *eq->stats.prios[i];
+	for (size_t i = 0, n = 0; funcs != NULL &&
+			i <= FIREFLY_EVENT_STATS_FUNCS; i++)
+		if (funcs[i].execute != NULL || funcs[i].wait.count > 0)
+			s->funcs[n++] = funcs[i];
+	return s;
+}
+
+void firefly_event_queue_stats_free(struct firefly_event_queue_stats **stats)
+{
+	if (*stats == NULL)
+		return;
+	FIREFLY_FREE((*stats)->prios);
+	FIREFLY_FREE((*stats)->funcs);
+	FIREFLY_FREE(*stats);
+	*stats = NULL;
+}
+
+/**
+ * @brief Clear the histograms of an entry, keeping what it is for.
+ */
+static void firefly_event_stats_entry_reset(
+		struct firefly_event_stats_entry *e)
+{
+	memset(&e->wait, 0, sizeof(e->wait));
+	memset(&e->exec, 0, sizeof(e->exec));
+}
+
+void firefly_event_queue_stats_reset(struct firefly_event_queue *eq)
+{
+	eq->stats.depth_high = eq->nbr_events;
+	eq->stats.pool_in_use_high = eq->event_pool_in_use;
+	eq->stats.pool_grows = 0;
+	eq->stats.nbr_added = 0;
+	eq->stats.nbr_returned = 0;
+	eq->stats.nbr_dropped = 0;
+	for (size_t i = 0; i < FIREFLY_EVENT_QUEUE_NBR_PRIOS; i++)
+		if (eq->stats.prios[i] != NULL)
+			firefly_event_stats_entry_reset(eq->stats.prios[i]);
+	for (size_t i = 0; eq->stats.funcs != NULL &&
+			i <= FIREFLY_EVENT_STATS_FUNCS; i++)
+		firefly_event_stats_entry_reset(&eq->stats.funcs[i]);
+}
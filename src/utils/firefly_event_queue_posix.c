@@ -1,41 +1,194 @@
 #define _POSIX_C_SOURCE (200112L)
 #include <pthread.h>
+#include <sched.h>
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include <utils/firefly_event_queue_posix.h>
 #include <utils/firefly_event_queue.h>
+#include <utils/firefly_errors.h>
 
-struct firefly_event_queue_posix_context {
-	pthread_mutex_t lock;
-	pthread_cond_t signal;
-	pthread_t event_loop;
-	bool event_loop_stop;
-};
+#include "utils/firefly_event_queue_private.h"
+#include "utils/firefly_event_queue_posix_private.h"
+
+/**
+ * @brief The smallest number of slots in the ingress ring.
+ */
+#define FIREFLY_EVENT_QUEUE_POSIX_RING_MIN (256)
+
+/**
+ * @brief The largest number of events moved from the ingress ring to the
+ * scheduler at a time, bounds the time the queue lock is held.
+ */
+#define FIREFLY_EVENT_QUEUE_POSIX_BATCH (64)
+
+/**
+ * @brief The number of polls between reading the clock while spinning.
+ */
+#define FIREFLY_EVENT_QUEUE_POSIX_SPIN_CHECK (64)
 
 int64_t firefly_event_queue_posix_add(struct firefly_event_queue *eq,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
 		unsigned int nbr_deps, const int64_t *deps);
 
+int64_t firefly_event_queue_posix_add_keyed(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_deps,
+		const int64_t *deps);
+
+int64_t firefly_event_queue_posix_add_at(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline, firefly_event_execute_f execute,
+		void *context);
+
+int firefly_event_queue_posix_cancel(struct firefly_event_queue *eq,
+		int64_t id);
+
+size_t firefly_event_queue_posix_purge(struct firefly_event_queue *eq,
+		const void *owner);
+
+/*
+ * The clock timing the events of posix queues, cheap enough to leave on.
+ */
+static uint64_t firefly_event_queue_posix_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
 struct firefly_event_queue *firefly_event_queue_posix_new(size_t pool_size)
+{
+	return firefly_event_queue_posix_new_pool(pool_size, 1);
+}
+
+struct firefly_event_queue *firefly_event_queue_posix_new_pool(
+		size_t pool_size, size_t nbr_workers)
 {
 	int res;
-	struct firefly_event_queue_posix_context *ctx =
-		malloc(sizeof(struct firefly_event_queue_posix_context));
+	size_t ring_size = FIREFLY_EVENT_QUEUE_POSIX_RING_MIN;
+	struct firefly_event_queue_posix_context *ctx;
+	pthread_condattr_t cond_attr;
+
+	if (nbr_workers < 1)
+		return NULL;
+	ctx = malloc(sizeof(struct firefly_event_queue_posix_context));
+	if (ctx == NULL)
+		return NULL;
+	ctx->event_loops = calloc(nbr_workers, sizeof(pthread_t));
+	while (ring_size < pool_size)
+		ring_size *= 2;
+	ctx->ring = malloc(ring_size * sizeof(*ctx->ring));
+	if (ctx->event_loops == NULL || ctx->ring == NULL) {
+		free(ctx->event_loops);
+		free(ctx->ring);
+		free(ctx);
+		return NULL;
+	}
+	for (size_t i = 0; i < ring_size; i++)
+		ctx->ring[i].seq = i;
+	ctx->ring_mask = ring_size - 1;
+	ctx->ring_head = 0;
+	ctx->ring_tail = 0;
+	ctx->next_id = 0;
+	ctx->nbr_outstanding = 0;
+	ctx->nbr_parked = 0;
+	ctx->nbr_waking = 0;
+	ctx->nbr_spinning = 0;
+	ctx->kicks = 0;
+	ctx->strategy = FIREFLY_EVENT_QUEUE_POSIX_BLOCK;
+	ctx->spin_ns = 0;
+	ctx->wait_stats = (struct firefly_event_queue_posix_wait_stats) {0};
+	ctx->nbr_workers = nbr_workers;
 	res = pthread_mutex_init(&ctx->lock, NULL);
 	if (res) {
 		fprintf(stderr, "ERROR: init mutex.\n");
 	}
-	res = pthread_cond_init(&ctx->signal, NULL);
+	pthread_condattr_init(&cond_attr);
+	// Timed waits for timer events must not jump with the wall clock.
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	res = pthread_cond_init(&ctx->signal, &cond_attr);
 	if (res) {
 		fprintf(stderr, "ERROR: init cond variable.\n");
 	}
+	pthread_condattr_destroy(&cond_attr);
 	ctx->event_loop_stop = false;
 	struct firefly_event_queue *eq =
 		firefly_event_queue_new(firefly_event_queue_posix_add, pool_size, ctx);
+	ctx->eq = eq;
+	if (eq != NULL) {
+		firefly_event_queue_set_offer_keyed(eq,
+				firefly_event_queue_posix_add_keyed, nbr_workers > 1);
+		firefly_event_queue_set_timers(eq, firefly_event_queue_posix_add_at);
+		firefly_event_queue_set_cancel(eq, firefly_event_queue_posix_cancel,
+				firefly_event_queue_posix_purge);
+		firefly_event_queue_set_clock(eq, firefly_event_queue_posix_clock);
+	}
 	return eq;
 }
 
+/*
+ * Move published offers from the ring to the scheduler, oldest first. Stops at
+ * the first slot claimed but not yet published to keep the order, later
+ * offers may depend on it. The lock must be held.
+ */
+static size_t firefly_event_queue_posix_drain(
+		struct firefly_event_queue_posix_context *ctx, size_t max)
+{
+	size_t n = 0;
+
+	while (n < max) {
+		struct firefly_event_ingress *slot =
+			&ctx->ring[ctx->ring_tail & ctx->ring_mask];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq != ctx->ring_tail + 1)
+			break;
+		void *context = slot->context_size > 0 ? &slot->arg : slot->context;
+
+		if (firefly_event_insert(ctx->eq, slot->id, slot->key, slot->owner,
+					slot->prio, slot->execute, context, slot->context_size,
+					slot->destroy, slot->nbr_deps, slot->deps,
+					slot->enqueued) < 0) {
+			firefly_error(FIREFLY_ERROR_ALLOC, 1,
+					"Could not schedule offered event.");
+			if (slot->destroy != NULL)
+				slot->destroy(context);
+			__atomic_sub_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&slot->seq, ctx->ring_tail + ctx->ring_mask + 1,
+				__ATOMIC_RELEASE);
+		// Polling workers watch the tail to see offers drained by others.
+		__atomic_store_n(&ctx->ring_tail, ctx->ring_tail + 1,
+				__ATOMIC_RELEASE);
+		n++;
+	}
+	return n;
+}
+
+static bool firefly_event_queue_posix_ring_empty(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	return __atomic_load_n(&ctx->ring_head, __ATOMIC_SEQ_CST) ==
+		ctx->ring_tail;
+}
+
+/*
+ * Whether the oldest offer in the ring is published and can be drained.
+ */
+static bool firefly_event_queue_posix_ring_ready(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	struct firefly_event_ingress *slot =
+		&ctx->ring[ctx->ring_tail & ctx->ring_mask];
+	return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) ==
+		ctx->ring_tail + 1;
+}
+
 void firefly_event_queue_posix_free(struct firefly_event_queue **eq)
 {
 	// make sure loop is stopped, free context and queue
@@ -43,33 +196,384 @@ void firefly_event_queue_posix_free(struct firefly_event_queue **eq)
 		firefly_event_queue_get_context(*eq);
 
 	firefly_event_queue_posix_stop(*eq);
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_queue_posix_drain(ctx, ctx->ring_mask + 1);
+	pthread_mutex_unlock(&ctx->lock);
 	pthread_mutex_destroy(&ctx->lock);
 	pthread_cond_destroy(&ctx->signal);
+	free(ctx->event_loops);
+	free(ctx->ring);
 	free(ctx);
 	firefly_event_queue_free(eq);
 }
 
-int64_t firefly_event_queue_posix_add(struct firefly_event_queue *eq,
+static void firefly_event_queue_posix_signal(
+		struct firefly_event_queue_posix_context *ctx, bool all);
+
+/*
+ * Move every published offer from the ring to the scheduler and signal the
+ * workers if any was moved, the offers may have been watched by a worker
+ * about to park. Offers not yet published when called are left in the ring.
+ * The lock must be held.
+ */
+static void firefly_event_queue_posix_drain_all(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	size_t n = 0;
+	size_t m;
+
+	while (!firefly_event_queue_posix_ring_empty(ctx) &&
+			(m = firefly_event_queue_posix_drain(ctx, ctx->ring_mask + 1)) > 0)
+		n += m;
+	if (n > 0)
+		firefly_event_queue_posix_signal(ctx, n > 1);
+}
+
+/*
+ * Move every offer claimed before the call to the scheduler, also those
+ * claimed but not yet published. Their producers are let run instead of
+ * holding the lock while waiting for them. The lock must be held, it is
+ * released while waiting.
+ */
+static void firefly_event_queue_posix_drain_claimed(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	size_t pos = __atomic_load_n(&ctx->ring_head, __ATOMIC_SEQ_CST);
+
+	firefly_event_queue_posix_drain_all(ctx);
+	while ((intptr_t) (ctx->ring_tail - pos) < 0) {
+		pthread_mutex_unlock(&ctx->lock);
+		sched_yield();
+		pthread_mutex_lock(&ctx->lock);
+		firefly_event_queue_posix_drain_all(ctx);
+	}
+}
+
+/*
+ * Tell waiting workers there may be work, all of them or one of the parked.
+ * Polling workers see the kick without a system call. Parked workers already
+ * signalled but not yet running are not signalled again. The lock must be
+ * held.
+ */
+static void firefly_event_queue_posix_signal(
+		struct firefly_event_queue_posix_context *ctx, bool all)
+{
+	int waking = __atomic_load_n(&ctx->nbr_waking, __ATOMIC_SEQ_CST);
+
+	if (ctx->nbr_spinning > 0)
+		__atomic_add_fetch(&ctx->kicks, 1, __ATOMIC_RELEASE);
+	if (ctx->nbr_parked > waking) {
+		ctx->wait_stats.nbr_wakeups++;
+		if (all) {
+			__atomic_store_n(&ctx->nbr_waking, ctx->nbr_parked,
+					__ATOMIC_SEQ_CST);
+			pthread_cond_broadcast(&ctx->signal);
+		} else {
+			__atomic_add_fetch(&ctx->nbr_waking, 1, __ATOMIC_SEQ_CST);
+			pthread_cond_signal(&ctx->signal);
+		}
+	}
+}
+
+/*
+ * Wake a parked worker. Only enters the kernel if some worker is parked and
+ * not already signalled, the offer is published before nbr_parked is read
+ * and a worker increments nbr_parked before checking for work, so one of them
+ * sees the other. A signalled worker drains the ring after taking its signal,
+ * so it picks up this offer too. Polling workers watch the ring themselves.
+ */
+static void firefly_event_queue_posix_wake(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	if (__atomic_load_n(&ctx->nbr_parked, __ATOMIC_SEQ_CST) >
+			__atomic_load_n(&ctx->nbr_waking, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&ctx->lock);
+		firefly_event_queue_posix_signal(ctx, false);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+/*
+ * Count an event as outstanding, fails if that would exceed a strict pool.
+ */
+static int firefly_event_queue_posix_reserve(struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_context *ctx)
+{
+	if (eq->event_pool_strict_size &&
+			__atomic_add_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED) >
+			eq->event_pool_size) {
+		__atomic_sub_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+		firefly_error(FIREFLY_ERROR_ALLOC, 1,
+				"No available events in the pool.");
+		return -1;
+	} else if (!eq->event_pool_strict_size) {
+		__atomic_add_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/*
+ * Offer an event through the lock-free ingress ring. Falls back to inserting
+ * under the lock when the ring is full or the event has more dependencies than
+ * fit in a slot.
+ */
+static int64_t firefly_event_queue_posix_offer(
+		struct firefly_event_queue *eq, const void *key, const void *owner,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
+		size_t context_size, firefly_event_destroy_f destroy,
 		unsigned int nbr_deps, const int64_t *deps)
 {
-	int res = 0;
 	struct firefly_event_queue_posix_context *ctx =
 		(struct firefly_event_queue_posix_context *)
 		firefly_event_queue_get_context(eq);
+	struct firefly_event_ingress *slot = NULL;
+	uint64_t enqueued;
+	size_t pos;
+	int64_t id;
 
-	res = pthread_mutex_lock(&ctx->lock);
-	if (res) {
-		return res;
+	if (context_size > FIREFLY_EVENT_ARG_SIZE) {
+		firefly_error(FIREFLY_ERROR_EVENT, 1,
+				"Event argument too large to copy.");
+		return -1;
 	}
-	res = firefly_event_add(eq, prio, execute, context, nbr_deps, deps);
-	if (res > 0) {
-		pthread_cond_signal(&ctx->signal);
+	// Stamp the offer so the time spent in the ring counts as waiting.
+	enqueued = eq->stats.clock != NULL ? eq->stats.clock() : 0;
+
+	if (firefly_event_queue_posix_reserve(eq, ctx) < 0)
+		return -1;
+	id = __atomic_add_fetch(&ctx->next_id, 1, __ATOMIC_RELAXED);
+
+	pos = __atomic_load_n(&ctx->ring_head, __ATOMIC_RELAXED);
+	while (nbr_deps <= FIREFLY_EVENT_QUEUE_MAX_DEPENDS) {
+		struct firefly_event_ingress *s = &ctx->ring[pos & ctx->ring_mask];
+		size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&ctx->ring_head, &pos, pos + 1,
+						true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				slot = s;
+				break;
+			}
+		} else if (dif < 0) {
+			break; /* Full. */
+		} else {
+			pos = __atomic_load_n(&ctx->ring_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (slot != NULL) {
+		slot->id = id;
+		slot->key = key;
+		slot->owner = owner;
+		slot->prio = prio;
+		slot->enqueued = enqueued;
+		slot->execute = execute;
+		slot->context = context;
+		slot->context_size = context_size;
+		slot->destroy = destroy;
+		if (context_size > 0)
+			memcpy(&slot->arg, context, context_size);
+		slot->nbr_deps = nbr_deps;
+		if (nbr_deps > 0)
+			memcpy(slot->deps, deps, nbr_deps * sizeof(*deps));
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+		firefly_event_queue_posix_wake(ctx);
+		return id;
+	}
+
+	// Earlier offers must be scheduled first, this one may depend on them.
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_queue_posix_drain_claimed(ctx);
+	id = firefly_event_insert(eq, id, key, owner, prio, execute, context,
+			context_size, destroy, nbr_deps, deps, enqueued);
+	if (id > 0)
+		firefly_event_queue_posix_signal(ctx, false);
+	else
+		__atomic_sub_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->lock);
+	return id;
+}
+
+int64_t firefly_event_queue_posix_add(struct firefly_event_queue *eq,
+		unsigned char prio, firefly_event_execute_f execute, void *context,
+		unsigned int nbr_deps, const int64_t *deps)
+{
+	return firefly_event_queue_posix_offer(eq, NULL, NULL, prio, execute,
+			context, 0, NULL, nbr_deps, deps);
+}
+
+int64_t firefly_event_queue_posix_add_keyed(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_deps,
+		const int64_t *deps)
+{
+	return firefly_event_queue_posix_offer(eq, key, owner, prio, execute,
+			context, context_size, destroy, nbr_deps, deps);
+}
+
+int64_t firefly_event_queue_posix_add_at(struct firefly_event_queue *eq,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline, firefly_event_execute_f execute,
+		void *context)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	int64_t id;
+
+	if (firefly_event_queue_posix_reserve(eq, ctx) < 0)
+		return -1;
+	id = __atomic_add_fetch(&ctx->next_id, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&ctx->lock);
+	id = firefly_event_insert_at(eq, id, key, owner, prio, deadline, execute,
+			context);
+	// A parked worker may have to wake up earlier than it planned.
+	if (id > 0)
+		firefly_event_queue_posix_signal(ctx, false);
+	else
+		__atomic_sub_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->lock);
+	return id;
+}
+
+int firefly_event_queue_posix_cancel(struct firefly_event_queue *eq,
+		int64_t id)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	int res;
+
+	pthread_mutex_lock(&ctx->lock);
+	// The event may be published behind an offer not yet published.
+	firefly_event_queue_posix_drain_claimed(ctx);
+	res = firefly_event_cancel(eq, id);
+	if (res == 0) {
+		__atomic_sub_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+		// Events waiting for the cancelled one may have been released.
+		if (firefly_event_queue_length(eq) > 0)
+			firefly_event_queue_posix_signal(ctx, false);
 	}
 	pthread_mutex_unlock(&ctx->lock);
 	return res;
 }
 
+size_t firefly_event_queue_posix_purge(struct firefly_event_queue *eq,
+		const void *owner)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	size_t n;
+
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_queue_posix_drain_claimed(ctx);
+	n = firefly_event_purge(eq, owner);
+	__atomic_sub_fetch(&ctx->nbr_outstanding, n, __ATOMIC_RELAXED);
+	if (n > 0 && firefly_event_queue_length(eq) > 0)
+		firefly_event_queue_posix_signal(ctx, true);
+	pthread_mutex_unlock(&ctx->lock);
+	return n;
+}
+
+/*
+ * Queue the timers that are due. Only reads the clock if there are timers, the
+ * lock must be held.
+ */
+static void firefly_event_queue_posix_expire(struct firefly_event_queue *eq)
+{
+	uint64_t deadline;
+	uint64_t now;
+
+	if (firefly_event_queue_next_timer(eq, &deadline) &&
+			deadline <= (now = firefly_event_queue_now(eq)))
+		firefly_event_queue_expire(eq, now);
+}
+
+/*
+ * Wait for a signal or, if there are timers, until the next may be due. The
+ * lock must be held.
+ */
+static void firefly_event_queue_posix_wait(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	struct timespec at;
+	uint64_t deadline;
+	uint64_t now;
+
+	if (!firefly_event_queue_next_timer(ctx->eq, &deadline)) {
+		pthread_cond_wait(&ctx->signal, &ctx->lock);
+		return;
+	}
+	now = firefly_event_queue_now(ctx->eq);
+	if (deadline <= now)
+		return;
+	// The queue clock may be any clock, only the time left is used.
+	deadline -= now;
+	clock_gettime(CLOCK_MONOTONIC, &at);
+	at.tv_sec += deadline / 1000;
+	at.tv_nsec += (deadline % 1000) * 1000000;
+	if (at.tv_nsec >= 1000000000) {
+		at.tv_sec++;
+		at.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&ctx->signal, &ctx->lock, &at);
+}
+
+static inline void firefly_event_queue_posix_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Poll for work without the lock, until an offer is published, another thread
+ * drains the ring or kicks the pollers, a timer is due or the spin time is up.
+ * The lock must be held, it is released while polling.
+ *
+ * @return Whether there may be work.
+ */
+static bool firefly_event_queue_posix_spin(
+		struct firefly_event_queue_posix_context *ctx)
+{
+	struct firefly_event_ingress *slot =
+		&ctx->ring[ctx->ring_tail & ctx->ring_mask];
+	size_t tail = ctx->ring_tail;
+	size_t published = tail + 1;
+	size_t kicks = __atomic_load_n(&ctx->kicks, __ATOMIC_RELAXED);
+	bool poll = ctx->strategy == FIREFLY_EVENT_QUEUE_POSIX_POLL;
+	uint64_t until = firefly_event_queue_posix_clock() + ctx->spin_ns;
+	uint64_t deadline;
+	bool timer;
+	bool hit = false;
+
+	timer = firefly_event_queue_next_timer(ctx->eq, &deadline);
+	ctx->nbr_spinning++;
+	ctx->wait_stats.nbr_spins++;
+	pthread_mutex_unlock(&ctx->lock);
+	for (unsigned int i = 1; !hit; i++) {
+		// The slot is recycled once drained, so a moved tail is a hit too.
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == published ||
+				__atomic_load_n(&ctx->ring_tail, __ATOMIC_ACQUIRE) != tail ||
+				__atomic_load_n(&ctx->kicks, __ATOMIC_ACQUIRE) != kicks) {
+			hit = true;
+		} else if (i % FIREFLY_EVENT_QUEUE_POSIX_SPIN_CHECK == 0) {
+			if (timer && deadline <= firefly_event_queue_now(ctx->eq))
+				hit = true;
+			else if (!poll && firefly_event_queue_posix_clock() >= until)
+				break;
+		}
+		firefly_event_queue_posix_relax();
+	}
+	pthread_mutex_lock(&ctx->lock);
+	ctx->nbr_spinning--;
+	if (hit)
+		ctx->wait_stats.nbr_spin_hits++;
+	return hit;
+}
+
 void *firefly_event_posix_thread_main(void *args)
 {
 	struct firefly_event_queue *eq =
@@ -77,28 +581,64 @@ void *firefly_event_posix_thread_main(void *args)
 	struct firefly_event_queue_posix_context *ctx =
 		firefly_event_queue_get_context(eq);
 	struct firefly_event *ev = NULL;
-	pthread_mutex_lock(&ctx->lock);
-	int event_left = firefly_event_queue_length(eq);
-	bool finish = ctx->event_loop_stop;
-	pthread_mutex_unlock(&ctx->lock);
 
-	while (!finish || event_left > 0) {
-		pthread_mutex_lock(&ctx->lock);
-		event_left = firefly_event_queue_length(eq);
-		finish = ctx->event_loop_stop;
-		while (event_left <= 0 && !finish) {
-			pthread_cond_wait(&ctx->signal, &ctx->lock);
-			finish = ctx->event_loop_stop;
-			event_left = firefly_event_queue_length(eq);
+	pthread_mutex_lock(&ctx->lock);
+	while (true) {
+		firefly_event_queue_posix_drain(ctx, FIREFLY_EVENT_QUEUE_POSIX_BATCH);
+		firefly_event_queue_posix_expire(eq);
+		/*
+		 * Events may be left in the queue that can not be popped yet, they
+		 * are waiting for events running in other workers. Those workers
+		 * will signal when returning their events.
+		 */
+		while ((ev = firefly_event_pop(eq)) == NULL) {
+			if (ctx->strategy != FIREFLY_EVENT_QUEUE_POSIX_BLOCK &&
+					!ctx->event_loop_stop) {
+				if (firefly_event_queue_posix_spin(ctx)) {
+					firefly_event_queue_posix_drain(ctx,
+							FIREFLY_EVENT_QUEUE_POSIX_BATCH);
+					firefly_event_queue_posix_expire(eq);
+					continue;
+				}
+				// Events may have been queued while the lock was released.
+				if ((ev = firefly_event_pop(eq)) != NULL)
+					break;
+			}
+			__atomic_add_fetch(&ctx->nbr_parked, 1, __ATOMIC_SEQ_CST);
+			if (firefly_event_queue_posix_ring_ready(ctx)) {
+				__atomic_sub_fetch(&ctx->nbr_parked, 1, __ATOMIC_SEQ_CST);
+				firefly_event_queue_posix_drain(ctx,
+						FIREFLY_EVENT_QUEUE_POSIX_BATCH);
+				continue;
+			}
+			if (ctx->event_loop_stop &&
+					firefly_event_queue_posix_ring_empty(ctx) &&
+					firefly_event_queue_length(eq) == 0) {
+				__atomic_sub_fetch(&ctx->nbr_parked, 1, __ATOMIC_SEQ_CST);
+				firefly_event_queue_posix_signal(ctx, true);
+				pthread_mutex_unlock(&ctx->lock);
+				return NULL;
+			}
+			ctx->wait_stats.nbr_parks++;
+			firefly_event_queue_posix_wait(ctx);
+			/*
+			 * Timeouts and spurious wake-ups may take the signal of another
+			 * worker, that only costs it an extra signal later.
+			 */
+			if (ctx->nbr_waking > 0)
+				__atomic_sub_fetch(&ctx->nbr_waking, 1, __ATOMIC_SEQ_CST);
+			__atomic_sub_fetch(&ctx->nbr_parked, 1, __ATOMIC_SEQ_CST);
+			firefly_event_queue_posix_drain(ctx,
+					FIREFLY_EVENT_QUEUE_POSIX_BATCH);
+			firefly_event_queue_posix_expire(eq);
 		}
-		ev = firefly_event_pop(eq);
 		pthread_mutex_unlock(&ctx->lock);
-		if (ev != NULL) {
-			firefly_event_execute(ev);
-			pthread_mutex_lock(&ctx->lock);
-			firefly_event_return(eq, &ev);
-			pthread_mutex_unlock(&ctx->lock);
-		}
+		firefly_event_execute(ev);
+		pthread_mutex_lock(&ctx->lock);
+		firefly_event_return(eq, &ev);
+		__atomic_sub_fetch(&ctx->nbr_outstanding, 1, __ATOMIC_RELAXED);
+		if (ctx->nbr_workers > 1 && firefly_event_queue_length(eq) > 0)
+			firefly_event_queue_posix_signal(ctx, false);
 	}
 	return NULL;
 }
@@ -109,8 +649,10 @@ int firefly_event_queue_posix_run(struct firefly_event_queue *eq,
 	int res = 0;
 	struct firefly_event_queue_posix_context *ctx =
 		firefly_event_queue_get_context(eq);
-	res = pthread_create(
-			&ctx->event_loop, attr, firefly_event_posix_thread_main, eq);
+	for (size_t i = 0; i < ctx->nbr_workers && res == 0; i++) {
+		res = pthread_create(&ctx->event_loops[i], attr,
+				firefly_event_posix_thread_main, eq);
+	}
 	return res;
 }
 
@@ -120,8 +662,76 @@ int firefly_event_queue_posix_stop(struct firefly_event_queue *eq)
 		firefly_event_queue_get_context(eq);
 	pthread_mutex_lock(&ctx->lock);
 	ctx->event_loop_stop = true;
-	pthread_cond_signal(&ctx->signal);
+	firefly_event_queue_posix_signal(ctx, true);
+	pthread_mutex_unlock(&ctx->lock);
+	int res = 0;
+	for (size_t i = 0; i < ctx->nbr_workers; i++) {
+		int r = pthread_join(ctx->event_loops[i], NULL);
+		if (r != 0)
+			res = r;
+	}
+	return res;
+}
+
+struct firefly_event_queue_stats *firefly_event_queue_posix_stats_get(
+		struct firefly_event_queue *eq)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	struct firefly_event_queue_stats *stats;
+
+	pthread_mutex_lock(&ctx->lock);
+	// Count the offers still in the ring as queued.
+	firefly_event_queue_posix_drain_all(ctx);
+	stats = firefly_event_queue_stats_get(eq);
+	pthread_mutex_unlock(&ctx->lock);
+	return stats;
+}
+
+void firefly_event_queue_posix_stats_reset(struct firefly_event_queue *eq)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+
+	pthread_mutex_lock(&ctx->lock);
+	firefly_event_queue_stats_reset(eq);
+	ctx->wait_stats = (struct firefly_event_queue_posix_wait_stats) {0};
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void firefly_event_queue_posix_set_wait_strategy(struct firefly_event_queue *eq,
+		enum firefly_event_queue_posix_wait_strategy strategy,
+		unsigned int spin_us)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->strategy = strategy;
+	ctx->spin_ns = (uint64_t) spin_us * 1000;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void firefly_event_queue_posix_wait_stats_get(struct firefly_event_queue *eq,
+		struct firefly_event_queue_posix_wait_stats *stats)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+
+	pthread_mutex_lock(&ctx->lock);
+	*stats = ctx->wait_stats;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+int firefly_event_queue_posix_stats_name(struct firefly_event_queue *eq,
+		firefly_event_execute_f execute, const char *name)
+{
+	struct firefly_event_queue_posix_context *ctx =
+		firefly_event_queue_get_context(eq);
+	int res;
+
+	pthread_mutex_lock(&ctx->lock);
+	res = firefly_event_queue_stats_name(eq, execute, name);
 	pthread_mutex_unlock(&ctx->lock);
-	int res = pthread_join(ctx->event_loop, NULL);
 	return res;
 }
@@ -0,0 +1,62 @@
+/**
+ * @file
+ * @brief Private declarations for the posix event queue.
+ */
+
+#ifndef EVENT_QUEUE_POSIX_PRIVATE_H
+#define EVENT_QUEUE_POSIX_PRIVATE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <utils/firefly_event_queue.h>
+#include <utils/firefly_event_queue_posix.h>
+
+#include "utils/firefly_event_queue_private.h"
+
+/**
+ * @brief An offered event waiting in the ingress ring.
+ */
+struct firefly_event_ingress {
+	size_t seq; /**< The ticket of the slot, tells whether it is free or
+				  holds a published event. */
+	int64_t id; /**< The ID given to the event when offered. */
+	const void *key; /**< The affinity key of the event. */
+	const void *owner; /**< The owner of the event. */
+	unsigned char prio; /**< The priority of the event. */
+	uint64_t enqueued; /**< When the event was offered, if timed. */
+	firefly_event_execute_f execute; /**< The function of the event. */
+	void *context; /**< The argument of the event. */
+	size_t context_size; /**< The size of the argument copied into arg. */
+	union firefly_event_arg arg; /**< The copied argument, if any. */
+	firefly_event_destroy_f destroy; /**< The destructor of the event. */
+	unsigned int nbr_deps; /**< The number of dependencies in deps. */
+	int64_t deps[FIREFLY_EVENT_QUEUE_MAX_DEPENDS]; /**< The dependencies. */
+};
+
+/**
+ * @brief The context of a posix event queue.
+ */
+struct firefly_event_queue_posix_context {
+	pthread_mutex_t lock;
+	pthread_cond_t signal;
+	pthread_t *event_loops;
+	size_t nbr_workers;
+	bool event_loop_stop;
+	struct firefly_event_ingress *ring; /* Bounded MPSC ring of offers. */
+	size_t ring_mask;
+	size_t ring_head; /* Next ticket to claim, producers only. */
+	size_t ring_tail; /* Next ticket to drain, written under lock. */
+	int64_t next_id; /* Last ID given to an offered event. */
+	size_t nbr_outstanding; /* Offered events not yet returned. */
+	int nbr_parked; /* Workers waiting on signal. */
+	int nbr_waking; /* Signals not yet taken by a parked worker. */
+	int nbr_spinning; /* Workers polling, under lock. */
+	size_t kicks; /* Bumped under lock to end the polls of workers. */
+	enum firefly_event_queue_posix_wait_strategy strategy;
+	uint64_t spin_ns; /* How long to poll before parking. */
+	struct firefly_event_queue_posix_wait_stats wait_stats; /* Under lock. */
+	struct firefly_event_queue *eq;
+};
+#endif
@@ -16,23 +16,212 @@
 #include <stdint.h>
 #endif
 
+/**
+ * @brief The number of distinct event priorities, one per value of an
+ * unsigned char.
+ */
+#define FIREFLY_EVENT_QUEUE_NBR_PRIOS (256)
+
+/**
+ * @brief The number of 32 bit words needed to hold one bit per priority.
+ */
+#define FIREFLY_EVENT_QUEUE_PRIO_WORDS (FIREFLY_EVENT_QUEUE_NBR_PRIOS / 32)
+
+/**
+ * @brief The assumed size of a cache line, events in the pool are aligned to
+ * it and never share a line.
+ */
+#define FIREFLY_EVENT_QUEUE_CACHE_LINE (64)
+
+/**
+ * @brief A contiguous block of events in the pool. Slabs are only allocated,
+ * when the pool grows, and freed with the queue.
+ */
+struct firefly_event_slab {
+	struct firefly_event_slab *next; /**< The previously allocated slab. */
+};
+
+/**
+ * @brief A FIFO of events sharing the same priority.
+ */
+struct firefly_event_bucket {
+	struct firefly_event *head; /**< The oldest event in the bucket. */
+	struct firefly_event *tail; /**< The newest event in the bucket. */
+};
+
+/**
+ * @brief The state of an event taken from the pool.
+ */
+enum firefly_event_state {
+	FIREFLY_EVENT_FREE, /**< The event is in the pool. */
+	FIREFLY_EVENT_READY, /**< The event is queued and may be popped. */
+	FIREFLY_EVENT_BLOCKED, /**< The event is queued but waits for other
+							 events to finish. */
+	FIREFLY_EVENT_HELD, /**< The event is queued but held back since another
+						  event with the same key is running. */
+	FIREFLY_EVENT_RUNNING, /**< The event is popped but not yet returned. */
+	FIREFLY_EVENT_TIMED /**< The event waits in the timer wheel for its
+						  deadline. */
+};
+
+/**
+ * @brief The number of slots in the index of affinity keys.
+ */
+#define FIREFLY_EVENT_QUEUE_KEY_INDEX_SIZE (64)
+
+/**
+ * @brief The scheduling state of an affinity key, only present while an
+ * event with the key is running or held back.
+ */
+struct firefly_event_key {
+	const void *key; /**< The affinity key. */
+	bool busy; /**< Whether an event with this key is running or the key is
+				 handed over to a held event. */
+	struct firefly_event *handoff; /**< The held event the key is handed over
+									 to, if any. */
+	struct firefly_event *held; /**< The events held back waiting for the key,
+								  oldest first. */
+	struct firefly_event *held_last; /**< The last event in held. */
+	struct firefly_event_key *next; /**< The next key in the same slot of the
+									  key index or in the pool. */
+};
+
+/**
+ * @brief An edge in the dependency graph, one per dependency of an event on
+ * another unfinished event.
+ */
+struct firefly_event_dep {
+	struct firefly_event *waiter; /**< The event waiting for prereq. */
+	struct firefly_event *prereq; /**< The event waited for. */
+	struct firefly_event_dep *next_waiter; /**< The next edge in the waiter
+											 list of prereq. */
+	struct firefly_event_dep *prev_waiter; /**< The previous edge in the
+											 waiter list of prereq. */
+	struct firefly_event_dep *next_prereq; /**< The next edge in the prereq
+											 list of waiter. */
+	struct firefly_event_dep *prev_prereq; /**< The previous edge in the
+											 prereq list of waiter. */
+};
+
+/**
+ * @brief The number of bits of a deadline resolved by each level of the timer
+ * wheel.
+ */
+#define FIREFLY_EVENT_WHEEL_BITS (6)
+
+/**
+ * @brief The number of slots in each level of the timer wheel.
+ */
+#define FIREFLY_EVENT_WHEEL_SLOTS (1 << FIREFLY_EVENT_WHEEL_BITS)
+
+/**
+ * @brief The number of levels of the timer wheel. Deadlines further away than
+ * the wheel spans, 2^24 ms or about 4.6 hours, are parked in the last slot
+ * it reaches and placed again when that slot is cascaded.
+ */
+#define FIREFLY_EVENT_WHEEL_LEVELS (4)
+
+/**
+ * @brief A hierarchical timer wheel with millisecond ticks.
+ *
+ * Level 0 has one slot per millisecond, level n one slot per 64^n
+ * milliseconds. A timer is placed in the lowest level whose span covers the
+ * time left to its deadline and is moved down a level, cascaded, when the
+ * wheel reaches its slot. Slots are doubly linked lists through the next and
+ * prev pointers of the events, making both insertion and cancellation
+ * constant time.
+ */
+struct firefly_event_wheel {
+	uint64_t now; /**< The next tick to expire, every timer with an earlier
+					deadline has been moved to the buckets. */
+	size_t nbr_timers; /**< The number of events in the wheel. */
+	uint64_t occupied[FIREFLY_EVENT_WHEEL_LEVELS]; /**< One bit per slot,
+						set if the slot is non-empty. */
+	struct firefly_event *slots[FIREFLY_EVENT_WHEEL_LEVELS]
+		[FIREFLY_EVENT_WHEEL_SLOTS]; /**< The timers of each slot. */
+};
+
+/**
+ * @brief The statistics kept by an event queue.
+ */
+struct firefly_event_stats {
+	firefly_event_clock_f clock; /**< The clock timing events, if any. */
+	size_t depth_high; /**< The largest number of events in the queue. */
+	size_t pool_in_use_high; /**< The largest number of events in use. */
+	uint64_t pool_grows; /**< The number of times the pool has grown. */
+	uint64_t nbr_added; /**< The number of events added. */
+	uint64_t nbr_returned; /**< The number of events popped and returned. */
+	uint64_t nbr_dropped; /**< The number of events cancelled or purged. */
+	struct firefly_event_stats_entry *prios[FIREFLY_EVENT_QUEUE_NBR_PRIOS];
+						/**< The times per priority, allocated once the
+						  priority is first popped. */
+	struct firefly_event_stats_entry *funcs; /**< Hash table of the times per
+						execute function, FIREFLY_EVENT_STATS_FUNCS slots
+						followed by one for the functions not fitting,
+						allocated when first used. */
+};
+
 /**
  * @brief An event queue
  *
- * This is a priority queue, the events are placed in order upon insertion.
+ * This is a priority queue. Each priority has its own FIFO bucket and a two
+ * level bitmap keeps track of which buckets are non-empty, making both
+ * insertion and finding the first event constant time operations.
+ *
+ * Only events whose dependencies are finished are kept in the buckets. The
+ * others are blocked, reachable through the waiter lists of the events they
+ * depend on, and are moved to their bucket once the last of those events is
+ * returned to the queue. Unfinished events are indexed by ID to resolve
+ * dependencies when new events are added.
+ *
+ * When scheduling by affinity key, popped events whose key is busy are held
+ * on the key and the oldest is put first in its bucket again when the key is
+ * released.
+ *
+ * Timer events wait in a timer wheel and are put in their bucket once their
+ * deadline has passed, see firefly_event_queue_expire().
  */
 struct firefly_event_queue {
-	struct firefly_event *head; /**< Reference to the first event in
-						the queue. */
+	struct firefly_event_bucket buckets[FIREFLY_EVENT_QUEUE_NBR_PRIOS]; /**<
+						One FIFO per priority. */
+	uint32_t prio_map[FIREFLY_EVENT_QUEUE_PRIO_WORDS]; /**< One bit per
+						priority, set if the bucket is non-empty. */
+	uint32_t prio_map_summary; /**< One bit per word in prio_map, set if
+						the word is non-zero. */
+	size_t nbr_events; /**< The number of ready and blocked events. */
+	struct firefly_event **id_index; /**< Hash table of unfinished events
+									   keyed by ID. */
+	size_t id_index_size; /**< The number of slots in id_index, always a
+							power of two. */
+	struct firefly_event_dep *dep_pool; /**< Free list of dependency edges. */
+	struct firefly_event_key *key_index[FIREFLY_EVENT_QUEUE_KEY_INDEX_SIZE];
+						/**< Hash table of busy affinity keys. */
+	struct firefly_event_key *key_pool; /**< Free list of key states. */
 	firefly_offer_event offer_event_cb; /**< The callback used for adding
 							new events. */
+	firefly_offer_keyed_event offer_keyed_event_cb; /**< The callback used for
+							adding new events with an affinity key or a
+							copied argument, may be NULL. */
+	firefly_offer_event_at offer_event_at_cb; /**< The callback used for
+							adding timer events, may be NULL. */
+	firefly_cancel_event cancel_event_cb; /**< The callback used for
+							cancelling events, may be NULL. */
+	firefly_purge_events purge_events_cb; /**< The callback used for
+							purging the events of an owner, may be NULL. */
+	bool by_key; /**< Whether events are scheduled by affinity key. */
 	int64_t event_id; /**< Counter to keep track of used event ID's. */
-	struct firefly_event **event_pool; /**< A pre-allocated pool of events. */
+	struct firefly_event *event_pool; /**< The free list of pre-allocated
+										events. */
+	struct firefly_event_slab *event_slabs; /**< The slabs holding the
+											  events of the pool, newest
+											  first. */
 	size_t event_pool_size; /**< The number of events in the pool. */
 	size_t event_pool_in_use; /**< The number of events currently in use in the
 								event queue. */
 	bool event_pool_strict_size; /**< Whether or not the pool will grow on
 								   demand or keep the size constant. */
+	struct firefly_event_stats stats; /**< Statistics of the queue. */
+	struct firefly_event_wheel wheel; /**< The timer events not yet due. */
 	void *context; /**< A application defined context for this queue.
 							  Possibly a mutex. */
 };
@@ -46,15 +235,42 @@ struct firefly_event_queue {
 struct firefly_event {
 	unsigned char prio; /**< The priority of the event, higher value means
 					higher priority. */
+	unsigned char eff_prio; /**< The effective priority of the event, at
+							  least prio but possibly inherited from events
+							  depending on this one. */
+	enum firefly_event_state state; /**< Where in the queue the event is. */
 	int64_t id; /**< The unique identifier of this event. */
 	firefly_event_execute_f execute; /**< The function to call when the
 						event is executed. */
 	void *context; /**< The context passed to firefly_event_execute_f() when
 				the event is executed. */
-	int64_t depends[FIREFLY_EVENT_QUEUE_MAX_DEPENDS]; /**< The IDs of the events
-														this event depends on.
-														*/
-	struct firefly_event *next; /**< The next event. */
+	const void *key; /**< The affinity key of the event, may be NULL. */
+	const void *owner; /**< What else the event is purged with, may be
+						 NULL. */
+	firefly_event_destroy_f destroy; /**< Called with the context if the
+									   event is dropped unexecuted. */
+	unsigned int nbr_unsatisfied; /**< The number of unfinished events this
+									event depends on. */
+	struct firefly_event_dep *prereqs; /**< The edges to the unfinished
+										 events this event depends on. */
+	struct firefly_event_dep *waiters; /**< The edges from the events
+										 depending on this event. */
+	struct firefly_event_dep *waiters_last; /**< The last edge in waiters. */
+	struct firefly_event *index_next; /**< The next event in the same slot of
+										the ID index. */
+	struct firefly_event *next; /**< The next event in the same bucket, slot
+								  of the timer wheel, held on the same key or
+								  in the pool. */
+	struct firefly_event *prev; /**< The previous event in the same bucket,
+								  slot of the timer wheel or held on the same
+								  key. */
+	uint64_t deadline; /**< When a timer event is due, in milliseconds. */
+	unsigned int timer_slot; /**< The level and slot of the timer wheel a
+							   timer event is in, level * 64 + slot. */
+	uint64_t enqueued; /**< When the event was offered, if timed. */
+	uint64_t started; /**< When the event was popped, if timed. */
+	union firefly_event_arg arg; /**< Storage for the context when it is
+								   copied into the event. */
 };
 
 /**
@@ -68,24 +284,81 @@ struct firefly_event {
 struct firefly_event *firefly_event_take(struct firefly_event_queue *eq);
 
 /**
- * @brief Frees the memory used by the event
+ * @brief Initializes an allocated event without any dependencies.
  *
- * @param ev The event to free.
+ * @param ev The event to initialize.
+ * @param id The ID to give the event.
+ * @param prio The priority of the event.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
  */
-void firefly_event_free(struct firefly_event *ev);
+void firefly_event_init(struct firefly_event *ev, int64_t id, unsigned char prio,
+		firefly_event_execute_f execute, void *context);
 
 /**
- * @brief Initializes an allocated event.
+ * @brief Insert an event with a given ID into the queue.
  *
- * @param ev The event to initialize.
- * @param id The ID to give the event.
+ * Used by queue implementations assigning IDs themselves, the caller must make
+ * sure the ID is unique among unfinished events. Otherwise the same as
+ * firefly_event_add_keyed().
+ *
+ * @param eq The queue to insert the event into.
+ * @param id The ID of the new event, must be positive.
+ * @param key The affinity key of the event, may be NULL.
+ * @param owner What else the event is purged with, may be NULL.
  * @param prio The priority of the event.
  * @param execute The function called when the firefly_event is executed.
  * @param context The argument passed to the execute function when called.
+ * @param context_size If non-zero, the number of bytes of \p context to copy
+ * into the event.
+ * @param destroy Called with the context if the event is dropped, may be
+ * NULL.
  * @param nbr_depends The number of dependecies this event has.
  * @param depends The list of IDs of events this event depends on.
+ * @param enqueued The time the event was offered according to the clock of
+ * the queue, or 0 to use the current time.
+ * @return The ID of the event.
+ * @retval <0 on error.
  */
-void firefly_event_init(struct firefly_event *ev, int64_t id, unsigned char prio,
-		firefly_event_execute_f execute, void *context,
-		unsigned int nbr_depends, const int64_t *depends);
+int64_t firefly_event_insert(struct firefly_event_queue *eq, int64_t id,
+		const void *key, const void *owner, unsigned char prio,
+		firefly_event_execute_f execute, void *context, size_t context_size,
+		firefly_event_destroy_f destroy, unsigned int nbr_depends,
+		const int64_t *depends, uint64_t enqueued);
+
+/**
+ * @brief Get the first event in the queue without removing it.
+ *
+ * The first event is the oldest ready event of the highest effective
+ * priority, i.e. the event firefly_event_pop() would return.
+ *
+ * @param eq The queue to look in.
+ * @return The first event in the queue.
+ * @retval NULL if the queue is empty.
+ */
+struct firefly_event *firefly_event_queue_top(struct firefly_event_queue *eq);
+
+/**
+ * @brief Insert a timer event with a given ID into the queue.
+ *
+ * Used by queue implementations assigning IDs themselves, the caller must make
+ * sure the ID is unique among unfinished events. Otherwise the same as
+ * firefly_event_add_at().
+ *
+ * @param eq The queue to insert the event into.
+ * @param id The ID of the new event, must be positive.
+ * @param key The affinity key of the event, may be NULL.
+ * @param owner What else the event is purged with, may be NULL.
+ * @param prio The priority of the event.
+ * @param deadline The time the event is due, in milliseconds on the clock of
+ * the queue.
+ * @param execute The function called when the firefly_event is executed.
+ * @param context The argument passed to the execute function when called.
+ * @return The ID of the event.
+ * @retval <0 on error.
+ */
+int64_t firefly_event_insert_at(struct firefly_event_queue *eq, int64_t id,
+		const void *key, const void *owner, unsigned char prio,
+		uint64_t deadline,
+		firefly_event_execute_f execute, void *context);
 #endif
@@ -20,6 +20,11 @@ int64_t firefly_event_queue_vx_add(struct firefly_event_queue *eq,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
 		unsigned int nbr_deps, const int64_t *deps);
 
+int firefly_event_queue_vx_cancel(struct firefly_event_queue *eq, int64_t id);
+
+size_t firefly_event_queue_vx_purge(struct firefly_event_queue *eq,
+		const void *owner);
+
 struct firefly_event_queue *firefly_event_queue_vx_new(size_t pool_size)
 {
 	struct firefly_event_queue_vx_context *ctx = NULL;
@@ -56,6 +61,8 @@ struct firefly_event_queue *firefly_event_queue_vx_new(size_t pool_size)
 		eq = firefly_event_queue_new(firefly_event_queue_vx_add, pool_size, ctx);
 		if (!eq)
 			goto fail;
+		firefly_event_queue_set_cancel(eq, firefly_event_queue_vx_cancel,
+				firefly_event_queue_vx_purge);
 	}
 
 	return eq;
@@ -103,6 +110,33 @@ int64_t firefly_event_queue_vx_add(struct firefly_event_queue *eq,
 	return res;
 }
 
+int firefly_event_queue_vx_cancel(struct firefly_event_queue *eq, int64_t id)
+{
+	int res;
+	struct firefly_event_queue_vx_context *ctx;
+
+	ctx = firefly_event_queue_get_context(eq);
+	semTake(ctx->lock, WAIT_FOREVER);
+	res = firefly_event_cancel(eq, id);
+	semGive(ctx->lock);
+
+	return res;
+}
+
+size_t firefly_event_queue_vx_purge(struct firefly_event_queue *eq,
+		const void *owner)
+{
+	size_t n;
+	struct firefly_event_queue_vx_context *ctx;
+
+	ctx = firefly_event_queue_get_context(eq);
+	semTake(ctx->lock, WAIT_FOREVER);
+	n = firefly_event_purge(eq, owner);
+	semGive(ctx->lock);
+
+	return n;
+}
+
 void *firefly_event_vx_thread_main(void *args)
 {
 	struct firefly_event_queue *eq;
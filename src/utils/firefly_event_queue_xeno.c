@@ -22,6 +22,12 @@ int64_t firefly_event_queue_xeno_add(struct firefly_event_queue *eq,
 		unsigned char prio, firefly_event_execute_f execute, void *context,
 		unsigned int nbr_deps, const int64_t *deps);
 
+int firefly_event_queue_xeno_cancel(struct firefly_event_queue *eq,
+		int64_t id);
+
+size_t firefly_event_queue_xeno_purge(struct firefly_event_queue *eq,
+		const void *owner);
+
 struct firefly_event_queue *firefly_event_queue_xeno_new(size_t pool_size,
 		int prio, RTIME timeout)
 {
@@ -45,6 +51,9 @@ struct firefly_event_queue *firefly_event_queue_xeno_new(size_t pool_size,
 	ctx->timeout = timeout;
 	struct firefly_event_queue *eq =
 		firefly_event_queue_new(firefly_event_queue_xeno_add, pool_size, ctx);
+	if (eq != NULL)
+		firefly_event_queue_set_cancel(eq, firefly_event_queue_xeno_cancel,
+				firefly_event_queue_xeno_purge);
 	return eq;
 }
 
@@ -95,6 +104,41 @@ int64_t firefly_event_queue_xeno_add(struct firefly_event_queue *eq,
 	return res;
 }
 
+int firefly_event_queue_xeno_cancel(struct firefly_event_queue *eq,
+		int64_t id)
+{
+	int res;
+	struct firefly_event_queue_xeno_context *ctx =
+		(struct firefly_event_queue_xeno_context *)
+		firefly_event_queue_get_context(eq);
+
+	res = rt_mutex_acquire(&ctx->lock, ctx->timeout);
+	if (res) {
+		fprintf(stderr, "Could not get event lock.\n");
+		return res;
+	}
+	res = firefly_event_cancel(eq, id);
+	rt_mutex_release(&ctx->lock);
+	return res;
+}
+
+size_t firefly_event_queue_xeno_purge(struct firefly_event_queue *eq,
+		const void *owner)
+{
+	size_t n;
+	struct firefly_event_queue_xeno_context *ctx =
+		(struct firefly_event_queue_xeno_context *)
+		firefly_event_queue_get_context(eq);
+
+	if (rt_mutex_acquire(&ctx->lock, ctx->timeout)) {
+		fprintf(stderr, "Could not get event lock.\n");
+		return 0;
+	}
+	n = firefly_event_purge(eq, owner);
+	rt_mutex_release(&ctx->lock);
+	return n;
+}
+
 void firefly_event_xeno_thread_main(void *args)
 {
 	int err;
@@ -0,0 +1,129 @@
+/**
+ * @file
+ * @brief Implementation of the reference counted packet buffers.
+ */
+#include "utils/firefly_packet.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "protocol/firefly_protocol_private.h"
+
+struct firefly_packet_pool *firefly_packet_pool_new(size_t capacity)
+{
+	struct firefly_packet_pool *pool;
+
+	pool = FIREFLY_MALLOC(sizeof(*pool));
+	if (pool != NULL) {
+		pool->free = NULL;
+		pool->nbr_free = 0;
+		pool->capacity = capacity;
+		pool->refs = 1;
+	}
+	return pool;
+}
+
+static void firefly_packet_pool_release(struct firefly_packet_pool *pool)
+{
+	struct firefly_packet *pkt;
+
+	if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	pkt = pool->free;
+	while (pkt != NULL) {
+		struct firefly_packet *next = pkt->next;
+
+		FIREFLY_FREE(pkt);
+		pkt = next;
+	}
+	FIREFLY_FREE(pool);
+}
+
+void firefly_packet_pool_free(struct firefly_packet_pool *pool)
+{
+	if (pool != NULL)
+		firefly_packet_pool_release(pool);
+}
+
+static struct firefly_packet *firefly_packet_alloc(size_t capacity)
+{
+	struct firefly_packet *pkt;
+
+	pkt = FIREFLY_MALLOC(sizeof(*pkt) + capacity);
+	if (pkt != NULL) {
+		pkt->pool = NULL;
+		pkt->next = NULL;
+		pkt->capacity = capacity;
+	}
+	return pkt;
+}
+
+struct firefly_packet *firefly_packet_get(struct firefly_packet_pool *pool)
+{
+	struct firefly_packet *pkt;
+
+	/*
+	 * Only the owner pops, so the head can not be popped and pushed back
+	 * by someone else between the load and the exchange.
+	 */
+	pkt = __atomic_load_n(&pool->free, __ATOMIC_ACQUIRE);
+	while (pkt != NULL && !__atomic_compare_exchange_n(&pool->free, &pkt,
+				pkt->next, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		;
+	if (pkt != NULL) {
+		__atomic_sub_fetch(&pool->nbr_free, 1, __ATOMIC_RELAXED);
+	} else {
+		pkt = firefly_packet_alloc(pool->capacity);
+		if (pkt == NULL)
+			return NULL;
+		pkt->pool = pool;
+	}
+	__atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+	pkt->refs = 1;
+	pkt->offset = 0;
+	pkt->size = 0;
+	return pkt;
+}
+
+struct firefly_packet *firefly_packet_new(size_t capacity)
+{
+	struct firefly_packet *pkt;
+
+	pkt = firefly_packet_alloc(capacity);
+	if (pkt != NULL) {
+		pkt->refs = 1;
+		pkt->offset = 0;
+		pkt->size = 0;
+	}
+	return pkt;
+}
+
+struct firefly_packet *firefly_packet_ref(struct firefly_packet *pkt)
+{
+	__atomic_add_fetch(&pkt->refs, 1, __ATOMIC_RELAXED);
+	return pkt;
+}
+
+void firefly_packet_release(struct firefly_packet *pkt)
+{
+	struct firefly_packet_pool *pool;
+
+	if (__atomic_sub_fetch(&pkt->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	pool = pkt->pool;
+	if (pool == NULL) {
+		FIREFLY_FREE(pkt);
+		return;
+	}
+	if (__atomic_add_fetch(&pool->nbr_free, 1, __ATOMIC_RELAXED) >
+			FIREFLY_PACKET_POOL_MAX_FREE) {
+		__atomic_sub_fetch(&pool->nbr_free, 1, __ATOMIC_RELAXED);
+		FIREFLY_FREE(pkt);
+	} else {
+		pkt->next = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&pool->free, &pkt->next, pkt,
+					false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	firefly_packet_pool_release(pool);
+}
@@ -0,0 +1,112 @@
+/**
+ * @file
+ * @brief Reference counted packet buffers and the pools they are taken from.
+ *
+ * The transport writer of a connection encodes each packet into a buffer
+ * taken from the pool of the connection. The transport sends it from there
+ * and the resend queue keeps a reference to important packets instead of a
+ * copy. A sample encoded on a channel is encoded into a packet after room
+ * left for its header, which is written in front of it when it is sent. A
+ * packet goes back to its pool when its last reference is released, from any
+ * thread.
+ */
+
+#ifndef FIREFLY_PACKET_H
+#define FIREFLY_PACKET_H
+
+#include <stdlib.h>
+
+/**
+ * @brief The largest number of free packets kept by a pool, more are freed
+ * when they are released.
+ */
+#define FIREFLY_PACKET_POOL_MAX_FREE (16)
+
+struct firefly_packet_pool;
+
+/**
+ * @brief A reference counted packet buffer.
+ */
+struct firefly_packet {
+	struct firefly_packet_pool *pool; /**< The pool the packet returns to,
+										NULL if it was allocated alone. */
+	struct firefly_packet *next; /**< The next free packet in the pool. */
+	size_t refs; /**< The number of references to the packet. */
+	size_t offset; /**< The start of the packet in data, room may be left
+					 before it for headers filled in later. */
+	size_t size; /**< The size of the packet starting at offset. */
+	size_t capacity; /**< The size of data. */
+	unsigned char data[]; /**< The packet. */
+};
+
+/**
+ * @brief A pool of packets of the same capacity.
+ *
+ * Only the owner of the pool may take packets from it, any thread may
+ * release them. The pool is freed when its owner has freed it and all its
+ * packets are released.
+ */
+struct firefly_packet_pool {
+	struct firefly_packet *free; /**< The free packets, a stack pushed to by
+								   any thread and popped by the owner. */
+	size_t nbr_free; /**< The number of packets in free. */
+	size_t capacity; /**< The capacity of the packets. */
+	size_t refs; /**< One reference held by the owner and one by each packet
+				   taken from the pool. */
+};
+
+/**
+ * @brief Allocate a new pool.
+ *
+ * @param capacity The capacity of the packets of the pool.
+ * @return The new pool.
+ * @retval NULL on allocation failure.
+ */
+struct firefly_packet_pool *firefly_packet_pool_new(size_t capacity);
+
+/**
+ * @brief Release the owner's reference to the pool. The pool is freed once
+ * all of its packets are released as well.
+ *
+ * @param pool The pool to free.
+ */
+void firefly_packet_pool_free(struct firefly_packet_pool *pool);
+
+/**
+ * @brief Take a packet from a pool, or allocate a new one if the pool has no
+ * free packets.
+ *
+ * Must only be called by the owner of the pool.
+ *
+ * @param pool The pool to take the packet from.
+ * @return The packet with one reference, offset 0 and size 0.
+ * @retval NULL on allocation failure.
+ */
+struct firefly_packet *firefly_packet_get(struct firefly_packet_pool *pool);
+
+/**
+ * @brief Allocate a packet not belonging to any pool.
+ *
+ * @param capacity The capacity of the packet.
+ * @return The packet with one reference, offset 0 and size 0.
+ * @retval NULL on allocation failure.
+ */
+struct firefly_packet *firefly_packet_new(size_t capacity);
+
+/**
+ * @brief Take another reference to a packet.
+ *
+ * @param pkt The packet.
+ * @return The packet.
+ */
+struct firefly_packet *firefly_packet_ref(struct firefly_packet *pkt);
+
+/**
+ * @brief Release a reference to a packet. The last release returns the packet
+ * to its pool or frees it.
+ *
+ * @param pkt The packet to release.
+ */
+void firefly_packet_release(struct firefly_packet *pkt);
+
+#endif
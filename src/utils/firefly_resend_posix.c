@@ -16,12 +16,27 @@ struct resend_queue *firefly_resend_queue_new()
 {
 	struct resend_queue *rq;
 
+	pthread_condattr_t attr;
+
 	rq = malloc(sizeof(*rq));
 	if (rq) {
+		rq->index = calloc(FIREFLY_RESEND_INDEX_MIN, sizeof(*rq->index));
+		rq->heap = malloc(FIREFLY_RESEND_INDEX_MIN * sizeof(*rq->heap));
+		if (rq->index == NULL || rq->heap == NULL) {
+			free(rq->index);
+			free(rq->heap);
+			free(rq);
+			return NULL;
+		}
+		rq->index_size = FIREFLY_RESEND_INDEX_MIN;
+		rq->heap_size = FIREFLY_RESEND_INDEX_MIN;
+		rq->nbr_elems = 0;
 		rq->next_id = 1;
-		rq->first = NULL;
-		rq->last = NULL;
-		pthread_cond_init(&rq->sig, NULL);
+		// Deadlines are on the monotonic clock, unaffected by clock changes.
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&rq->sig, &attr);
+		pthread_condattr_destroy(&attr);
 		pthread_mutex_init(&rq->lock, NULL);
 	}
 
@@ -30,17 +45,13 @@ struct resend_queue *firefly_resend_queue_new()
 
 void firefly_resend_queue_free(struct resend_queue *rq)
 {
-	struct resend_elem *re = rq->first;
-	struct resend_elem *tmp;
-
-	while(re != NULL) {
-		tmp = re->prev;
-		firefly_resend_elem_free(re);
-		re = tmp;
-	}
+	for (size_t i = 0; i < rq->nbr_elems; i++)
+		firefly_resend_elem_free(rq->heap[i]);
 
 	pthread_cond_destroy(&rq->sig);
 	pthread_mutex_destroy(&rq->lock);
+	free(rq->index);
+	free(rq->heap);
 	free(rq);
 }
 
@@ -56,105 +67,285 @@ static inline void timespec_add_ms(struct timespec *t, long d)
 	t->tv_nsec = tmp;
 }
 
-unsigned char firefly_resend_add(struct resend_queue *rq,
-		unsigned char *data, size_t size, long timeout_ms,
+static inline long timespec_diff_us(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000L +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static inline bool timespec_before(struct timespec *t, struct timespec *u)
+{
+	return t->tv_sec == u->tv_sec ?
+		t->tv_nsec < u->tv_nsec : t->tv_sec < u->tv_sec;
+}
+
+void firefly_resend_rto_init(struct firefly_resend_rto *rto, long timeout_ms,
+		unsigned char retries)
+{
+	rto->srtt = 0;
+	rto->rttvar = 0;
+	rto->timeout = timeout_ms;
+	rto->retries = retries;
+}
+
+void firefly_resend_rto_sample(struct firefly_resend_rto *rto, long rtt_us)
+{
+	long var;
+	long timeout;
+
+	if (rtt_us < 0)
+		return;
+	if (rtt_us == 0)
+		rtt_us = 1;
+	if (rto->srtt == 0) {
+		rto->srtt = rtt_us;
+		rto->rttvar = rtt_us / 2;
+	} else {
+		long err = rtt_us - rto->srtt;
+
+		rto->rttvar += ((err < 0 ? -err : err) - rto->rttvar) / 4;
+		rto->srtt += err / 8;
+	}
+	// The variation term is at least the 1 ms granularity of timeouts.
+	var = 4 * rto->rttvar < 1000 ? 1000 : 4 * rto->rttvar;
+	timeout = (rto->srtt + var + 999) / 1000;
+	if (timeout < FIREFLY_RESEND_TIMEOUT_MIN)
+		timeout = FIREFLY_RESEND_TIMEOUT_MIN;
+	else if (timeout > FIREFLY_RESEND_TIMEOUT_MAX)
+		timeout = FIREFLY_RESEND_TIMEOUT_MAX;
+	rto->timeout = timeout;
+}
+
+/*
+ * The slot of an ID in the index. IDs are handed out in sequence so the low
+ * bits spread them evenly.
+ */
+static inline struct resend_elem **firefly_resend_slot(
+		struct resend_queue *rq, uint32_t id)
+{
+	return &rq->index[id & (rq->index_size - 1)];
+}
+
+static struct resend_elem *firefly_resend_find(struct resend_queue *rq,
+		uint32_t id)
+{
+	struct resend_elem *re = *firefly_resend_slot(rq, id);
+
+	while (re != NULL && re->id != id)
+		re = re->index_next;
+	return re;
+}
+
+/*
+ * Double the index when it holds more packets than slots. On allocation
+ * failure the old index is kept, only with longer chains.
+ */
+static void firefly_resend_index_grow(struct resend_queue *rq)
+{
+	struct resend_elem **old = rq->index;
+	size_t old_size = rq->index_size;
+	struct resend_elem **index;
+
+	index = calloc(old_size * 2, sizeof(*index));
+	if (index == NULL)
+		return;
+	rq->index = index;
+	rq->index_size = old_size * 2;
+	for (size_t i = 0; i < old_size; i++) {
+		struct resend_elem *re = old[i];
+
+		while (re != NULL) {
+			struct resend_elem *next = re->index_next;
+			struct resend_elem **slot = firefly_resend_slot(rq, re->id);
+
+			re->index_next = *slot;
+			*slot = re;
+			re = next;
+		}
+	}
+	free(old);
+}
+
+static void firefly_resend_index_remove(struct resend_queue *rq,
+		struct resend_elem *re)
+{
+	struct resend_elem **link = firefly_resend_slot(rq, re->id);
+
+	while (*link != re)
+		link = &(*link)->index_next;
+	*link = re->index_next;
+}
+
+static inline void firefly_resend_heap_set(struct resend_queue *rq,
+		size_t pos, struct resend_elem *re)
+{
+	rq->heap[pos] = re;
+	re->heap_pos = pos;
+}
+
+static void firefly_resend_sift_up(struct resend_queue *rq, size_t pos)
+{
+	struct resend_elem *re = rq->heap[pos];
+
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+
+		if (!timespec_before(&re->resend_at, &rq->heap[parent]->resend_at))
+			break;
+		firefly_resend_heap_set(rq, pos, rq->heap[parent]);
+		pos = parent;
+	}
+	firefly_resend_heap_set(rq, pos, re);
+}
+
+static void firefly_resend_sift_down(struct resend_queue *rq, size_t pos)
+{
+	struct resend_elem *re = rq->heap[pos];
+	size_t child;
+
+	while ((child = 2 * pos + 1) < rq->nbr_elems) {
+		if (child + 1 < rq->nbr_elems &&
+				timespec_before(&rq->heap[child + 1]->resend_at,
+					&rq->heap[child]->resend_at))
+			child++;
+		if (!timespec_before(&rq->heap[child]->resend_at, &re->resend_at))
+			break;
+		firefly_resend_heap_set(rq, pos, rq->heap[child]);
+		pos = child;
+	}
+	firefly_resend_heap_set(rq, pos, re);
+}
+
+/*
+ * Restore the heap after the deadline of the packet at pos changed.
+ */
+static void firefly_resend_heap_fix(struct resend_queue *rq, size_t pos)
+{
+	struct resend_elem *re = rq->heap[pos];
+
+	firefly_resend_sift_up(rq, pos);
+	firefly_resend_sift_down(rq, re->heap_pos);
+}
+
+static void firefly_resend_heap_remove(struct resend_queue *rq,
+		struct resend_elem *re)
+{
+	struct resend_elem *last = rq->heap[--rq->nbr_elems];
+
+	if (last != re) {
+		firefly_resend_heap_set(rq, re->heap_pos, last);
+		firefly_resend_heap_fix(rq, last->heap_pos);
+	}
+}
+
+uint32_t firefly_resend_add(struct resend_queue *rq,
+		struct firefly_packet *pkt, long timeout_ms,
 		unsigned char retries, struct firefly_connection *conn)
 {
 	struct resend_elem *re = malloc(sizeof(*re));
+	struct resend_elem **slot;
 	if (re == NULL) {
 		return 0;
 	}
-	re->data = data;
-	re->size = size;
-	clock_gettime(CLOCK_REALTIME, &re->resend_at);
+	re->pkt = firefly_packet_ref(pkt);
+	clock_gettime(CLOCK_MONOTONIC, &re->sent_at);
+	re->resend_at = re->sent_at;
 	timespec_add_ms(&re->resend_at, timeout_ms);
 	re->num_retries = retries;
+	re->resent = false;
 	re->conn = conn;
 	re->timeout = timeout_ms;
-	re->prev = NULL;
 	pthread_mutex_lock(&rq->lock);
-	re->id = rq->next_id++;
-	if (rq->next_id == 0) {
-		rq->next_id = 1;
-	}
-	if (rq->last == NULL) {
-		rq->first = re;
-	} else {
-		rq->last->prev = re;
+	if (rq->nbr_elems == rq->heap_size) {
+		struct resend_elem **heap;
+
+		heap = realloc(rq->heap, rq->heap_size * 2 * sizeof(*heap));
+		if (heap == NULL) {
+			pthread_mutex_unlock(&rq->lock);
+			firefly_resend_elem_free(re);
+			return 0;
+		}
+		rq->heap = heap;
+		rq->heap_size *= 2;
 	}
-	rq->last = re;
-	pthread_cond_signal(&rq->sig);
+	// Skip 0 and, once the IDs have wrapped, IDs still in the queue.
+	do {
+		re->id = rq->next_id++;
+		if (rq->next_id == 0) {
+			rq->next_id = 1;
+		}
+	} while (firefly_resend_find(rq, re->id) != NULL);
+	if (rq->nbr_elems >= rq->index_size)
+		firefly_resend_index_grow(rq);
+	slot = firefly_resend_slot(rq, re->id);
+	re->index_next = *slot;
+	*slot = re;
+	rq->heap[rq->nbr_elems] = re;
+	firefly_resend_sift_up(rq, rq->nbr_elems++);
+	// Only a new first packet moves the deadline of the resend loop.
+	if (rq->heap[0] == re)
+		pthread_cond_signal(&rq->sig);
 	pthread_mutex_unlock(&rq->lock);
 	return re->id;
 }
 
 static inline struct resend_elem *firefly_resend_pop(
-		struct resend_queue *rq, unsigned char id)
+		struct resend_queue *rq, uint32_t id)
 {
-	struct resend_elem *re = rq->first;
-	// If queue is empty return NULL
-	if (re == NULL)
-		return NULL;
-	// If first elem remove it and return it
-	if (re->id == id) {
-		rq->first = re->prev;
-		if (rq->last == re) {
-			rq->last = NULL;
-		}
-		return re;
-	}
-	while (re->prev != NULL) {
-		if (re->prev->id == id) {
-			struct resend_elem *tmp = re->prev;
-			re->prev = re->prev->prev;
-			if (rq->last == tmp) {
-				rq->last = re;
-			}
-			return tmp;
-		} else {
-			re = re->prev;
-		}
+	struct resend_elem *re = firefly_resend_find(rq, id);
+
+	if (re != NULL) {
+		firefly_resend_index_remove(rq, re);
+		firefly_resend_heap_remove(rq, re);
 	}
-	return NULL;
+	return re;
 }
 
-void firefly_resend_readd(struct resend_queue *rq, unsigned char id)
+void firefly_resend_readd(struct resend_queue *rq, uint32_t id)
 {
-	pthread_mutex_lock(&rq->lock);
-	struct resend_elem *re = firefly_resend_pop(rq, id);
-	pthread_mutex_unlock(&rq->lock);
-	if (re == NULL)
-		return;
-
-	// Decrement retries counter
-	re->num_retries--;
+	struct resend_elem *re;
 
-	timespec_add_ms(&re->resend_at, re->timeout);
-	re->prev = NULL;
 	pthread_mutex_lock(&rq->lock);
-	if (rq->last == NULL) {
-		rq->first = re;
-	} else {
-		rq->last->prev = re;
+	re = firefly_resend_find(rq, id);
+	if (re != NULL) {
+		// Decrement retries counter
+		re->num_retries--;
+		re->resent = true;
+
+		// Back off exponentially while the packet is not acked.
+		if (re->timeout <= FIREFLY_RESEND_TIMEOUT_MAX / 2)
+			re->timeout *= 2;
+		else if (re->timeout < FIREFLY_RESEND_TIMEOUT_MAX)
+			re->timeout = FIREFLY_RESEND_TIMEOUT_MAX;
+		timespec_add_ms(&re->resend_at, re->timeout);
+		firefly_resend_heap_fix(rq, re->heap_pos);
+		pthread_cond_signal(&rq->sig);
 	}
-	rq->last = re;
-	pthread_cond_signal(&rq->sig);
 	pthread_mutex_unlock(&rq->lock);
 }
 
-void firefly_resend_remove(struct resend_queue *rq, unsigned char id)
+long firefly_resend_remove(struct resend_queue *rq, uint32_t id)
 {
+	struct timespec now;
+	long rtt = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	pthread_mutex_lock(&rq->lock);
 	struct resend_elem *re = firefly_resend_pop(rq, id);
-	if (re != NULL)
+	if (re != NULL) {
+		// Karn's algorithm, the ack of a resent packet may be for any send.
+		if (!re->resent)
+			rtt = timespec_diff_us(&re->sent_at, &now);
 		firefly_resend_elem_free(re);
+	}
 	pthread_cond_signal(&rq->sig);
 	pthread_mutex_unlock(&rq->lock);
+	return rtt;
 }
 
 void firefly_resend_elem_free(struct resend_elem *re)
 {
-	free(re->data);
+	firefly_packet_release(re->pkt);
 	free(re);
 }
 
@@ -162,7 +353,7 @@ struct resend_elem *firefly_resend_top(struct resend_queue *rq)
 {
 	struct resend_elem *re = NULL;
 	pthread_mutex_lock(&rq->lock);
-	re = rq->first;
+	re = rq->nbr_elems > 0 ? rq->heap[0] : NULL;
 	pthread_mutex_unlock(&rq->lock);
 	return re;
 }
@@ -174,17 +365,17 @@ static inline bool timespec_past(struct timespec *fixed, struct timespec *var)
 }
 
 int firefly_resend_wait(struct resend_queue *rq,
-		unsigned char **data, size_t *size,
+		struct firefly_packet **pkt,
 		struct firefly_connection **conn,
-		unsigned char *id)
+		uint32_t *id)
 {
 	int result;
 	struct resend_elem *res = NULL;
 	struct timespec now;
 
 	pthread_mutex_lock(&rq->lock);
-	clock_gettime(CLOCK_REALTIME, &now);
-	res = rq->first;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	res = rq->nbr_elems > 0 ? rq->heap[0] : NULL;
 	while (res == NULL || !timespec_past(&now, &res->resend_at)) {
 		if (res == NULL) {
 			pthread_cond_wait(&rq->sig, &rq->lock);
@@ -192,22 +383,20 @@ int firefly_resend_wait(struct resend_queue *rq,
 			struct timespec at = res->resend_at;
 			pthread_cond_timedwait(&rq->sig, &rq->lock, &at);
 		}
-		clock_gettime(CLOCK_REALTIME, &now);
-		res = rq->first;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		res = rq->nbr_elems > 0 ? rq->heap[0] : NULL;
 	}
 	*conn = res->conn;
 	// Check if counter has reached 0
 	if (res->num_retries <= 0) {
 		firefly_resend_pop(rq, res->id);
 		firefly_resend_elem_free(res);
-		*data = NULL;
+		*pkt = NULL;
 		*id = 0;
-		*size = 0;
 		result = -1;
 	} else {
-		*data = malloc(res->size);
-		memcpy(*data, res->data, res->size);
-		*size = res->size;
+		// A reference, the packet may be acked while it is sent.
+		*pkt = firefly_packet_ref(res->pkt);
 		*id = res->id;
 		result = 0;
 	}
@@ -230,10 +419,9 @@ void *firefly_resend_run(void *args)
 {
 	struct firefly_resend_loop_args *largs;
 	struct resend_queue *rq;
-	unsigned char *data;
-	size_t size;
+	struct firefly_packet *pkt;
 	struct firefly_connection *conn;
-	unsigned char id;
+	uint32_t id;
 	int res;
 
 	largs = args;
@@ -244,15 +432,15 @@ void *firefly_resend_run(void *args)
 	while (true) {
 		int prev_state;
 
-		res = firefly_resend_wait(rq, &data, &size, &conn, &id);
+		res = firefly_resend_wait(rq, &pkt, &conn, &id);
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &prev_state);
 		if (res < 0) {
 			if (largs->on_no_ack)
 				largs->on_no_ack(conn);
 		} else {
-			conn->transport->write(data, size, conn,
-					false, NULL);
-			free(data);
+			conn->transport->write(pkt->data + pkt->offset, pkt->size,
+					conn, false, NULL);
+			firefly_packet_release(pkt);
 			firefly_resend_readd(rq, id);
 		}
 		pthread_setcancelstate(prev_state, NULL);
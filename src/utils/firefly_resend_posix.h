@@ -1,36 +1,105 @@
 #ifndef FIREFLY_TRANSPORT_RESEND_QUEUE_H
 #define FIREFLY_TRANSPORT_RESEND_QUEUE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <protocol/firefly_protocol.h>
 
+#include "utils/firefly_packet.h"
+
+/**
+ * @brief The smallest number of slots in the ID index of a resend queue.
+ */
+#define FIREFLY_RESEND_INDEX_MIN (64)
+
+/**
+ * @brief The largest interval in ms between resends of a packet, the limit
+ * of its backoff and of the estimated timeout.
+ */
+#define FIREFLY_RESEND_TIMEOUT_MAX (60000)
+
+/**
+ * @brief The smallest estimated timeout in ms.
+ */
+#define FIREFLY_RESEND_TIMEOUT_MIN (10)
+
 /**
  * @brief Represents a packet in the resend queue.
  */
 struct resend_elem {
-	unsigned char *data; /**< The data of the packet. */
-	size_t size; /**< The size of the data. */
-	unsigned char id; /**< The unique identifier of this packet in its queue. */
-	struct timespec resend_at; /**< The absolute time when this packet must be
-								 sent again. */
-	long timeout; /**< The interval between resends for this packet. */
+	struct firefly_packet *pkt; /**< The packet, referenced by the queue. */
+	uint32_t id; /**< The unique identifier of this packet in its queue. */
+	struct timespec resend_at; /**< The absolute time on CLOCK_MONOTONIC when
+								 this packet must be sent again. */
+	struct timespec sent_at; /**< The time on CLOCK_MONOTONIC when this
+							   packet was added. */
+	long timeout; /**< The interval between resends for this packet, doubled
+					on each resend. */
 	unsigned char num_retries; /**< Number of times left this packet will be
 								 sent until it is removed. */
+	bool resent; /**< True if this packet has been sent again, its ack then
+				   gives no round trip time. */
 	struct firefly_connection *conn; /**< The connection this packet comes from. */
-	struct resend_elem *prev; /**< The next packet in the queue. */
+	size_t heap_pos; /**< The position of this packet in the heap. */
+	struct resend_elem *index_next; /**< The next packet in the same slot of
+									  the ID index. */
 };
 
 /**
- * @brief The resend queue itself (as a single linked list).
+ * @brief The resend queue itself, a binary min-heap ordered by the time each
+ * packet must be sent again, with its packets indexed by ID.
  */
 struct resend_queue {
-	struct resend_elem *first; /**< The first element in the queue. */
-	struct resend_elem *last; /**< The last element in the queue. */
+	struct resend_elem **heap; /**< The packets, heap[0] is the one to send
+								 first. */
+	size_t heap_size; /**< The number of slots in heap. */
 	pthread_mutex_t lock; /**< The lock ensuring mutual exclusion when using the
 							queue. */
-	pthread_cond_t sig; /**< Signal used to signal when new packet is added. */
-	unsigned char next_id; /**< Counter keeping track of IDs. */
+	pthread_cond_t sig; /**< Signal used to signal when new packet is added,
+						  waits on CLOCK_MONOTONIC. */
+	uint32_t next_id; /**< Counter keeping track of IDs. */
+	struct resend_elem **index; /**< The packets hashed by ID. */
+	size_t index_size; /**< The number of slots in index, a power of 2. */
+	size_t nbr_elems; /**< The number of packets in the queue. */
 };
 
+/**
+ * @brief The retransmission timeout of a connection, estimated from the round
+ * trip times of its acked packets like TCP does (RFC 6298).
+ *
+ * It is kept by the transport connection and only used by the events of its
+ * connection.
+ */
+struct firefly_resend_rto {
+	long srtt; /**< The smoothed round trip time in us, 0 before the first
+				 sample. */
+	long rttvar; /**< The round trip time variation in us. */
+	long timeout; /**< The timeout in ms to give new packets. */
+	unsigned char retries; /**< The number of resends of a packet before
+							 giving up. */
+};
+
+/**
+ * @brief Initialize the timeout of a connection.
+ *
+ * @param rto The timeout to initialize.
+ * @param timeout_ms The timeout to use until the first round trip time is
+ * measured.
+ * @param retries The number of resends of a packet before giving up.
+ */
+void firefly_resend_rto_init(struct firefly_resend_rto *rto, long timeout_ms,
+		unsigned char retries);
+
+/**
+ * @brief Update the timeout of a connection with a measured round trip time.
+ *
+ * @param rto The timeout to update.
+ * @param rtt_us The round trip time in us as returned by
+ * #firefly_resend_remove(), negative values are ignored.
+ */
+void firefly_resend_rto_sample(struct firefly_resend_rto *rto, long rtt_us);
+
 /**
  * @brief Allocates memory and initializes the elements in the new resend queue
  * struct.
@@ -53,20 +122,20 @@ struct resend_queue *firefly_resend_queue_new();
 void firefly_resend_queue_free(struct resend_queue *rq);
 
 /**
- * @brief Adds a new element to the back of the provided resend queue with the
- * specified parameters.
+ * @brief Adds a new element to the provided resend queue with the specified
+ * parameters, it is due after \p timeout_ms.
  *
  * @param rq      The queue to add the element to.
- * @param data    The data to resend.
- * @param size    The size of the data to resend.
+ * @param pkt     The packet to resend, the queue takes a reference to it.
  * @param timeout_ms      The time to wait before resending this packet.
  * @param retries The number of retries before giving up.
  * @param conn    The connection to resend on.
  *
- * @return The id assigned to the created resend block.
+ * @return The id assigned to the created resend block, never 0.
+ * @retval 0 on allocation failure.
  */
-unsigned char firefly_resend_add(struct resend_queue *rq,
-		unsigned char *data, size_t size, long timeout_ms,
+uint32_t firefly_resend_add(struct resend_queue *rq,
+		struct firefly_packet *pkt, long timeout_ms,
 		unsigned char retries, struct firefly_connection *conn);
 
 /**
@@ -74,19 +143,23 @@ unsigned char firefly_resend_add(struct resend_queue *rq,
  *
  * @param rq The resend queue to remove from.
  * @param id The id of the packet to remove as returned by firefly_resend_add()
+ * @return The time in us since the packet was added.
+ * @retval -1 if the packet was not found or has been resent, its round trip
+ * time is then unknown.
  * @see firefly_resend_add()
+ * @see firefly_resend_rto_sample()
  */
-void firefly_resend_remove(struct resend_queue *rq, unsigned char id);
+long firefly_resend_remove(struct resend_queue *rq, uint32_t id);
 
 /**
- * @brief Free's a packet including its data.
+ * @brief Free's a packet and releases its reference to the packet buffer.
  *
  * @param re The packet to free.
  */
 void firefly_resend_elem_free(struct resend_elem *re);
 
 /**
- * @brief Returns, but does not remove, the first element from the queue.
+ * @brief Returns, but does not remove, the element due first in the queue.
  *
  * @param rq The resend_queue to search through.
  *
@@ -96,14 +169,12 @@ void firefly_resend_elem_free(struct resend_elem *re);
 struct resend_elem *firefly_resend_top(struct resend_queue *rq);
 
 /**
- * @brief Wait until it is time to resend the next packet and get the data
- * associated with that packet.
+ * @brief Wait until it is time to resend the next packet and get a reference
+ * to that packet.
  *
  * @param rq The resend queue to wait on packets in.
- * @param data Result parameter, a pointer to a pointer of data. The memory will
- * be allocated and set by this function.
- * @param size Result parameter, a pointer to the variable the size of the data
- * will be saved in.
+ * @param pkt Result parameter. The packet to send again, the caller must
+ * release it with #firefly_packet_release().
  * @param conn Result parameter. The pointed to pointer will be set to the
  * connection the returned data shall be sent on.
  * @param id Result parameter. The ID of the packet returned.
@@ -112,28 +183,29 @@ struct resend_elem *firefly_resend_top(struct resend_queue *rq);
  * @return Integer indicating result.
  * @retval 0 If a packet was returned and should be sent again.
  * @retval <0 If a packet was found but its number of retries was exceeded. In
- * this case the parameters \p data, \p size and \p id will be set
- * to \c NULL, \c 0 and \c 0 respectively and the parameter \p conn will
+ * this case the parameters \p pkt and \p id will be set to \c NULL and
+ * \c 0 respectively and the parameter \p conn will
  * be set to the connection the packet was associated with.
  * @note The packet will remain in its place in the queue after this operation.
  * @see #firefly_resend_readd()
  */
-int firefly_resend_wait(struct resend_queue *rq, unsigned char **data,
-		size_t *size, struct firefly_connection **conn, unsigned char *id);
+int firefly_resend_wait(struct resend_queue *rq, struct firefly_packet **pkt,
+		struct firefly_connection **conn, uint32_t *id);
 
 /**
  * @brief Add a timeout to a packet already in the resend queue.
  *
- * Add to queue again, add timeout to resend_at, return -1 if retries reached 0
+ * The timeout of the packet is doubled, up to #FIREFLY_RESEND_TIMEOUT_MAX, and
+ * added to resend_at. The number of retries left is decremented.
+ *
  * @param rq The resend queue the packet is in.
  * @param id The id of the packet to add the timeout to.
- * @param timeout_ms The timeout in ms to add to the packet.
  *
  * @note This function must be called after calling #firefly_resend_wait() to
- * push the packet to the back of the queue.
+ * move the packet to its new place in the queue.
  * @see #firefly_resend_wait()
  */
-void firefly_resend_readd(struct resend_queue *rq, unsigned char id);
+void firefly_resend_readd(struct resend_queue *rq, uint32_t id);
 
 /**
  * @brief The argument to #firefly_resend_run.
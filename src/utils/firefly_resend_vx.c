@@ -19,9 +19,18 @@ struct resend_queue *firefly_resend_queue_new()
 
 	rq = malloc(sizeof(*rq));
 	if (rq) {
+		rq->index = calloc(FIREFLY_RESEND_INDEX_MIN, sizeof(*rq->index));
+		rq->heap = malloc(FIREFLY_RESEND_INDEX_MIN * sizeof(*rq->heap));
+		if (!rq->index || !rq->heap) {
+			free(rq->index);
+			free(rq->heap);
+			free(rq);
+			return NULL;
+		}
+		rq->index_size = FIREFLY_RESEND_INDEX_MIN;
+		rq->heap_size = FIREFLY_RESEND_INDEX_MIN;
+		rq->nbr_elems = 0;
 		rq->next_id = 1;
-		rq->first = NULL;
-		rq->last = NULL;
 		rq->lock = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
 		rq->sig = semCCreate(0, 0);
 	}
@@ -31,19 +40,13 @@ struct resend_queue *firefly_resend_queue_new()
 
 void firefly_resend_queue_free(struct resend_queue *rq)
 {
-	struct resend_elem *re;
-
-	re = rq->first;
-	while (re) {
-		struct resend_elem *tmp;
-
-		tmp = re->prev;
-		firefly_resend_elem_free(re);
-		re = tmp;
-	}
+	for (size_t i = 0; i < rq->nbr_elems; i++)
+		firefly_resend_elem_free(rq->heap[i]);
 
 	semDelete(rq->lock);
 	semDelete(rq->sig);
+	free(rq->index);
+	free(rq->heap);
 	free(rq);
 }
 
@@ -59,120 +62,310 @@ static inline void timespec_add_ms(struct timespec *t, long d)
 	t->tv_nsec = tmp;
 }
 
-unsigned char firefly_resend_add(struct resend_queue *rq,
-		unsigned char *data, size_t size, long timeout_ms,
+static inline long timespec_diff_us(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000L +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static inline bool timespec_before(struct timespec *t, struct timespec *u)
+{
+	return t->tv_sec == u->tv_sec ?
+		t->tv_nsec < u->tv_nsec : t->tv_sec < u->tv_sec;
+}
+
+void firefly_resend_rto_init(struct firefly_resend_rto *rto, long timeout_ms,
+		unsigned char retries)
+{
+	rto->srtt = 0;
+	rto->rttvar = 0;
+	rto->timeout = timeout_ms;
+	rto->retries = retries;
+}
+
+void firefly_resend_rto_sample(struct firefly_resend_rto *rto, long rtt_us)
+{
+	long var;
+	long timeout;
+
+	if (rtt_us < 0)
+		return;
+	if (rtt_us == 0)
+		rtt_us = 1;
+	if (rto->srtt == 0) {
+		rto->srtt = rtt_us;
+		rto->rttvar = rtt_us / 2;
+	} else {
+		long err;
+
+		err = rtt_us - rto->srtt;
+		rto->rttvar += ((err < 0 ? -err : err) - rto->rttvar) / 4;
+		rto->srtt += err / 8;
+	}
+	/* The variation term is at least the 1 ms granularity of timeouts. */
+	var = 4 * rto->rttvar < 1000 ? 1000 : 4 * rto->rttvar;
+	timeout = (rto->srtt + var + 999) / 1000;
+	if (timeout < FIREFLY_RESEND_TIMEOUT_MIN)
+		timeout = FIREFLY_RESEND_TIMEOUT_MIN;
+	else if (timeout > FIREFLY_RESEND_TIMEOUT_MAX)
+		timeout = FIREFLY_RESEND_TIMEOUT_MAX;
+	rto->timeout = timeout;
+}
+
+/*
+ * The slot of an ID in the index. IDs are handed out in sequence so the low
+ * bits spread them evenly.
+ */
+static inline struct resend_elem **firefly_resend_slot(
+		struct resend_queue *rq, uint32_t id)
+{
+	return &rq->index[id & (rq->index_size - 1)];
+}
+
+static struct resend_elem *firefly_resend_find(struct resend_queue *rq,
+		uint32_t id)
+{
+	struct resend_elem *re;
+
+	re = *firefly_resend_slot(rq, id);
+	while (re && re->id != id)
+		re = re->index_next;
+	return re;
+}
+
+/*
+ * Double the index when it holds more packets than slots. On allocation
+ * failure the old index is kept, only with longer chains.
+ */
+static void firefly_resend_index_grow(struct resend_queue *rq)
+{
+	struct resend_elem **old;
+	struct resend_elem **index;
+	size_t old_size;
+
+	old = rq->index;
+	old_size = rq->index_size;
+	index = calloc(old_size * 2, sizeof(*index));
+	if (!index)
+		return;
+	rq->index = index;
+	rq->index_size = old_size * 2;
+	for (size_t i = 0; i < old_size; i++) {
+		struct resend_elem *re;
+
+		re = old[i];
+		while (re) {
+			struct resend_elem *next;
+			struct resend_elem **slot;
+
+			next = re->index_next;
+			slot = firefly_resend_slot(rq, re->id);
+			re->index_next = *slot;
+			*slot = re;
+			re = next;
+		}
+	}
+	free(old);
+}
+
+static void firefly_resend_index_remove(struct resend_queue *rq,
+		struct resend_elem *re)
+{
+	struct resend_elem **link;
+
+	link = firefly_resend_slot(rq, re->id);
+	while (*link != re)
+		link = &(*link)->index_next;
+	*link = re->index_next;
+}
+
+static inline void firefly_resend_heap_set(struct resend_queue *rq,
+		size_t pos, struct resend_elem *re)
+{
+	rq->heap[pos] = re;
+	re->heap_pos = pos;
+}
+
+static void firefly_resend_sift_up(struct resend_queue *rq, size_t pos)
+{
+	struct resend_elem *re;
+
+	re = rq->heap[pos];
+	while (pos > 0) {
+		size_t parent;
+
+		parent = (pos - 1) / 2;
+		if (!timespec_before(&re->resend_at, &rq->heap[parent]->resend_at))
+			break;
+		firefly_resend_heap_set(rq, pos, rq->heap[parent]);
+		pos = parent;
+	}
+	firefly_resend_heap_set(rq, pos, re);
+}
+
+static void firefly_resend_sift_down(struct resend_queue *rq, size_t pos)
+{
+	struct resend_elem *re;
+	size_t child;
+
+	re = rq->heap[pos];
+	while ((child = 2 * pos + 1) < rq->nbr_elems) {
+		if (child + 1 < rq->nbr_elems &&
+				timespec_before(&rq->heap[child + 1]->resend_at,
+					&rq->heap[child]->resend_at))
+			child++;
+		if (!timespec_before(&rq->heap[child]->resend_at, &re->resend_at))
+			break;
+		firefly_resend_heap_set(rq, pos, rq->heap[child]);
+		pos = child;
+	}
+	firefly_resend_heap_set(rq, pos, re);
+}
+
+/*
+ * Restore the heap after the deadline of the packet at pos changed.
+ */
+static void firefly_resend_heap_fix(struct resend_queue *rq, size_t pos)
+{
+	struct resend_elem *re;
+
+	re = rq->heap[pos];
+	firefly_resend_sift_up(rq, pos);
+	firefly_resend_sift_down(rq, re->heap_pos);
+}
+
+static void firefly_resend_heap_remove(struct resend_queue *rq,
+		struct resend_elem *re)
+{
+	struct resend_elem *last;
+
+	last = rq->heap[--rq->nbr_elems];
+	if (last != re) {
+		firefly_resend_heap_set(rq, re->heap_pos, last);
+		firefly_resend_heap_fix(rq, last->heap_pos);
+	}
+}
+
+uint32_t firefly_resend_add(struct resend_queue *rq,
+		struct firefly_packet *pkt, long timeout_ms,
 		unsigned char retries, struct firefly_connection *conn)
 {
 	struct resend_elem *re;
+	struct resend_elem **slot;
+	bool first;
 
 	re = malloc(sizeof(*re));
 	if (!re)
 		return 0;
 
-	re->data = (char *) data;
-	re->size = size;
-	clock_gettime(CLOCK_REALTIME, &re->resend_at);
+	re->pkt = firefly_packet_ref(pkt);
+	clock_gettime(CLOCK_MONOTONIC, &re->sent_at);
+	re->resend_at = re->sent_at;
 	timespec_add_ms(&re->resend_at, timeout_ms);
 	re->num_retries = retries;
+	re->resent = false;
 	re->conn = conn;
 	re->timeout = timeout_ms;
-	re->prev = NULL;
 
-	/* printf("WAITING FOR RQ LOCK\n"); */
 	semTake(rq->lock, WAIT_FOREVER);
-	/* printf("TOOK RQ LOCK\n"); */
-	re->id = rq->next_id++;
-	if (rq->next_id == 0) {
-		rq->next_id = 1;
-	}
-	if (rq->last == NULL) {
-		rq->first = re;
-	} else {
-		rq->last->prev = re;
+	if (rq->nbr_elems == rq->heap_size) {
+		struct resend_elem **heap;
+
+		heap = realloc(rq->heap, rq->heap_size * 2 * sizeof(*heap));
+		if (!heap) {
+			semGive(rq->lock);
+			firefly_resend_elem_free(re);
+			return 0;
+		}
+		rq->heap = heap;
+		rq->heap_size *= 2;
 	}
-	rq->last = re;
+	// Skip 0 and, once the IDs have wrapped, IDs still in the queue.
+	do {
+		re->id = rq->next_id++;
+		if (rq->next_id == 0) {
+			rq->next_id = 1;
+		}
+	} while (firefly_resend_find(rq, re->id));
+	if (rq->nbr_elems >= rq->index_size)
+		firefly_resend_index_grow(rq);
+	slot = firefly_resend_slot(rq, re->id);
+	re->index_next = *slot;
+	*slot = re;
+	rq->heap[rq->nbr_elems] = re;
+	firefly_resend_sift_up(rq, rq->nbr_elems++);
+	first = rq->heap[0] == re;
 	semGive(rq->lock);
-	semGive(rq->sig);
+	/* Only a new first packet moves the deadline of the resend loop. */
+	if (first)
+		semGive(rq->sig);
 
 	return re->id;
 }
 
 static inline struct resend_elem *firefly_resend_pop(
-		struct resend_queue *rq, unsigned char id)
+		struct resend_queue *rq, uint32_t id)
 {
 	struct resend_elem *re;
 
-	re = rq->first;
-	if (!re)
-		return NULL;
-
-	// If first elem remove it and return it
-	if (re->id == id) {
-		rq->first = re->prev;
-		if (rq->last == re)
-			rq->last = NULL;
-		return re;
+	re = firefly_resend_find(rq, id);
+	if (re) {
+		firefly_resend_index_remove(rq, re);
+		firefly_resend_heap_remove(rq, re);
 	}
-	while (re->prev) {
-		if (re->prev->id == id) {
-			struct resend_elem *tmp;
-
-			tmp = re->prev;
-			re->prev = re->prev->prev;
-			if (rq->last == tmp) {
-				rq->last = re;
-			}
-			return tmp;
-		} else {
-			re = re->prev;
-		}
-	}
-	return NULL;
+	return re;
 }
 
-void firefly_resend_readd(struct resend_queue *rq, unsigned char id)
+void firefly_resend_readd(struct resend_queue *rq, uint32_t id)
 {
 	struct resend_elem *re;
 
 	semTake(rq->lock, WAIT_FOREVER);
-	re = firefly_resend_pop(rq, id);
-	semGive(rq->lock);
-
-	if (!re)
+	re = firefly_resend_find(rq, id);
+	if (!re) {
+		semGive(rq->lock);
 		return;
+	}
 
 	re->num_retries--;
+	re->resent = true;
 
+	/* Back off exponentially while the packet is not acked. */
+	if (re->timeout <= FIREFLY_RESEND_TIMEOUT_MAX / 2)
+		re->timeout *= 2;
+	else if (re->timeout < FIREFLY_RESEND_TIMEOUT_MAX)
+		re->timeout = FIREFLY_RESEND_TIMEOUT_MAX;
 	timespec_add_ms(&re->resend_at, re->timeout);
-	re->prev = NULL;
-
-	semTake(rq->lock, WAIT_FOREVER);
-	if (rq->last == NULL) {
-		rq->first = re;
-	} else {
-		rq->last->prev = re;
-	}
-	rq->last = re;
+	firefly_resend_heap_fix(rq, re->heap_pos);
 	semGive(rq->lock);
 	semGive(rq->sig);
 }
 
-void firefly_resend_remove(struct resend_queue *rq, unsigned char id)
+long firefly_resend_remove(struct resend_queue *rq, uint32_t id)
 {
 	struct resend_elem *re;
+	struct timespec now;
+	long rtt;
 
-	/* printf("%s\n", __func__); */
+	rtt = -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	semTake(rq->lock, WAIT_FOREVER);
 	re = firefly_resend_pop(rq, id);
-	if (re != NULL)
+	if (re != NULL) {
+		/* Karn's algorithm, the ack of a resent packet may be for any send. */
+		if (!re->resent)
+			rtt = timespec_diff_us(&re->sent_at, &now);
 		firefly_resend_elem_free(re);
+	}
 	semGive(rq->lock);
 	semGive(rq->sig);
+
+	return rtt;
 }
 
 void firefly_resend_elem_free(struct resend_elem *re)
 {
-	free(re->data);
+	firefly_packet_release(re->pkt);
 	free(re);
 }
 
@@ -182,7 +375,7 @@ struct resend_elem *firefly_resend_top(struct resend_queue *rq)
 	struct resend_elem *re = NULL;
 	
 	semTake(rq->lock, WAIT_FOREVER);
-	re = rq->first;
+	re = rq->nbr_elems > 0 ? rq->heap[0] : NULL;
 	semGive(rq->lock);
 
 	return re;
@@ -195,17 +388,17 @@ static inline bool timespec_past(struct timespec *fixed, struct timespec *var)
 }
 
 int firefly_resend_wait(struct resend_queue *rq,
-		unsigned char **data, size_t *size,
+		struct firefly_packet **pkt,
 		struct firefly_connection **conn,
-		unsigned char *id)
+		uint32_t *id)
 {
 	int result;
 	struct resend_elem *res = NULL;
 	struct timespec now;
 
 	semTake(rq->lock, WAIT_FOREVER);
-	clock_gettime(CLOCK_REALTIME, &now);
-	res = rq->first;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	res = rq->nbr_elems > 0 ? rq->heap[0] : NULL;
 	while (!res || !timespec_past(&now, &res->resend_at)) {
 		/* TODO: Port of posix code. Clean it up. */
 		if (!res) {
@@ -223,24 +416,20 @@ int firefly_resend_wait(struct resend_queue *rq,
 			semTake(rq->sig, timeout);
 			semTake(rq->lock, WAIT_FOREVER);
 		}
-		clock_gettime(CLOCK_REALTIME, &now);
-		res = rq->first;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		res = rq->nbr_elems > 0 ? rq->heap[0] : NULL;
 	}
 	*conn = res->conn;
 
 	if (res->num_retries <= 0) {
 		firefly_resend_pop(rq, res->id);
 		firefly_resend_elem_free(res);
-		*data = NULL;
+		*pkt = NULL;
 		*id = 0;
-		*size = 0;
 		result = -1;
 	} else {
-		*data = malloc(res->size);
-		if (!*data)
-			printf("malloc failed %s:%d\n", __FILE__, __LINE__);
-		memcpy(*data, res->data, res->size);
-		*size = res->size;
+		/* A reference, the packet may be acked while it is sent. */
+		*pkt = firefly_packet_ref(res->pkt);
 		*id = res->id;
 		result = 0;
 	}
@@ -253,10 +442,9 @@ void *firefly_resend_run(void *args)
 {
 	struct firefly_resend_loop_args *largs;
 	struct resend_queue *rq;
-	unsigned char *data;
-	size_t size;
+	struct firefly_packet *pkt;
 	struct firefly_connection *conn;
-	unsigned char id;
+	uint32_t id;
 	int res;
 
 	largs = args;
@@ -264,14 +452,15 @@ void *firefly_resend_run(void *args)
 	rq = largs->rq;
 
 	for (;;) {
-		res = firefly_resend_wait(rq, &data, &size, &conn, &id);
+		res = firefly_resend_wait(rq, &pkt, &conn, &id);
 		taskSafe();
 		if (res < 0) {
 			if (largs->on_no_ack)
 				largs->on_no_ack(conn);
 		} else {
-			conn->transport->write(data, size, conn, false, NULL);
-			free(data);
+			conn->transport->write(pkt->data + pkt->offset, pkt->size,
+					conn, false, NULL);
+			firefly_packet_release(pkt);
 			firefly_resend_readd(rq, id);
 		}
 		taskUnsafe();